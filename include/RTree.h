@@ -9,6 +9,9 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <vector>
+
 #define ASSERT assert // RTree uses ASSERT( condition )
 #ifndef Min
   #define Min qMin
@@ -95,6 +98,20 @@ public:
   /// Remove all entries from tree
   void RemoveAll();
 
+  /// Entry used to bulk load the tree
+  struct Entry
+  {
+    ELEMTYPE m_min[NUMDIMS];                      ///< Min dimensions of bounding box
+    ELEMTYPE m_max[NUMDIMS];                      ///< Max dimensions of bounding box
+    DATATYPE m_data;                              ///< Data Id or Ptr
+  };
+
+  /// Replace the tree contents with a Sort-Tile-Recursive packed tree.
+  /// The resulting tree is a regular tree: Insert and Remove can be used on it afterwards.
+  /// \param a_entries Entries to load
+  /// \param a_count Number of entries
+  void BulkLoad(const Entry* a_entries, int a_count);
+
   /// Count the data elements in this container.  This is slow as no internal counter is maintained.
   int Count();
 
@@ -303,6 +320,18 @@ protected:
     Branch m_branch[MAXNODES];                    ///< Branch
   };
 
+  /// Orders branches on the center of their rectangle along one axis, used by BulkLoad
+  struct BranchCenterLess
+  {
+    int m_axis;
+    BranchCenterLess(int a_axis) : m_axis(a_axis) {}
+    bool operator()(const Branch& a_branchA, const Branch& a_branchB) const
+    {
+      return (a_branchA.m_rect.m_min[m_axis] + a_branchA.m_rect.m_max[m_axis])
+           < (a_branchB.m_rect.m_min[m_axis] + a_branchB.m_rect.m_max[m_axis]);
+    }
+  };
+
   /// A link list of nodes for reinsertion after a delete operation
   struct ListNode
   {
@@ -356,6 +385,7 @@ protected:
   void ReInsert(Node* a_node, ListNode** a_listNode);
   bool Search(Node* a_node, Rect* a_rect, int& a_foundCount, bool a_resultCallback(DATATYPE a_data, void* a_context), void* a_context);
   void RemoveAllRec(Node* a_node);
+  void PackLevel(std::vector<Branch>& a_branches, int a_level);
   void Reset();
   void CountRec(Node* a_node, int& a_count);
 
@@ -773,6 +803,87 @@ void RTREE_QUAL::RemoveAll()
 }
 
 
+RTREE_TEMPLATE
+void RTREE_QUAL::BulkLoad(const Entry* a_entries, int a_count)
+{
+  RemoveAll();
+  if(a_count <= 0)
+  {
+    return;
+  }
+
+  std::vector<Branch> branches(a_count);
+  for(int index = 0; index < a_count; ++index)
+  {
+    for(int axis = 0; axis < NUMDIMS; ++axis)
+    {
+      branches[index].m_rect.m_min[axis] = a_entries[index].m_min[axis];
+      branches[index].m_rect.m_max[axis] = a_entries[index].m_max[axis];
+    }
+    branches[index].m_data = a_entries[index].m_data;
+  }
+
+  // Pack each level into nodes until a single node is left: it becomes the root
+  int level = 0;
+  while(branches.size() > (size_t)MAXNODES)
+  {
+    PackLevel(branches, level);
+    ++level;
+  }
+
+  m_root->m_level = level;
+  for(size_t index = 0; index < branches.size(); ++index)
+  {
+    m_root->m_branch[index] = branches[index];
+  }
+  m_root->m_count = (int)branches.size();
+}
+
+
+// Sort-Tile-Recursive packing of one level.
+// Branches are sorted on the first axis, cut in vertical slices of about sqrt(nodes) nodes,
+// each slice sorted on the second axis and then cut in nodes.
+// Branch counts are spread evenly across nodes so that no node is under MINNODES.
+// On return, a_branches holds the branches pointing to the new nodes.
+RTREE_TEMPLATE
+void RTREE_QUAL::PackLevel(std::vector<Branch>& a_branches, int a_level)
+{
+  const int count = (int)a_branches.size();
+  const int nodeCount = (count + MAXNODES - 1) / MAXNODES;
+  const int sliceNodes = (int)ceil(sqrt((double)nodeCount));
+
+  std::vector<int> nodeStart(nodeCount + 1);
+  for(int index = 0; index <= nodeCount; ++index)
+  {
+    nodeStart[index] = (int)(((long long)count * index) / nodeCount);
+  }
+
+  std::sort(a_branches.begin(), a_branches.end(), BranchCenterLess(0));
+  if(NUMDIMS > 1)
+  {
+    for(int slice = 0; slice < nodeCount; slice += sliceNodes)
+    {
+      int sliceEnd = Min(slice + sliceNodes, nodeCount);
+      std::sort(a_branches.begin() + nodeStart[slice], a_branches.begin() + nodeStart[sliceEnd], BranchCenterLess(1));
+    }
+  }
+
+  std::vector<Branch> parents(nodeCount);
+  for(int index = 0; index < nodeCount; ++index)
+  {
+    Node* node = AllocNode();
+    node->m_level = a_level;
+    for(int branch = nodeStart[index]; branch < nodeStart[index+1]; ++branch)
+    {
+      node->m_branch[node->m_count++] = a_branches[branch];
+    }
+    parents[index].m_rect = NodeCover(node);
+    parents[index].m_child = node;
+  }
+  a_branches.swap(parents);
+}
+
+
 RTREE_TEMPLATE
 void RTREE_QUAL::Reset()
 {
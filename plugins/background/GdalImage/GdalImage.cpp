@@ -0,0 +1,357 @@
+//***************************************************************
+// CLass: GdalImage
+//
+// Description: rasters read through GDAL, for the GDAL and GeoTIFF backgrounds
+//
+//
+// Author: Chris Browet <cbro@semperpax.com> (C) 2010
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//******************************************************************
+
+#include "GdalImage.h"
+
+#include <QColor>
+#include <QPainter>
+
+#include <QDebug>
+
+#include "gdal_priv.h"
+
+// Size, in pixels of the overview level, of the blocks read from the images
+#define BLOCK_SIZE 256
+
+static void closeDataset(GDALDataset* ds)
+{
+    GDALClose((GDALDatasetH)ds);
+}
+
+static inline int toByte(float v)
+{
+    return v <= 0.f ? 0 : (v >= 255.f ? 255 : int(v));
+}
+
+static QVector<QRgb> paletteColors(GDALColorTable* colTable, int theType)
+{
+    QVector<QRgb> colors(colTable->GetColorEntryCount());
+    for (int i=0; i<colors.size(); ++i) {
+        const GDALColorEntry* color = colTable->GetColorEntry(i);
+        switch (theType)
+        {
+        case GdalImage::Palette_Gray:
+            colors[i] = qRgb(color->c1, color->c1, color->c1);
+            break;
+        case GdalImage::Palette_RGBA:
+            colors[i] = qRgba(color->c1, color->c2, color->c3, color->c4);
+            break;
+        case GdalImage::Palette_HLS:
+            colors[i] = QColor::fromHsl(color->c1, color->c2, color->c3, color->c4).rgba();
+            break;
+        case GdalImage::Palette_CMYK:
+            colors[i] = QColor::fromCmyk(color->c1, color->c2, color->c3, color->c4).rgba();
+            break;
+        }
+    }
+    return colors;
+}
+
+void GdalImage::setDataset(GDALDataset* aDataset)
+{
+    ImgType type = Unknown;
+    bandCount = aDataset->GetRasterCount();
+    ixA = -1;
+    ix[0] = ix[1] = ix[2] = ix[3] = 0;
+    theMin = 0.;
+    theUnit = 1.;
+    GDALColorTable* colTable = NULL;
+    for (int i=0; i<bandCount; ++i) {
+        GDALRasterBand  *poBand = aDataset->GetRasterBand( i+1 );
+        GDALColorInterp bandtype = poBand->GetColorInterpretation();
+        qDebug() << "Band " << i+1 << " Color: " <<  GDALGetColorInterpretationName(poBand->GetColorInterpretation());
+
+        switch (bandtype)
+        {
+        case GCI_Undefined:
+        {
+            type = Unknown;
+            double adfMinMax[2];
+            int             bGotMin, bGotMax;
+            adfMinMax[0] = poBand->GetMinimum( &bGotMin );
+            adfMinMax[1] = poBand->GetMaximum( &bGotMax );
+            if( ! (bGotMin && bGotMax) )
+                GDALComputeRasterMinMax((GDALRasterBandH)poBand, TRUE, adfMinMax);
+            theMin = adfMinMax[0];
+            theUnit = (adfMinMax[1] - adfMinMax[0]) / 256;
+            if (theUnit <= 0.)
+                theUnit = 1.;
+            break;
+        }
+        case GCI_GrayIndex:
+            type = GrayScale;
+            break;
+        case GCI_RedBand:
+            type = Rgb;
+            ix[0] = i;
+            break;
+        case GCI_GreenBand:
+            type = Rgb;
+            ix[1] = i;
+            break;
+        case GCI_BlueBand :
+            type = Rgb;
+            ix[2] = i;
+            break;
+        case GCI_HueBand:
+            type = Hsl;
+            ix[0] = i;
+            break;
+        case GCI_SaturationBand:
+            type = Hsl;
+            ix[1] = i;
+            break;
+        case GCI_LightnessBand:
+            type = Hsl;
+            ix[2] = i;
+            break;
+        case GCI_CyanBand:
+            type = Cmyk;
+            ix[0] = i;
+            break;
+        case GCI_MagentaBand:
+            type = Cmyk;
+            ix[1] = i;
+            break;
+        case GCI_YellowBand:
+            type = Cmyk;
+            ix[2] = i;
+            break;
+        case GCI_BlackBand:
+            type = Cmyk;
+            ix[3] = i;
+            break;
+        case GCI_YCbCr_YBand:
+            type = YUV;
+            ix[0] = i;
+            break;
+        case GCI_YCbCr_CbBand:
+            type = YUV;
+            ix[1] = i;
+            break;
+        case GCI_YCbCr_CrBand:
+            type = YUV;
+            ix[2] = i;
+            break;
+        case GCI_AlphaBand:
+            ixA = i;
+            break;
+        case GCI_PaletteIndex:
+            colTable = poBand->GetColorTable();
+            switch (colTable->GetPaletteInterpretation())
+            {
+            case GPI_Gray :
+                type = Palette_Gray;
+                break;
+            case GPI_RGB :
+                type = Palette_RGBA;
+                break;
+            case GPI_CMYK :
+                type = Palette_CMYK;
+                break;
+            case GPI_HLS :
+                type = Palette_HLS;
+                break;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    theSize = QSize(aDataset->GetRasterXSize(), aDataset->GetRasterYSize());
+    theType = type;
+    if (colTable)
+        thePalette = paletteColors(colTable, theType);
+    theDataset = QSharedPointer<GDALDataset>(aDataset, closeDataset);
+}
+
+// Converts a row of pixel interleaved samples; the type is tested once per row, not per pixel
+static void convertRow(const GdalImage& img, const float* in, QRgb* out, int width)
+{
+    const int n = img.bandCount;
+    const float* a = img.ixA != -1 ? in + img.ixA : NULL;
+
+    switch (img.theType)
+    {
+    case GdalImage::Unknown:
+    {
+        const float lo = img.theMin;
+        const float unit = img.theUnit;
+        for (int x=0; x<width; ++x) {
+            int v = toByte((in[x*n] - lo) / unit);
+            out[x] = qRgb(v, v, v);
+        }
+        break;
+    }
+    case GdalImage::GrayScale:
+        for (int x=0; x<width; ++x) {
+            int v = toByte(in[x*n]);
+            out[x] = qRgb(v, v, v);
+        }
+        break;
+    case GdalImage::Rgb:
+    {
+        const float* r = in + img.ix[0];
+        const float* g = in + img.ix[1];
+        const float* b = in + img.ix[2];
+        if (a)
+            for (int x=0; x<width; ++x)
+                out[x] = qRgba(toByte(r[x*n]), toByte(g[x*n]), toByte(b[x*n]), toByte(a[x*n]));
+        else
+            for (int x=0; x<width; ++x)
+                out[x] = qRgb(toByte(r[x*n]), toByte(g[x*n]), toByte(b[x*n]));
+        break;
+    }
+    case GdalImage::Hsl:
+    {
+        const float* h = in + img.ix[0];
+        const float* sat = in + img.ix[1];
+        const float* l = in + img.ix[2];
+        for (int x=0; x<width; ++x)
+            out[x] = QColor::fromHsl(h[x*n], sat[x*n], l[x*n], a ? toByte(a[x*n]) : 255).rgba();
+        break;
+    }
+    case GdalImage::Cmyk:
+    {
+        const float* c = in + img.ix[0];
+        const float* m = in + img.ix[1];
+        const float* y = in + img.ix[2];
+        const float* k = in + img.ix[3];
+        for (int x=0; x<width; ++x)
+            out[x] = QColor::fromCmyk(c[x*n], m[x*n], y[x*n], k[x*n], a ? toByte(a[x*n]) : 255).rgba();
+        break;
+    }
+    case GdalImage::YUV:
+    {
+        // From http://www.fourcc.org/fccyvrgb.php
+        const float* y = in + img.ix[0];
+        const float* u = in + img.ix[1];
+        const float* v = in + img.ix[2];
+        for (int x=0; x<width; ++x) {
+            float Y = 1.164f*(y[x*n] - 16);
+            float U = u[x*n] - 128;
+            float V = v[x*n] - 128;
+            out[x] = qRgba(toByte(Y + 1.596f*V), toByte(Y - 0.813f*V - 0.391f*U), toByte(Y + 2.018f*U),
+                           a ? toByte(a[x*n]) : 255);
+        }
+        break;
+    }
+    case GdalImage::Palette_Gray:
+    case GdalImage::Palette_RGBA:
+    case GdalImage::Palette_HLS:
+    case GdalImage::Palette_CMYK:
+    {
+        const QRgb* colors = img.thePalette.constData();
+        const int count = img.thePalette.size();
+        for (int x=0; x<width; ++x) {
+            int i = int(in[x*n]);
+            out[x] = (i >= 0 && i < count) ? colors[i] : 0;
+        }
+        break;
+    }
+    }
+}
+
+// Reads a window of the image, scaled to size; GDAL takes it from the best overview, if any
+static QImage readBlock(const GdalImage& img, const QRect& window, const QSize& size)
+{
+    QVector<float> buf(size.width() * size.height() * img.bandCount);
+    CPLErr err = img.theDataset->RasterIO( GF_Read, window.x(), window.y(), window.width(), window.height(),
+            buf.data(), size.width(), size.height(), GDT_Float32, img.bandCount, NULL,
+            sizeof(float) * img.bandCount, sizeof(float) * img.bandCount * size.width(), sizeof(float) );
+    if (err != CE_None) {
+        qDebug() << "GDAL: RasterIO failed to read " << window << " from " << img.theFilename;
+        return QImage();
+    }
+
+    QImage block(size, QImage::Format_ARGB32);
+    const float* in = buf.constData();
+    for (int row = 0; row < size.height(); ++row, in += size.width() * img.bandCount)
+        convertRow(img, in, (QRgb*)block.scanLine(row), size.width());
+    return block;
+}
+
+/**************/
+
+GdalBlockCache::GdalBlockCache()
+{
+#ifndef _MOBILE
+    theBlocks.setMaxCost(64*1024*1024);
+#else
+    theBlocks.setMaxCost(16*1024*1024);
+#endif
+}
+
+bool GdalBlockCache::draw(QPainter& P, const GdalImage& img, const QRectF& projBbox, const QSize& size)
+{
+    QSizeF sz(projBbox.width() / img.adfGeoTransform[1], projBbox.height() / img.adfGeoTransform[5]);
+    if (sz.isNull())
+        return false;
+
+    QPointF s((projBbox.left() - img.adfGeoTransform[0]) / img.adfGeoTransform[1],
+             (projBbox.top() - img.adfGeoTransform[3]) / img.adfGeoTransform[5]);
+
+    qDebug() << "Pixmap Origin: " << s.x() << "," << s.y();
+    qDebug() << "Pixmap size: " << sz.width() << "," << sz.height();
+
+    double rtx = size.width() / (double)sz.width();
+    double rty = size.height() / (double)sz.height();
+
+    QRect mRect = QRect(s.toPoint(), sz.toSize());
+    QRect iRect = QRect(QPoint(0, 0), img.theSize).intersected(mRect);
+    if (iRect.isEmpty())
+        return true;
+
+    // Each level halves the resolution; take the coarsest one still finer than the screen
+    int level = 0;
+    double ratio = qMin(1. / rtx, 1. / rty);
+    while (ratio >= 2. && (BLOCK_SIZE << level) < qMax(img.theSize.width(), img.theSize.height())) {
+        ratio /= 2.;
+        ++level;
+    }
+
+    int span = BLOCK_SIZE << level;
+    for (int by = iRect.top() / span; by <= iRect.bottom() / span; ++by)
+        for (int bx = iRect.left() / span; bx <= iRect.right() / span; ++bx) {
+            const QImage* theBlock = block(img, level, bx, by);
+            if (!theBlock)
+                continue;
+            QRect window = QRect(bx*span, by*span, span, span).intersected(QRect(QPoint(0, 0), img.theSize));
+            QRectF fRect((window.x() - s.x()) * rtx, (window.y() - s.y()) * rty, window.width() * rtx, window.height() * rty);
+            P.drawImage(fRect, *theBlock);
+        }
+    return true;
+}
+
+void GdalBlockCache::clear()
+{
+    theBlocks.clear();
+}
+
+const QImage* GdalBlockCache::block(const GdalImage& img, int level, int bx, int by)
+{
+    QString key = QString("%1|%2|%3|%4").arg(img.theFilename).arg(level).arg(bx).arg(by);
+    if (QImage* cached = theBlocks.object(key))
+        return cached;
+
+    int span = BLOCK_SIZE << level;
+    QRect window = QRect(bx*span, by*span, span, span).intersected(QRect(QPoint(0, 0), img.theSize));
+    QSize size((window.width() + (1 << level) - 1) >> level, (window.height() + (1 << level) - 1) >> level);
+    QImage decoded = readBlock(img, window, size);
+    if (decoded.isNull())
+        return NULL;
+
+    QImage* theBlock = new QImage(decoded);
+    theBlocks.insert(key, theBlock, theBlock->byteCount());
+    return theBlock;
+}
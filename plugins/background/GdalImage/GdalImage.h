@@ -0,0 +1,85 @@
+//***************************************************************
+// CLass: GdalImage
+//
+// Description: rasters read through GDAL, for the GDAL and GeoTIFF backgrounds
+//
+//
+// Author: Chris Browet <cbro@semperpax.com> (C) 2010
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//******************************************************************
+
+#ifndef GDALIMAGE_H
+#define GDALIMAGE_H
+
+#include <QCache>
+#include <QImage>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+class GDALDataset;
+class QPainter;
+
+class GdalImage
+{
+public:
+    enum ImgType
+    {
+        Unknown,
+        GrayScale,
+        Rgb,
+        Hsl,
+        Cmyk,
+        YUV,
+        Palette_Gray,
+        Palette_RGBA,
+        Palette_CMYK,
+        Palette_HLS
+    };
+
+    // Takes the dataset over, and finds out from its bands how to convert its pixels
+    void setDataset(GDALDataset* aDataset);
+
+    QString theFilename;
+    double adfGeoTransform[6];
+
+    // Kept open; the blocks drawn are read from it
+    QSharedPointer<GDALDataset> theDataset;
+    QSize theSize;
+    int bandCount;
+    // The ImgType, and the bands of its components, in the order of the type name
+    int theType;
+    int ix[4];
+    int ixA;
+    // Scale of Unknown images
+    double theMin, theUnit;
+    // Colors of the palette types
+    QVector<QRgb> thePalette;
+};
+
+/**
+    Decoded blocks of GDAL images, by file, overview level and position.
+
+    Images are read in blocks of 256 pixels of the coarsest power of two level still finer than the
+    screen; GDAL takes them from the matching overview, if the file has some.
+*/
+class GdalBlockCache
+{
+public:
+    GdalBlockCache();
+
+    // Draws the part of the image in the projected box onto a painter of the given size; returns
+    // false if the box is empty
+    bool draw(QPainter& P, const GdalImage& img, const QRectF& projBbox, const QSize& size);
+    void clear();
+
+private:
+    // Valid until the next insert
+    const QImage* block(const GdalImage& img, int level, int bx, int by);
+
+    QCache<QString, QImage> theBlocks;
+};
+
+#endif // GDALIMAGE_H
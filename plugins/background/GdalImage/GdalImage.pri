@@ -0,0 +1,8 @@
+DEPENDPATH += $$PWD
+INCLUDEPATH += $$PWD
+
+HEADERS += \
+    $$PWD/GdalImage.h
+
+SOURCES += \
+    $$PWD/GdalImage.cpp
@@ -18,16 +18,9 @@
 
 #include <QLocale>
 
-class GDALDataset;
-class GDALColorTable;
+#include "GdalImage.h"
 
-class GdalImage
-{
-public:
-    QString theFilename;
-    QPixmap theImg;
-    double adfGeoTransform[6];
-};
+class GDALDataset;
 
 class GdalAdapter : public IMapAdapter
 {
@@ -35,20 +28,6 @@ class GdalAdapter : public IMapAdapter
     Q_INTERFACES(IMapAdapter)
 
 public:
-    enum ImgType
-    {
-        Unknown,
-        GrayScale,
-        Rgb,
-        Hsl,
-        Cmyk,
-        YUV,
-        Palette_Gray,
-        Palette_RGBA,
-        Palette_CMYK,
-        Palette_HLS
-    };
-
     GdalAdapter();
     virtual ~GdalAdapter();
 
@@ -166,6 +145,7 @@ private:
 
     QList<GdalImage> theImages;
     QString theSourceTag;
+    mutable GdalBlockCache theBlocks;
 
 //	TiffType theType;
 //	int bandCount;
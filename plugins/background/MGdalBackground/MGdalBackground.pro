@@ -5,6 +5,7 @@ TARGET = $$qtLibraryTarget(MGdalBackgroundPlugin)
 DEPENDPATH += $${MERKAARTOR_SRC_DIR}/interfaces
 INCLUDEPATH += $${MERKAARTOR_SRC_DIR}/interfaces
 include ($${MERKAARTOR_SRC_DIR}/interfaces/Interfaces.pri)
+include (../GdalImage/GdalImage.pri)
 
 DEPENDPATH += $${MERKAARTOR_SRC_DIR}/src/Utils
 INCLUDEPATH += $${MERKAARTOR_SRC_DIR}/src/Utils
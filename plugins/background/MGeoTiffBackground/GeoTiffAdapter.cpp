@@ -215,11 +215,11 @@ bool GeoTiffAdapter::loadImage(const QString& fn)
             poDataset->GetRasterCount() );
 
     img.theFilename = fn;
-    img.theImg.load(fn);
+    img.setDataset(poDataset);
+    poDataset = NULL;
     theImages.push_back(img);
     theBbox = theBbox.united(bbox);
 
-    GDALClose((GDALDatasetH)poDataset);
     return true;
 }
 
@@ -306,37 +306,10 @@ QPixmap GeoTiffAdapter::getPixmap(const QRectF& /*wgs84Bbox*/, const QRectF& the
         projBbox = QRectF(radToAng(theProjBbox.left()), radToAng(theProjBbox.top()), radToAng(theProjBbox.width()), radToAng(theProjBbox.height()));
 
 
-    for (int i=0; i<theImages.size(); ++i) {
-        QPixmap theImg = theImages[i].theImg;
-
-        QSizeF sz(projBbox.width() / theImages[i].adfGeoTransform[1], projBbox.height() / theImages[i].adfGeoTransform[5]);
-        if (sz.isNull())
+    for (int i=0; i<theImages.size(); ++i)
+        if (!theBlocks.draw(p, theImages[i], projBbox, src.size()))
             return QPixmap();
 
-        QPointF s((projBbox.left() - theImages[i].adfGeoTransform[0]) / theImages[i].adfGeoTransform[1],
-                 (projBbox.top() - theImages[i].adfGeoTransform[3]) / theImages[i].adfGeoTransform[5]);
-
-        qDebug() << "Pixmap Origin: " << s.x() << "," << s.y();
-        qDebug() << "Pixmap size: " << sz.width() << "," << sz.height();
-
-        double rtx = src.width() / (double)sz.width();
-        double rty = src.height() / (double)sz.height();
-
-        QRect mRect = QRect(s.toPoint(), sz.toSize());
-        QRect iRect = theImg.rect().intersected(mRect);
-        QRect sRect = QRect(iRect.topLeft() - mRect.topLeft(), iRect.size());
-        QRect fRect = QRect(sRect.x() * rtx, sRect.y() * rty, sRect.width() * rtx, sRect.height() * rty);
-
-        qDebug() << "mrect: " << mRect;
-        qDebug() << "iRect: " << iRect;
-        qDebug() << "sRect: " << sRect;
-
-    //	QImage img2 = theImg.copy(iRect).scaled(fRect.size());
-    //	p.drawImage(fRect.topLeft(), img2);
-        QPixmap img2 = theImg.copy(iRect).scaled(fRect.size());
-        p.drawPixmap(fRect.topLeft(), img2);
-    }
-
     p.end();
     return pix;
 }
@@ -352,6 +325,7 @@ void GeoTiffAdapter::setImageManager(IImageManager* /*anImageManager*/)
 
 void GeoTiffAdapter::cleanup()
 {
+    theBlocks.clear();
     theImages.clear();
     theBbox = QRectF();
     theProjection = QString();
@@ -18,16 +18,9 @@
 
 #include <QLocale>
 
-class GDALDataset;
-class GDALColorTable;
+#include "GdalImage.h"
 
-class GdalImage
-{
-public:
-    QString theFilename;
-    QPixmap theImg;
-    double adfGeoTransform[6];
-};
+class GDALDataset;
 
 class GeoTiffAdapter : public IMapAdapter
 {
@@ -35,17 +28,6 @@ class GeoTiffAdapter : public IMapAdapter
     Q_INTERFACES(IMapAdapter)
 
 public:
-    enum TiffType
-    {
-        Unknown,
-        Rgb,
-        Rgba,
-        Palette_Gray,
-        Palette_RGBA,
-        Palette_CMYK,
-        Palette_HLS
-    };
-
     GeoTiffAdapter();
     virtual ~GeoTiffAdapter();
 
@@ -163,6 +145,7 @@ private:
 
     QList<GdalImage> theImages;
     QString theSourceTag;
+    mutable GdalBlockCache theBlocks;
 
 //	TiffType theType;
 //	int bandCount;
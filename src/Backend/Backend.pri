@@ -2,7 +2,9 @@ INCLUDEPATH += $$MERKAARTOR_SRC_DIR/Backend
 DEPENDPATH += $$MERKAARTOR_SRC_DIR/Backend
 
 HEADERS += \
-    MemoryBackend.h
+    MemoryBackend.h \
+    MemoryPool.h
 
 SOURCES += \
-    MemoryBackend.cpp
+    MemoryBackend.cpp \
+    MemoryPool.cpp
@@ -1,7 +1,12 @@
 #include "MemoryBackend.h"
 #include "RTree.h"
+#include "Global.h"
+#include "RenderList.h"
 
 #include <QReadWriteLock>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QVarLengthArray>
 
 RenderPriority NodePri(RenderPriority::IsSingular,0., 0);
 RenderPriority SegmentPri(RenderPriority::IsLinear,0.,99);
@@ -11,6 +16,10 @@ typedef RTree<Feature*, qreal, 2, qreal, 32> CoordTree;
 class MemoryBackendPrivate
 {
 public:
+    MemoryBackendPrivate()
+        : changeRevision(0)
+    {
+    }
 
     /* If locked, deletes are delayed. */
     QReadWriteLock delayedDeletesLock;
@@ -19,119 +28,286 @@ public:
     QMutex toBeDeletedLock;
     QList<Feature*> toBeDeleted;
 
+    /* Only used from the GUI thread */
     QHash<Feature*, CoordBox> AllocFeatures;
+
+    /* Protects theRTree and the trees: searches lock it for read, index updates for write */
+    mutable QReadWriteLock indexLock;
     QHash<ILayer*, CoordTree*> theRTree;
-    QList<Feature*> findResult;
+    /* Entries in each tree, as CoordTree::Count() walks the whole tree */
+    QHash<ILayer*, int> treeSize;
+
+    /* Index updates queued while indexing of a layer is blocked */
+    QHash<ILayer*, QHash<Feature*, QRectF> > pendingIndex;
+
+    /* Change journal: the box of revision r is in changes[r % CHANGE_JOURNAL_SIZE] */
+    mutable QMutex changeLock;
+    quint32 changeRevision;
+    QVector<QRectF> changes;
 };
 
-bool indexFindCallbackList(Feature* F, void* ctxt)
+#define CHANGE_JOURNAL_SIZE 4096
+
+static void fillEntry(CoordTree::Entry& e, const QRectF& bb, Feature* F)
 {
-    ((QList<Feature*>*)(ctxt))->append(F);
+    e.m_min[0] = bb.bottomLeft().x();
+    e.m_min[1] = bb.bottomLeft().y();
+    e.m_max[0] = bb.topRight().x();
+    e.m_max[1] = bb.topRight().y();
+    e.m_data = F;
+}
+
+static bool benchmarkCountCallback(Feature* /*F*/, void* ctxt)
+{
+    ++(*((int*)ctxt));
     return true;
 }
 
-bool indexFindCallback(Feature* F, void* ctxt)
+/* Compares the packed tree with one built by per-feature inserts (--benchmark) */
+static void benchmarkBulkLoad(CoordTree* packed, const std::vector<CoordTree::Entry>& entries, qint64 packMs)
 {
-    IndexFindContext* pCtxt = (IndexFindContext*)ctxt;
+    QElapsedTimer timer;
+    timer.start();
+    CoordTree inserted;
+    for (size_t i=0; i<entries.size(); ++i)
+        inserted.Insert(entries[i].m_min, entries[i].m_max, entries[i].m_data);
+    qint64 insertMs = timer.elapsed();
+
+    qreal minX = entries[0].m_min[0], minY = entries[0].m_min[1];
+    qreal maxX = entries[0].m_max[0], maxY = entries[0].m_max[1];
+    for (size_t i=1; i<entries.size(); ++i) {
+        minX = qMin(minX, entries[i].m_min[0]);
+        minY = qMin(minY, entries[i].m_min[1]);
+        maxX = qMax(maxX, entries[i].m_max[0]);
+        maxY = qMax(maxY, entries[i].m_max[1]);
+    }
 
-    if (!F->isVisible())
+    /* Viewport-sized windows (1% of the extent in each direction) on a regular grid */
+    const int steps = 32;
+    qreal w = (maxX - minX) / 100.;
+    qreal h = (maxY - minY) / 100.;
+    qint64 queryMs[2];
+    int found[2];
+    CoordTree* trees[2] = { packed, &inserted };
+    for (int t=0; t<2; ++t) {
+        found[t] = 0;
+        timer.restart();
+        for (int i=0; i<steps; ++i)
+            for (int j=0; j<steps; ++j) {
+                qreal min[] = {minX + (maxX - minX - w) * i / steps, minY + (maxY - minY - h) * j / steps};
+                qreal max[] = {min[0] + w, min[1] + h};
+                trees[t]->Search(min, max, &benchmarkCountCallback, (void*)&found[t]);
+            }
+        queryMs[t] = timer.elapsed();
+    }
+
+    qDebug() << "Index benchmark:" << entries.size() << "features";
+    qDebug() << "  bulk load:" << packMs << "ms, per-feature inserts:" << insertMs << "ms";
+    qDebug() << "  " << steps*steps << "queries: packed" << queryMs[0] << "ms (" << found[0] << "hits), inserted" << queryMs[1] << "ms (" << found[1] << "hits)";
+}
+
+typedef QVarLengthArray<Feature*, 512> FoundArray;
+
+struct IndexSearch {
+    const IndexFilter* filter;
+    IndexVisitor visitor;
+    void* ctxt;
+};
+
+static bool indexSearchCallback(Feature* F, void* ctxt)
+{
+    IndexSearch* s = (IndexSearch*)ctxt;
+    if (!(F->getType() & s->filter->types))
         return true;
+    if (s->filter->visibleOnly && F->isHidden())
+        return true;
+    return s->visitor(F, s->ctxt);
+}
 
+static bool indexFindCallbackList(Feature* F, void* ctxt)
+{
+    ((QList<Feature*>*)(ctxt))->append(F);
+    return true;
+}
+
+static bool indexFindCallbackArray(Feature* F, void* ctxt)
+{
+    ((FoundArray*)(ctxt))->append(F);
+    return true;
+}
+
+/* Adds a visible feature to the render list; runs outside of the index lock as it builds paths */
+static void addToFeatureSet(Feature* F, const IndexFindContext* pCtxt)
+{
     if (CHECK_WAY(F)) {
         Way * R = STATIC_CAST_WAY(F);
-        if (pCtxt->theFeatures->value(R->renderPriority()).contains(F))
-            return true;
         R->buildPath(*(pCtxt->theProjection));
         if (M_PREFS->getTrackPointsVisible()) {
             for (int i=0; i<R->size(); ++i) {
                 if (pCtxt->bbox.contains(R->getNode(i)->boundingBox()))
-                    if (!pCtxt->theFeatures->value(NodePri).contains(R->getNode(i)))
-                        (*(pCtxt->theFeatures))[NodePri].insert(R->getNode(i));
+                    pCtxt->theFeatures->add(R->getNode(i), NodePri, RenderList::NodeItem);
             }
         }
-        (*(pCtxt->theFeatures))[R->renderPriority()].insert(F);
+        pCtxt->theFeatures->add(F, R->renderPriority(), RenderList::WayItem);
     } else
     if (CHECK_RELATION(F)) {
         Relation * RR = STATIC_CAST_RELATION(F);
-        if (pCtxt->theFeatures->value(RR->renderPriority()).contains(F))
-            return true;
         RR->buildPath(*(pCtxt->theProjection));
-        (*(pCtxt->theFeatures))[RR->renderPriority()].insert(F);
+        pCtxt->theFeatures->add(F, RR->renderPriority(), RenderList::RelationItem);
     } else
     if (CHECK_NODE(F)) {
-        if (pCtxt->theFeatures->value(NodePri).contains(F))
-            return true;
         if (!(F->isVirtual() && !M_PREFS->getVirtualNodesVisible())) {
             Node * N = STATIC_CAST_NODE(F);
             N->buildPath(*(pCtxt->theProjection));
-            (*(pCtxt->theFeatures))[NodePri].insert(F);
+            pCtxt->theFeatures->add(F, NodePri, RenderList::NodeItem);
         }
     } else {
-        if (pCtxt->theFeatures->value(SegmentPri).contains(F))
-            return true;
-        (*(pCtxt->theFeatures))[SegmentPri].insert(F);
+        pCtxt->theFeatures->add(F, SegmentPri, RenderList::OtherItem);
     }
-
-    return true;
 }
 
 void MemoryBackend::indexAdd(ILayer* l, const QRectF& bb, Feature* aFeat)
 {
     if (!l)
         return;
+    p->AllocFeatures[aFeat] = bb;
+
+    QHash<ILayer*, QHash<Feature*, QRectF> >::iterator pending = p->pendingIndex.find(l);
+    if (pending != p->pendingIndex.end()) {
+        pending.value()[aFeat] = bb;
+        return;
+    }
+
+    QWriteLocker lock(&p->indexLock);
     if (!p->theRTree.contains(l))
         p->theRTree[l] = new CoordTree();
 
-    p->AllocFeatures[aFeat] = bb;
     qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
     qreal max[] = {bb.topRight().x(), bb.topRight().y()};
     p->theRTree[l]->Insert(min, max, aFeat);
+    ++p->treeSize[l];
 }
 
 void MemoryBackend::indexRemove(ILayer* l, const QRectF& bb, Feature* aFeat)
 {
     if (!l)
         return;
+
+    QHash<ILayer*, QHash<Feature*, QRectF> >::iterator pending = p->pendingIndex.find(l);
+    if (pending != p->pendingIndex.end() && pending.value().remove(aFeat))
+        return;
+
+    QWriteLocker lock(&p->indexLock);
     if (!p->theRTree.contains(l))
         return;
 
     qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
     qreal max[] = {bb.topRight().x(), bb.topRight().y()};
     p->theRTree[l]->Remove(min, max, aFeat);
+    int& size = p->treeSize[l];
+    if (size > 0)
+        --size;
 }
 
-const QList<Feature*>& MemoryBackend::indexFind(ILayer* l, const QRectF& bb)
+void MemoryBackend::blockIndexing(ILayer* l)
 {
-    p->findResult.clear();
-    if (p->theRTree.contains(l)) {
-        qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
-        qreal max[] = {bb.topRight().x(), bb.topRight().y()};
-        p->theRTree[l]->Search(min, max, &indexFindCallbackList, (void*)&p->findResult);
+    if (!l || p->pendingIndex.contains(l))
+        return;
+    p->pendingIndex.insert(l, QHash<Feature*, QRectF>());
+}
+
+void MemoryBackend::unblockIndexing(ILayer* l)
+{
+    if (!p->pendingIndex.contains(l))
+        return;
+    QHash<Feature*, QRectF> pending = p->pendingIndex.take(l);
+    if (pending.isEmpty())
+        return;
+
+    QWriteLocker lock(&p->indexLock);
+    if (!p->theRTree.contains(l))
+        p->theRTree[l] = new CoordTree();
+    CoordTree* tree = p->theRTree[l];
+    int& size = p->treeSize[l];
+
+    /* A batch that is a small share of the layer is cheaper to insert than to repack everything */
+    if (pending.size() * 4 < size + pending.size()) {
+        QHash<Feature*, QRectF>::const_iterator i = pending.constBegin();
+        for (; i != pending.constEnd(); ++i) {
+            qreal min[] = {i.value().bottomLeft().x(), i.value().bottomLeft().y()};
+            qreal max[] = {i.value().topRight().x(), i.value().topRight().y()};
+            tree->Insert(min, max, i.key());
+        }
+        size += pending.size();
+        return;
     }
 
-    return p->findResult;
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<CoordTree::Entry> entries;
+    entries.reserve(size + pending.size());
+    CoordTree::Iterator it;
+    tree->GetFirst(it);
+    while (!tree->IsNull(it)) {
+        CoordTree::Entry e;
+        it.GetBounds(e.m_min, e.m_max);
+        e.m_data = *it;
+        entries.push_back(e);
+        tree->GetNext(it);
+    }
+
+    QHash<Feature*, QRectF>::const_iterator i = pending.constBegin();
+    for (; i != pending.constEnd(); ++i) {
+        CoordTree::Entry e;
+        fillEntry(e, i.value(), i.key());
+        entries.push_back(e);
+    }
+    tree->BulkLoad(&entries[0], (int)entries.size());
+    size = (int)entries.size();
+
+    if (g_Merk_Benchmark)
+        benchmarkBulkLoad(tree, entries, timer.elapsed());
 }
 
-void MemoryBackend::indexFind(ILayer* l, const QRectF& bb, const IndexFindContext& ctxt)
+void MemoryBackend::indexVisit(ILayer* l, const QRectF& bb, IndexVisitor visitor, void* ctxt, const IndexFilter& filter) const
 {
-    if (!p->theRTree.contains(l))
+    QReadLocker lock(&p->indexLock);
+    CoordTree* tree = p->theRTree.value(l);
+    if (!tree)
         return;
+
+    IndexSearch search;
+    search.filter = &filter;
+    search.visitor = visitor;
+    search.ctxt = ctxt;
     qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
     qreal max[] = {bb.topRight().x(), bb.topRight().y()};
-    p->theRTree[l]->Search(min, max, &indexFindCallback, (void*)&ctxt);
+    tree->Search(min, max, &indexSearchCallback, (void*)&search);
 }
 
+int MemoryBackend::indexFind(ILayer* l, const QRectF& bb, QList<Feature*>& result, const IndexFilter& filter) const
+{
+    int before = result.size();
+    indexVisit(l, bb, &indexFindCallbackList, (void*)&result, filter);
+    return result.size() - before;
+}
+
+void MemoryBackend::indexFind(ILayer* l, const QRectF& bb, const IndexFindContext& ctxt)
+{
+    // Collect first, so that paths are not built while holding the index lock
+    FoundArray found;
+    indexVisit(l, bb, &indexFindCallbackArray, (void*)&found, IndexFilter(IFeature::All, true));
+    for (int i=0; i<found.size(); ++i)
+        addToFeatureSet(found[i], &ctxt);
+}
 
 void MemoryBackend::get(ILayer* l, const QRectF& bb, QList<Feature*>& theFeatures)
 {
-    if (!p->theRTree.contains(l))
-        return;
-    qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
-    qreal max[] = {bb.topRight().x(), bb.topRight().y()};
-    p->theRTree[l]->Search(min, max, &indexFindCallback, (void*)(&theFeatures));
+    indexFind(l, bb, theFeatures);
 }
 
-void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+void MemoryBackend::getFeatureSet(ILayer* l, RenderList& theFeatures,
                                   const QList<CoordBox>& invalidRects, Projection& theProjection)
 {
     IndexFindContext ctxt;
@@ -144,7 +320,7 @@ void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*
     }
 }
 
-void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+void MemoryBackend::getFeatureSet(ILayer* l, RenderList& theFeatures,
                                   const CoordBox& invalidRect, Projection& theProjection)
 {
     IndexFindContext ctxt;
@@ -375,8 +551,12 @@ void MemoryBackend::deallocVirtualNode(Feature *f)
 
 void MemoryBackend::sync(Feature *f)
 {
-    if (p->AllocFeatures.contains(f) && !p->AllocFeatures[f].isNull())
+    if (p->AllocFeatures.contains(f) && !p->AllocFeatures[f].isNull()) {
+        recordChange(p->AllocFeatures[f]);
         indexRemove(f->layer(), p->AllocFeatures[f], f);
+    }
+    if (f->layer() && !f->isVirtual())
+        recordChange(f->boundingBox());
     if (CHECK_NODE(f)) {
         Node* N = STATIC_CAST_NODE(f);
         if (!N->tagSize())
@@ -392,4 +572,36 @@ void MemoryBackend::sync(Feature *f)
     }
 }
 
+void MemoryBackend::recordChange(const CoordBox& bb)
+{
+    if (bb.isNull())
+        return;
+    QMutexLocker lock(&p->changeLock);
+    if (p->changes.isEmpty())
+        p->changes.resize(CHANGE_JOURNAL_SIZE);
+    ++p->changeRevision;
+    p->changes[p->changeRevision % CHANGE_JOURNAL_SIZE] = bb;
+}
+
+void MemoryBackend::touch(Feature* f)
+{
+    if (f->layer() && !f->isVirtual())
+        recordChange(f->boundingBox());
+}
+
+quint32 MemoryBackend::changeRevision() const
+{
+    QMutexLocker lock(&p->changeLock);
+    return p->changeRevision;
+}
 
+bool MemoryBackend::changesSince(quint32 revision, QList<QRectF>& boxes) const
+{
+    QMutexLocker lock(&p->changeLock);
+    quint32 count = p->changeRevision - revision;
+    if (count > CHANGE_JOURNAL_SIZE)
+        return false;
+    for (quint32 r = revision + 1; count--; ++r)
+        boxes << p->changes[r % CHANGE_JOURNAL_SIZE];
+    return true;
+}
@@ -3,14 +3,29 @@
 
 #include "Features.h"
 
+class RenderList;
+
 struct IndexFindContext {
-    QMap<RenderPriority, QSet <Feature*> >* theFeatures;
+    RenderList* theFeatures;
     QRectF* clipRect;
     Projection* theProjection;
     QTransform* theTransform;
     CoordBox bbox;
 };
 
+/* Restricts a spatial query to the features with a type bit in types (IFeature::FeatureType), and
+   with visibleOnly, to those not hidden */
+struct IndexFilter {
+    IndexFilter(unsigned char aTypes = IFeature::All, bool aVisibleOnly = false)
+        : types(aTypes), visibleOnly(aVisibleOnly) {}
+
+    unsigned char types;
+    bool visibleOnly;
+};
+
+/* Called for each feature found; returning false stops the search */
+typedef bool (*IndexVisitor)(Feature* F, void* ctxt);
+
 class MemoryBackendPrivate;
 class MemoryBackend
 {
@@ -46,16 +61,39 @@ public:
     virtual void delayDeletes();
     virtual void resumeDeletes();
 
-    virtual const QList<Feature*>& indexFind(ILayer* l, const QRectF& vp);
+    /* Spatial queries may run from any thread, e.g. the render workers, while the GUI thread edits:
+       the trees are behind a reader-writer lock, held for the search only. Visitors run under that
+       lock and must not change the index (sync, alloc, dealloc). Features found are not deleted
+       while delayDeletes() is in effect. */
+    /* Appends the features found to result, and returns their number */
+    virtual int indexFind(ILayer* l, const QRectF& bb, QList<Feature*>& result, const IndexFilter& filter = IndexFilter()) const;
+    virtual void indexVisit(ILayer* l, const QRectF& bb, IndexVisitor visitor, void* ctxt, const IndexFilter& filter = IndexFilter()) const;
     virtual void indexFind(ILayer* l, const QRectF& bb, const IndexFindContext& findResult);
     virtual void get(ILayer* l, const QRectF& bb, QList<Feature*>& theFeatures);
-    virtual void getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+    /* Appends the visible features to render, unsorted; features found from several rects are
+       appended each time, RenderList::sort() drops the duplicates */
+    virtual void getFeatureSet(ILayer* l, RenderList& theFeatures,
                                const QList<CoordBox>& invalidRects, Projection& theProjection);
-    virtual void getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+    virtual void getFeatureSet(ILayer* l, RenderList& theFeatures,
                                const CoordBox& invalidRect, Projection& theProjection);
     virtual void indexAdd(ILayer* l, const QRectF& bb, Feature* aFeat);
     virtual void indexRemove(ILayer* l, const QRectF& bb, Feature* aFeat);
 
+    /* While blocked, index updates for the layer are queued; when unblocked, the tree is bulk-loaded
+     * if they are a large share of it, and they are inserted one by one otherwise. */
+    virtual void blockIndexing(ILayer* l);
+    virtual void unblockIndexing(ILayer* l);
+
+    /* Journal of the areas whose rendering changed, for the render caches. sync() records the old and
+     * new bounding boxes of the feature, touch() its current one. */
+    virtual void touch(Feature* f);
+    quint32 changeRevision() const;
+    /* Boxes changed after the given revision; false if the journal no longer goes back that far */
+    bool changesSince(quint32 revision, QList<QRectF>& boxes) const;
+
+private:
+    void recordChange(const CoordBox& bb);
+
 };
 
 #endif // MEMORYBACKEND_H
@@ -0,0 +1,125 @@
+#include "MemoryPool.h"
+
+#include <new>
+#include <stdlib.h>
+
+MemoryPool::MemoryPool(size_t objectSize, int objectsPerSlab)
+    : theObjectsPerSlab(objectsPerSlab), theUsed(0)
+{
+    /* Keep every slot aligned for doubles and pointers */
+    const size_t align = sizeof(void*) > sizeof(double) ? sizeof(void*) : sizeof(double);
+    if (objectSize < sizeof(FreeSlot))
+        objectSize = sizeof(FreeSlot);
+    theObjectSize = (objectSize + align - 1) / align * align;
+}
+
+MemoryPool::~MemoryPool()
+{
+    foreach (Slab* slab, theSlabs) {
+        free(slab->data);
+        delete slab;
+    }
+}
+
+MemoryPool::Slab* MemoryPool::slabOf(const void* ptr) const
+{
+    QMap<quintptr, Slab*>::const_iterator it = theSlabs.upperBound((quintptr)ptr);
+    if (it == theSlabs.constBegin())
+        return NULL;
+    --it;
+    Slab* slab = it.value();
+    if ((const char*)ptr >= slab->data + theObjectSize * theObjectsPerSlab)
+        return NULL;
+    return slab;
+}
+
+void MemoryPool::setAvailable(Slab* slab, bool val)
+{
+    if (val) {
+        slab->available = theAvailable.size();
+        theAvailable.append(slab);
+    } else {
+        Slab* last = theAvailable.last();
+        theAvailable[slab->available] = last;
+        last->available = slab->available;
+        theAvailable.removeLast();
+        slab->available = -1;
+    }
+}
+
+void* MemoryPool::allocate()
+{
+    QMutexLocker locker(&theMutex);
+
+    if (theAvailable.isEmpty()) {
+        char* data = (char*)malloc(theObjectSize * theObjectsPerSlab);
+        if (!data)
+            return NULL;
+        Slab* slab = new Slab;
+        slab->data = data;
+        slab->freeList = NULL;
+        slab->used = 0;
+        /* Thread the new slots in address order so that consecutive allocations are adjacent */
+        for (int i=theObjectsPerSlab-1; i>=0; --i) {
+            FreeSlot* slot = (FreeSlot*)(data + i*theObjectSize);
+            slot->next = slab->freeList;
+            slab->freeList = slot;
+        }
+        theSlabs.insert((quintptr)data, slab);
+        setAvailable(slab, true);
+    }
+
+    Slab* slab = theAvailable.last();
+    FreeSlot* slot = slab->freeList;
+    slab->freeList = slot->next;
+    if (++slab->used == theObjectsPerSlab)
+        setAvailable(slab, false);
+    ++theUsed;
+    return slot;
+}
+
+void MemoryPool::deallocate(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    QMutexLocker locker(&theMutex);
+    Slab* slab = slabOf(ptr);
+    if (!slab) {
+        qWarning("MemoryPool: freeing an object it does not own");
+        return;
+    }
+
+    FreeSlot* slot = (FreeSlot*)ptr;
+    slot->next = slab->freeList;
+    slab->freeList = slot;
+    if (slab->available < 0)
+        setAvailable(slab, true);
+    --theUsed;
+
+    /* Keep one slab with room, so that alternating allocations and frees do not thrash */
+    if (--slab->used == 0 && theAvailable.size() > 1) {
+        setAvailable(slab, false);
+        theSlabs.remove((quintptr)slab->data);
+        free(slab->data);
+        delete slab;
+    }
+}
+
+bool MemoryPool::owns(const void* ptr) const
+{
+    QMutexLocker locker(&theMutex);
+    return slabOf(ptr) != NULL;
+}
+
+int MemoryPool::used() const
+{
+    QMutexLocker locker(&theMutex);
+    return theUsed;
+}
+
+qint64 MemoryPool::reserved() const
+{
+    QMutexLocker locker(&theMutex);
+    return (qint64)theSlabs.size() * theObjectsPerSlab * theObjectSize;
+}
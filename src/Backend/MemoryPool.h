@@ -0,0 +1,58 @@
+#ifndef MEMORYPOOL_H
+#define MEMORYPOOL_H
+
+#include <QMutex>
+#include <QMap>
+#include <QVector>
+
+/* Fixed-size object allocator.
+ *
+ * Objects are carved out of large contiguous slabs instead of one heap block each,
+ * which removes the per-allocation malloc overhead and keeps objects allocated together
+ * (e.g. the nodes of an import) next to each other in memory.
+ * Each slab recycles its freed slots through an intrusive free list, and a slab whose
+ * objects are all freed is returned to the system, except the last one with free room.
+ */
+class MemoryPool
+{
+public:
+    MemoryPool(size_t objectSize, int objectsPerSlab = 4096);
+    ~MemoryPool();
+
+    size_t objectSize() const { return theObjectSize; }
+
+    void* allocate();
+    void deallocate(void* ptr);
+    bool owns(const void* ptr) const;
+
+    /* Number of objects currently allocated */
+    int used() const;
+    /* Bytes reserved from the system */
+    qint64 reserved() const;
+
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+    struct Slab {
+        char* data;
+        FreeSlot* freeList;
+        int used;
+        // In theAvailable, or -1 when full
+        int available;
+    };
+
+    Slab* slabOf(const void* ptr) const;
+    void setAvailable(Slab* slab, bool val);
+
+    size_t theObjectSize;
+    int theObjectsPerSlab;
+    mutable QMutex theMutex;
+    // By address, to find the slab of an object
+    QMap<quintptr, Slab*> theSlabs;
+    // Slabs with free slots; allocation takes from the last one
+    QVector<Slab*> theAvailable;
+    int theUsed;
+};
+
+#endif // MEMORYPOOL_H
@@ -1,3 +1,5 @@
+#include "Global.h"
+
 #include "Command.h"
 #include "Document.h"
 #include "Layer.h"
@@ -89,10 +91,14 @@ int Command::getDirtyLevel()
     return commandDirtyLevel;
 }
 
+/* Subclasses call undo() before reverting their changes and redo() after applying them; the boxes
+ * of the feature before and after the change go to the backend change journal, also covering the
+ * changes of dirty state that do not move the feature */
 void Command::undo()
 {
     if (mainFeature) {
         isUndone = true;
+        g_backend.touch(mainFeature);
         mainFeature->notifyChanges();
     }
 }
@@ -102,6 +108,7 @@ void Command::redo()
     if (mainFeature) {
         isUndone = false;
         mainFeature->notifyChanges();
+        g_backend.touch(mainFeature);
     }
 }
 
@@ -275,13 +275,8 @@ void FeaturesDock::on_btFind_clicked(bool)
     if (!tsel)
         return;
 
-    Found.clear();
-    int added = 0;
-    for (VisibleFeatureIterator i(Main->document()); !i.isEnd() && (!dlg->sbMaxResult->value() || added < dlg->sbMaxResult->value()); ++i) {
-        if (tsel->matches(i.get(), Main->view()->pixelPerM())) {
-            Found << i.get();
-        }
-    }
+    Found = Main->document()->findFeatures(tsel, Main->view()->pixelPerM(), dlg->sbMaxResult->value());
+    delete tsel;
 
     findMode = true;
     ui.tabBar->blockSignals(true);
@@ -412,11 +407,9 @@ void FeaturesDock::updateList()
         for (int j=0; j<Main->document()->layerSize(); ++j) {
             if (!Main->document()->getLayer(j)->size())
                 continue;
-            QList < Feature* > ret = g_backend.indexFind(Main->document()->getLayer(j), theViewport);
+            QList < Feature* > ret;
+            g_backend.indexFind(Main->document()->getLayer(j), theViewport, ret, IndexFilter(IFeature::All, true));
             foreach (Feature* F, ret) {
-                if (F->isHidden())
-                    continue;
-
                 if (ui.cbWithin->isChecked()) {
                     if (Main->view()->viewport().contains(F->boundingBox()))
                         addItem(F);
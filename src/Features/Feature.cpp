@@ -16,6 +16,7 @@
 #include "PropertiesDock.h"
 
 #include "Utils.h"
+#include "MemoryPool.h"
 
 #include <QApplication>
 #include <QUuid>
@@ -88,16 +89,16 @@ class FeaturePrivate
 {
 public:
     FeaturePrivate(Feature* aFeature)
-        :  LastActor(Feature::User)
-        , PossiblePaintersUpToDate(false)
-        , PixelPerMForPainter(-1), CurrentPainter(0), HasPainter(false)
-        , theFeature(aFeature), LastPartNotification(0)
-        , Deleted(false), Visible(true), Uploaded(false), FilterRevision(-1)
-        , Virtual(false), Special(false), DirtyLevel(0)
-        , parentLayer(0)
+        : CurrentPainter(0), theFeature(aFeature), parentLayer(0)
+        , PixelPerMForPainter(-1)
+        , LastActor(Feature::User), LastPartNotification(0)
     #ifndef FRISIUS_BUILD
         , Time(QDateTime::currentDateTime().toTime_t()), User(0xffffffff)
     #endif
+        , FilterRevision(-1), DirtyLevel(0), LayerSlot(-1)
+        , PossiblePaintersUpToDate(false), HasPainter(false)
+        , Deleted(false), Visible(true), Uploaded(false)
+        , Virtual(false), Special(false)
     {
 #ifndef FRISIUS_BUILD
         initVersionNumber();
@@ -105,22 +106,26 @@ public:
 #endif
     }
     FeaturePrivate(const FeaturePrivate& other)
-        : Tags(other.Tags), LastActor(other.LastActor)
-        , PossiblePaintersUpToDate(false)
-        , PixelPerMForPainter(-1), CurrentPainter(0), HasPainter(false)
-        , theFeature(NULL), LastPartNotification(0)
-        , Deleted(false), Visible(true), Uploaded(false), FilterRevision(-1)
-        , Virtual(other.Virtual), Special(other.Special), DirtyLevel(0)
-        , parentLayer(0)
+        : Tags(other.Tags)
+        , CurrentPainter(0), theFeature(NULL), parentLayer(0)
+        , PixelPerMForPainter(-1)
+        , LastActor(other.LastActor), LastPartNotification(0)
     #ifndef FRISIUS_BUILD
         , Time(other.Time), User(other.User)
     #endif
+        , FilterRevision(-1), DirtyLevel(0), LayerSlot(-1)
+        , PossiblePaintersUpToDate(false), HasPainter(false)
+        , Deleted(false), Visible(true), Uploaded(false)
+        , Virtual(other.Virtual), Special(other.Special)
     {
 #ifndef FRISIUS_BUILD
         initVersionNumber();
 #endif
     }
 
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
     void updatePossiblePainters();
     void blankPainters();
     void updatePainters(qreal PixelPerM);
@@ -133,34 +138,61 @@ public:
     }
 #endif
 
-    mutable IFeature::FId Id; // 9 (16)
-    QList<QPair<quint32, quint32> > Tags; // 4
-    Feature::ActorType LastActor; // 4
-    QList<const FeaturePainter*> PossiblePainters; // 4
-    bool PossiblePaintersUpToDate; // 1
+    // Grouped by size, so that a feature does not pay for padding (128 bytes on 64 bits, was 152)
+    mutable IFeature::FId Id; // 16
+    QList<QPair<quint32, quint32> > Tags; // 8
+    QList<const FeaturePainter*> PossiblePainters; // 8
+    QList<Feature*> Parents; // 8
+    QList<FilterLayer*> FilterLayers; // 8
+    const FeaturePainter* CurrentPainter; // 8
+    Feature* theFeature; // 8
+    Layer* parentLayer; // 8
     qreal PixelPerMForPainter; // 8
-    const FeaturePainter* CurrentPainter; // 4
-    bool HasPainter; // 1
-    Feature* theFeature; // 4
-    QList<Feature*> Parents; // 4
+    qreal Alpha; // 8
+    Feature::ActorType LastActor; // 4
     int LastPartNotification; // 4
 #ifndef FRISIUS_BUILD
     uint Time; // 4
     quint32 User; // 4
     int VersionNumber; // 4
 #endif
+    int FilterRevision; // 4
+    int DirtyLevel; // 4
+    int LayerSlot; // 4
+    bool PossiblePaintersUpToDate; // 1
+    bool HasPainter; // 1
     bool Deleted; // 1
     bool Visible; // 1
     bool Uploaded; // 1
-    int FilterRevision; // 4
     bool Virtual; // 1
     bool Special; // 1
-    int DirtyLevel; // 4
-    QList<FilterLayer*> FilterLayers; // 4
-    qreal Alpha; // 8
-    Layer* parentLayer; // 4
 };
 
+/* Never destroyed: features are still being deleted by g_backend at exit */
+static MemoryPool* featurePrivatePool()
+{
+    static MemoryPool* pool = new MemoryPool(sizeof(FeaturePrivate));
+    return pool;
+}
+
+void* FeaturePrivate::operator new(size_t /*size*/)
+{
+    void* ptr = featurePrivatePool()->allocate();
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void FeaturePrivate::operator delete(void* ptr)
+{
+    featurePrivatePool()->deallocate(ptr);
+}
+
+const MemoryPool& Feature::privateMemoryPool()
+{
+    return *featurePrivatePool();
+}
+
 Feature::Feature()
 : MetaUpToDate(false), ReadOnly(false)
 {
@@ -197,6 +229,16 @@ Layer* Feature::layer() const
     return p->parentLayer;
 }
 
+int Feature::layerSlot() const
+{
+    return p->LayerSlot;
+}
+
+void Feature::setLayerSlot(int slot)
+{
+    p->LayerSlot = slot;
+}
+
 void Feature::setLastUpdated(Feature::ActorType A)
 {
     p->LastActor = A;
@@ -431,6 +473,14 @@ bool Feature::isSpecial() const
     return p->Special;
 }
 
+/* Keeps the tag index of the document up to date, see Document::notifyTagUpdate */
+static void notifyTagUpdate(Feature* F, quint32 key, bool added)
+{
+    Layer* L = F->layer();
+    if (L && L->getDocument())
+        L->getDocument()->notifyTagUpdate(L, F, key, added);
+}
+
 void Feature::setTag(int index, const QString& key, const QString& value)
 {
     if (key.toLower() == "created_by")
@@ -442,14 +492,19 @@ void Feature::setTag(int index, const QString& key, const QString& value)
     for (; i<p->Tags.size(); ++i)
         if (p->Tags[i].first == pi.first)
         {
-            if (p->Tags[i].second == pi.second)
+            if (p->Tags[i].second == pi.second) {
+                // Already set: give back the reference taken above
+                if (!key.isEmpty() && !value.isEmpty())
+                    g_removeFromTagList(pi.first, pi.second);
                 return;
+            }
             g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
             p->Tags[i].second = pi.second;
             break;
         }
     if (i == p->Tags.size()) {
         p->Tags.insert(p->Tags.begin() + index, pi);
+        notifyTagUpdate(this, pi.first, true);
     }
     invalidatePainter();
     invalidateMeta();
@@ -466,14 +521,43 @@ void Feature::setTag(const QString& key, const QString& value)
     for (; i<p->Tags.size(); ++i)
         if (p->Tags[i].first == pi.first)
         {
-            if (p->Tags[i].second == pi.second)
+            if (p->Tags[i].second == pi.second) {
+                // Already set: give back the reference taken above
+                if (!key.isEmpty() && !value.isEmpty())
+                    g_removeFromTagList(pi.first, pi.second);
                 return;
+            }
             g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
             p->Tags[i].second = pi.second;
             break;
         }
     if (i == p->Tags.size()) {
         p->Tags.push_back(pi);
+        notifyTagUpdate(this, pi.first, true);
+    }
+    invalidateMeta();
+    invalidatePainter();
+}
+
+void Feature::setInternedTag(quint32 key, quint32 value)
+{
+    g_addToTagList(key, value);
+
+    int i = 0;
+    for (; i<p->Tags.size(); ++i)
+        if (p->Tags[i].first == key)
+        {
+            if (p->Tags[i].second == value) {
+                g_removeFromTagList(key, value);
+                return;
+            }
+            g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
+            p->Tags[i].second = value;
+            break;
+        }
+    if (i == p->Tags.size()) {
+        p->Tags.push_back(qMakePair(key, value));
+        notifyTagUpdate(this, key, true);
     }
     invalidateMeta();
     invalidatePainter();
@@ -483,6 +567,7 @@ void Feature::clearTags()
 {
     while (p->Tags.size()) {
         g_removeFromTagList(p->Tags[0].first, p->Tags[0].second);
+        notifyTagUpdate(this, p->Tags[0].first, false);
         p->Tags.erase(p->Tags.begin());
     }
     invalidateMeta();
@@ -497,6 +582,7 @@ void Feature::clearTag(const QString& k)
         if (p->Tags[i].first == ik)
         {
             g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
+            notifyTagUpdate(this, ik, false);
             p->Tags.erase(p->Tags.begin()+i);
             break;
         }
@@ -507,6 +593,7 @@ void Feature::clearTag(const QString& k)
 void Feature::removeTag(int idx)
 {
     g_removeFromTagList(p->Tags[idx].first, p->Tags[idx].second);
+    notifyTagUpdate(this, p->Tags[idx].first, false);
     p->Tags.erase(p->Tags.begin()+idx);
     invalidateMeta();
     invalidatePainter();
@@ -527,20 +614,29 @@ QString Feature::tagKey(int i) const
     return g_getTagKey(p->Tags[i].first);
 }
 
+quint32 Feature::tagKeyId(int i) const
+{
+    return p->Tags[i].first;
+}
+
 int Feature::findKey(const QString &k) const
 {
+    if (p->Tags.isEmpty())
+        return -1;
+
+    quint32 ik = g_getTagKeyIndex(k);
     for (int i=0; i<p->Tags.size(); ++i)
-        if (tagKey(i) == k)
+        if (p->Tags[i].first == ik)
             return i;
     return -1;
 }
 
 QString Feature::tagValue(const QString& k, const QString& Default) const
 {
-    for (int i=0; i<p->Tags.size(); ++i)
-        if (tagKey(i) == k)
-            return tagValue(i);
-    return Default;
+    int i = findKey(k);
+    if (i == -1)
+        return Default;
+    return tagValue(i);
 }
 
 void Feature::invalidateMeta()
@@ -552,6 +648,7 @@ void Feature::invalidatePainter()
 {
     p->PossiblePaintersUpToDate = false;
     p->PixelPerMForPainter = -1;
+    g_backend.touch(this);
 }
 
 static QPainterPath painterPath;
@@ -575,9 +672,12 @@ void FeaturePrivate::updatePossiblePainters()
 
     PossiblePainters.clear();
     QList<const FeaturePainter*> DefaultPainters;
-    for (int i=0; i<theFeature->layer()->getDocument()->getPaintersSize(); ++i)
+    Document* theDocument = theFeature->layer()->getDocument();
+    QVector<int> candidates;
+    theDocument->getPossiblePainters(Tags, candidates);
+    for (int i=0; i<candidates.size(); ++i)
     {
-        const FeaturePainter* Current = dynamic_cast<const FeaturePainter*>(theFeature->layer()->getDocument()->getPainter(i));
+        const FeaturePainter* Current = static_cast<const FeaturePainter*>(theDocument->getPainter(candidates[i]));
         switch (Current->matchesTag(theFeature,NULL)) {
         case TagSelect_Match:
             PossiblePainters.push_back(Current);
@@ -42,6 +42,7 @@ class QPen;
 class QProgressDialog;
 
 class FeaturePrivate;
+class MemoryPool;
 
 class RenderPriority
 {
@@ -75,6 +76,14 @@ public:
     {
         return theLayer;
     }
+    Class renderClass() const
+    {
+        return theClass;
+    }
+    qreal priority() const
+    {
+        return InClassPriority;
+    }
 
 private:
     Class theClass;
@@ -153,6 +162,9 @@ public:
 #endif
     virtual void setLayer(Layer* aLayer);
     virtual Layer* layer() const;
+    // Position in the features of its layer; only maintained by Layer
+    int layerSlot() const;
+    void setLayerSlot(int slot);
     virtual QString description() const = 0;
 
     /** Set the tag "key=value" to the current object
@@ -172,6 +184,13 @@ public:
         */
     virtual void setTag(int index, const QString& key, const QString& value);
 
+    /** Set the tag "key=value" from ids returned by g_setTagKey and g_setTagValue
+         * Both strings must be non empty
+         * @param key the id of the key
+         * @param value the id of the value
+         */
+    void setInternedTag(quint32 key, quint32 value);
+
     /** remove all the tags for the curent feature
          */
     virtual void clearTags();
@@ -210,6 +229,8 @@ public:
          * @return the value
         */
     virtual QString tagKey(int i) const;
+    /** the interned id of the key of the tag at the position "i", see g_getTagKey */
+    quint32 tagKeyId(int i) const;
 
     /** remove the tag at the position "i".
          * position start at 0.
@@ -338,13 +359,13 @@ public:
     void getLock();
     void releaseLock();
 
+    static const MemoryPool& privateMemoryPool();
+
 private:
     FeaturePrivate* p;
 
 protected:
     mutable CoordBox BBox;
-    bool ReadOnly; // 1
-    bool MetaUpToDate;
     IFeature::FId newId(IFeature::FeatureType type) const;
     QMutex featMutex;
 
@@ -352,6 +373,9 @@ protected:
     static void tagsFromXML(Document* d, Feature* f, QXmlStreamReader& stream);
 
     QPainterPath thePath;
+    // Last, so that the small members of Node can use the padding after them
+    bool ReadOnly; // 1
+    bool MetaUpToDate;
 };
 
 Q_DECLARE_METATYPE( Feature * );
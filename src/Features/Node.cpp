@@ -4,6 +4,7 @@
 #include "MapRenderer.h"
 #include "LineF.h"
 #include "Global.h"
+#include "MemoryPool.h"
 
 #include <QApplication>
 #include <QtGui/QPainter>
@@ -31,6 +32,49 @@ Node::~Node(void)
 {
 }
 
+/* Never destroyed: nodes are still being deleted by g_backend at exit */
+static MemoryPool* nodePool()
+{
+    static MemoryPool* pool = new MemoryPool(sizeof(Node));
+    return pool;
+}
+
+const MemoryPool& Node::memoryPool()
+{
+    return *nodePool();
+}
+
+void* Node::operator new(size_t size)
+{
+    void* ptr = Node::operator new(size, std::nothrow);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* Node::operator new(size_t size, const std::nothrow_t&) Q_DECL_NOTHROW
+{
+    if (size != sizeof(Node))
+        return ::operator new(size, std::nothrow);
+    return nodePool()->allocate();
+}
+
+void Node::operator delete(void* ptr, size_t size)
+{
+    if (size != sizeof(Node))
+        ::operator delete(ptr);
+    else
+        nodePool()->deallocate(ptr);
+}
+
+void Node::operator delete(void* ptr, const std::nothrow_t&) Q_DECL_NOTHROW
+{
+    if (nodePool()->owns(ptr))
+        nodePool()->deallocate(ptr);
+    else
+        ::operator delete(ptr);
+}
+
 const QPointF& Node::projected() const
 {
     return Projected;
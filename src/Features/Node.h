@@ -11,7 +11,10 @@
 #include <QtCore/QDateTime>
 #include <QtXml>
 
+#include <new>
+
 class QProgressDialog;
+class MemoryPool;
 
 class Node : public Feature
 {
@@ -27,12 +30,20 @@ public:
     Node(const Node& other);
     virtual ~Node();
 
-    quint16 ProjectionRevision;
-    QPointF Projected;
+    /* Plain nodes are allocated from a slab pool; derived classes use the heap */
+    static void* operator new(size_t size);
+    static void* operator new(size_t size, const std::nothrow_t&) Q_DECL_NOTHROW;
+    static void operator delete(void* ptr, size_t size);
+    static void operator delete(void* ptr, const std::nothrow_t&) Q_DECL_NOTHROW;
+    static const MemoryPool& memoryPool();
 
+    // The small members first, packed together (and after those of Feature where the ABI allows)
+    quint16 ProjectionRevision;
     bool IsWaypoint;
     bool IsPOI;
 
+    QPointF Projected;
+
 public:
     virtual QString getClass() const {return "Node";}
     virtual char getType() const {return IFeature::Point;}
@@ -12,6 +12,9 @@
 #include <QAbstractTableModel>
 #include <QProgressDialog>
 #include <QPainter>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QDebug>
 
 #include <algorithm>
 #include <utility>
@@ -41,6 +44,7 @@ class RelationPrivate
             : theRelation(R), theModel(0), ModelReferences(0)
             , PathUpToDate(false)
             , ProjectionRevision(0)
+            , RingsUpToDate(false)
             , BBoxUpToDate(false)
             , Width(0)
         {
@@ -50,6 +54,7 @@ class RelationPrivate
             delete theModel;
         }
         void CalculateWidth();
+        void buildRings();
 
         Relation* theRelation;
         QList<QPair<QString, MapFeaturePtr> > Members;
@@ -60,6 +65,19 @@ class RelationPrivate
         bool PathUpToDate;
         int ProjectionRevision;
 
+        /* Member ways joined end to end, kept across projection changes */
+        struct RingPart {
+            Way* way;
+            bool reversed;
+        };
+        struct Ring {
+            QString role;
+            QList<RingPart> parts;
+            bool closed;
+        };
+        QList<Ring> Rings;
+        bool RingsUpToDate;
+
         bool BBoxUpToDate;
 
         RenderPriority theRenderPriority;
@@ -67,6 +85,111 @@ class RelationPrivate
         qreal Width;
     };
 
+/* End nodes of a member way, the first and last downloaded ones as for Way::buildPath */
+static bool wayEnds(Way* W, Node*& first, Node*& last)
+{
+    first = last = NULL;
+    int count = 0;
+    for (int i=0; i<W->size(); ++i) {
+        Node* N = W->getNode(i);
+        if (N->notEverythingDownloaded())
+            continue;
+        if (!first)
+            first = N;
+        last = N;
+        ++count;
+    }
+    return count > 1;
+}
+
+/*
+    Joins the member ways sharing an end node and having the same role. Ways are looked up by end
+    node, so this is linear in the number of members rather than rescanning them after each join.
+*/
+void RelationPrivate::buildRings()
+{
+    Rings.clear();
+
+    struct Member {
+        QString role;
+        Way* way;
+        Node* first;
+        Node* last;
+        bool used;
+    };
+    QVector<Member> members;
+    members.reserve(Members.size());
+    QHash<Node*, QVector<int> > byEnd;
+    for (int i=0; i<Members.size(); ++i) {
+        if (!CHECK_WAY(Members[i].second))
+            continue;
+        Member m;
+        m.role = Members[i].first;
+        m.way = STATIC_CAST_WAY(Members[i].second);
+        m.used = false;
+        if (!wayEnds(m.way, m.first, m.last))
+            continue;
+        byEnd[m.first] << members.size();
+        if (m.last != m.first)
+            byEnd[m.last] << members.size();
+        members << m;
+    }
+
+    // Unused member of the role ending at N, -1 if none
+    struct Finder {
+        QVector<Member>& members;
+        QHash<Node*, QVector<int> >& byEnd;
+        int operator()(Node* N, const QString& role) {
+            QHash<Node*, QVector<int> >::iterator it = byEnd.find(N);
+            if (it == byEnd.end())
+                return -1;
+            QVector<int>& candidates = it.value();
+            for (int i=0; i<candidates.size(); ++i) {
+                const Member& m = members[candidates[i]];
+                if (m.used) {
+                    // Will never be wanted again
+                    candidates.remove(i--);
+                    continue;
+                }
+                if (m.role == role)
+                    return candidates[i];
+            }
+            return -1;
+        }
+    } findAt = { members, byEnd };
+
+    for (int i=0; i<members.size(); ++i) {
+        if (members[i].used)
+            continue;
+        Ring ring;
+        ring.role = members[i].role;
+        members[i].used = true;
+        RingPart start = { members[i].way, false };
+        ring.parts << start;
+        Node* head = members[i].first;
+        Node* tail = members[i].last;
+
+        // Forward from the tail...
+        int k;
+        while (tail != head && (k = findAt(tail, ring.role)) >= 0) {
+            members[k].used = true;
+            RingPart part = { members[k].way, members[k].first != tail };
+            ring.parts << part;
+            tail = part.reversed ? members[k].first : members[k].last;
+        }
+        // ... then backward from the head, for a way picked in the middle of an open chain
+        while (tail != head && (k = findAt(head, ring.role)) >= 0) {
+            members[k].used = true;
+            RingPart part = { members[k].way, members[k].last != head };
+            ring.parts.prepend(part);
+            head = part.reversed ? members[k].last : members[k].first;
+        }
+        ring.closed = (tail == head);
+        Rings << ring;
+    }
+    RingsUpToDate = true;
+}
+
 #define DEFAULTWIDTH 6
 #define LANEWIDTH 4
 
@@ -141,6 +264,7 @@ void Relation::partChanged(Feature*, int ChangeId)
         return;
 
     p->PathUpToDate = false;
+    p->RingsUpToDate = false;
     p->BBoxUpToDate = false;
     MetaUpToDate = false;
     g_backend.sync(this);
@@ -326,6 +450,7 @@ void Relation::add(const QString& Role, Feature* F)
     p->Members.push_back(qMakePair(Role,F));
     F->setParentFeature(this);
     p->PathUpToDate = false;
+    p->RingsUpToDate = false;
     p->BBoxUpToDate = false;
     MetaUpToDate = false;
     g_backend.sync(this);
@@ -339,6 +464,7 @@ void Relation::add(const QString& Role, Feature* F, int Idx)
     std::rotate(p->Members.begin()+Idx,p->Members.end()-1,p->Members.end());
     F->setParentFeature(this);
     p->PathUpToDate = false;
+    p->RingsUpToDate = false;
     p->BBoxUpToDate = false;
     MetaUpToDate = false;
     g_backend.sync(this);
@@ -354,6 +480,7 @@ void Relation::remove(int Idx)
     if (F && find(F) == p->Members.size())
         F->unsetParentFeature(this);
     p->PathUpToDate = false;
+    p->RingsUpToDate = false;
     p->BBoxUpToDate = false;
     MetaUpToDate = false;
     g_backend.sync(this);
@@ -452,15 +579,11 @@ void Relation::buildPath(Projection const &theProjection)
         if (tagValue("type", "") == "multipolygon")
             isMultipolygon = true;
 
-
-        // Handle polygons made of scattered ways
-        QList< QPair<QString,QPainterPath> > memberPaths;
         for (int i=0; i<size(); ++i) {
             if (CHECK_WAY(p->Members[i].second)) {
                 Way* M = STATIC_CAST_WAY(p->Members[i].second);
                 M->buildPath(theProjection);
                 if (M->getPath().elementCount() > 1) {
-                    memberPaths << qMakePair(p->Members[i].first, M->getPath());
                     if (isMultipolygon && (p->Members[i].first == "outer" || p->Members[i].first.isEmpty())) {
                         if (!numOuter)
                             outerWay = M;
@@ -472,58 +595,51 @@ void Relation::buildPath(Projection const &theProjection)
             }
         }
 
+        // Handle polygons made of scattered ways
+        if (!p->RingsUpToDate)
+            p->buildRings();
+
         QList<QPainterPath> innerPaths;
         QList<QPainterPath> outerPaths;
-
-        while (memberPaths.size()) {
-            // handle the start...
-            QPointF curPoint;
+        for (int r=0; r<p->Rings.size(); ++r) {
+            const RelationPrivate::Ring& ring = p->Rings[r];
             QPainterPath curPath;
-            QString curRole;
-
-            curRole = memberPaths[0].first;
-            curPath.moveTo(memberPaths[0].second.elementAt(0));
-            for (int j=1; j<memberPaths[0].second.elementCount(); ++j) {
-                curPoint = memberPaths[0].second.elementAt(j);
-                curPath.lineTo(curPoint);
-            }
-            // ... and remove it
-            memberPaths.removeAt(0);
-            // Check if any remaining path starts or ends at the current point
-            for (int k=0; k<memberPaths.size(); ++k) {
-                if (memberPaths[k].second.elementAt(0) == curPoint && memberPaths[k].first == curRole) { // Check start
-                    for (int l=1; l<memberPaths[k].second.elementCount(); ++l) {
-                        curPoint = memberPaths[k].second.elementAt(l);
-                        curPath.lineTo(curPoint);
-                    }
-                    memberPaths.removeAt(k);
-                    k=0;
-                } else if (memberPaths[k].second.elementAt(memberPaths[k].second.elementCount()-1) == curPoint  && memberPaths[k].first == curRole) { // Check end
-                    for (int l=memberPaths[k].second.elementCount()-2; l>=0; --l) {
-                        curPoint = memberPaths[k].second.elementAt(l);
-                        curPath.lineTo(curPoint);
-                    }
-                    memberPaths.removeAt(k);
-                    k=0;
+            for (int i=0; i<ring.parts.size(); ++i) {
+                const QPainterPath& wayPath = ring.parts[i].way->getPath();
+                int n = wayPath.elementCount();
+                if (ring.parts[i].reversed) {
+                    if (!i)
+                        curPath.moveTo(wayPath.elementAt(n-1));
+                    for (int j=n-2; j>=0; --j)
+                        curPath.lineTo(wayPath.elementAt(j));
+                } else {
+                    if (!i)
+                        curPath.moveTo(wayPath.elementAt(0));
+                    for (int j=1; j<n; ++j)
+                        curPath.lineTo(wayPath.elementAt(j));
                 }
             }
-            if (curRole == "inner" and isMultipolygon)
+            if (ring.closed)
+                curPath.closeSubpath();
+            if (ring.role == "inner" && isMultipolygon)
                 innerPaths << curPath;
             else
                 outerPaths << curPath;
         }
 
+        // Holes are left out by the even-odd rule, no need for boolean operations on the paths
         if (outerWay && tagSize() == 1) {
             outerWay->rebuildPath(theProjection);
             for (int i=0; i<innerPaths.size(); ++i) {
                 outerWay->addPathHole(innerPaths[i]);
             }
         } else {
+            p->thePath.setFillRule(Qt::OddEvenFill);
             for (int i=0; i<outerPaths.size(); ++i) {
                 p->thePath.addPath(outerPaths[i]);
             }
             for (int i=0; i<innerPaths.size(); ++i) {
-                p->thePath = p->thePath.subtracted(innerPaths[i]);
+                p->thePath.addPath(innerPaths[i]);
             }
         }
 
@@ -532,6 +648,50 @@ void Relation::buildPath(Projection const &theProjection)
     }
 }
 
+void Relation::benchmarkPaths(Document* theDocument, const Projection& theProjection)
+{
+    QList<Relation*> theRelations;
+    int members = 0;
+    for (FeatureIterator it(theDocument); !it.isEnd(); ++it) {
+        Relation* R = CAST_RELATION(it.get());
+        if (R && R->tagValue("type", "") == "multipolygon") {
+            theRelations << R;
+            members += R->size();
+        }
+    }
+    if (theRelations.isEmpty())
+        return;
+
+    QElapsedTimer timer;
+    qint64 fullNs = 0, reprojectNs = 0, worstNs = 0;
+    Relation* worst = NULL;
+    int rings = 0;
+    for (int i=0; i<theRelations.size(); ++i) {
+        Relation* R = theRelations[i];
+        R->p->PathUpToDate = false;
+        R->p->RingsUpToDate = false;
+        timer.start();
+        R->buildPath(theProjection);
+        qint64 ns = timer.nsecsElapsed();
+        fullNs += ns;
+        rings += R->p->Rings.size();
+        if (ns > worstNs) {
+            worstNs = ns;
+            worst = R;
+        }
+
+        // As after a projection change: the rings are kept
+        R->p->PathUpToDate = false;
+        timer.start();
+        R->buildPath(theProjection);
+        reprojectNs += timer.nsecsElapsed();
+    }
+
+    qDebug() << "Multipolygon path benchmark:" << theRelations.size() << "relations," << members << "members," << rings << "rings";
+    qDebug() << "  build:" << fullNs / 1000000 << "ms, rebuild with cached rings:" << reprojectNs / 1000000 << "ms";
+    qDebug() << "  slowest:" << worst->id().numId << "with" << worst->size() << "members," << worstNs / 1000000 << "ms";
+}
+
 const QPainterPath& Relation::getPath() const
 {
     return p->thePath;
@@ -553,6 +713,7 @@ void Relation::updateMeta()
     Feature::updateMeta();
 
     p->PathUpToDate = false;
+    p->RingsUpToDate = false;
     p->CalculateWidth();
 
     MetaUpToDate = true;
@@ -55,6 +55,8 @@ public:
 
     const QPainterPath& getPath() const;
     void buildPath(Projection const &theProjection);
+    // Logs the time taken to build the paths of the multipolygons of the document
+    static void benchmarkPaths(Document* theDocument, const Projection& theProjection);
 
     virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString());
     static Relation* fromXML(Document* d, Layer* L, QXmlStreamReader& stream);
@@ -10,25 +10,91 @@
 
 #include <QtGui/QPainter>
 #include <QProgressDialog>
+#include <QtConcurrent/QtConcurrentMap>
 
 #include <algorithm>
+#include <limits>
 #include <QList>
 
 #define TEST_RFLAGS(x) theView->renderOptions().options.testFlag(x)
 
+// One meter at the equator, in degrees: the tolerance of the first simplified level
+#define LEVEL_BASE_TOLERANCE (360. / 40080000)
+// Doublings of the tolerance tried, well past the size of the Earth
+#define MAX_LEVELS 32
+
 class TrackSegmentPrivate
 {
     public:
         TrackSegmentPrivate()
-        : Distance(0)
+        : Distance(0), LevelsUpToDate(false)
         {
         }
 
         QList<TrackNode*> Nodes;
         qreal Distance;
         CoordBox BBox;
+
+        /* Douglas-Peucker tolerance under which each node is dropped, and the nodes kept at
+         * tolerances doubling from LEVEL_BASE_TOLERANCE; all the nodes are drawn below the first */
+        QVector<float> Importance;
+        QVector<QVector<int> > Levels;
+        QVector<qreal> LevelTolerances;
+        bool LevelsUpToDate;
 };
 
+static qreal segmentDistance(const QPointF& P, const QPointF& A, const QPointF& B)
+{
+    QPointF AB = B - A;
+    qreal len2 = AB.x()*AB.x() + AB.y()*AB.y();
+    qreal t = len2 > 0 ? ((P.x()-A.x())*AB.x() + (P.y()-A.y())*AB.y()) / len2 : 0;
+    QPointF H = A + AB * qBound(qreal(0), t, qreal(1));
+    return ::distance(P, H);
+}
+
+/*
+    Douglas-Peucker over the whole segment at once: each node gets the tolerance under which it is
+    dropped, bounded by the one of the span it splits so that a coarser level is always a subset of
+    a finer one. Any tolerance is then a simple filter.
+*/
+static void computeImportance(const QList<TrackNode*>& Nodes, QVector<float>& Importance)
+{
+    int n = Nodes.size();
+    Importance.fill(0, n);
+    if (n < 2)
+        return;
+
+    QVector<QPointF> pts(n);
+    for (int i=0; i<n; ++i)
+        pts[i] = Nodes[i]->position();
+    Importance[0] = Importance[n-1] = std::numeric_limits<float>::max();
+
+    struct Span { int from, to; float bound; };
+    QVector<Span> stack;
+    Span all = { 0, n-1, std::numeric_limits<float>::max() };
+    stack << all;
+    while (!stack.isEmpty()) {
+        Span s = stack.last();
+        stack.pop_back();
+        if (s.to - s.from < 2)
+            continue;
+        int best = s.from + 1;
+        qreal bestD = -1;
+        for (int i=s.from+1; i<s.to; ++i) {
+            qreal d = segmentDistance(pts[i], pts[s.from], pts[s.to]);
+            if (d > bestD) {
+                bestD = d;
+                best = i;
+            }
+        }
+        float imp = qMin(float(bestD), s.bound);
+        Importance[best] = imp;
+        Span left = { s.from, best, imp };
+        Span right = { best, s.to, imp };
+        stack << left << right;
+    }
+}
+
 TrackSegment::TrackSegment(void)
     : Feature()
 {
@@ -74,6 +140,7 @@ QString TrackSegment::description() const
 void TrackSegment::add(TrackNode* aPoint)
 {
     p->Nodes.push_back(aPoint);
+    p->LevelsUpToDate = false;
     aPoint->setParentFeature(this);
     g_backend.sync(this);
 }
@@ -82,6 +149,7 @@ void TrackSegment::add(TrackNode* Pt, int Idx)
 {
     p->Nodes.push_back(Pt);
     std::rotate(p->Nodes.begin()+Idx,p->Nodes.end()-1,p->Nodes.end());
+    p->LevelsUpToDate = false;
     g_backend.sync(this);
 }
 
@@ -97,6 +165,7 @@ void TrackSegment::remove(int idx)
 {
     Node* Pt = p->Nodes[idx];
     p->Nodes.erase(p->Nodes.begin()+idx);
+    p->LevelsUpToDate = false;
     Pt->unsetParentFeature(this);
     g_backend.sync(this);
 }
@@ -133,6 +202,68 @@ bool TrackSegment::isNull() const
     return (p->Nodes.size() == 0);
 }
 
+void TrackSegment::updateLevels()
+{
+    QMutexLocker mutlock(&featMutex);
+    if (p->LevelsUpToDate)
+        return;
+
+    computeImportance(p->Nodes, p->Importance);
+    p->Levels.clear();
+    p->LevelTolerances.clear();
+    qreal tolerance = LEVEL_BASE_TOLERANCE;
+    int previous = p->Nodes.size();
+    for (int k=0; k<MAX_LEVELS && previous > 2; ++k, tolerance *= 2) {
+        QVector<int> level;
+        for (int i=0; i<p->Importance.size(); ++i)
+            if (p->Importance[i] >= tolerance)
+                level << i;
+        // Not worth the memory unless a quarter of the nodes go
+        if (level.size() > previous * 3 / 4)
+            continue;
+        level.squeeze();
+        p->Levels << level;
+        p->LevelTolerances << tolerance;
+        previous = level.size();
+    }
+    p->LevelsUpToDate = true;
+}
+
+static void updateSegmentLevels(TrackSegment*& S)
+{
+    S->updateLevels();
+}
+
+void TrackSegment::updateLevels(const QList<TrackSegment*>& segments)
+{
+    QList<TrackSegment*> theSegments(segments);
+    QtConcurrent::blockingMap(theSegments, updateSegmentLevels);
+}
+
+QVector<int> TrackSegment::simplified(qreal tolerance)
+{
+    updateLevels();
+
+    QVector<int> result;
+    for (int i=0; i<p->Importance.size(); ++i)
+        if (p->Importance[i] >= tolerance)
+            result << i;
+    return result;
+}
+
+// The nodes to draw, NULL for all of them
+const QVector<int>* TrackSegment::levelFor(qreal PixelPerM)
+{
+    updateLevels();
+
+    // Up to half a pixel off
+    qreal tolerance = LEVEL_BASE_TOLERANCE / PixelPerM / 2;
+    int level = -1;
+    while (level+1 < p->Levels.size() && p->LevelTolerances[level+1] <= tolerance)
+        ++level;
+    return level < 0 ? NULL : &p->Levels[level];
+}
+
 void TrackSegment::drawDirectionMarkers(QPainter &P, QPen &pen, const QPointF & FromF, const QPointF & ToF)
 {
     if (::distance(FromF,ToF) <= 30.0)
@@ -161,6 +292,13 @@ void TrackSegment::drawSimple(QPainter &P, MapView *theView)
     Q_UNUSED(theView)
 }
 
+// Unlike CoordBox::intersects, also true for a horizontal or vertical segment
+static bool boxOverlaps(const CoordBox& box, const Coord& a, const Coord& b)
+{
+    return qMin(a.x(), b.x()) <= box.right() && qMax(a.x(), b.x()) >= box.left()
+        && qMin(a.y(), b.y()) <= box.top() && qMax(a.y(), b.y()) >= box.bottom();
+}
+
 void TrackSegment::drawTouchup(QPainter &P, MapView* theView)
 {
     QPen pen;
@@ -168,19 +306,26 @@ void TrackSegment::drawTouchup(QPainter &P, MapView* theView)
     if (!TEST_RFLAGS(RendererOptions::TrackSegmentVisible))
         return;
 
-    for (int i=1; i<p->Nodes.size(); ++i)
+    // Only the nodes that show at this zoom level
+    const QVector<int>* level = levelFor(theView->pixelPerM());
+    int count = level ? level->size() : p->Nodes.size();
+
+    for (int i=1; i<count; ++i)
     {
-        if (!theView->viewport().contains(p->Nodes[i-1]->position()) && !theView->viewport().contains(p->Nodes[i]->position()))
+        TrackNode* From = p->Nodes[level ? level->at(i-1) : i-1];
+        TrackNode* To = p->Nodes[level ? level->at(i) : i];
+        // Simplified levels have long segments, whose ends may both be out of a close view
+        if (!boxOverlaps(theView->viewport(), From->position(), To->position()))
             continue;
 
-        QPointF FromF = theView->toView(p->Nodes[i-1]);
-        QPointF ToF = theView->toView(p->Nodes[i]);
+        QPointF FromF = theView->toView(From);
+        QPointF ToF = theView->toView(To);
 
         if (!M_PREFS->getSimpleGpxTrack())
         {
-            qreal distance = p->Nodes[i-1]->position().distanceFrom(p->Nodes[i]->position());
-            qreal slope = (p->Nodes[i]->elevation() - p->Nodes[i-1]->elevation()) / (distance * 10.0);
-            qreal speed = p->Nodes[i]->speed();
+            qreal distance = From->position().distanceFrom(To->position());
+            qreal slope = (To->elevation() - From->elevation()) / (distance * 10.0);
+            qreal speed = To->speed();
 
             int width = M_PREFS->getGpxTrackWidth();
             // Dynamic track line width adaption to zoom level
@@ -311,6 +456,8 @@ void TrackSegment::cascadedRemoveIfUsing(Document* theDocument, Feature* aFeatur
 
 void TrackSegment::partChanged(Feature*, int)
 {
+    // A node moved
+    p->LevelsUpToDate = false;
 }
 
 void TrackSegment::updateMeta()
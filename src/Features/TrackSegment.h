@@ -3,6 +3,8 @@
 
 #include "Feature.h"
 
+#include <QVector>
+
 class TrackSegmentPrivate;
 class TrackNode;
 
@@ -18,6 +20,7 @@ protected:
     TrackSegment(const TrackSegment& other);
 
 private:
+    const QVector<int>* levelFor(qreal PixelPerM);
     void drawDirectionMarkers(QPainter & P, QPen & pen, const QPointF & FromF, const QPointF & ToF);
 
 public:
@@ -49,6 +52,13 @@ public:
     virtual bool isNull() const;
 
     void sortByTime();
+
+    // Indices of the nodes kept when simplifying the segment within tolerance, in degrees
+    QVector<int> simplified(qreal tolerance);
+    // Builds the levels of detail if out of date; otherwise done on first draw
+    void updateLevels();
+    // Same for many segments, in parallel
+    static void updateLevels(const QList<TrackSegment*>& segments);
     virtual void partChanged(Feature* F, int ChangeId);
 
     qreal distance();
@@ -653,7 +653,9 @@ void Way::addPathHole(const QPainterPath& pth)
     if (!p->PathUpToDate)
         return;
 
-    p->thePath = p->thePath.subtracted(pth);
+    // Filled with the even-odd rule, the hole is left out
+    p->thePath.setFillRule(Qt::OddEvenFill);
+    p->thePath.addPath(pth);
 }
 
 void Way::rebuildPath(const Projection &theProjection)
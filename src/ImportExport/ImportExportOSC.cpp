@@ -17,6 +17,10 @@
 #include "DirtyListExecutorOSC.h"
 
 #include "DownloadOSM.h"
+#include "Global.h"
+#include "OsmXmlParser.h"
+
+#include <QFile>
 
 ImportExportOSC::ImportExportOSC(Document* doc)
  : IImportExport(doc)
@@ -44,15 +48,164 @@ bool ImportExportOSC::export_(const QList<Feature *>&)
 
 // IMPORT
 
+/* Skips the rest of the current element, whatever it holds */
+static void skipElement(OsmXmlParser& parser)
+{
+    int depth = 1;
+    while (depth) {
+        OsmXmlParser::TokenType token = parser.readNext();
+        if (token == OsmXmlParser::StartElement)
+            ++depth;
+        else if (token == OsmXmlParser::EndElement)
+            --depth;
+        else
+            return;
+    }
+}
+
+static qint64 featureId(const OsmXmlParser& parser)
+{
+    return parser.int64Attribute(parser.hasAttribute("id") ? "id" : "xml:id");
+}
+
+/* The attributes read by Feature::fromXML */
+static void featureAttributes(const OsmXmlParser& parser, Feature* F)
+{
+    F->setLastUpdated((Feature::ActorType)parser.int64Attribute("actor", Feature::OSMServer));
+    F->setDeleted(parser.rawAttribute("deleted") == "true");
+    F->setDirtyLevel(parser.int64Attribute("dirtylevel"));
+    F->setUploaded(parser.rawAttribute("uploaded") == "true");
+    F->setSpecial(parser.rawAttribute("special") == "true");
+#ifndef FRISIUS_BUILD
+    uint time;
+    if (parser.timeAttribute("timestamp", time))
+        F->setTime(time);
+    else
+        F->setTime(QDateTime());
+    F->setUser(parser.stringAttribute("user"));
+    F->setVersionNumber(qMax(parser.int64Attribute("version"), qint64(0)));
+#endif
+}
+
+/* A member not downloaded yet, as Way::fromXML and Relation::fromXML add them */
+static Feature* memberFeature(Document* d, Layer* L, const IFeature::FId& id)
+{
+    Feature* F = d->getFeature(id);
+    if (F)
+        return F;
+    if (id.type == IFeature::Point)
+        F = g_backend.allocNode(L, Coord(0,0));
+    else if (id.type == IFeature::LineString)
+        F = g_backend.allocWay(L);
+    else
+        F = g_backend.allocRelation(L);
+    F->setId(id);
+    F->setLastUpdated(Feature::NotYetDownloaded);
+    L->add(F);
+    return F;
+}
+
+/* Like Node::fromXML, Way::fromXML and Relation::fromXML, reading up to the end of the element */
+static Feature* parseFeature(Document* d, Layer* L, OsmXmlParser& parser)
+{
+    Feature* F = 0;
+    if (parser.isElement("node")) {
+        Coord pos(parser.realAttribute("lon"), parser.realAttribute("lat"));
+        IFeature::FId id(IFeature::Point, featureId(parser));
+        Node* N = CAST_NODE(d->getFeature(id));
+        if (!N) {
+            N = g_backend.allocNode(L, pos);
+            N->setId(id);
+            L->add(N);
+            featureAttributes(parser, N);
+        } else {
+            featureAttributes(parser, N);
+            if (N->layer() != L) {
+                N->layer()->remove(N);
+                L->add(N);
+            }
+            N->setPosition(pos);
+        }
+        F = N;
+    } else if (parser.isElement("way")) {
+        IFeature::FId id(IFeature::LineString, featureId(parser));
+        Way* W = CAST_WAY(d->getFeature(id));
+        if (!W) {
+            W = g_backend.allocWay(L);
+            W->setId(id);
+            L->add(W);
+        } else if (W->layer() != L) {
+            W->layer()->remove(W);
+            L->add(W);
+        }
+        featureAttributes(parser, W);
+        while (W->size())
+            W->remove(0);
+        F = W;
+    } else if (parser.isElement("relation")) {
+        IFeature::FId id(IFeature::OsmRelation, featureId(parser));
+        Relation* R = CAST_RELATION(d->getFeature(id));
+        if (!R) {
+            R = g_backend.allocRelation(L);
+            R->setId(id);
+            L->add(R);
+        } else if (R->layer() != L) {
+            R->layer()->remove(R);
+            L->add(R);
+        }
+        featureAttributes(parser, R);
+        while (R->size())
+            R->remove(0);
+        F = R;
+    } else {
+        skipElement(parser);
+        return 0;
+    }
+
+    while (parser.readNext() == OsmXmlParser::StartElement) {
+        if (parser.isElement("tag")) {
+            F->setTag(parser.stringAttribute("k"), parser.stringAttribute("v"));
+        } else if (parser.isElement("nd") && CAST_WAY(F)) {
+            IFeature::FId nId(IFeature::Point, parser.int64Attribute("ref"));
+            CAST_WAY(F)->add(CAST_NODE(memberFeature(d, L, nId)));
+        } else if (parser.isElement("member") && CAST_RELATION(F)) {
+            QByteArray type = parser.rawAttribute("type");
+            IFeature::FId mId(IFeature::Point, parser.int64Attribute("ref"));
+            if (type == "way")
+                mId.type = IFeature::LineString;
+            else if (type == "relation")
+                mId.type = IFeature::OsmRelation;
+            else if (type != "node") {
+                skipElement(parser);
+                continue;
+            }
+            CAST_RELATION(F)->add(parser.stringAttribute("role"), memberFeature(d, L, mId));
+        } else {
+            qDebug() << "OSC: logic error: " << parser.name();
+        }
+        skipElement(parser);
+    }
+    return F;
+}
 
 // import the  input
 bool ImportExportOSC::import(Layer* aLayer)
 {
-    QXmlStreamReader stream(Device);
+    // Parse the file in place if it can be mapped
+    QByteArray Content;
+    const char* data = 0;
+    qint64 size = 0;
+    QFile* File = qobject_cast<QFile*>(Device);
+    if (File && (data = reinterpret_cast<const char*>(File->map(0, File->size()))))
+        size = File->size();
+    else {
+        Content = Device->readAll();
+        data = Content.constData();
+        size = Content.size();
+    }
 
-    while (stream.readNext() && stream.tokenType() != QXmlStreamReader::Invalid && stream.tokenType() != QXmlStreamReader::StartElement)
-        ;
-    if (stream.name() != "osmChange" && stream.name() != "osmchange") {
+    OsmXmlParser parser(data, size);
+    if (parser.readNext() != OsmXmlParser::StartElement || !(parser.isElement("osmChange") || parser.isElement("osmchange"))) {
 //        QMessageBox::critical(this, tr("Invalid file"), tr("%1 is not a valid osmChange file.").arg(fn));
         return false;
     }
@@ -66,93 +219,48 @@ bool ImportExportOSC::import(Layer* aLayer)
     }
 
     QList<IFeature::FId> featIdList;
-    Feature* F = NULL;
-    stream.readNext();
-    while(!stream.atEnd() && !stream.isEndElement()) {
-        if (stream.name() == "create") {
-            stream.readNext();
-            while(!stream.atEnd() && !stream.isEndElement()) {
-                if (stream.name() == "node") {
-                    F = Node::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
-                } else if (stream.name() == "way") {
-                    F = Way::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
-                } else if (stream.name() == "relation") {
-                    F = Relation::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
-                } else if (!stream.isWhitespace()) {
-                    qDebug() << "OSC: logic error: " << stream.name() << " : " << stream.tokenType() << " (" << stream.lineNumber() << ")";
-                    stream.skipCurrentElement();
-                }
-                if (F) {
-                    for (int i=0; i<F->size(); ++i) {
-                        if (F->get(i)->notEverythingDownloaded() && F->get(i)->hasOSMId())
-                            featIdList << F->get(i)->id();
-                    }
-                }
+    while (parser.readNext() == OsmXmlParser::StartElement) {
+        bool create = parser.isElement("create");
+        bool modify = parser.isElement("modify");
+        if (!create && !modify && !parser.isElement("delete")) {
+            skipElement(parser);
+            continue;
+        }
 
-                stream.readNext();
-            }
-        } else if (stream.name() == "modify") {
-            stream.readNext();
-            while(!stream.atEnd() && !stream.isEndElement()) {
-                QString sid = (stream.attributes().hasAttribute("id") ? stream.attributes().value("id").toString() : stream.attributes().value("xml:id").toString());
-                if (stream.name() == "node") {
-                    IFeature::FId id(Feature::Point, sid.toLongLong());
-                    F = theDoc->getFeature(id);
-                    if (!F || F->notEverythingDownloaded())
-                        downloadFeature(0, id, theDoc, dLayer);
-                    F = Node::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
-                } else if (stream.name() == "way") {
-                    IFeature::FId id(Feature::LineString, sid.toLongLong());
-                    F = theDoc->getFeature(id);
-                    if (!F || F->notEverythingDownloaded())
-                        downloadFeature(0, id, theDoc, dLayer);
-                    F = Way::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
-                } else if (stream.name() == "relation") {
-                    IFeature::FId id(Feature::OsmRelation, sid.toLongLong());
-                    F = theDoc->getFeature(id);
+        while (parser.readNext() == OsmXmlParser::StartElement) {
+            if (modify) {
+                IFeature::FId id(IFeature::Point, featureId(parser));
+                if (parser.isElement("way"))
+                    id.type = IFeature::LineString;
+                else if (parser.isElement("relation"))
+                    id.type = IFeature::OsmRelation;
+                else if (!parser.isElement("node"))
+                    id.numId = 0;
+                if (id.numId) {
+                    Feature* F = theDoc->getFeature(id);
                     if (!F || F->notEverythingDownloaded())
                         downloadFeature(0, id, theDoc, dLayer);
-                    F = Relation::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
-                } else if (!stream.isWhitespace()) {
-                    qDebug() << "OSC: logic error: " << stream.name() << " : " << stream.tokenType() << " (" << stream.lineNumber() << ")";
-                    stream.skipCurrentElement();
                 }
-                if (F) {
-                    for (int i=0; i<F->size(); ++i) {
-                        if (F->get(i)->notEverythingDownloaded() && F->get(i)->hasOSMId())
-                            featIdList << F->get(i)->id();
-                    }
-                }
-                stream.readNext();
             }
-        } else if (stream.name() == "delete") {
-            stream.readNext();
-            while(!stream.atEnd() && !stream.isEndElement()) {
-                if (stream.name() == "node") {
-                    Node* N = Node::fromXML(theDoc, aLayer, stream);
-                    theList->add(new RemoveFeatureCommand(theDoc, N));
-                } else if (stream.name() == "way") {
-                    Way* W = Way::fromXML(theDoc, aLayer, stream);
-                    theList->add(new RemoveFeatureCommand(theDoc, W));
-                } else if (stream.name() == "relation") {
-                    Relation* R = Relation::fromXML(theDoc, aLayer, stream);
-                    theList->add(new RemoveFeatureCommand(theDoc, R));
-                } else if (!stream.isWhitespace()) {
-                    qDebug() << "OSC: logic error: " << stream.name() << " : " << stream.tokenType() << " (" << stream.lineNumber() << ")";
-                    stream.skipCurrentElement();
+
+            Feature* F = parseFeature(theDoc, aLayer, parser);
+            if (!F) {
+                qDebug() << "OSC: logic error: " << parser.name();
+                continue;
+            }
+            if (create || modify) {
+                theList->add(new AddFeatureCommand(aLayer, F, true));
+                for (int i=0; i<F->size(); ++i) {
+                    if (F->get(i)->notEverythingDownloaded() && F->get(i)->hasOSMId())
+                        featIdList << F->get(i)->id();
                 }
-                stream.readNext();
+            } else {
+                theList->add(new RemoveFeatureCommand(theDoc, F));
             }
         }
-
-        stream.readNext();
     }
+    if (parser.tokenType() == OsmXmlParser::Invalid)
+        qDebug() << "OSC:" << parser.errorString();
     downloadFeatures(0, featIdList, theDoc, dLayer);
 
     if (dLayer->size() == 0 && dLayer != theDoc->getLastDownloadLayer()) {
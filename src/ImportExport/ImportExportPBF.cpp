@@ -15,12 +15,22 @@
 #include <QApplication>
 #include <QMessageBox>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QQueue>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
 
 #include "ImportExportPBF.h"
 #include "Global.h"
+#include "MemoryPool.h"
+#include "Utils.h"
 
 #include "zlib.h"
-//#include "bzlib.h"
+
+#include <algorithm>
 
 #define NANO ( 1000.0 * 1000.0 * 1000.0 )
 #define MAX_BLOCK_HEADER_SIZE ( 64 * 1024 )
@@ -36,12 +46,6 @@ ImportExportPBF::~ImportExportPBF()
 {
 }
 
-// export
-bool ImportExportPBF::export_(const QList<Feature *>& /*featList*/)
-{
-    return false;
-}
-
 /***************************************************/
 /*
 Copyright 2010  Christian Vetter veaac.fdirct@gmail.com
@@ -54,18 +58,6 @@ int convertNetworkByteOrder( char data[4] )
     return ( ( ( unsigned ) data[0] ) << 24 ) | ( ( ( unsigned ) data[1] ) << 16 ) | ( ( ( unsigned ) data[2] ) << 8 ) | ( unsigned ) data[3];
 }
 
-static void *SzAlloc( void *p, size_t size)
-{
-    p = p;
-    return malloc( size );
-}
-
-static void SzFree( void *p, void *address)
-{
-    p = p;
-    free( address );
-}
-
 void ImportExportPBF::loadGroup()
 {
     const OSMPBF::PrimitiveGroup& group = m_primitiveBlock.primitivegroup( m_currentGroup );
@@ -95,20 +87,10 @@ void ImportExportPBF::loadBlock()
     m_loadBlock = false;
     m_currentGroup = 0;
     m_currentEntity = 0;
-    int stringCount = m_primitiveBlock.stringtable().s_size();
-    // precompute all strings that match a necessary tag
-    m_nodeTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_nodeTagIDs[i] = m_nodeTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-    m_wayTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_wayTagIDs[i] = m_wayTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-    m_relationTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_relationTagIDs[i] = m_relationTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
 }
 
-bool ImportExportPBF::readNextBlock()
+// Reads the next data blob, leaving its decompression and decoding to decodeBlock
+bool ImportExportPBF::readRawBlob( QByteArray& data )
 {
     if ( !readBlockHeader() )
         return false;
@@ -118,11 +100,21 @@ bool ImportExportPBF::readNextBlock()
         return false;
     }
 
-    if ( !readBlob() )
-        return false;
+    return readBlobData( data );
+}
 
-    if ( !m_primitiveBlock.ParseFromArray( m_buffer.data(), m_buffer.size() ) ) {
-        qCritical() << "failed to parse PrimitiveBlock";
+// Reads the blob announced by the last block header, still packed
+bool ImportExportPBF::readBlobData( QByteArray& data )
+{
+    int size = m_blockHeader.datasize();
+    if ( size < 0 || size > MAX_BLOB_SIZE ) {
+        qCritical() << "invalid Blob size:" << size;
+        return false;
+    }
+    data.resize( size );
+    int readBytes = m_file.read( data.data(), size );
+    if ( readBytes != size ) {
+        qCritical() << "failed to read Blob";
         return false;
     }
     return true;
@@ -152,54 +144,35 @@ bool ImportExportPBF::readBlockHeader()
     return true;
 }
 
-bool ImportExportPBF::readBlob()
+// Unpacks a blob as read from the file; safe to call from any thread
+bool ImportExportPBF::unpackBlob( const QByteArray& data, QByteArray& buffer )
 {
-    int size = m_blockHeader.datasize();
-    if ( size < 0 || size > MAX_BLOB_SIZE ) {
-        qCritical() << "invalid Blob size:" << size;
-        return false;
-    }
-    m_buffer.resize( size );
-    int readBytes = m_file.read( m_buffer.data(), size );
-    if ( readBytes != size ) {
-        qCritical() << "failed to read Blob";
-        return false;
-    }
-    if ( !m_blob.ParseFromArray( m_buffer.constData(), size ) ) {
+    OSMPBF::Blob blob;
+    if ( !blob.ParseFromArray( data.constData(), data.size() ) ) {
         qCritical() << "failed to parse blob";
         return false;
     }
 
-    if ( m_blob.has_raw() ) {
-        const std::string& data = m_blob.raw();
-        m_buffer.resize( data.size() );
-        for ( unsigned i = 0; i < data.size(); i++ )
-            m_buffer[i] = data[i];
-    } else if ( m_blob.has_zlib_data() ) {
-        if ( !unpackZlib() )
-            return false;
-//    } else if ( m_blob.has_bzip2_data() ) {
-//        if ( !unpackBzip2() )
-//            return false;
-    } else if ( m_blob.has_lzma_data() ) {
-        if ( !unpackLzma() )
+    if ( blob.has_raw() ) {
+        buffer = QByteArray( blob.raw().data(), blob.raw().size() );
+    } else if ( blob.has_zlib_data() ) {
+        if ( !inflateZlib( blob, buffer ) )
             return false;
     } else {
-        qCritical() << "Blob contains no data";
+        qCritical() << "Blob contains no data or uses an unsupported compression";
         return false;
     }
-
     return true;
 }
 
-bool ImportExportPBF::unpackZlib()
+bool ImportExportPBF::inflateZlib( const OSMPBF::Blob& blob, QByteArray& buffer )
 {
-    m_buffer.resize( m_blob.raw_size() );
+    buffer.resize( blob.raw_size() );
     z_stream compressedStream;
-    compressedStream.next_in = ( unsigned char* ) m_blob.zlib_data().data();
-    compressedStream.avail_in = m_blob.zlib_data().size();
-    compressedStream.next_out = ( unsigned char* ) m_buffer.data();
-    compressedStream.avail_out = m_blob.raw_size();
+    compressedStream.next_in = ( unsigned char* ) blob.zlib_data().data();
+    compressedStream.avail_in = blob.zlib_data().size();
+    compressedStream.next_out = ( unsigned char* ) buffer.data();
+    compressedStream.avail_out = blob.raw_size();
     compressedStream.zalloc = Z_NULL;
     compressedStream.zfree = Z_NULL;
     compressedStream.opaque = Z_NULL;
@@ -211,6 +184,7 @@ bool ImportExportPBF::unpackZlib()
     ret = inflate( &compressedStream, Z_FINISH );
     if ( ret != Z_STREAM_END ) {
         qCritical() << "failed to inflate zlib stream";
+        inflateEnd( &compressedStream );
         return false;
     }
     ret = inflateEnd( &compressedStream );
@@ -221,44 +195,6 @@ bool ImportExportPBF::unpackZlib()
     return true;
 }
 
-bool ImportExportPBF::unpackBzip2()
-{
-//    unsigned size = m_blob.raw_size();
-//    m_buffer.resize( size );
-//    m_bzip2Buffer.resize( m_blob.bzip2_data().size() );
-//    for ( unsigned i = 0; i < m_blob.bzip2_data().size(); i++ )
-//        m_bzip2Buffer[i] = m_blob.bzip2_data()[i];
-//    int ret = BZ2_bzBuffToBuffDecompress( m_buffer.data(), &size, m_bzip2Buffer.data(), m_bzip2Buffer.size(), 0, 0 );
-//    if ( ret != BZ_OK ) {
-//        qCritical() << "failed to unpack bzip2 stream";
-//        return false;
-//    }
-    return true;
-}
-
-bool ImportExportPBF::unpackLzma()
-{
-//    ISzAlloc alloc = { SzAlloc, SzFree };
-//    ELzmaStatus status;
-//    SizeT destinationLength = m_blob.raw_size();
-//    SizeT sourceLength = m_blob.lzma_data().size() - LZMA_PROPS_SIZE + 8;
-//    int ret = LzmaDecode(
-//            ( unsigned char* ) m_buffer.data(),
-//            &destinationLength,
-//            ( const unsigned char* ) m_blob.lzma_data().data() + LZMA_PROPS_SIZE + 8,
-//            &sourceLength,
-//            ( const unsigned char* ) m_blob.lzma_data().data(),
-//            LZMA_PROPS_SIZE + 8,
-//            LZMA_FINISH_END,
-//            &status,
-//            &alloc );
-
-//    if ( ret != SZ_OK )
-//        return false;
-
-    return true;
-}
-
 void ImportExportPBF::parseNode( Layer* aLayer )
 {
     const OSMPBF::Node& inputNode = m_primitiveBlock.primitivegroup( m_currentGroup ).nodes( m_currentEntity );
@@ -287,13 +223,13 @@ void ImportExportPBF::parseNode( Layer* aLayer )
         if (info.has_timestamp())
             N->setTime(QDateTime::fromTime_t(info.timestamp()));
         if (info.has_user_sid())
-            N->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+            N->setUser(m_strings[info.user_sid()]);
     }
 #endif
 
     for ( int tag = 0; tag < inputNode.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputNode.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputNode.vals( tag ) ).data() );
+        QString key = m_strings[ inputNode.keys( tag ) ];
+        QString value = m_strings[ inputNode.vals( tag ) ];
         N->setTag(key, value);
     }
 
@@ -329,13 +265,13 @@ void ImportExportPBF::parseWay( Layer* aLayer )
         if (info.has_timestamp())
             W->setTime(QDateTime::fromTime_t(info.timestamp()));
         if (info.has_user_sid())
-            W->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+            W->setUser(m_strings[info.user_sid()]);
     }
 #endif
 
     for ( int tag = 0; tag < inputWay.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputWay.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputWay.vals( tag ) ).data() );
+        QString key = m_strings[ inputWay.keys( tag ) ];
+        QString value = m_strings[ inputWay.vals( tag ) ];
         W->setTag(key, value);
     }
 
@@ -385,20 +321,20 @@ void ImportExportPBF::parseRelation( Layer* aLayer )
         if (info.has_timestamp())
             R->setTime(QDateTime::fromTime_t(info.timestamp()));
         if (info.has_user_sid())
-            R->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+            R->setUser(m_strings[info.user_sid()]);
     }
 #endif
 
     for ( int tag = 0; tag < inputRelation.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputRelation.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputRelation.vals( tag ) ).data() );
+        QString key = m_strings[ inputRelation.keys( tag ) ];
+        QString value = m_strings[ inputRelation.vals( tag ) ];
         R->setTag(key, value);
     }
 
     long long lastRef = 0;
     for ( int i = 0; i < inputRelation.types_size(); i++ ) {
         lastRef += inputRelation.memids( i );
-        QString role = QString::fromUtf8(m_primitiveBlock.stringtable().s( inputRelation.roles_sid( i ) ).data());
+        QString role = m_strings[ inputRelation.roles_sid( i ) ];
 
         switch (inputRelation.types( i )) {
         case OSMPBF::Relation::NODE: {
@@ -481,7 +417,7 @@ void ImportExportPBF::parseDense( Layer* aLayer )
 #ifndef FRISIUS_BUILD
         N->setVersionNumber(dense.denseinfo().version(m_currentEntity));
         N->setTime(m_lastDenseTimestamp);
-        N->setUser(m_primitiveBlock.stringtable().s(m_lastDenseUserSid).data());
+        N->setUser(m_strings[m_lastDenseUserSid]);
 #endif
     }
 
@@ -495,8 +431,8 @@ void ImportExportPBF::parseDense( Layer* aLayer )
             break;
         }
 
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( dense.keys_vals( m_lastDenseTag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( dense.keys_vals( m_lastDenseTag + 1 ) ).data() );
+        QString key = m_strings[ dense.keys_vals( m_lastDenseTag ) ];
+        QString value = m_strings[ dense.keys_vals( m_lastDenseTag + 1 ) ];
         N->setTag(key, value);
 
         m_lastDenseTag += 2;
@@ -516,6 +452,249 @@ void ImportExportPBF::parseDense( Layer* aLayer )
 /* End of MoNav rip */
 /***************************************************/
 
+/* Import pipeline: a reader thread pulls the raw blobs from the file, a pool of workers inflates and decodes
+ * them, and the GUI thread commits the decoded blocks in file order, as features have to be created there. */
+
+struct PBFBlock
+{
+    PBFBlock()
+        : filePos(0), decoded(false), ok(false)
+    {
+    }
+
+    QByteArray data;
+    qint64 filePos;
+    OSMPBF::PrimitiveBlock block;
+    QVector<QString> strings;
+    bool decoded;
+    bool ok;
+};
+
+class PBFReader : public QThread
+{
+public:
+    PBFReader(PBFPipeline* aPipeline)
+        : thePipeline(aPipeline)
+    {
+    }
+
+protected:
+    virtual void run();
+
+private:
+    PBFPipeline* thePipeline;
+};
+
+class PBFDecodeTask : public QRunnable
+{
+public:
+    PBFDecodeTask(PBFPipeline* aPipeline, PBFBlock* aBlock)
+        : thePipeline(aPipeline), theBlock(aBlock)
+    {
+    }
+
+    virtual void run();
+
+private:
+    PBFPipeline* thePipeline;
+    PBFBlock* theBlock;
+};
+
+class PBFPipeline
+{
+public:
+    PBFPipeline(ImportExportPBF* anImporter, int threads)
+        : theImporter(anImporter), theReader(this)
+        , maxPending(2 * threads + 1)
+        , readerDone(false), stopped(false), failed(false)
+        , bytes(0), readTime(0), decodeTime(0), waitTime(0)
+    {
+        thePool.setMaxThreadCount(threads);
+    }
+    ~PBFPipeline()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        theReader.start();
+    }
+
+    void stop()
+    {
+        {
+            QMutexLocker locker(&lock);
+            stopped = true;
+            changed.wakeAll();
+        }
+        theReader.wait();
+        thePool.waitForDone();
+        qDeleteAll(blocks);
+        blocks.clear();
+    }
+
+    /* The next block in file order once it is decoded, or NULL at the end of the file. */
+    PBFBlock* next()
+    {
+        QMutexLocker locker(&lock);
+        QElapsedTimer timer;
+        timer.start();
+        while (!stopped) {
+            if (!blocks.isEmpty() && blocks.head()->decoded) {
+                waitTime += timer.elapsed();
+                changed.wakeAll();
+                return blocks.dequeue();
+            }
+            if (blocks.isEmpty() && readerDone)
+                break;
+            changed.wait(&lock);
+        }
+        waitTime += timer.elapsed();
+        return NULL;
+    }
+
+    void readBlocks()
+    {
+        QElapsedTimer timer;
+        while (true) {
+            {
+                QMutexLocker locker(&lock);
+                while (blocks.size() >= maxPending && !stopped)
+                    changed.wait(&lock);
+                if (stopped)
+                    break;
+            }
+
+            PBFBlock* block = new PBFBlock;
+            timer.start();
+            // Running out of blocks is only fine at the end of the file
+            bool atEnd = theImporter->m_file.atEnd();
+            bool ok = theImporter->readRawBlob(block->data);
+            block->filePos = theImporter->m_file.pos();
+
+            QMutexLocker locker(&lock);
+            readTime += timer.elapsed();
+            if (!ok) {
+                if (!atEnd)
+                    failed = true;
+                delete block;
+                break;
+            }
+            bytes = block->filePos;
+            blocks.enqueue(block);
+            thePool.start(new PBFDecodeTask(this, block));
+        }
+
+        QMutexLocker locker(&lock);
+        readerDone = true;
+        changed.wakeAll();
+    }
+
+    void decode(PBFBlock* block)
+    {
+        {
+            QMutexLocker locker(&lock);
+            if (stopped)
+                return;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        bool ok = ImportExportPBF::decodeBlock(block);
+
+        QMutexLocker locker(&lock);
+        decodeTime += timer.elapsed();
+        block->ok = ok;
+        block->decoded = true;
+        changed.wakeAll();
+    }
+
+    // A block could not be read
+    bool readFailed() { QMutexLocker locker(&lock); return failed; }
+    qint64 bytesRead() { QMutexLocker locker(&lock); return bytes; }
+    qint64 readMs() { QMutexLocker locker(&lock); return readTime; }
+    qint64 decodeMs() { QMutexLocker locker(&lock); return decodeTime; }
+    qint64 waitMs() { QMutexLocker locker(&lock); return waitTime; }
+
+private:
+    ImportExportPBF* theImporter;
+    PBFReader theReader;
+    QThreadPool thePool;
+    int maxPending;
+
+    QMutex lock;
+    QWaitCondition changed;
+    QQueue<PBFBlock*> blocks;
+    bool readerDone;
+    bool stopped;
+    bool failed;
+
+    qint64 bytes;
+    qint64 readTime;
+    qint64 decodeTime;
+    qint64 waitTime;
+};
+
+void PBFReader::run()
+{
+    thePipeline->readBlocks();
+}
+
+void PBFDecodeTask::run()
+{
+    thePipeline->decode(theBlock);
+}
+
+// Inflates and parses a raw blob, and converts its string table; safe to call from any thread
+bool ImportExportPBF::decodeBlock( PBFBlock* block )
+{
+    QByteArray buffer;
+    bool ok = unpackBlob( block->data, buffer );
+    block->data.clear();
+    if ( !ok )
+        return false;
+
+    if ( !block->block.ParseFromArray( buffer.constData(), buffer.size() ) ) {
+        qCritical() << "failed to parse PrimitiveBlock";
+        return false;
+    }
+
+    const OSMPBF::StringTable& table = block->block.stringtable();
+    block->strings.resize( table.s_size() );
+    for ( int i = 0; i < table.s_size(); i++ )
+        block->strings[i] = QString::fromUtf8( table.s( i ).data(), table.s( i ).size() );
+
+    return true;
+}
+
+// Creates the features of the current block
+void ImportExportPBF::commitBlock( Layer* aLayer )
+{
+    if ( !m_primitiveBlock.primitivegroup_size() )
+        return;
+
+    loadBlock();
+    loadGroup();
+    while ( !m_loadBlock ) {
+        switch ( m_mode ) {
+        case ModeNode:
+            parseNode( aLayer );
+            break;
+        case ModeWay:
+            parseWay( aLayer );
+            break;
+        case ModeRelation:
+            parseRelation( aLayer );
+            break;
+        case ModeDense:
+            parseDense( aLayer );
+            break;
+        }
+        ++m_entityCount;
+    }
+}
+
 // Specify the input as a QFile
 bool ImportExportPBF::loadFile(QString filename)
 {
@@ -535,7 +714,8 @@ bool ImportExportPBF::loadFile(QString filename)
         return false;
     }
 
-    if ( !readBlob() )
+    QByteArray data;
+    if ( !readBlobData( data ) || !unpackBlob( data, m_buffer ) )
         return false;
 
     if ( !m_headerBlock.ParseFromArray( m_buffer.data(), m_buffer.size() ) ) {
@@ -567,36 +747,453 @@ bool ImportExportPBF::import(Layer* aLayer)
     progress.setRange(0, m_file.size());
     progress.show();
 
-    while (true && !progress.wasCanceled()) {
-        if ( m_loadBlock ) {
-            if ( !readNextBlock() )
-                break;
-            loadBlock();
-            loadGroup();
-        }
-
-        switch ( m_mode ) {
-        case ModeNode:
-            parseNode( aLayer );
-            break;
-        case ModeWay:
-            parseWay( aLayer );
-            break;
-        case ModeRelation:
-            parseRelation( aLayer );
+    qint64 memoryBefore = g_Merk_Benchmark ? Utils::residentMemory() : 0;
+    int nodesBefore = Node::memoryPool().used();
+    int featuresBefore = Feature::privateMemoryPool().used();
+
+    int threads = g_Merk_ImportThreads > 0 ? g_Merk_ImportThreads : qMax(1, QThread::idealThreadCount() - 1);
+    PBFPipeline pipeline(this, threads);
+    m_entityCount = 0;
+    qint64 commitTime = 0;
+    QElapsedTimer timer;
+    timer.start();
+
+    // Index the parsed features in one go once parsing is done
+    aLayer->blockIndexing(true);
+
+    bool OK = true;
+    pipeline.start();
+    while (!progress.wasCanceled()) {
+        PBFBlock* block = pipeline.next();
+        if (!block)
             break;
-        case ModeDense:
-            parseDense( aLayer );
+        if (!block->ok) {
+            qCritical() << "PBF import: cannot decode the block ending at" << block->filePos;
+            OK = false;
+            delete block;
             break;
         }
-        progress.setValue(m_file.pos());
+        m_primitiveBlock.Swap(&block->block);
+        m_strings.swap(block->strings);
+        qint64 filePos = block->filePos;
+        delete block;
+
+        QElapsedTimer commitTimer;
+        commitTimer.start();
+        commitBlock( aLayer );
+        commitTime += commitTimer.elapsed();
+
+        progress.setValue(filePos);
         qApp->processEvents();
-//#ifndef NDEBUG
-//        if (aLayer->size() > 1000000)
-//            break;
-//#endif
     }
+    if (pipeline.readFailed())
+        OK = false;
+    pipeline.stop();
     progress.reset();
 
+    aLayer->blockIndexing(false);
+
+    if (g_Merk_Benchmark) {
+        qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+        qreal megabytes = pipeline.bytesRead() / (1024. * 1024.);
+        qDebug() << "PBF import:" << m_entityCount << "features," << megabytes << "MB in" << elapsed << "ms ("
+                 << megabytes * 1000. / elapsed << "MB/s," << qint64(m_entityCount) * 1000 / elapsed << "features/s) with" << threads << "decode threads";
+        qDebug() << "  read:" << pipeline.readMs() << "ms, decode:" << pipeline.decodeMs() << "ms (all threads), commit:" << commitTime
+                 << "ms, waiting for decoded blocks:" << pipeline.waitMs() << "ms";
+
+        int nodes = Node::memoryPool().used() - nodesBefore;
+        int features = Feature::privateMemoryPool().used() - featuresBefore;
+        qint64 memory = Utils::residentMemory() - memoryBefore;
+        qDebug() << "PBF memory:" << features << "features," << nodes << "pooled nodes";
+        qDebug() << "  node object:" << Node::memoryPool().objectSize() + Feature::privateMemoryPool().objectSize() << "bytes (Node + FeaturePrivate)";
+        if (features && memoryBefore >= 0)
+            qDebug() << "  resident memory grew by" << memory << "bytes," << memory / features << "bytes per feature";
+    }
+
+    return OK;
+}
+
+/* Export: the primitive blocks are built on the calling thread, then serialized and compressed on a thread
+ * pool, and written out in order. */
+
+#define PBF_BLOCK_SIZE 8000
+
+struct PBFOutputBlock
+{
+    PBFOutputBlock()
+        : done(false), ok(false)
+    {
+    }
+
+    OSMPBF::PrimitiveBlock block;
+    QByteArray data;
+    bool done;
+    bool ok;
+};
+
+class PBFEncodeTask : public QRunnable
+{
+public:
+    PBFEncodeTask(PBFEncoder* anEncoder, PBFOutputBlock* aBlock)
+        : theEncoder(anEncoder), theBlock(aBlock)
+    {
+    }
+
+    virtual void run();
+
+private:
+    PBFEncoder* theEncoder;
+    PBFOutputBlock* theBlock;
+};
+
+class PBFEncoder
+{
+public:
+    PBFEncoder(QIODevice* aDevice, int threads)
+        : theDevice(aDevice), maxPending(2 * threads + 1)
+    {
+        thePool.setMaxThreadCount(threads);
+    }
+    ~PBFEncoder()
+    {
+        thePool.waitForDone();
+        qDeleteAll(blocks);
+    }
+
+    /* Queues a block for compression, writing out the finished ones meanwhile */
+    bool add(PBFOutputBlock* block)
+    {
+        {
+            QMutexLocker locker(&lock);
+            blocks.enqueue(block);
+        }
+        thePool.start(new PBFEncodeTask(this, block));
+        return write(maxPending);
+    }
+
+    bool finish()
+    {
+        return write(0);
+    }
+
+    void encode(PBFOutputBlock* block)
+    {
+        std::string raw;
+        bool ok = block->block.SerializeToString(&raw);
+        block->block.Clear();
+        if (ok)
+            ok = ImportExportPBF::encodeBlob("OSMData", raw, block->data);
+
+        QMutexLocker locker(&lock);
+        block->ok = ok;
+        block->done = true;
+        changed.wakeAll();
+    }
+
+private:
+    /* Writes the compressed blocks in order, waiting until at most pending blocks are left */
+    bool write(int pending)
+    {
+        QMutexLocker locker(&lock);
+        while (!blocks.isEmpty()) {
+            if (!blocks.head()->done) {
+                if (blocks.size() <= pending)
+                    break;
+                changed.wait(&lock);
+                continue;
+            }
+            PBFOutputBlock* block = blocks.dequeue();
+            locker.unlock();
+            bool ok = block->ok && theDevice->write(block->data) == block->data.size();
+            delete block;
+            locker.relock();
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    QIODevice* theDevice;
+    QThreadPool thePool;
+    int maxPending;
+
+    QMutex lock;
+    QWaitCondition changed;
+    QQueue<PBFOutputBlock*> blocks;
+};
+
+void PBFEncodeTask::run()
+{
+    theEncoder->encode(theBlock);
+}
+
+/* The string table of a block under construction; id 0 is reserved for the empty string */
+class PBFStringTable
+{
+public:
+    PBFStringTable(OSMPBF::PrimitiveBlock& aBlock)
+        : theTable(aBlock.mutable_stringtable())
+    {
+        theTable->add_s("");
+        ids.insert(QString(), 0);
+    }
+
+    int id(const QString& s)
+    {
+        QHash<QString, int>::const_iterator it = ids.constFind(s);
+        if (it != ids.constEnd())
+            return it.value();
+
+        int i = theTable->s_size();
+        QByteArray utf8 = s.toUtf8();
+        theTable->add_s(utf8.constData(), utf8.size());
+        ids.insert(s, i);
+        return i;
+    }
+
+private:
+    OSMPBF::StringTable* theTable;
+    QHash<QString, int> ids;
+};
+
+template<class T>
+static bool idLessThan(const T* a, const T* b)
+{
+    return a->id().numId < b->id().numId;
+}
+
+static qint64 toPBFCoord(qreal degrees)
+{
+    return qRound64(degrees * NANO / 100.);
+}
+
+#ifndef FRISIUS_BUILD
+static qint64 toPBFTime(const Feature* F)
+{
+    QDateTime t = F->time();
+    return t.isValid() ? t.toTime_t() : 0;
+}
+
+static void infoToPBF(const Feature* F, OSMPBF::Info* info, PBFStringTable& strings)
+{
+    info->set_version(F->versionNumber());
+    info->set_timestamp(toPBFTime(F));
+    info->set_user_sid(strings.id(F->user()));
+}
+#endif
+
+template<class T>
+static void tagsToPBF(const Feature* F, T* entity, PBFStringTable& strings)
+{
+    for (int i=0; i<F->tagSize(); ++i) {
+        entity->add_keys(strings.id(F->tagKey(i)));
+        entity->add_vals(strings.id(F->tagValue(i)));
+    }
+}
+
+bool ImportExportPBF::encodeBlob( const char* type, const std::string& raw, QByteArray& output )
+{
+    OSMPBF::Blob blob;
+    blob.set_raw_size( raw.size() );
+
+    uLongf compressedSize = compressBound( raw.size() );
+    QByteArray compressed;
+    compressed.resize( compressedSize );
+    if ( compress2( ( Bytef* ) compressed.data(), &compressedSize, ( const Bytef* ) raw.data(), raw.size(), Z_DEFAULT_COMPRESSION ) != Z_OK ) {
+        qCritical() << "failed to deflate zlib stream";
+        return false;
+    }
+    blob.set_zlib_data( compressed.constData(), compressedSize );
+
+    std::string blobData;
+    if ( !blob.SerializeToString( &blobData ) || blobData.size() > size_t( MAX_BLOB_SIZE ) ) {
+        qCritical() << "failed to serialize Blob";
+        return false;
+    }
+
+    OSMPBF::BlobHeader header;
+    header.set_type( type );
+    header.set_datasize( blobData.size() );
+    std::string headerData;
+    if ( !header.SerializeToString( &headerData ) || headerData.size() > size_t( MAX_BLOCK_HEADER_SIZE ) ) {
+        qCritical() << "failed to serialize BlockHeader";
+        return false;
+    }
+
+    // The BlockHeader size in network byte order, the BlockHeader, then the Blob
+    quint32 size = headerData.size();
+    output.clear();
+    output.reserve( 4 + headerData.size() + blobData.size() );
+    output.append( char( ( size >> 24 ) & 0xff ) );
+    output.append( char( ( size >> 16 ) & 0xff ) );
+    output.append( char( ( size >> 8 ) & 0xff ) );
+    output.append( char( size & 0xff ) );
+    output.append( headerData.data(), headerData.size() );
+    output.append( blobData.data(), blobData.size() );
+    return true;
+}
+
+// export
+bool ImportExportPBF::export_(const QList<Feature *>& featList)
+{
+    if (!IImportExport::export_(featList))
+        return false;
+    if (!Device || !Device->isOpen())
+        return false;
+
+    QList<Node*> nodes;
+    QList<Way*> ways;
+    QList<Relation*> relations;
+    foreach (Feature* F, theFeatures) {
+        if (F->isVirtual() || F->isDeleted())
+            continue;
+        if (CHECK_NODE(F))
+            nodes << STATIC_CAST_NODE(F);
+        else if (CHECK_WAY(F))
+            ways << STATIC_CAST_WAY(F);
+        else if (CHECK_RELATION(F))
+            relations << STATIC_CAST_RELATION(F);
+    }
+    std::sort(nodes.begin(), nodes.end(), idLessThan<Node>);
+    std::sort(ways.begin(), ways.end(), idLessThan<Way>);
+    std::sort(relations.begin(), relations.end(), idLessThan<Relation>);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    OSMPBF::HeaderBlock headerBlock;
+    headerBlock.add_required_features("OsmSchema-V0.6");
+    headerBlock.add_required_features("DenseNodes");
+    headerBlock.set_writingprogram(QString("%1 %2").arg(qApp->applicationName()).arg(STRINGIFY(VERSION)).toUtf8().constData());
+    if (nodes.size()) {
+        CoordBox bbox(nodes[0]->position(), nodes[0]->position());
+        for (int i=1; i<nodes.size(); ++i)
+            bbox.merge(nodes[i]->position());
+        OSMPBF::HeaderBBox* pbfBox = headerBlock.mutable_bbox();
+        pbfBox->set_left(qRound64(bbox.left() * NANO));
+        pbfBox->set_right(qRound64(bbox.right() * NANO));
+        pbfBox->set_top(qRound64(bbox.top() * NANO));
+        pbfBox->set_bottom(qRound64(bbox.bottom() * NANO));
+    }
+    std::string raw;
+    QByteArray data;
+    if (!headerBlock.SerializeToString(&raw) || !encodeBlob("OSMHeader", raw, data))
+        return false;
+    if (Device->write(data) != data.size())
+        return false;
+
+    int threads = g_Merk_ImportThreads > 0 ? g_Merk_ImportThreads : qMax(1, QThread::idealThreadCount() - 1);
+    PBFEncoder encoder(Device, threads);
+
+    for (int start=0; start<nodes.size(); start+=PBF_BLOCK_SIZE) {
+        PBFOutputBlock* out = new PBFOutputBlock;
+        PBFStringTable strings(out->block);
+        OSMPBF::DenseNodes* dense = out->block.add_primitivegroup()->mutable_dense();
+#ifndef FRISIUS_BUILD
+        OSMPBF::DenseInfo* denseInfo = dense->mutable_denseinfo();
+#endif
+
+        qint64 lastId = 0, lastLat = 0, lastLon = 0, lastTimestamp = 0;
+        int lastUserSid = 0;
+        int end = qMin(start + PBF_BLOCK_SIZE, nodes.size());
+        for (int i=start; i<end; ++i) {
+            Node* N = nodes[i];
+            qint64 lat = toPBFCoord(N->position().y());
+            qint64 lon = toPBFCoord(N->position().x());
+            dense->add_id(N->id().numId - lastId);
+            dense->add_lat(lat - lastLat);
+            dense->add_lon(lon - lastLon);
+            lastId = N->id().numId;
+            lastLat = lat;
+            lastLon = lon;
+
+#ifndef FRISIUS_BUILD
+            qint64 timestamp = toPBFTime(N);
+            int userSid = strings.id(N->user());
+            denseInfo->add_version(N->versionNumber());
+            denseInfo->add_timestamp(timestamp - lastTimestamp);
+            denseInfo->add_changeset(0);
+            denseInfo->add_uid(0);
+            denseInfo->add_user_sid(userSid - lastUserSid);
+            lastTimestamp = timestamp;
+            lastUserSid = userSid;
+#endif
+
+            for (int j=0; j<N->tagSize(); ++j) {
+                dense->add_keys_vals(strings.id(N->tagKey(j)));
+                dense->add_keys_vals(strings.id(N->tagValue(j)));
+            }
+            dense->add_keys_vals(0);
+        }
+        if (!encoder.add(out))
+            return false;
+    }
+
+    for (int start=0; start<ways.size(); start+=PBF_BLOCK_SIZE) {
+        PBFOutputBlock* out = new PBFOutputBlock;
+        PBFStringTable strings(out->block);
+        OSMPBF::PrimitiveGroup* group = out->block.add_primitivegroup();
+
+        int end = qMin(start + PBF_BLOCK_SIZE, ways.size());
+        for (int i=start; i<end; ++i) {
+            Way* W = ways[i];
+            OSMPBF::Way* way = group->add_ways();
+            way->set_id(W->id().numId);
+            tagsToPBF(W, way, strings);
+#ifndef FRISIUS_BUILD
+            infoToPBF(W, way->mutable_info(), strings);
+#endif
+            qint64 lastRef = 0;
+            for (int j=0; j<W->size(); ++j) {
+                qint64 ref = W->get(j)->id().numId;
+                way->add_refs(ref - lastRef);
+                lastRef = ref;
+            }
+        }
+        if (!encoder.add(out))
+            return false;
+    }
+
+    for (int start=0; start<relations.size(); start+=PBF_BLOCK_SIZE) {
+        PBFOutputBlock* out = new PBFOutputBlock;
+        PBFStringTable strings(out->block);
+        OSMPBF::PrimitiveGroup* group = out->block.add_primitivegroup();
+
+        int end = qMin(start + PBF_BLOCK_SIZE, relations.size());
+        for (int i=start; i<end; ++i) {
+            Relation* R = relations[i];
+            OSMPBF::Relation* relation = group->add_relations();
+            relation->set_id(R->id().numId);
+            tagsToPBF(R, relation, strings);
+#ifndef FRISIUS_BUILD
+            infoToPBF(R, relation->mutable_info(), strings);
+#endif
+            qint64 lastRef = 0;
+            for (int j=0; j<R->size(); ++j) {
+                const Feature* F = R->get(j);
+                if (CHECK_NODE(F))
+                    relation->add_types(OSMPBF::Relation::NODE);
+                else if (CHECK_WAY(F))
+                    relation->add_types(OSMPBF::Relation::WAY);
+                else if (CHECK_RELATION(F))
+                    relation->add_types(OSMPBF::Relation::RELATION);
+                else
+                    continue;
+                relation->add_roles_sid(strings.id(R->getRole(j)));
+                relation->add_memids(F->id().numId - lastRef);
+                lastRef = F->id().numId;
+            }
+        }
+        if (!encoder.add(out))
+            return false;
+    }
+
+    if (!encoder.finish())
+        return false;
+
+    if (g_Merk_Benchmark)
+        qDebug() << "PBF export:" << nodes.size() + ways.size() + relations.size() << "features," << Device->pos() << "bytes in"
+                 << timer.elapsed() << "ms with" << threads << "compression threads";
+
     return true;
 }
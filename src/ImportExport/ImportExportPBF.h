@@ -18,11 +18,18 @@
 #include "osmformat.pb.h"
 
 class QDomDocument;
+struct PBFBlock;
+class PBFPipeline;
+class PBFEncoder;
+
 /**
     @author cbro <cbro@semperpax.com>
 */
 class ImportExportPBF : public IImportExport
 {
+    friend class PBFPipeline;
+    friend class PBFEncoder;
+
 protected:
     enum Mode {
         ModeNode, ModeWay, ModeRelation, ModeDense
@@ -43,7 +50,6 @@ public:
 
 protected:
     OSMPBF::BlobHeader m_blockHeader;
-    OSMPBF::Blob m_blob;
 
     OSMPBF::HeaderBlock m_headerBlock;
     OSMPBF::PrimitiveBlock m_primitiveBlock;
@@ -54,14 +60,6 @@ protected:
 
     Mode m_mode;
 
-    QHash< QString, int > m_nodeTags;
-    QHash< QString, int > m_wayTags;
-    QHash< QString, int > m_relationTags;
-
-    std::vector< int > m_nodeTagIDs;
-    std::vector< int > m_wayTagIDs;
-    std::vector< int > m_relationTagIDs;
-
     long long m_lastDenseID;
     long long m_lastDenseLatitude;
     long long m_lastDenseLongitude;
@@ -71,19 +69,24 @@ protected:
     long long m_lastDenseUserSid;
     int m_lastDenseTag;
 
+    QVector<QString> m_strings;
+
     QFile m_file;
     QByteArray m_buffer;
-    QByteArray m_bzip2Buffer;
+
+    int m_entityCount;
 
 protected:
     void loadGroup();
     void loadBlock();
-    bool readNextBlock();
+    void commitBlock( Layer* aLayer );
+    bool readRawBlob( QByteArray& data );
     bool readBlockHeader();
-    bool readBlob();
-    bool unpackZlib();
-    bool unpackBzip2();
-    bool unpackLzma();
+    bool readBlobData( QByteArray& data );
+    static bool unpackBlob( const QByteArray& data, QByteArray& buffer );
+    static bool inflateZlib( const OSMPBF::Blob& blob, QByteArray& buffer );
+    static bool decodeBlock( PBFBlock* block );
+    static bool encodeBlob( const char* type, const std::string& raw, QByteArray& output );
 
     void parseNode( Layer* aLayer );
     void parseWay( Layer* aLayer );
@@ -9,108 +9,237 @@
 
 #include <QBuffer>
 #include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QFuture>
 #include <QMessageBox>
-#include <QDomDocument>
 #include <QProgressDialog>
+#include <QtConcurrent/QtConcurrentRun>
+#include <QXmlStreamReader>
 
+// Points whose time is parsed in one go off the GUI thread
+#define TIME_BATCH 4096
+// Points read between progress updates
+#define PROGRESS_STEP 1024
 
-static TrackNode* importTrkPt(const QDomElement& Root, Document* /* theDocument */, Layer* theLayer)
+namespace {
+
+struct TimeBatch
+{
+    QVector<TrackNode*> nodes;
+    QVector<QString> values;
+    QVector<uint> times;
+};
+
+void parseTimes(TimeBatch* batch)
+{
+    batch->times.resize(batch->values.size());
+    for (int i=0; i<batch->values.size(); ++i)
+    {
+        QDateTime dt(QDateTime::fromString(batch->values[i].left(19), Qt::ISODate));
+        dt.setTimeSpec(Qt::UTC);
+        batch->times[i] = dt.toTime_t();
+    }
+}
+
+/**
+    Reads a GPX file as a stream, creating the track nodes and segments as their elements come, so
+    that memory does not depend on the size of the file. Time stamps are the costly part of a track
+    point; they are parsed by batches in a worker thread while reading goes on.
+*/
+class GpxImport
+{
+public:
+    GpxImport(QIODevice& File, Document* theDocument, bool MakeSegment, QProgressDialog& progress)
+        : File(File), stream(&File), theDocument(theDocument), MakeSegment(MakeSegment), progress(progress)
+        , points(0), filling(new TimeBatch), parsing(new TimeBatch)
+    {
+    }
+
+    ~GpxImport()
+    {
+        // The last batch is not worth a thread
+        applyTimes();
+        qSwap(filling, parsing);
+        parseTimes(parsing);
+        applyTimes();
+        delete filling;
+        delete parsing;
+
+        // Levels of detail of the new segments, so that the first render does not wait for them
+        QList<TrackSegment*> theSegments;
+        for (int i=0; i<blocked.size(); ++i)
+            for (int j=0; j<blocked[i]->size(); ++j)
+                if (TrackSegment* S = CAST_SEGMENT(blocked[i]->get(j)))
+                    theSegments << S;
+        TrackSegment::updateLevels(theSegments);
+
+        for (int i=0; i<blocked.size(); ++i)
+            blocked[i]->blockIndexing(false);
+    }
+
+    bool read(QList<TrackLayer*>& theTracklayers);
+    QString errorString() const;
+    int pointCount() const { return points; }
+
+private:
+    TrackNode* importTrkPt(Layer* theLayer);
+    void importTrkSeg(Layer* theLayer);
+    void importRte(Layer* theLayer);
+    void importTrk(Layer* theLayer);
+    void addTime(TrackNode* Pt, const QString& Value);
+    void applyTimes();
+    bool canceled();
+    void block(Layer* theLayer);
+
+    QIODevice& File;
+    QXmlStreamReader stream;
+    Document* theDocument;
+    bool MakeSegment;
+    QProgressDialog& progress;
+    int points;
+
+    TimeBatch* filling;
+    TimeBatch* parsing;
+    QFuture<void> parsed;
+    QList<Layer*> blocked;
+};
+
+bool GpxImport::canceled()
+{
+    return progress.wasCanceled() || stream.hasError();
+}
+
+// Spatial indexing of the layer is done once at the end of the import
+void GpxImport::block(Layer* theLayer)
+{
+    if (theLayer->isIndexingBlocked())
+        return;
+    theLayer->blockIndexing(true);
+    blocked.append(theLayer);
+}
+
+void GpxImport::addTime(TrackNode* Pt, const QString& Value)
 {
-    qreal Lat = Root.attribute("lat").toDouble();
-    qreal Lon = Root.attribute("lon").toDouble();
+    filling->nodes.append(Pt);
+    filling->values.append(Value);
+    if (filling->nodes.size() < TIME_BATCH)
+        return;
+
+    applyTimes();
+    qSwap(filling, parsing);
+    parsed = QtConcurrent::run(parseTimes, parsing);
+}
+
+// Waits for the batch being parsed and sets its times
+void GpxImport::applyTimes()
+{
+    parsed.waitForFinished();
+    for (int i=0; i<parsing->times.size(); ++i)
+        parsing->nodes[i]->setTime(parsing->times[i]);
+    parsing->nodes.clear();
+    parsing->values.clear();
+    parsing->times.clear();
+}
+
+TrackNode* GpxImport::importTrkPt(Layer* theLayer)
+{
+    qreal Lat = stream.attributes().value("lat").toString().toDouble();
+    qreal Lon = stream.attributes().value("lon").toString().toDouble();
 
     TrackNode* Pt = g_backend.allocTrackNode(theLayer, Coord(Lon,Lat));
     Pt->setLastUpdated(Feature::Log);
-    if (Root.hasAttribute("xml:id"))
-        Pt->setId(IFeature::FId(IFeature::Point, Root.attribute("xml:id").toLongLong()));
+    if (stream.attributes().hasAttribute("xml:id"))
+        Pt->setId(IFeature::FId(IFeature::Point, stream.attributes().value("xml:id").toString().toLongLong()));
 
     theLayer->add(Pt);
 
-    if (Root.tagName() == "wpt")
+    if (stream.name() == "wpt")
         Pt->setTag("_waypoint_", "yes");
 
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-
-        if (t.isNull())
-            continue;
-
-        if (t.tagName() == "time")
+        if (stream.name() == "time")
         {
-            QString Value;
-            for (QDomNode s = t.firstChild(); !s.isNull(); s = s.nextSibling())
-            {
-                QDomText ss = s.toText();
-                if (!ss.isNull())
-                    Value += ss.data();
-            }
+            QString Value = stream.readElementText(QXmlStreamReader::IncludeChildElements);
             if (!Value.isEmpty())
-            {
-                QDateTime dt(QDateTime::fromString(Value.left(19), Qt::ISODate));
-                dt.setTimeSpec(Qt::UTC);
-                Pt->setTime(dt);
-            }
+                addTime(Pt, Value);
         }
-        else if (t.tagName() == "ele")
+        else if (stream.name() == "ele")
         {
-            Pt->setElevation( t.text().toDouble() );
+            Pt->setElevation( stream.readElementText(QXmlStreamReader::IncludeChildElements).toDouble() );
         }
-        else if (t.tagName() == "speed")
+        else if (stream.name() == "speed")
         {
-            Pt->setSpeed( t.text().toDouble() );
+            Pt->setSpeed( stream.readElementText(QXmlStreamReader::IncludeChildElements).toDouble() );
         }
-        else if (t.tagName() == "name")
+        else if (stream.name() == "name")
         {
-            Pt->setTag("name", t.text());
+            Pt->setTag("name", stream.readElementText(QXmlStreamReader::IncludeChildElements));
         }
-        else if (t.tagName() == "desc")
+        else if (stream.name() == "desc")
         {
-            Pt->setTag("_description_", t.text());
+            Pt->setTag("_description_", stream.readElementText(QXmlStreamReader::IncludeChildElements));
         }
-        else if (t.tagName() == "cmt")
+        else if (stream.name() == "cmt")
         {
-            Pt->setTag("_comment_", t.text());
+            Pt->setTag("_comment_", stream.readElementText(QXmlStreamReader::IncludeChildElements));
         }
-        else if (t.tagName() == "extensions") // for OpenStreetBugs
+        else if (stream.name() == "extensions") // for OpenStreetBugs
         {
-            QDomNodeList li = t.elementsByTagName("id");
-            if (li.size()) {
-                QString id = li.at(0).toElement().text();
+            // First "id" element at any depth
+            bool hasId = false;
+            QString id;
+            for (int depth = 1; depth && !stream.atEnd(); )
+            {
+                stream.readNext();
+                if (stream.isStartElement()) {
+                    if (!hasId && stream.name() == "id") {
+                        id = stream.readElementText(QXmlStreamReader::IncludeChildElements);
+                        hasId = true;
+                    } else
+                        ++depth;
+                } else if (stream.isEndElement())
+                    --depth;
+            }
+            if (hasId) {
                 Pt->setId(IFeature::FId(IFeature::Point | IFeature::Special, id.toLongLong()));
                 Pt->setTag("_special_", "yes"); // Assumed to be OpenstreetBugs as they don't use their own namesoace
                 Pt->setSpecial(true);
             }
         }
+        else
+            stream.skipCurrentElement();
     }
 
+    if (++points % PROGRESS_STEP == 0)
+        progress.setValue(int(File.pos() / 1024));
+
     return Pt;
 }
 
-
-static void importTrkSeg(const QDomElement& Root, Document* theDocument, Layer* theLayer, bool MakeSegment, QProgressDialog & progress)
+void GpxImport::importTrkSeg(Layer* theLayer)
 {
     TrackSegment* S = g_backend.allocSegment(theLayer);
     theLayer->add(S);
 
-    if (Root.hasAttribute("xml:id"))
-        S->setId(IFeature::FId(IFeature::GpxSegment, Root.attribute("xml:id").toLongLong()));
+    if (stream.attributes().hasAttribute("xml:id"))
+        S->setId(IFeature::FId(IFeature::GpxSegment, stream.attributes().value("xml:id").toString().toLongLong()));
 
     Node* lastPoint = NULL;
 
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (t.isNull() || t.tagName() != "trkpt")
+        if (stream.name() != "trkpt") {
+            stream.skipCurrentElement();
             continue;
+        }
 
-        progress.setValue(progress.value()+1);
-        if (progress.wasCanceled())
+        TrackNode* Pt = importTrkPt(theLayer);
+        if (canceled())
             return;
 
-        TrackNode* Pt = importTrkPt(t,theDocument, theLayer);
-
         if (MakeSegment == false)
             continue;
 
@@ -136,33 +265,30 @@ static void importTrkSeg(const QDomElement& Root, Document* theDocument, Layer*
         g_backend.deallocFeature(theLayer, S);
 }
 
-static void importRte(const QDomElement& Root, Document* theDocument, Layer* theLayer, bool MakeSegment, QProgressDialog & progress)
+void GpxImport::importRte(Layer* theLayer)
 {
     TrackSegment* S = g_backend.allocSegment(theLayer);
     theLayer->add(S);
 
-    if (Root.hasAttribute("xml:id"))
-        S->setId(IFeature::FId(IFeature::GpxSegment, Root.attribute("xml:id").toLongLong()));
+    if (stream.attributes().hasAttribute("xml:id"))
+        S->setId(IFeature::FId(IFeature::GpxSegment, stream.attributes().value("xml:id").toString().toLongLong()));
 
     TrackNode* lastPoint = NULL;
 
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (!t.isNull() && t.tagName() == "name") {
-            theLayer->setName(t.text());
+        if (stream.name() == "name") {
+            theLayer->setName(stream.readElementText(QXmlStreamReader::IncludeChildElements));
         } else
-        if (!t.isNull() && t.tagName() == "desc") {
-            theLayer->setDescription(t.text());
+        if (stream.name() == "desc") {
+            theLayer->setDescription(stream.readElementText(QXmlStreamReader::IncludeChildElements));
         } else
-        if (!t.isNull() && t.tagName() == "rtept") {
+        if (stream.name() == "rtept") {
 
-            progress.setValue(progress.value()+1);
-            if (progress.wasCanceled())
+            TrackNode* Pt = importTrkPt(theLayer);
+            if (canceled())
                 return;
 
-            TrackNode* Pt = importTrkPt(t,theDocument, theLayer);
-
             if (MakeSegment == false)
                 continue;
 
@@ -180,109 +306,123 @@ static void importRte(const QDomElement& Root, Document* theDocument, Layer* the
             }
             S->add(Pt);
             lastPoint = Pt;
-        }
+        } else
+            stream.skipCurrentElement();
     }
 
     if (!S->size())
         g_backend.deallocFeature(theLayer, S);
 }
 
-static void importTrk(const QDomElement& Root, Document* theDocument, Layer* theLayer, bool MakeSegment, QProgressDialog & progress)
+void GpxImport::importTrk(Layer* theLayer)
 {
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (!t.isNull() && t.tagName() == "trkseg") {
-            importTrkSeg(t,theDocument, theLayer, MakeSegment, progress);
-            if (progress.wasCanceled())
+        if (stream.name() == "trkseg") {
+            importTrkSeg(theLayer);
+            if (canceled())
                 return;
         } else
-        if (!t.isNull() && t.tagName() == "name") {
-            theLayer->setName(t.text());
+        if (stream.name() == "name") {
+            theLayer->setName(stream.readElementText(QXmlStreamReader::IncludeChildElements));
         } else
-        if (!t.isNull() && t.tagName() == "desc") {
-            theLayer->setDescription(t.text());
-        }
+        if (stream.name() == "desc") {
+            theLayer->setDescription(stream.readElementText(QXmlStreamReader::IncludeChildElements));
+        } else
+            stream.skipCurrentElement();
     }
 }
 
-static void importGPX(const QDomElement& Root, Document* theDocument, QList<TrackLayer*>& theTracklayers, bool MakeSegment, QProgressDialog & progress)
+bool GpxImport::read(QList<TrackLayer*>& theTracklayers)
 {
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
-    {
-        QDomElement t = n.toElement();
-        if (t.isNull())
-            continue;
+    if (!stream.readNextStartElement())
+        return false;
+    if (stream.name() != "gpx") {
+        stream.raiseError("Root is not a gpx node");
+        return false;
+    }
 
-        if (t.tagName() == "trk")
-        {
-            TrackLayer* newLayer = new TrackLayer();
-            theDocument->add(newLayer);
-            importTrk(t,theDocument, newLayer, MakeSegment, progress);
-            if (!newLayer->size()) {
-                theDocument->remove(newLayer);
-                delete newLayer;
-            } else {
-                theTracklayers.append(newLayer);
-            }
-        }
-        else if (t.tagName() == "rte")
+    while (stream.readNextStartElement())
+    {
+        if (stream.name() == "trk" || stream.name() == "rte")
         {
             TrackLayer* newLayer = new TrackLayer();
             theDocument->add(newLayer);
-            importRte(t,theDocument, newLayer, MakeSegment, progress);
+            block(newLayer);
+            if (stream.name() == "trk")
+                importTrk(newLayer);
+            else
+                importRte(newLayer);
             if (!newLayer->size()) {
+                blocked.removeOne(newLayer);
                 theDocument->remove(newLayer);
                 delete newLayer;
             } else {
                 theTracklayers.append(newLayer);
             }
         }
-        else if (t.tagName() == "wpt")
+        else if (stream.name() == "wpt")
         {
-            importTrkPt(t,theDocument, theTracklayers[0]);
-            progress.setValue(progress.value()+1);
+            block(theTracklayers[0]);
+            importTrkPt(theTracklayers[0]);
         }
-        if (progress.wasCanceled())
-            return;
+        else
+            stream.skipCurrentElement();
+        if (canceled())
+            break;
     }
+    return !canceled();
+}
+
+QString GpxImport::errorString() const
+{
+    return QString("Parse error at line %1, column %2:\n%3")
+            .arg(stream.lineNumber())
+            .arg(stream.columnNumber())
+            .arg(stream.errorString());
+}
+
 }
 
 bool importGPX(QWidget* aParent, QIODevice& File, Document* theDocument, QList<TrackLayer*>& theTracklayers, bool MakeSegment)
 {
-    // TODO remove debug messageboxes
-    QDomDocument DomDoc;
-    QString ErrorStr;
-    int ErrorLine;
-    int ErrorColumn;
-    if (!DomDoc.setContent(&File, true, &ErrorStr, &ErrorLine,&ErrorColumn))
-    {
-        File.close();
-        QMessageBox::warning(aParent,"Parse error",
-            QString("Parse error at line %1, column %2:\n%3")
-                                  .arg(ErrorLine)
-                                  .arg(ErrorColumn)
-                                  .arg(ErrorStr));
+    if (!File.isOpen() && !File.open(QIODevice::ReadOnly))
         return false;
-    }
-    QDomElement root = DomDoc.documentElement();
-    if (root.tagName() != "gpx")
-    {
-        QMessageBox::information(aParent, "Parse error","Root is not a gpx node");
-        return false;
-    }
 
     QProgressDialog progress("Importing GPX...", "Cancel", 0, 0);
     progress.setWindowModality(Qt::WindowModal);
-    progress.setMaximum(progress.maximum() + DomDoc.elementsByTagName("trkpt").count());
-    progress.setMaximum(progress.maximum() + DomDoc.elementsByTagName("wpt").count());
+    // In kB, as files can be bigger than an int
+    progress.setMaximum(int(File.size() / 1024));
 
-    importGPX(root, theDocument, theTracklayers, MakeSegment, progress);
+    QElapsedTimer timer;
+    timer.start();
+
+    bool OK;
+    QString ErrorStr;
+    int points;
+    {
+        GpxImport theImport(File, theDocument, MakeSegment, progress);
+        OK = theImport.read(theTracklayers);
+        if (!OK)
+            ErrorStr = theImport.errorString();
+        points = theImport.pointCount();
+    }
+
+    if (g_Merk_Benchmark) {
+        qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+        qDebug() << "GPX import:" << points << "points in" << elapsed << "ms (" << qint64(points) * 1000 / elapsed << "points/s)";
+    }
 
     progress.setValue(progress.maximum());
     if (progress.wasCanceled())
         return false;
 
+    if (!OK)
+    {
+        QMessageBox::warning(aParent, "Parse error", ErrorStr);
+        return false;
+    }
+
     return true;
 }
 
@@ -10,17 +10,16 @@
 #include "Features.h"
 #include "Global.h"
 #include "IProgressWindow.h"
+#include "OsmXmlParser.h"
 
 #include <QApplication>
-#include <QBuffer>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QEventLoop>
 #include <QFile>
 #include <QMessageBox>
 #include <QProgressBar>
 #include <QProgressDialog>
-#include <QDomDocument>
-#include <QXmlAttributes>
 
 
 OSMHandler::OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict)
@@ -28,42 +27,66 @@ OSMHandler::OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict)
 {
 }
 
-void OSMHandler::parseTag(const QXmlAttributes &atts)
+#define SKIPPED_TAG 0xffffffff
+
+void OSMHandler::parseTag(const OsmXmlParser& parser)
 {
     if (!Current) return;
 
-    Current->setTag(atts.value("k"),atts.value("v"));
+    QByteArray k = parser.rawAttribute("k");
+    QByteArray v = parser.rawAttribute("v");
+    if (k.isEmpty() || v.isEmpty()) {
+        Current->setTag(parser.stringAttribute("k"), parser.stringAttribute("v"));
+        return;
+    }
+
+    QHash<QByteArray, quint32>::const_iterator ik = keyIds.constFind(k);
+    if (ik == keyIds.constEnd()) {
+        QString key = OsmXmlParser::decode(k.constData(), k.size());
+        ik = keyIds.insert(QByteArray(k.constData(), k.size()), key.toLower() == "created_by" ? SKIPPED_TAG : g_setTagKey(key));
+    }
+    if (ik.value() == SKIPPED_TAG)
+        return;
+
+    QHash<QByteArray, quint32>::const_iterator iv = valueIds.constFind(v);
+    if (iv == valueIds.constEnd())
+        iv = valueIds.insert(QByteArray(v.constData(), v.size()), g_setTagValue(OsmXmlParser::decode(v.constData(), v.size())));
+
+    Current->setInternedTag(ik.value(), iv.value());
 }
 
-void parseStandardAttributes(const QXmlAttributes& atts, Feature* F)
+void OSMHandler::parseStandardAttributes(const OsmXmlParser& parser, Feature* F)
 {
 #ifndef FRISIUS_BUILD
-    QString ts = atts.value("timestamp");
-    QDateTime time = QDateTime::fromString(ts.left(19), Qt::ISODate);
-    if (!time.isValid())
-        time = QDateTime::currentDateTime();
-    QString user = atts.value("user");
+    uint time;
+    if (!parser.timeAttribute("timestamp", time))
+        time = QDateTime::currentDateTime().toTime_t();
     F->setTime(time);
-    F->setUser(user);
-    QString version = atts.value("version");
-    if (!version.isEmpty())
-        F->setVersionNumber(version.toInt());
+
+    QByteArray user = parser.rawAttribute("user");
+    QHash<QByteArray, QString>::const_iterator iu = userNames.constFind(user);
+    if (iu == userNames.constEnd())
+        iu = userNames.insert(QByteArray(user.constData(), user.size()), OsmXmlParser::decode(user.constData(), user.size()));
+    F->setUser(iu.value());
+
+    if (!parser.rawAttribute("version").isEmpty())
+        F->setVersionNumber(parser.int64Attribute("version"));
 #endif
 }
 
-void OSMHandler::parseNode(const QXmlAttributes& atts)
+void OSMHandler::parseNode(const OsmXmlParser& parser)
 {
-    qreal Lat = atts.value("lat").toDouble();
-    qreal Lon = atts.value("lon").toDouble();
-    QString id = atts.value("id");
-    Node* Pt = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, id.toLongLong())));
+    qreal Lat = parser.realAttribute("lat");
+    qreal Lon = parser.realAttribute("lon");
+    qint64 id = parser.int64Attribute("id");
+    Node* Pt = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, id)));
     if (Pt)
     {
         Node* userPt = Pt;
         Pt = g_backend.allocNode(theLayer, Coord(Lon,Lat));
-        Pt->setId(IFeature::FId(IFeature::Point | IFeature::Conflict, id.toLongLong()));
+        Pt->setId(IFeature::FId(IFeature::Point | IFeature::Conflict, id));
         Pt->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,Pt);
+        parseStandardAttributes(parser,Pt);
 
         if (userPt->lastUpdated() == Feature::User)
         {
@@ -93,6 +116,8 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
             {
                 g_backend.deallocFeature(theLayer, Pt);
                 Pt = userPt;
+                if (!movedFeatures.contains(Pt))
+                    movedFeatures.insert(Pt, Pt->layer());
                 Pt->layer()->remove(Pt);
                 theLayer->add(Pt);
                 Pt->setPosition(Coord(Lon,Lat));
@@ -115,14 +140,15 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
     else
     {
         Pt = g_backend.allocNode(theLayer, Coord(Lon,Lat));
-        Pt->setId(IFeature::FId(IFeature::Point, id.toLongLong()));
+        Pt->setId(IFeature::FId(IFeature::Point, id));
         Pt->setLastUpdated(Feature::OSMServer);
         theLayer->add(Pt);
+        addedFeatures << Pt;
         NewFeature = true;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,Pt);
+        parseStandardAttributes(parser,Pt);
         Current = Pt;
         for (int i=0; i<Pt->sizeParents(); ++i) {
             if (Pt->getParent(i)->isDeleted()) continue;
@@ -133,27 +159,31 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
         Current = NULL;
 }
 
-void OSMHandler::parseNd(const QXmlAttributes& atts)
+void OSMHandler::parseNd(const OsmXmlParser& parser)
 {
     Way* R = dynamic_cast<Way*>(Current);
     if (!R) return;
-    Node *Part = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, atts.value("ref").toLongLong()));
+    IFeature::FId id(IFeature::Point, parser.int64Attribute("ref"));
+    Node *Part = CAST_NODE(theDocument->getFeature(id));
+    if (!Part) {
+        Part = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, id);
+        addedFeatures << Part;
+    }
     if (NewFeature)
         R->add(Part);
 }
 
-void OSMHandler::parseWay(const QXmlAttributes& atts)
+void OSMHandler::parseWay(const OsmXmlParser& parser)
 {
-    QString id = atts.value("id");
-    QString ts = atts.value("timestamp"); ts.truncate(19);
-    Way* R = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, id.toLongLong())));
+    qint64 id = parser.int64Attribute("id");
+    Way* R = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, id)));
     if (R)
     {
         Way* userRd = R;
         R = g_backend.allocWay(theLayer);
-        R->setId(IFeature::FId(IFeature::LineString | IFeature::Conflict, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::LineString | IFeature::Conflict, id));
         R->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,R);
+        parseStandardAttributes(parser,R);
 
         if (userRd->lastUpdated() == Feature::User)
         {
@@ -183,6 +213,8 @@ void OSMHandler::parseWay(const QXmlAttributes& atts)
 #endif
                 g_backend.deallocFeature(theLayer, R);
                 R = userRd;
+                if (!movedFeatures.contains(R))
+                    movedFeatures.insert(R, R->layer());
                 R->layer()->remove(R);
                 theLayer->add(R);
                 while (R->size())
@@ -201,50 +233,58 @@ void OSMHandler::parseWay(const QXmlAttributes& atts)
     else
     {
         R = g_backend.allocWay(theLayer);
-        R->setId(IFeature::FId(IFeature::LineString, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::LineString, id));
         R->setLastUpdated(Feature::OSMServer);
         theLayer->add(R);
+        addedFeatures << R;
         NewFeature = true;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,R);
+        parseStandardAttributes(parser,R);
         Current = R;
         touchedWays << R;
     } else
         Current = NULL;
 }
 
-void OSMHandler::parseMember(const QXmlAttributes& atts)
+void OSMHandler::parseMember(const OsmXmlParser& parser)
 {
     Relation* R = dynamic_cast<Relation*>(Current);
     if (!R)
         return;
-    QString Type = atts.value("type");
+    QByteArray Type = parser.rawAttribute("type");
+    qint64 ref = parser.int64Attribute("ref");
     Feature* F = 0;
-    if (Type == "node")
-        F = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, atts.value("ref").toLongLong()));
-    else if (Type == "way")
-        F = Feature::getWayOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::LineString, atts.value("ref").toLongLong()));
-    else if (Type == "relation")
-        F = Feature::getRelationOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::OsmRelation, atts.value("ref").toLongLong()));
+    if (Type == "node") {
+        F = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, ref)));
+        if (!F)
+            addedFeatures << (F = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, ref)));
+    } else if (Type == "way") {
+        F = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, ref)));
+        if (!F)
+            addedFeatures << (F = Feature::getWayOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::LineString, ref)));
+    } else if (Type == "relation") {
+        F = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, ref)));
+        if (!F)
+            addedFeatures << (F = Feature::getRelationOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::OsmRelation, ref)));
+    }
 
     if (F && F != R)
-        R->add(atts.value("role"),F);
+        R->add(parser.stringAttribute("role"),F);
 }
 
-void OSMHandler::parseRelation(const QXmlAttributes& atts)
+void OSMHandler::parseRelation(const OsmXmlParser& parser)
 {
-    QString id = atts.value("id");
-    QString ts = atts.value("timestamp"); ts.truncate(19);
-    Relation* R = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, id.toLongLong())));
+    qint64 id = parser.int64Attribute("id");
+    Relation* R = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, id)));
     if (R)
     {
         Relation* userR = R;
         R = g_backend.allocRelation(theLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation | IFeature::Conflict, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::OsmRelation | IFeature::Conflict, id));
         R->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,R);
+        parseStandardAttributes(parser,R);
 
         if (R->lastUpdated() == Feature::User)
         {
@@ -274,6 +314,8 @@ void OSMHandler::parseRelation(const QXmlAttributes& atts)
 #endif
                 g_backend.deallocFeature(theLayer, R);
                 R = userR;
+                if (!movedFeatures.contains(R))
+                    movedFeatures.insert(R, R->layer());
                 R->layer()->remove(R);
                 theLayer->add(R);
                 while (R->size())
@@ -292,41 +334,67 @@ void OSMHandler::parseRelation(const QXmlAttributes& atts)
     else
     {
         R = g_backend.allocRelation(theLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::OsmRelation, id));
         R->setLastUpdated(Feature::OSMServer);
         NewFeature = true;
         theLayer->add(R);
+        addedFeatures << R;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,R);
+        parseStandardAttributes(parser,R);
         Current = R;
         touchedRelations << R;
     } else
         Current = NULL;
 }
 
-bool OSMHandler::startElement ( const QString &, const QString & /* localName */, const QString & qName, const QXmlAttributes & atts )
+void OSMHandler::startElement(const OsmXmlParser& parser)
 {
-    if (qName == "tag")
-        parseTag(atts);
-    else if (qName == "node")
-        parseNode(atts);
-    else if (qName == "nd")
-        parseNd(atts);
-    else if (qName == "way")
-        parseWay(atts);
-    else if (qName == "member")
-        parseMember(atts);
-    else if (qName == "relation")
-        parseRelation(atts);
-    return true;
+    if (parser.isElement("nd"))
+        parseNd(parser);
+    else if (parser.isElement("tag"))
+        parseTag(parser);
+    else if (parser.isElement("node"))
+        parseNode(parser);
+    else if (parser.isElement("way"))
+        parseWay(parser);
+    else if (parser.isElement("member"))
+        parseMember(parser);
+    else if (parser.isElement("relation"))
+        parseRelation(parser);
 }
 
-bool OSMHandler::endElement ( const QString &, const QString & /* localName */, const QString & qName )
+void OSMHandler::endElement(const OsmXmlParser& parser)
 {
-    if (qName == "node")
+    if (parser.isElement("node"))
         Current = 0;
+}
+
+/* Feeds the handler until the end of the document; returns false if canceled */
+static bool parseOSM(OsmXmlParser& parser, OSMHandler& theHandler, QProgressDialog* dlg, QProgressBar* Bar)
+{
+    qint64 lastUpdate = 0;
+    OsmXmlParser::TokenType token;
+    while ((token = parser.readNext()) == OsmXmlParser::StartElement || token == OsmXmlParser::EndElement) {
+        if (token == OsmXmlParser::StartElement)
+            theHandler.startElement(parser);
+        else
+            theHandler.endElement(parser);
+
+        if (parser.position() - lastUpdate >= 256*1024) {
+            lastUpdate = parser.position();
+            if (Bar)
+                Bar->setValue(lastUpdate);
+            qApp->processEvents();
+            if (dlg && dlg->wasCanceled())
+                return false;
+        }
+    }
+    if (token == OsmXmlParser::Invalid)
+        qDebug() << "OSM XML:" << parser.errorString();
+    if (Bar)
+        Bar->setValue(parser.position());
     return true;
 }
 
@@ -356,26 +424,9 @@ static bool downloadToResolve(const QList<Feature*>& Resolution, QWidget* aParen
                 Lbl->setText(QApplication::translate("Downloader","Parsing unresolved %1 of %2").arg(i+1).arg(Resolution.size()));
 
                 QByteArray ba(theDownloader->content());
-                QBuffer  File(&ba);
-                File.open(QIODevice::ReadOnly);
-
+                OsmXmlParser parser(ba.constData(), ba.size());
                 OSMHandler theHandler(theDocument,theLayer,NULL);
-
-                QXmlSimpleReader xmlReader;
-                xmlReader.setContentHandler(&theHandler);
-                QXmlInputSource source;
-                QByteArray buf(File.read(10240));
-                source.setData(buf);
-                xmlReader.parse(&source,true);
-                while (!File.atEnd())
-                {
-                    QByteArray buf(File.read(20480));
-                    source.setData(buf);
-                    xmlReader.parseContinue();
-                    qApp->processEvents();
-                    if (dlg && dlg->wasCanceled())
-                        break;
-                }
+                parseOSM(parser, theHandler, dlg, NULL);
             }
             Resolution[i]->setLastUpdated(Feature::OSMServer);
         }
@@ -443,62 +494,9 @@ static bool deleteIncompleteRelations(QWidget* /*aParent*/, Document* /*theDocum
     return true;
 }
 
-bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
+/* What is left of an import once everything is parsed; returns false if canceled */
+static bool finishImport(QWidget* aParent, Document* theDocument, Layer* theLayer, Layer* conflictLayer, OSMHandler& theHandler, QProgressDialog* dlg, Downloader* theDownloader)
 {
-    QDomDocument DomDoc;
-    QString ErrorStr;
-    /* int ErrorLine; */
-    /* int ErrorColumn; */
-
-    QProgressDialog* dlg = NULL;
-    QProgressBar* Bar = NULL;
-    QLabel* Lbl = NULL;
-    IProgressWindow* aProgressWindow = dynamic_cast<IProgressWindow*>(aParent);
-    if (aProgressWindow) {
-        dlg = aProgressWindow->getProgressDialog();
-        if (dlg) {
-            dlg->setWindowTitle(QApplication::translate("Downloader", "Parsing..."));
-
-            Bar = aProgressWindow->getProgressBar();
-            Bar->setTextVisible(false);
-
-            Lbl = aProgressWindow->getProgressLabel();
-            Lbl->setText(QApplication::translate("Downloader","Parsing XML"));
-
-            dlg->show();
-        }
-    }
-
-    if (theDownloader)
-        theDownloader->setAnimator(dlg,Lbl,Bar,false);
-    Layer* conflictLayer = new DrawingLayer(QApplication::translate("Downloader","Conflicts from %1").arg(theLayer->name()));
-    theDocument->add(conflictLayer);
-
-    OSMHandler theHandler(theDocument,theLayer,conflictLayer);
-
-    QXmlSimpleReader xmlReader;
-    xmlReader.setContentHandler(&theHandler);
-    QXmlInputSource source;
-    QByteArray buf(File.read(10240));
-    source.setData(buf);
-    xmlReader.parse(&source,true);
-    if (Bar) {
-        Bar->setMaximum(File.size());
-        Bar->setValue(Bar->value()+buf.size());
-    }
-
-    while (!File.atEnd())
-    {
-        QByteArray buf(File.read(20480));
-        source.setData(buf);
-        xmlReader.parseContinue();
-        if (Bar)
-            Bar->setValue(Bar->value()+buf.size());
-        qApp->processEvents();
-        if (dlg && dlg->wasCanceled())
-            break;
-    }
-
     bool WasCanceled = false;
     if (dlg)
         WasCanceled = dlg->wasCanceled();
@@ -576,19 +574,221 @@ bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer*
     return true;
 }
 
+static QProgressDialog* showParsing(QWidget* aParent, QLabel*& Lbl, QProgressBar*& Bar)
+{
+    QProgressDialog* dlg = NULL;
+    IProgressWindow* aProgressWindow = dynamic_cast<IProgressWindow*>(aParent);
+    if (aProgressWindow) {
+        dlg = aProgressWindow->getProgressDialog();
+        if (dlg) {
+            dlg->setWindowTitle(QApplication::translate("Downloader", "Parsing..."));
+
+            Bar = aProgressWindow->getProgressBar();
+            Bar->setTextVisible(false);
+
+            Lbl = aProgressWindow->getProgressLabel();
+            Lbl->setText(QApplication::translate("Downloader","Parsing XML"));
+
+            dlg->show();
+        }
+    }
+    return dlg;
+}
+
+static bool importOSM(QWidget* aParent, const char* data, qint64 size, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
+{
+    QProgressBar* Bar = NULL;
+    QLabel* Lbl = NULL;
+    QProgressDialog* dlg = showParsing(aParent, Lbl, Bar);
+
+    if (theDownloader)
+        theDownloader->setAnimator(dlg,Lbl,Bar,false);
+    Layer* conflictLayer = new DrawingLayer(QApplication::translate("Downloader","Conflicts from %1").arg(theLayer->name()));
+    theDocument->add(conflictLayer);
+
+    OsmXmlParser parser(data, size);
+    OSMHandler theHandler(theDocument,theLayer,conflictLayer);
+    if (Bar)
+        Bar->setMaximum(size);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Index the parsed features in one go once parsing is done
+    theLayer->blockIndexing(true);
+    parseOSM(parser, theHandler, dlg, Bar);
+    theLayer->blockIndexing(false);
+
+    if (g_Merk_Benchmark) {
+        qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+        qreal megabytes = parser.position() / (1024. * 1024.);
+        qDebug() << "OSM import:" << megabytes << "MB in" << elapsed << "ms (" << megabytes * 1000. / elapsed << "MB/s)";
+    }
+
+    return finishImport(aParent, theDocument, theLayer, conflictLayer, theHandler, dlg, theDownloader);
+}
+
+/*** OSMStreamImport ***/
+
+// Smaller chunks are gathered until there is that much data to parse
+#define OSM_STREAM_BATCH (256*1024)
+
+OSMStreamImport::OSMStreamImport(QWidget* aParent, Document* aDoc, Layer* aLayer)
+    : theParent(aParent), theDocument(aDoc), theLayer(aLayer), conflictLayer(0), theHandler(0)
+    , Received(0), ParseTime(0)
+{
+}
+
+OSMStreamImport::~OSMStreamImport()
+{
+    // Download canceled or failed before the end of finish(): nothing of it is kept
+    if (theHandler) {
+        rollback();
+        theLayer->blockIndexing(false);
+        theDocument->remove(conflictLayer);
+        delete conflictLayer;
+        delete theHandler;
+    }
+}
+
+void OSMStreamImport::start()
+{
+    conflictLayer = new DrawingLayer(QApplication::translate("Downloader","Conflicts from %1").arg(theLayer->name()));
+    theDocument->add(conflictLayer);
+    theHandler = new OSMHandler(theDocument,theLayer,conflictLayer);
+
+    // Index the parsed features in one go once the download is done
+    theLayer->blockIndexing(true);
+    Timer.start();
+}
+
+/* Gives the features the download took over back to their layer, with the new features they now
+ * hold, which are then no longer part of what is to be removed */
+static void restore(Feature* F, Layer* aLayer, Layer* theLayer, QSet<Feature*>& added)
+{
+    if (F->layer() == theLayer && aLayer != theLayer) {
+        theLayer->remove(F);
+        aLayer->add(F);
+    }
+    for (int i=0; i<F->size(); ++i) {
+        Feature* C = F->get(i);
+        if (C && added.remove(C))
+            restore(C, aLayer, theLayer, added);
+    }
+}
+
+/* Removes and deletes what was parsed so far; the features already there are updated in place
+ * by the import, and keep the new state of those it took over, with the new features they hold */
+void OSMStreamImport::rollback()
+{
+    QSet<Feature*> added;
+    added.reserve(theHandler->addedFeatures.size());
+    foreach (Feature* F, theHandler->addedFeatures)
+        added.insert(F);
+
+    QHash<Feature*, Layer*>::const_iterator it = theHandler->movedFeatures.constBegin();
+    for (; it != theHandler->movedFeatures.constEnd(); ++it)
+        if (!added.contains(it.key()))
+            restore(it.key(), it.value(), theLayer, added);
+
+    QList<Feature*> MustDelete;
+    foreach (Feature* F, theHandler->addedFeatures) {
+        if (!added.contains(F) || F->layer() != theLayer)
+            continue;
+        // Its nodes and members may be features of the user
+        while (F->size())
+            F->remove(F->size()-1);
+        MustDelete.append(F);
+    }
+    foreach (Feature* F, MustDelete) {
+        // Still used by a feature of the user the download updated in place
+        if (F->sizeParents())
+            continue;
+        theLayer->deleteFeature(F);
+    }
+}
+
+/* Parses the first bytes of the pending data, and drops them */
+bool OSMStreamImport::parse(qint64 size)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QProgressDialog* dlg = NULL;
+    IProgressWindow* aProgressWindow = dynamic_cast<IProgressWindow*>(theParent);
+    if (aProgressWindow)
+        dlg = aProgressWindow->getProgressDialog();
+
+    OsmXmlParser parser(Pending.constData(), size);
+    bool OK = parseOSM(parser, *theHandler, dlg, NULL);
+    Pending.remove(0, size);
+
+    ParseTime += timer.elapsed();
+    return OK;
+}
+
+bool OSMStreamImport::write(const char* data, qint64 size)
+{
+    if (!theHandler)
+        start();
+
+    Received += size;
+    Pending.append(data, size);
+    if (Pending.size() < OSM_STREAM_BATCH)
+        return true;
+
+    qint64 complete = OsmXmlParser::completePrefix(Pending.constData(), Pending.size());
+    return !complete || parse(complete);
+}
+
+bool OSMStreamImport::finish(Downloader* theDownloader)
+{
+    if (!theHandler)
+        start();
+
+    QProgressBar* Bar = NULL;
+    QLabel* Lbl = NULL;
+    QProgressDialog* dlg = showParsing(theParent, Lbl, Bar);
+    if (theDownloader)
+        theDownloader->setAnimator(dlg,Lbl,Bar,false);
+
+    qint64 transfer = Timer.elapsed();
+    qint64 before = ParseTime;
+    if (!parse(Pending.size()))
+        return false;
+    theLayer->blockIndexing(false);
+
+    if (g_Merk_Benchmark) {
+        qint64 elapsed = qMax(Timer.elapsed(), qint64(1));
+        qreal megabytes = Received / (1024. * 1024.);
+        qDebug() << "OSM import:" << megabytes << "MB in" << elapsed << "ms (" << megabytes * 1000. / elapsed << "MB/s),"
+                 << ParseTime << "ms parsing, of which" << ParseTime - before << "ms after the" << transfer << "ms transfer";
+    }
+
+    OSMHandler* aHandler = theHandler;
+    theHandler = NULL;
+    bool OK = finishImport(theParent, theDocument, theLayer, conflictLayer, *aHandler, dlg, theDownloader);
+    delete aHandler;
+    return OK;
+}
+
 bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument, Layer* theLayer)
 {
     QFile File(aFilename);
     if (!File.open(QIODevice::ReadOnly))
          return false;
-    return importOSM(aParent, File, theDocument, theLayer, 0 );
+
+    // Parse the file in place if it can be mapped
+    if (uchar* data = File.map(0, File.size()))
+        return importOSM(aParent, reinterpret_cast<const char*>(data), File.size(), theDocument, theLayer, 0 );
+
+    QByteArray Content = File.readAll();
+    return importOSM(aParent, Content.constData(), Content.size(), theDocument, theLayer, 0 );
 }
 
 bool importOSM(QWidget* aParent, QByteArray& Content, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
 {
-    QBuffer File(&Content);
-    File.open(QIODevice::ReadOnly);
-    return importOSM(aParent, File, theDocument, theLayer, theDownloader);
+    return importOSM(aParent, Content.constData(), Content.size(), theDocument, theLayer, theDownloader);
 }
 
 
@@ -13,24 +13,33 @@ class QByteArray;
 class QString;
 class QWidget;
 
-#include <QXmlDefaultHandler>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
 #include <QSet>
+#include <QString>
 
-class OSMHandler : public QXmlDefaultHandler
+#include "DownloadOSM.h"
+
+class OsmXmlParser;
+
+class OSMHandler
 {
 public:
     OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict);
 
-    virtual bool startElement ( const QString & namespaceURI, const QString & localName, const QString & qName, const QXmlAttributes & atts );
-    virtual bool endElement ( const QString & namespaceURI, const QString & localName, const QString & qName );
+    void startElement(const OsmXmlParser& parser);
+    void endElement(const OsmXmlParser& parser);
 
 private:
-    void parseNode(const QXmlAttributes & atts);
-    void parseTag(const QXmlAttributes & atts);
-    void parseWay(const QXmlAttributes & atts);
-    void parseNd(const QXmlAttributes & atts);
-    void parseMember(const QXmlAttributes & atts);
-    void parseRelation(const QXmlAttributes& atts);
+    void parseStandardAttributes(const OsmXmlParser& parser, Feature* F);
+    void parseNode(const OsmXmlParser& parser);
+    void parseTag(const OsmXmlParser& parser);
+    void parseWay(const OsmXmlParser& parser);
+    void parseNd(const OsmXmlParser& parser);
+    void parseMember(const OsmXmlParser& parser);
+    void parseRelation(const OsmXmlParser& parser);
 
     Document* theDocument;
     Layer* theLayer;
@@ -38,9 +47,52 @@ private:
     Feature* Current;
     bool NewFeature;
 
+    /* Interned ids and user names by their raw XML value. The keys are copied out of the parsed
+     * buffer, so that a download can be parsed and released batch by batch */
+    QHash<QByteArray, quint32> keyIds;
+    QHash<QByteArray, quint32> valueIds;
+    QHash<QByteArray, QString> userNames;
+
 public:
         QSet<Way*> touchedWays;
         QSet<Relation*> touchedRelations;
+
+        /* What the import created in its layer, and the layers of the features it took over, so
+         * that an interrupted download can be taken back out */
+        QList<Feature*> addedFeatures;
+        QHash<Feature*, Layer*> movedFeatures;
+};
+
+/**
+    Import of an OSM download while it comes in. Each chunk received is appended to what is left of
+    the previous ones; once a batch of data is there, its complete nodes, ways and relations are
+    parsed into the layer, the rest waiting for more data. finish() parses the end of the document
+    and then checks the import like importOSM does. If the download fails or is canceled before,
+    what was parsed is removed from the layer again.
+*/
+class OSMStreamImport : public DownloadSink
+{
+public:
+    OSMStreamImport(QWidget* aParent, Document* aDoc, Layer* aLayer);
+    ~OSMStreamImport();
+
+    bool write(const char* data, qint64 size);
+    bool finish(Downloader* theDownloader);
+
+private:
+    void start();
+    bool parse(qint64 size);
+    void rollback();
+
+    QWidget* theParent;
+    Document* theDocument;
+    Layer* theLayer;
+    Layer* conflictLayer;
+    OSMHandler* theHandler;
+    QByteArray Pending;
+    qint64 Received;
+    qint64 ParseTime;
+    QElapsedTimer Timer;
 };
 
 bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument, Layer* theLayer);
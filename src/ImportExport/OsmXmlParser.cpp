@@ -0,0 +1,383 @@
+#include "OsmXmlParser.h"
+
+#include <QDateTime>
+
+#include <string.h>
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static const double powersOf10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+OsmXmlParser::OsmXmlParser(const char* data, qint64 size)
+    : begin(data), cur(data), end(data + size)
+    , theType(EndElement), theName(data), theNameLength(0), pendingEnd(false)
+{
+    if (!data)
+        begin = cur = end = theName = "";
+}
+
+OsmXmlParser::TokenType OsmXmlParser::setError(const QString& error)
+{
+    theError = QString("%1 at byte %2").arg(error).arg(position());
+    return theType = Invalid;
+}
+
+bool OsmXmlParser::skipPast(const char* marker)
+{
+    int length = qstrlen(marker);
+    while (true) {
+        const char* p = static_cast<const char*>(memchr(cur, marker[0], end - cur));
+        if (!p || end - p < length) {
+            cur = end;
+            return false;
+        }
+        if (!memcmp(p, marker, length)) {
+            cur = p + length;
+            return true;
+        }
+        cur = p + 1;
+    }
+}
+
+OsmXmlParser::TokenType OsmXmlParser::readNext()
+{
+    if (theType == EndDocument || theType == Invalid)
+        return theType;
+    if (pendingEnd) {
+        // The end of an empty element, e.g. <nd ref="1"/>
+        pendingEnd = false;
+        return theType = EndElement;
+    }
+    theAttributes.clear();
+
+    while (true) {
+        const char* lt = static_cast<const char*>(memchr(cur, '<', end - cur));
+        if (!lt) {
+            cur = end;
+            return theType = EndDocument;
+        }
+        cur = lt + 1;
+        if (cur >= end)
+            return setError("Unexpected end of document");
+
+        if (*cur == '?') {
+            if (!skipPast("?>"))
+                return setError("Unterminated processing instruction");
+            continue;
+        }
+        if (*cur == '!') {
+            if (end - cur >= 3 && cur[1] == '-' && cur[2] == '-') {
+                if (!skipPast("-->"))
+                    return setError("Unterminated comment");
+            } else if (end - cur >= 8 && !memcmp(cur, "![CDATA[", 8)) {
+                if (!skipPast("]]>"))
+                    return setError("Unterminated CDATA section");
+            } else {
+                // Doctype, maybe with an internal subset
+                int depth = 0;
+                while (cur < end && (*cur != '>' || depth)) {
+                    if (*cur == '[')
+                        ++depth;
+                    else if (*cur == ']')
+                        --depth;
+                    ++cur;
+                }
+                if (cur >= end)
+                    return setError("Unterminated doctype");
+                ++cur;
+            }
+            continue;
+        }
+
+        if (*cur == '/') {
+            theName = ++cur;
+            while (cur < end && *cur != '>' && !isSpace(*cur))
+                ++cur;
+            theNameLength = cur - theName;
+            const char* gt = static_cast<const char*>(memchr(cur, '>', end - cur));
+            if (!gt)
+                return setError("Unterminated end element");
+            cur = gt + 1;
+            return theType = EndElement;
+        }
+
+        theName = cur;
+        while (cur < end && *cur != '>' && *cur != '/' && !isSpace(*cur))
+            ++cur;
+        theNameLength = cur - theName;
+        if (!theNameLength)
+            return setError("Invalid element name");
+
+        while (true) {
+            while (cur < end && isSpace(*cur))
+                ++cur;
+            if (cur >= end)
+                return setError("Unterminated start element");
+            if (*cur == '>') {
+                ++cur;
+                return theType = StartElement;
+            }
+            if (*cur == '/') {
+                if (cur + 1 >= end || cur[1] != '>')
+                    return setError("Invalid empty element");
+                cur += 2;
+                pendingEnd = true;
+                return theType = StartElement;
+            }
+
+            Attribute a;
+            a.name = cur;
+            while (cur < end && *cur != '=' && *cur != '>' && !isSpace(*cur))
+                ++cur;
+            a.nameLength = cur - a.name;
+            while (cur < end && isSpace(*cur))
+                ++cur;
+            if (!a.nameLength || cur >= end || *cur != '=')
+                return setError("Invalid attribute");
+            ++cur;
+            while (cur < end && isSpace(*cur))
+                ++cur;
+            if (cur >= end || (*cur != '"' && *cur != '\''))
+                return setError("Unquoted attribute value");
+            char quote = *cur++;
+            const char* close = static_cast<const char*>(memchr(cur, quote, end - cur));
+            if (!close)
+                return setError("Unterminated attribute value");
+            a.value = cur;
+            a.valueLength = close - cur;
+            cur = close + 1;
+            theAttributes.append(a);
+        }
+    }
+}
+
+static inline bool startsElement(const char* p, qint64 left, const char* aName)
+{
+    int length = qstrlen(aName);
+    return left > length && !memcmp(p, aName, length)
+        && (isSpace(p[length]) || p[length] == '>' || p[length] == '/');
+}
+
+qint64 OsmXmlParser::completePrefix(const char* data, qint64 size)
+{
+    // The children of top level elements (tag, nd, member) have other names, and '<' is always
+    // escaped in attribute values. Comments and CDATA sections are not looked into.
+    for (const char* p = data + size - 1; p >= data; --p) {
+        if (*p != '<')
+            continue;
+        qint64 left = data + size - (p + 1);
+        if (startsElement(p + 1, left, "node") || startsElement(p + 1, left, "way")
+                || startsElement(p + 1, left, "relation"))
+            return p - data;
+    }
+    return 0;
+}
+
+bool OsmXmlParser::isElement(const char* aName) const
+{
+    return int(qstrlen(aName)) == theNameLength && !memcmp(theName, aName, theNameLength);
+}
+
+QByteArray OsmXmlParser::name() const
+{
+    return QByteArray::fromRawData(theName, theNameLength);
+}
+
+const OsmXmlParser::Attribute* OsmXmlParser::findAttribute(const char* aName) const
+{
+    int length = qstrlen(aName);
+    for (int i=0; i<theAttributes.size(); ++i) {
+        const Attribute& a = theAttributes[i];
+        if (a.nameLength == length && !memcmp(a.name, aName, length))
+            return &a;
+    }
+    return NULL;
+}
+
+bool OsmXmlParser::hasAttribute(const char* aName) const
+{
+    return findAttribute(aName) != NULL;
+}
+
+QByteArray OsmXmlParser::rawAttribute(const char* aName) const
+{
+    const Attribute* a = findAttribute(aName);
+    if (!a)
+        return QByteArray();
+    return QByteArray::fromRawData(a->value, a->valueLength);
+}
+
+QString OsmXmlParser::stringAttribute(const char* aName) const
+{
+    const Attribute* a = findAttribute(aName);
+    if (!a)
+        return QString();
+    return decode(a->value, a->valueLength);
+}
+
+qint64 OsmXmlParser::int64Attribute(const char* aName, qint64 defaultValue) const
+{
+    const Attribute* a = findAttribute(aName);
+    if (!a || !a->valueLength)
+        return defaultValue;
+
+    const char* p = a->value;
+    const char* e = p + a->valueLength;
+    bool negative = (*p == '-');
+    if (negative || *p == '+')
+        ++p;
+    if (p == e)
+        return defaultValue;
+
+    qint64 value = 0;
+    for (; p < e; ++p) {
+        if (!isDigit(*p))
+            return defaultValue;
+        value = value * 10 + (*p - '0');
+    }
+    return negative ? -value : value;
+}
+
+qreal OsmXmlParser::realAttribute(const char* aName, qreal defaultValue) const
+{
+    const Attribute* a = findAttribute(aName);
+    if (!a || !a->valueLength)
+        return defaultValue;
+
+    const char* p = a->value;
+    const char* e = p + a->valueLength;
+    bool negative = (*p == '-');
+    if (negative || *p == '+')
+        ++p;
+
+    quint64 mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    bool point = false;
+    for (; p < e; ++p) {
+        if (isDigit(*p)) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (point)
+                ++decimals;
+            if (++digits > 18)
+                break;
+        } else if (*p == '.' && !point) {
+            point = true;
+        } else
+            break;
+    }
+
+    if (p != e || !digits) {
+        // Exponents, overlong or malformed numbers: take the slow road
+        bool ok;
+        qreal value = QByteArray(a->value, a->valueLength).toDouble(&ok);
+        return ok ? value : defaultValue;
+    }
+
+    qreal value = qreal(mantissa) / powersOf10[decimals];
+    return negative ? -value : value;
+}
+
+static inline bool readDigits(const char* p, int count, int& value)
+{
+    value = 0;
+    for (int i=0; i<count; ++i) {
+        if (!isDigit(p[i]))
+            return false;
+        value = value * 10 + (p[i] - '0');
+    }
+    return true;
+}
+
+bool OsmXmlParser::timeAttribute(const char* aName, uint& epoch) const
+{
+    const Attribute* a = findAttribute(aName);
+    if (!a || a->valueLength < 19)
+        return false;
+
+    // yyyy-MM-ddTHH:mm:ss, anything after the seconds (fraction, zone) being ignored
+    const char* p = a->value;
+    int year, month, day, hour, minute, second;
+    if (p[4] != '-' || p[7] != '-' || p[10] != 'T' || p[13] != ':' || p[16] != ':')
+        return false;
+    if (!readDigits(p, 4, year) || !readDigits(p+5, 2, month) || !readDigits(p+8, 2, day)
+            || !readDigits(p+11, 2, hour) || !readDigits(p+14, 2, minute) || !readDigits(p+17, 2, second))
+        return false;
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59)
+        return false;
+
+    quint32 key = ((year * 12 + month - 1) * 31 + day - 1) * 24 + hour;
+    QHash<quint32, uint>::const_iterator it = hourCache.constFind(key);
+    if (it == hourCache.constEnd()) {
+        QDateTime hourStart(QDate(year, month, day), QTime(hour, 0));
+        if (!hourStart.isValid())
+            return false;
+        it = hourCache.insert(key, hourStart.toTime_t());
+    }
+    epoch = it.value() + minute * 60 + second;
+    return true;
+}
+
+QString OsmXmlParser::decode(const char* value, int length)
+{
+    const char* e = value + length;
+    const char* p = value;
+    while (p < e && *p != '&' && *p != '\n' && *p != '\t' && *p != '\r')
+        ++p;
+    if (p == e)
+        return QString::fromUtf8(value, length);
+
+    // Entities and attribute value normalization
+    QString res;
+    res.reserve(length);
+    const char* start = value;
+    for (p = value; p < e; ++p) {
+        if (*p == '\n' || *p == '\t' || *p == '\r') {
+            res += QString::fromUtf8(start, p - start);
+            res += QLatin1Char(' ');
+            start = p + 1;
+            continue;
+        }
+        if (*p != '&')
+            continue;
+        const char* semicolon = static_cast<const char*>(memchr(p, ';', e - p));
+        if (!semicolon)
+            break;
+        res += QString::fromUtf8(start, p - start);
+
+        QByteArray entity(p + 1, semicolon - p - 1);
+        if (entity == "amp")
+            res += QLatin1Char('&');
+        else if (entity == "lt")
+            res += QLatin1Char('<');
+        else if (entity == "gt")
+            res += QLatin1Char('>');
+        else if (entity == "quot")
+            res += QLatin1Char('"');
+        else if (entity == "apos")
+            res += QLatin1Char('\'');
+        else if (entity.startsWith('#')) {
+            bool ok;
+            uint code = entity.startsWith("#x") ? entity.mid(2).toUInt(&ok, 16) : entity.mid(1).toUInt(&ok);
+            if (ok)
+                res += QString::fromUcs4(&code, 1);
+        } else
+            res += QString::fromUtf8(p, semicolon - p + 1);
+
+        p = semicolon;
+        start = p + 1;
+    }
+    res += QString::fromUtf8(start, e - start);
+    return res;
+}
@@ -0,0 +1,83 @@
+#ifndef OSMXMLPARSER_H
+#define OSMXMLPARSER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVarLengthArray>
+
+/**
+    Pull parser for OSM XML (.osm and .osc) working in place on a memory buffer.
+
+    Only elements and their attributes are reported: text, comments, processing instructions,
+    CDATA sections and the doctype are skipped. Attribute values are decoded on demand straight
+    from the buffer, which must stay valid as long as the parser and the values it returned.
+*/
+class OsmXmlParser
+{
+public:
+    enum TokenType {
+        StartElement,
+        EndElement,
+        EndDocument,
+        Invalid
+    };
+
+    OsmXmlParser(const char* data, qint64 size);
+
+    TokenType readNext();
+    TokenType tokenType() const { return theType; }
+    QString errorString() const { return theError; }
+
+    // Bytes of the buffer consumed so far
+    qint64 position() const { return cur - begin; }
+
+    // Name of the current element, for start and end elements
+    bool isElement(const char* aName) const;
+    QByteArray name() const;
+
+    // Attributes of the current start element
+    bool hasAttribute(const char* aName) const;
+    // The raw attribute value, entities not decoded; points into the buffer
+    QByteArray rawAttribute(const char* aName) const;
+    QString stringAttribute(const char* aName) const;
+    qint64 int64Attribute(const char* aName, qint64 defaultValue = 0) const;
+    qreal realAttribute(const char* aName, qreal defaultValue = 0.) const;
+    // An ISO 8601 "yyyy-MM-ddTHH:mm:ss" timestamp read as local time, like QDateTime::fromString;
+    // returns false if it is missing or malformed
+    bool timeAttribute(const char* aName, uint& epoch) const;
+
+    static QString decode(const char* value, int length);
+
+    // Length of the part of a partly received document before its last node, way or relation
+    // start tag, i.e. what can be parsed without waiting for more data
+    static qint64 completePrefix(const char* data, qint64 size);
+
+private:
+    struct Attribute {
+        const char* name;
+        int nameLength;
+        const char* value;
+        int valueLength;
+    };
+
+    const Attribute* findAttribute(const char* aName) const;
+    bool skipPast(const char* marker);
+    TokenType setError(const QString& error);
+
+    const char* begin;
+    const char* cur;
+    const char* end;
+
+    TokenType theType;
+    QString theError;
+    const char* theName;
+    int theNameLength;
+    bool pendingEnd;
+    QVarLengthArray<Attribute, 16> theAttributes;
+
+    // Local epoch of each hour seen, as timestamps come in runs
+    mutable QHash<quint32, uint> hourCache;
+};
+
+#endif // OSMXMLPARSER_H
@@ -138,14 +138,12 @@ void CreateSingleWayInteraction::snapMouseMoveEvent(QMouseEvent* ev, Feature* la
         qreal curAngle = 666;
 
         Way* R;
+        QList < Feature* > ret;
         for (int j=0; j<document()->layerSize(); ++j) {
-            QList < Feature* > ret = g_backend.indexFind(document()->getLayer(j), HotZone);
+            ret.clear();
+            g_backend.indexFind(document()->getLayer(j), HotZone, ret, IndexFilter(IFeature::LineString, true));
             foreach(Feature* F, ret) {
-                if (!(R = CAST_WAY(F)))
-                    continue;
-
-                if (R->isHidden())
-                    continue;
+                R = STATIC_CAST_WAY(F);
                 if (R->notEverythingDownloaded())
                     continue;
 
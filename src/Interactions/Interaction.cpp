@@ -234,13 +234,13 @@ void FeatureSnapInteraction::updateSnap(QMouseEvent* event)
 
     Way* R;
     Node* N;
+    QList < Feature* > ret;
     for (int j=0; j<document()->layerSize(); ++j) {
-        QList < Feature* > ret = g_backend.indexFind(document()->getLayer(j), HotZone);
+        ret.clear();
+        g_backend.indexFind(document()->getLayer(j), HotZone, ret, IndexFilter(IFeature::All, true));
         foreach(Feature* F, ret) {
             if (F)
             {
-                if (F->isHidden())
-                    continue;
                 if (NoSnap.contains(F))
                     continue;
                 if (F->notEverythingDownloaded())
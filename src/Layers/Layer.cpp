@@ -15,6 +15,7 @@
 #include "MainWindow.h"
 
 #include <QApplication>
+#include <QElapsedTimer>
 #include <QMultiMap>
 #include <QProgressDialog>
 #include <QUuid>
@@ -25,6 +26,8 @@
 #include <algorithm>
 #include "LayerPrivate.h"
 
+#define BENCHMARK_FEATURES 100000
+
 /* Layer */
 
 Layer::Layer()
@@ -51,6 +54,7 @@ Layer::Layer(const Layer&)
 Layer::~Layer()
 {
     clear();
+    blockIndexing(false);
     delete p;
 }
 
@@ -153,12 +157,16 @@ bool Layer::isUploadable() const
 
 void Layer::add(Feature* aFeature)
 {
-    if (aFeature) {
+    if (aFeature && exists(aFeature)) {
+        qDebug() << "Layer::add: logic error, feature already in the layer";
+    } else if (aFeature) {
         aFeature->setLayer(this);
-        p->Features.push_back(aFeature);
+        p->addFeature(aFeature);
         g_backend.sync(aFeature);
         aFeature->invalidateMeta();
         notifyIdUpdate(aFeature->id(),aFeature);
+        if (p->theDocument)
+            p->theDocument->notifyTagsUpdate(this, aFeature, true);
     } else {
         qDebug() << "Layer::add: logic error, no featured passed";
     }
@@ -166,8 +174,10 @@ void Layer::add(Feature* aFeature)
 
 void Layer::remove(Feature* aFeature)
 {
-    if (p->Features.removeOne(aFeature))
+    if (p->removeFeature(aFeature))
     {
+        if (p->theDocument)
+            p->theDocument->notifyTagsUpdate(this, aFeature, false);
         g_backend.sync(aFeature);
         aFeature->setLayer(0);
         notifyIdUpdate(aFeature->id(),0);
@@ -176,8 +186,10 @@ void Layer::remove(Feature* aFeature)
 
 void Layer::deleteFeature(Feature* aFeature)
 {
-    if (p->Features.removeOne(aFeature))
+    if (p->removeFeature(aFeature))
     {
+        if (p->theDocument)
+            p->theDocument->notifyTagsUpdate(this, aFeature, false);
         g_backend.deallocFeature(this, aFeature);
         aFeature->setLayer(0);
         notifyIdUpdate(aFeature->id(),0);
@@ -186,16 +198,16 @@ void Layer::deleteFeature(Feature* aFeature)
 
 void Layer::clear()
 {
-    while (p->Features.count())
+    while (p->count())
     {
-        remove(p->Features[0]);
+        remove(p->features().last());
     }
 }
 
 void Layer::deleteAll() {
-    while (p->Features.count())
+    while (p->count())
     {
-        deleteFeature(p->Features[0]);
+        deleteFeature(p->features().last());
     }
 }
 
@@ -206,27 +218,47 @@ void Layer::notifyIdUpdate(const IFeature::FId& id, Feature* aFeature)
     if (!aFeature) {
         i = p->IdMap.find(id.numId);
         while (i != p->IdMap.end() && i.key() == id.numId) {
-            if (i.value()->id().type & id.type)
+            if (i.value()->id().type & id.type) {
+                if (p->theDocument)
+                    p->theDocument->notifyIdUpdate(this, id, i.value(), false);
                 i = p->IdMap.erase(i);
-            else
+            } else
                 ++i;
         }
     }
     else {
-        if (!aFeature->isVirtual())
+        if (!aFeature->isVirtual()) {
             p->IdMap.insertMulti(id.numId, aFeature);
+            if (p->theDocument)
+                p->theDocument->notifyIdUpdate(this, id, aFeature, true);
+        }
     }
 }
 
+void Layer::blockIndexing(bool val)
+{
+    if (val == p->IndexingBlocked)
+        return;
+    p->IndexingBlocked = val;
+    if (val)
+        g_backend.blockIndexing(this);
+    else
+        g_backend.unblockIndexing(this);
+}
+
+bool Layer::isIndexingBlocked() const
+{
+    return p->IndexingBlocked;
+}
+
 bool Layer::exists(Feature* F) const
 {
-    int i = p->Features.indexOf(F);
-    return (i != -1);
+    return p->slotOf(F) != -1;
 }
 
 int Layer::size() const
 {
-    return p->Features.size();
+    return p->count();
 }
 
 void Layer::setDocument(Document* aDocument)
@@ -241,26 +273,20 @@ Document* Layer::getDocument()
 
 int Layer::get(Feature* aFeature)
 {
-    for (int i=0; i<p->Features.size(); ++i)
-        if (p->Features[i] == aFeature)
-            return i;
-
-    return -1;
+    // Squeeze the holes out first, so that the slot is the index for get(int)
+    p->features();
+    return p->slotOf(aFeature);
 }
 
 QList<Feature *> Layer::get()
 {
-    QList<Feature *> theList;
-    for (int i=0; i<p->Features.size(); ++i)
-        if (p->Features[i])
-            theList.append(p->Features[i]);
-    return theList;
+    return p->features();
 }
 
 
 Feature* Layer::get(int i)
 {
-    return p->Features.at(i);
+    return p->features().at(i);
 }
 
 Feature* Layer::get(const IFeature::FId& id)
@@ -278,8 +304,40 @@ Feature* Layer::get(const IFeature::FId& id)
 
 const Feature* Layer::get(int i) const
 {
-    if((int)i>=p->Features.size()) return 0;
-    return p->Features[i];
+    if((int)i>=p->count()) return 0;
+    return p->features()[i];
+}
+
+void Layer::benchmarkMembership()
+{
+    DrawingLayer theLayer("Benchmark");
+    theLayer.blockIndexing(true);
+
+    QList<Feature*> theFeatures;
+    for (int i=0; i<BENCHMARK_FEATURES; ++i)
+        theFeatures << g_backend.allocNode(&theLayer, Coord(0.001 * (i % 1000), 0.001 * (i / 1000)));
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i=0; i<theFeatures.size(); ++i)
+        theLayer.add(theFeatures[i]);
+    qint64 addNs = timer.nsecsElapsed();
+
+    // Every other feature, like a big selection being deleted
+    timer.start();
+    for (int i=0; i<theFeatures.size(); i += 2)
+        theLayer.remove(theFeatures[i]);
+    qint64 removeNs = timer.nsecsElapsed();
+
+    timer.start();
+    theLayer.clear();
+    qint64 clearNs = timer.nsecsElapsed();
+
+    for (int i=0; i<theFeatures.size(); ++i)
+        g_backend.deallocFeature(&theLayer, theFeatures[i]);
+
+    qDebug() << "Layer membership benchmark:" << theFeatures.size() << "features";
+    qDebug() << "  add:" << addNs / 1000000 << "ms, remove half:" << removeNs / 1000000 << "ms, clear:" << clearNs / 1000000 << "ms";
 }
 
 LayerWidget* Layer::getWidget(void)
@@ -325,20 +383,21 @@ const QString& Layer::id() const
 
 CoordBox Layer::boundingBox()
 {
-    if(p->Features.size()==0) return CoordBox(Coord(0,0),Coord(0,0));
+    const QList<Feature*>& Features = p->features();
+    if(Features.size()==0) return CoordBox(Coord(0,0),Coord(0,0));
     CoordBox Box;
     bool haveFirst = false;
-    for (int i=0; i<p->Features.size(); ++i) {
-        if (p->Features.at(i)->isDeleted())
+    for (int i=0; i<Features.size(); ++i) {
+        if (Features.at(i)->isDeleted())
             continue;
-        if (p->Features.at(i)->notEverythingDownloaded())
+        if (Features.at(i)->notEverythingDownloaded())
             continue;
-        if (p->Features.at(i)->boundingBox().isNull())
+        if (Features.at(i)->boundingBox().isNull())
             continue;
         if (haveFirst)
-            Box.merge(p->Features.at(i)->boundingBox());
+            Box.merge(Features.at(i)->boundingBox());
         else {
-            Box = p->Features.at(i)->boundingBox();
+            Box = Features.at(i)->boundingBox();
             haveFirst = true;
         }
     }
@@ -370,7 +429,7 @@ int Layer::getDisplaySize() const
     int objects = 0;
 
     QList<MapFeaturePtr>::const_iterator i;
-    for (i = p->Features.constBegin(); i != p->Features.constEnd(); i++) {
+    for (i = p->features().constBegin(); i != p->features().constEnd(); i++) {
         if ((*i)->isVirtual())
             continue;
         ++objects;
@@ -384,7 +443,7 @@ int Layer::getDirtySize() const
     int dirtyObjects = 0;
 
     QList<MapFeaturePtr>::const_iterator i;
-    for (i = p->Features.constBegin(); i != p->Features.constEnd(); i++) {
+    for (i = p->features().constBegin(); i != p->features().constEnd(); i++) {
         Feature* F = (*i);
         if (F->isVirtual())
             continue;
@@ -506,7 +565,7 @@ bool DrawingLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDia
         stream.writeAttribute("version", "0.6");
         stream.writeAttribute("generator", QString("%1 %2").arg(STRINGIFY(PRODUCT)).arg(STRINGIFY(VERSION)));
 
-        if (p->Features.size()) {
+        if (p->count()) {
             stream.writeStartElement("bound");
             CoordBox layBB = boundingBox();
             QString S = QString().number(layBB.bottomLeft().y(),'f',6) + ",";
@@ -518,8 +577,8 @@ bool DrawingLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDia
             stream.writeEndElement();
         }
 
-        QList<MapFeaturePtr>::iterator it;
-        for(it = p->Features.begin(); it != p->Features.end(); it++)
+        QList<MapFeaturePtr>::const_iterator it;
+        for(it = p->features().constBegin(); it != p->features().constEnd(); it++)
             (*it)->toXML(stream, progress);
         stream.writeEndElement();
 
@@ -634,67 +693,40 @@ void TrackLayer::extractLayer()
     extL->setUploadable(false);
 
     TrackNode* P;
-    QList<TrackNode*> PL;
 
     const qreal coordPer10M = (double(COORD_MAX) * 2 / 40080000) * 2;
 
+    QList<TrackSegment*> theSegments;
     for (int i=0; i < size(); i++) {
-        if (TrackSegment* S = dynamic_cast<TrackSegment*>(get(i))) {
-
-            if (S->size() < 2)
-                continue;
-
-            // Cope with walking tracks
-            qreal konstant = coordPer10M;
-            qreal meanSpeed = S->distance() / S->duration() * 3600;
-            if (meanSpeed < 10.)
-                konstant /= 3.;
-
-
-            PL.clear();
-
-            P = g_backend.allocTrackNode(extL, S->getNode(0)->position() );
-            P->setTime(S->getNode(0)->time());
-            P->setElevation(S->getNode(0)->elevation());
-            P->setSpeed(S->getNode(0)->speed());
-            PL.append(P);
-            int startP = 0;
-
-            P = g_backend.allocTrackNode(extL, S->getNode(1)->position() );
-            P->setTime(S->getNode(1)->time());
-            P->setElevation(S->getNode(1)->elevation());
-            P->setSpeed(S->getNode(1)->speed());
-            PL.append(P);
-            int endP = 1;
-
-            for (int j=2; j < S->size(); j++) {
-                P = g_backend.allocTrackNode(extL, S->getNode(j)->position() );
-                P->setTime(S->getNode(j)->time());
-                P->setElevation(S->getNode(j)->elevation());
-                P->setSpeed(S->getNode(j)->speed());
-                PL.append(P);
-                endP = PL.size()-1;
-
-                LineF l(PL[startP]->position(), PL[endP]->position());
-                for (int k=startP+1; k < endP; k++) {
-                    qreal d = l.distance(PL[k]->position());
-                    if (d < konstant) {
-                        Node* P = PL[k];
-                        PL.removeAt(k);
-                        g_backend.deallocFeature(extL, P);
-                        endP--;
-                    } else
-                        startP = k;
-                }
-            }
-
-            Way* R = g_backend.allocWay(extL);
-            R->setLastUpdated(Feature::OSMServer);
-            extL->add(R);
-            for (int i=0; i < PL.size(); i++) {
-                extL->add(PL[i]);
-                R->add(PL[i]);
-            }
+        TrackSegment* S = dynamic_cast<TrackSegment*>(get(i));
+        if (S && S->size() >= 2)
+            theSegments << S;
+    }
+    // The simplification is the one of the levels of detail, done in parallel
+    TrackSegment::updateLevels(theSegments);
+
+    for (int i=0; i < theSegments.size(); i++) {
+        TrackSegment* S = theSegments[i];
+
+        // Cope with walking tracks
+        qreal konstant = coordPer10M;
+        qreal meanSpeed = S->distance() / S->duration() * 3600;
+        if (meanSpeed < 10.)
+            konstant /= 3.;
+
+        QVector<int> kept = S->simplified(konstant);
+
+        Way* R = g_backend.allocWay(extL);
+        R->setLastUpdated(Feature::OSMServer);
+        extL->add(R);
+        for (int j=0; j < kept.size(); j++) {
+            TrackNode* N = S->getNode(kept[j]);
+            P = g_backend.allocTrackNode(extL, N->position() );
+            P->setTime(N->time());
+            P->setElevation(N->elevation());
+            P->setSpeed(N->speed());
+            extL->add(P);
+            R->add(P);
         }
     }
 
@@ -744,8 +776,8 @@ bool TrackLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDialo
 
     QList<Node*>	waypoints;
     QList<TrackSegment*>	segments;
-    QList<MapFeaturePtr>::iterator it;
-    for(it = p->Features.begin(); it != p->Features.end(); it++) {
+    QList<MapFeaturePtr>::const_iterator it;
+    for(it = p->features().constBegin(); it != p->features().constEnd(); it++) {
         if (TrackSegment* S = CAST_SEGMENT(*it))
             segments.push_back(S);
         if (Node* P = CAST_NODE(*it))
@@ -940,13 +972,26 @@ FilterLayer::~ FilterLayer()
 void FilterLayer::setFilter(const QString& aFilter)
 {
     theSelectorString = aFilter;
-    delete theSelector;
+    TagSelector* oldSelector = theSelector;
     theSelector = TagSelector::parse(theSelectorString);
 
-    FeatureIterator it(p->theDocument);
-    for(;!it.isEnd(); ++it) {
-        it.get()->updateFilters();
+    // Only the features matching the old or the new filter may change
+    QList<Feature*> candidates;
+    if (p->theDocument && p->theDocument->getTagCandidates(oldSelector, candidates)
+            && p->theDocument->getTagCandidates(theSelector, candidates)) {
+        QSet<Feature*> done;
+        foreach (Feature* F, candidates)
+            if (!done.contains(F)) {
+                done.insert(F);
+                F->updateFilters();
+            }
+    } else {
+        FeatureIterator it(p->theDocument);
+        for(;!it.isEnd(); ++it) {
+            it.get()->updateFilters();
+        }
     }
+    delete oldSelector;
 }
 
 bool FilterLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDialog * progress)
@@ -90,6 +90,12 @@ public:
     virtual Feature* get(const IFeature::FId& id);
     void notifyIdUpdate(const IFeature::FId& id, Feature* aFeature);
 
+    void blockIndexing(bool val);
+    bool isIndexingBlocked() const;
+
+    // Logs the time taken to add, remove and clear features
+    static void benchmarkMembership();
+
     virtual void setDocument(Document* aDocument);
     Document* getDocument();
 
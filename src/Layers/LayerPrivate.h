@@ -14,12 +14,64 @@ public:
 
         IndexingBlocked = false;
         VirtualsUpdatesBlocked = false;
+
+        Holes = 0;
     }
     ~LayerPrivate()
     {
     }
 
-    QList<Feature*> Features;
+    // Position of F in Slots, -1 if not in the layer
+    int slotOf(Feature* F) const
+    {
+        int i = F ? F->layerSlot() : -1;
+        if (i < 0 || i >= Slots.size() || Slots.at(i) != F)
+            return -1;
+        return i;
+    }
+
+    void addFeature(Feature* F)
+    {
+        // Bounds the room taken by holes that are never read back
+        if (Holes > Slots.size() / 2)
+            compact();
+        F->setLayerSlot(Slots.size());
+        Slots.push_back(F);
+    }
+
+    // Leaves a hole in the slot of F, so that removal is O(1) and keeps the order
+    bool removeFeature(Feature* F)
+    {
+        int i = slotOf(F);
+        if (i == -1)
+            return false;
+        Slots[i] = NULL;
+        ++Holes;
+        while (!Slots.isEmpty() && !Slots.last()) {
+            Slots.removeLast();
+            --Holes;
+        }
+        F->setLayerSlot(-1);
+        return true;
+    }
+
+    int count() const
+    {
+        return Slots.size() - Holes;
+    }
+
+    // The features in the order they were added, without holes
+    const QList<Feature*>& features() const
+    {
+        if (Holes)
+            compact();
+        return Slots;
+    }
+
+    // Each feature knows its slot, see Feature::layerSlot()
+    mutable QList<Feature*> Slots;
+    // Removed features not yet squeezed out of Slots
+    mutable int Holes;
     QHash<qint64, MapFeaturePtr> IdMap;
 
     QString Name;
@@ -35,6 +87,21 @@ public:
     int dirtyLevel;
 
     Document* theDocument;
+
+private:
+    void compact() const
+    {
+        int j = 0;
+        for (int i=0; i<Slots.size(); ++i) {
+            Feature* F = Slots.at(i);
+            if (!F)
+                continue;
+            F->setLayerSlot(j);
+            Slots[j++] = F;
+        }
+        Slots.erase(Slots.begin() + j, Slots.end());
+        Holes = 0;
+    }
 };
 
 #endif // LAYERPRIVATE_H
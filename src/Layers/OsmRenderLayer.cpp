@@ -4,18 +4,40 @@
 
 #include "Document.h"
 #include "MapRenderer.h"
+#include "RenderList.h"
+#include "SvgCache.h"
 #include "MerkaartorPreferences.h"
 
 #if QT_VERSION >= 0x050000
 #include <QtConcurrent>
 #endif
 
+#include <QDataStream>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QSet>
+
+#include <algorithm>
+#include <math.h>
+
 inline uint qHash(const QPoint& p)
 {
     return (uint)(p.y() + (p.x() << 16));
 }
 
 #define TILE_SIZE 256
+/* Features are gathered from TILE_SURROUND times the tile size around it, and rendered with a
+ * TILE_MARGIN pixels margin, so that labels, icons and arrows straddling tile borders are complete */
+#define TILE_SURROUND 2.0
+#define TILE_MARGIN 64
+/* Tiles per side of the blocks whose labels are placed together, see LabelDecisions */
+#define LABEL_BLOCK_TILES 8
+/* Labels placed, over all the blocks, beyond which the blocks out of view are dropped */
+#define MAX_LABEL_DECISIONS 200000
+/* Steps of the zoom levels and of the pixel per meter, in log scale */
+#define TILE_LEVEL_STEPS 65536.
+#define TILE_PPM_STEPS 100.
+
 QList<TILE_TYPE> tiles;
 QReadWriteLock tileLock; /* Protects 'tiles' variable */
 QReadWriteLock renderLock; /* Read locks indicate rendering threads, Write lock blocks them */
@@ -23,28 +45,347 @@ QReadWriteLock renderLock; /* Read locks indicate rendering threads, Write lock
 #define TILE_X(t) t.x()
 #define TILE_Y(t) t.y()
 
-class TileCache : public QObject
+struct TileKey
+{
+    qint64 level;
+    int ppm;
+    int x;
+    int y;
+
+    bool operator==(const TileKey& other) const
+    {
+        return x == other.x && y == other.y && level == other.level && ppm == other.ppm;
+    }
+};
+
+inline uint qHash(const TileKey& k)
+{
+    return (uint)(k.y + (k.x << 16)) ^ ::qHash(k.level) ^ (uint)(k.ppm << 24);
+}
+
+/* Block of a tile position, rounding down for negative ones too */
+static inline int blockOf(int tile)
+{
+    return tile >= 0 ? tile / LABEL_BLOCK_TILES : -((-tile - 1) / LABEL_BLOCK_TILES) - 1;
+}
+
+/* Rect intersection that also works with the empty boxes of nodes */
+static inline bool touches(const QRectF& a, const QRectF& b)
+{
+    QRectF na = a.normalized();
+    QRectF nb = b.normalized();
+    return na.left() <= nb.right() && nb.left() <= na.right() && na.top() <= nb.bottom() && nb.top() <= na.bottom();
+}
+
+/* Rendered tiles of all the zoom levels seen, with a memory budget and LRU eviction. Invalidated
+ * tiles are kept, and still drawn, until their replacement is rendered */
+class TileCache
+{
+public:
+    TileCache()
+        : bytes(0), useClock(0)
+    {
+#ifndef _MOBILE
+        maxBytes = 128*1024*1024; // 512 tiles
+#else
+        maxBytes = 32*1024*1024;
+#endif
+    }
+
+    // Whether there is an up to date tile
+    bool contains(const TileKey& k)
+    {
+        QMutexLocker lock(&mutex);
+        QHash<TileKey, Tile>::const_iterator it = theTiles.constFind(k);
+        return it != theTiles.constEnd() && !it.value().stale;
+    }
+
+    bool get(const TileKey& k, QImage& img)
+    {
+        QMutexLocker lock(&mutex);
+        QHash<TileKey, Tile>::iterator it = theTiles.find(k);
+        if (it == theTiles.end())
+            return false;
+        it.value().lastUse = ++useClock;
+        img = it.value().image;
+        return true;
+    }
+
+    // area is the box, in coordinates, of the features the tile was rendered from
+    void insert(const TileKey& k, const QImage& img, const QRectF& area)
+    {
+        QMutexLocker lock(&mutex);
+        Tile t;
+        t.image = img;
+        t.area = area;
+        t.lastUse = ++useClock;
+        t.stale = false;
+        QHash<TileKey, Tile>::iterator it = theTiles.find(k);
+        if (it != theTiles.end())
+            bytes -= it.value().image.byteCount();
+        theTiles.insert(k, t);
+        bytes += img.byteCount();
+        if (bytes > maxBytes)
+            evict();
+    }
+
+    // Marks stale the tiles rendered from features in these boxes
+    int invalidate(const QList<QRectF>& boxes)
+    {
+        if (boxes.isEmpty())
+            return 0;
+        QRectF all = boxes[0].normalized();
+        for (int i=1; i<boxes.size(); ++i)
+            all |= boxes[i].normalized();
+
+        QMutexLocker lock(&mutex);
+        int count = 0;
+        QHash<TileKey, Tile>::iterator it = theTiles.begin();
+        for (; it != theTiles.end(); ++it) {
+            Tile& t = it.value();
+            if (t.stale || !touches(t.area, all))
+                continue;
+            for (int i=0; i<boxes.size() && !t.stale; ++i)
+                t.stale = touches(t.area, boxes[i]);
+            if (t.stale)
+                ++count;
+        }
+        return count;
+    }
+
+    // Marks stale the tiles of a level at the tile positions
+    int invalidate(qint64 level, int ppm, const QSet<QPoint>& positions)
+    {
+        QMutexLocker lock(&mutex);
+        int count = 0;
+        foreach (const QPoint& pos, positions) {
+            TileKey k = { level, ppm, pos.x(), pos.y() };
+            QHash<TileKey, Tile>::iterator it = theTiles.find(k);
+            if (it == theTiles.end() || it.value().stale)
+                continue;
+            it.value().stale = true;
+            ++count;
+        }
+        return count;
+    }
+
+    // Marks stale the tiles of a level in the range of tile positions
+    int invalidate(qint64 level, int ppm, const QRect& range)
+    {
+        QMutexLocker lock(&mutex);
+        int count = 0;
+        QHash<TileKey, Tile>::iterator it = theTiles.begin();
+        for (; it != theTiles.end(); ++it) {
+            const TileKey& k = it.key();
+            if (k.level != level || k.ppm != ppm || it.value().stale || !range.contains(k.x, k.y))
+                continue;
+            it.value().stale = true;
+            ++count;
+        }
+        return count;
+    }
+
+    void clear()
+    {
+        QMutexLocker lock(&mutex);
+        theTiles.clear();
+        bytes = 0;
+    }
+
+private:
+    struct Tile {
+        QImage image;
+        QRectF area;
+        quint64 lastUse;
+        bool stale;
+    };
+
+    // Evicts the least recently used tiles down to 3/4 of the budget at once
+    void evict()
+    {
+        QVector<QPair<quint64, TileKey> > byUse;
+        byUse.reserve(theTiles.size());
+        QHash<TileKey, Tile>::const_iterator it = theTiles.constBegin();
+        for (; it != theTiles.constEnd(); ++it)
+            byUse.append(qMakePair(it.value().lastUse, it.key()));
+        std::sort(byUse.begin(), byUse.end(), lessUse);
+
+        for (int i=0; i<byUse.size() && bytes > maxBytes * 3 / 4; ++i) {
+            bytes -= theTiles.value(byUse[i].second).image.byteCount();
+            theTiles.remove(byUse[i].second);
+        }
+    }
+
+    static bool lessUse(const QPair<quint64, TileKey>& a, const QPair<quint64, TileKey>& b)
+    {
+        return a.first < b.first;
+    }
+
+    QMutex mutex;
+    QHash<TileKey, Tile> theTiles;
+    qint64 bytes;
+    qint64 maxBytes;
+    quint64 useClock;
+};
+
+/* Label decisions of the blocks of tiles of all the levels seen, keyed like the tiles but with the
+ * position of the block */
+class LabelBlocks
 {
 public:
-    TileCache(QObject* parent) : QObject(parent) {}
-    void insert(const TILE_TYPE& k, QImage* v)
+    LabelBlocks()
+    {
+    }
+    ~LabelBlocks()
     {
-        m_tileCache.insert(k, v);
+        clear();
     }
-    bool contains(const TILE_TYPE& k)
+
+    LabelDecisions* get(const TileKey& k) const
     {
-        return m_tileCache.contains(k);
+        return theBlocks.value(k);
+    }
+
+    LabelDecisions* getOrCreate(const TileKey& k)
+    {
+        LabelDecisions*& d = theBlocks[k];
+        if (!d) {
+            qreal size = TILE_SIZE * LABEL_BLOCK_TILES;
+            d = new LabelDecisions(QRectF(k.x * size, k.y * size, size, size));
+        }
+        return d;
+    }
+
+    // Marks stale the blocks whose labels may come from features in the boxes, in coordinates
+    void setStale(const QList<QRectF>& boxes, const Projection& aProjection, bool flipY)
+    {
+        QList<QRectF> projected;
+        for (int i=0; i<boxes.size(); ++i)
+            projected << QRectF(aProjection.project(boxes[i].topLeft()), aProjection.project(boxes[i].bottomRight()));
+
+        QHash<TileKey, LabelDecisions*>::iterator it = theBlocks.begin();
+        for (; it != theBlocks.end(); ++it) {
+            LabelDecisions* d = it.value();
+            // Pixels per projected unit of the level
+            qreal scaleX = pow(2., it.key().level / TILE_LEVEL_STEPS);
+            qreal scaleY = flipY ? -scaleX : scaleX;
+            for (int i=0; i<projected.size() && !d->isStale(); ++i) {
+                const QRectF& r = projected[i];
+                QRectF pixels(QPointF(r.left()*scaleX, r.top()*scaleY), QPointF(r.right()*scaleX, r.bottom()*scaleY));
+                if (touches(pixels.normalized().adjusted(-TILE_MARGIN, -TILE_MARGIN, TILE_MARGIN, TILE_MARGIN), d->area()))
+                    d->setStale();
+            }
+        }
+    }
+
+    // Once there are too many labels, drops the blocks but those kept; returns the dropped ones
+    QList<TileKey> trim(const QSet<TileKey>& keep)
+    {
+        QList<TileKey> dropped;
+        int count = 0;
+        foreach (LabelDecisions* d, theBlocks)
+            count += d->size();
+        if (count <= MAX_LABEL_DECISIONS)
+            return dropped;
+
+        QHash<TileKey, LabelDecisions*>::iterator it = theBlocks.begin();
+        while (it != theBlocks.end()) {
+            if (keep.contains(it.key())) {
+                ++it;
+                continue;
+            }
+            dropped << it.key();
+            delete it.value();
+            it = theBlocks.erase(it);
+        }
+        return dropped;
     }
-    QImage* get(const TILE_TYPE& k)
+
+    void clear()
     {
-        return m_tileCache[k];
+        qDeleteAll(theBlocks);
+        theBlocks.clear();
     }
 
 private:
-    QCache<const TILE_TYPE, QImage> m_tileCache;
+    QHash<TileKey, LabelDecisions*> theBlocks;
 };
 
-TileCache* tileCache;
+/* Places the labels of a block of tiles, from the features of all of them, see LabelDecisions. The
+ * tiles of the cache whose labels changed are added to changed */
+class DecideLabels
+{
+public:
+    DecideLabels(OsmRenderLayer* orl, QSet<QPoint>* aChanged, QMutex* aChangedLock)
+        : p(orl), changed(aChanged), changedLock(aChangedLock) { }
+
+    typedef void result_type;
+
+    void operator()(const QPoint& block)
+    {
+        if (p->renderCanceled.load() || !p->theDocument)
+            return;
+        if (!renderLock.tryLockForRead()) return;
+
+        TileKey key = { p->tileLevel, p->tilePpm, block.x(), block.y() };
+        LabelDecisions* decisions = p->theLabelBlocks->get(key);
+
+        // The same features and frame as the tiles, see RenderTile
+        int x1 = block.x() * LABEL_BLOCK_TILES, y1 = block.y() * LABEL_BLOCK_TILES;
+        QPointF projTL(x1*p->tileSizeCoordW, y1*p->tileSizeCoordH);
+        QPointF projBR((x1+LABEL_BLOCK_TILES)*p->tileSizeCoordW, (y1+LABEL_BLOCK_TILES)*p->tileSizeCoordH);
+        QPointF surround(p->tileSizeCoordW*(TILE_SURROUND-1)/2, p->tileSizeCoordH*(TILE_SURROUND-1)/2);
+        CoordBox area(p->theProjection.inverse2Coord(projTL - surround), p->theProjection.inverse2Coord(projBR + surround));
+
+        QElapsedTimer timer;
+        timer.start();
+
+        p->theDocument->lockPainters();
+        g_backend.delayDeletes();
+        RenderList theFeatures;
+        for (int i=0; i<p->theDocument->layerSize(); ++i)
+            g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, area, p->theProjection);
+
+        QPointF margin(p->tileSizeCoordW*TILE_MARGIN/TILE_SIZE, p->tileSizeCoordH*TILE_MARGIN/TILE_SIZE);
+        QRect screen(x1*TILE_SIZE - TILE_MARGIN, y1*TILE_SIZE - TILE_MARGIN,
+                     LABEL_BLOCK_TILES*TILE_SIZE + 2*TILE_MARGIN, LABEL_BLOCK_TILES*TILE_SIZE + 2*TILE_MARGIN);
+
+        QImage img(1, 1, QImage::Format_ARGB32_Premultiplied);
+        QPainter P(&img);
+        MapRenderer r;
+        r.gatherLabels(&P, theFeatures, QRectF(projTL - margin, projBR + margin), screen, p->PixelPerM, p->ROptions);
+        P.end();
+
+        bool fresh = decisions->isNew();
+        QVector<QRectF> moved = decisions->decide(r.theLabels.candidates(), screen.topLeft());
+        g_backend.resumeDeletes();
+        p->theDocument->unlockPainters();
+        renderLock.unlock();
+
+        if (g_Merk_Benchmark) {
+            QMutexLocker lock(&p->profileLock);
+            ++p->profileLabelBlocks;
+            p->profileLabelNs += timer.nsecsElapsed();
+        }
+
+        // No tile could show the labels of a new block yet
+        if (fresh || moved.isEmpty())
+            return;
+        QSet<QPoint> touched;
+        for (int i=0; i<moved.size(); ++i) {
+            const QRectF& b = moved[i];
+            for (int y=floor(b.top() / TILE_SIZE); y<=floor(b.bottom() / TILE_SIZE); ++y)
+                for (int x=floor(b.left() / TILE_SIZE); x<=floor(b.right() / TILE_SIZE); ++x)
+                    touched.insert(QPoint(x, y));
+        }
+        QMutexLocker lock(changedLock);
+        *changed += touched;
+    }
+
+    OsmRenderLayer* p;
+    QSet<QPoint>* changed;
+    QMutex* changedLock;
+};
 
 class RenderTile
 {
@@ -68,55 +409,74 @@ public:
 #endif
 #endif
 
-        if (!p->theDocument)
+        if (p->renderCanceled.load() || !p->theDocument)
             return;
 
+        TILE_TYPE tile = theTile;
+
+        const LabelDecisions* decisions = 0;
+        if (p->ROptions.options.testFlag(RendererOptions::NamesVisible)) {
+            TileKey block = { p->tileLevel, p->tilePpm, blockOf(TILE_X(tile)), blockOf(TILE_Y(tile)) };
+            decisions = p->theLabelBlocks->get(block);
+            // Its labels could not be placed: rendered next time, rather than cached without them
+            if (!decisions || decisions->isStale())
+                return;
+        }
+
         if (!renderLock.tryLockForRead()) return;
         p->theDocument->lockPainters();
 
-        TILE_TYPE tile = theTile;
-
-        QPointF projTL((TILE_X(tile)*p->tileSizeCoordW)+p->tileOriginCoord.x(), (TILE_Y(tile)*p->tileSizeCoordH)+p->tileOriginCoord.y());
-        QPointF projBR(((TILE_X(tile)+1)*p->tileSizeCoordW)+p->tileOriginCoord.x(), ((TILE_Y(tile)+1)*p->tileSizeCoordH)+p->tileOriginCoord.y());
-        QRectF projR(projTL, projBR);
+        QPointF projTL(TILE_X(tile)*p->tileSizeCoordW, TILE_Y(tile)*p->tileSizeCoordH);
+        QPointF projBR((TILE_X(tile)+1)*p->tileSizeCoordW, (TILE_Y(tile)+1)*p->tileSizeCoordH);
 
-#define TILE_SURROUND 2.0
-        qreal z = TILE_SURROUND * ((TILE_SIZE*TILE_SURROUND) / (p->theTransform.m11()*projR.width()*TILE_SURROUND));    // Adjust to main transform
-        qreal dlat = (projR.top()-projR.bottom())*(z-1)/2;
-        qreal dlon = (projR.right()-projR.left())*(z-1)/2;
-        projR.setBottom(projR.bottom()-dlat);
-        projR.setLeft(projR.left()-dlon);
-        projR.setTop(projR.top()+dlat);
-        projR.setRight(projR.right()+dlon);
-
-        Coord tl = p->theProjection.inverse2Coord(projR.topLeft());
-        Coord br = p->theProjection.inverse2Coord(projR.bottomRight());
+        QPointF surround(p->tileSizeCoordW*(TILE_SURROUND-1)/2, p->tileSizeCoordH*(TILE_SURROUND-1)/2);
+        Coord tl = p->theProjection.inverse2Coord(projTL - surround);
+        Coord br = p->theProjection.inverse2Coord(projBR + surround);
         CoordBox invalidRect(tl, br);
 
-        QMap<RenderPriority, QSet <Feature*> > theFeatures;
+        RenderList theFeatures;
+        QElapsedTimer timer;
+        timer.start();
 
         g_backend.delayDeletes();
         for (int i=0; i<p->theDocument->layerSize(); ++i)
             g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, invalidRect, p->theProjection);
+        qint64 gatherNs = timer.nsecsElapsed();
+        theFeatures.sort();
+        qint64 sortNs = timer.nsecsElapsed() - gatherNs;
 
-        QImage* img = new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32);
-        img->fill(Qt::transparent);
+        QImage img(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+        img.fill(Qt::transparent);
 
-        QPainter P(img);
+        QPointF margin(p->tileSizeCoordW*TILE_MARGIN/TILE_SIZE, p->tileSizeCoordH*TILE_MARGIN/TILE_SIZE);
+        QRectF projR(projTL - margin, projBR + margin);
+
+        QPainter P(&img);
         if (M_PREFS->getUseAntiAlias())
             P.setRenderHint(QPainter::Antialiasing);
         MapRenderer r;
-        r.render(&P, theFeatures, projR, /*QRect(0, 0, TILE_SIZE, TILE_SIZE)*/QRect(-((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, -((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, TILE_SIZE*TILE_SURROUND, TILE_SIZE*TILE_SURROUND), p->PixelPerM, p->ROptions);
+        r.setLabelDecisions(decisions);
+        r.render(&P, theFeatures, projR, QRect(-TILE_MARGIN, -TILE_MARGIN, TILE_SIZE+2*TILE_MARGIN, TILE_SIZE+2*TILE_MARGIN), p->PixelPerM, p->ROptions);
         P.end();
+        qint64 paintNs = timer.nsecsElapsed() - gatherNs - sortNs;
         g_backend.resumeDeletes();
         p->theDocument->unlockPainters();
         renderLock.unlock();
-        tileLock.lockForWrite();
-        tileCache->insert(tile, img);
+
+        TileKey key = { p->tileLevel, p->tilePpm, TILE_X(tile), TILE_Y(tile) };
+        p->theTileCache->insert(key, img, invalidRect);
+
+        if (g_Merk_Benchmark) {
+            QMutexLocker lock(&p->profileLock);
+            ++p->profileTiles;
+            p->profileFeatures += theFeatures.size();
+            p->profileGatherNs += gatherNs;
+            p->profileSortNs += sortNs;
+            p->profilePaintNs += paintNs;
+        }
 
         //            if (theFeatures.size())
-        //                img->save(QString("c:/temp/%1-%2.png").arg(tile.x()).arg(tile.y()));
-        tileLock.unlock();
+        //                img.save(QString("c:/temp/%1-%2.png").arg(tile.x()).arg(tile.y()));
     }
 
     OsmRenderLayer* p;
@@ -127,14 +487,30 @@ public:
 OsmRenderLayer::OsmRenderLayer(QObject *parent)
     : QObject(parent)
     , theDocument(0)
+    , tileLevel(0), tilePpm(0)
+    , tileSizeCoordW(1.), tileSizeCoordH(-1.)
+    , theTileCache(new TileCache)
+    , theLabelBlocks(new LabelBlocks)
+    , tileRevision(0)
+    , profileTiles(0), profileFeatures(0)
+    , profileGatherNs(0), profileSortNs(0), profilePaintNs(0)
+    , profileLabelBlocks(0), profileLabelNs(0)
 {
-    tileCache = new TileCache(this);
+    connect(&(renderGatheringWatcher), SIGNAL(finished()), SLOT(logRenderProfile()));
     connect(&(renderGatheringWatcher), SIGNAL(finished()), SIGNAL(renderingDone()));
 }
 
+OsmRenderLayer::~OsmRenderLayer()
+{
+    cancelRendering();
+    delete theTileCache;
+    delete theLabelBlocks;
+}
+
 void OsmRenderLayer::setDocument(Document *aDocument)
 {
     theDocument = aDocument;
+    tileContext.clear();
 }
 
 void OsmRenderLayer::setTransform(const QTransform &aTransform)
@@ -148,16 +524,162 @@ void OsmRenderLayer::setProjection(const Projection& aProjection)
     theProjection = aProjection;
 }
 
-void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions)
+QByteArray OsmRenderLayer::renderContext() const
+{
+    QByteArray context;
+    QDataStream out(&context, QIODevice::WriteOnly);
+
+    out << (quintptr)theDocument;
+    out << theProjection.getProjectionType() << theProjection.getProjectionProj4() << theProjection.projectionRevision();
+    // Rotation and axis orientation
+    out << qRound64(atan2(theTransform.m12(), theTransform.m11()) * 1e6) << (theTransform.m22() < 0);
+    out << (int)(ROptions.options & ~RendererOptions::Interacting) << (int)ROptions.arrowOptions;
+    out << theDocument->paintersRevision() << theDocument->filterRevision();
+    out << M_PREFS->getUseAntiAlias() << M_PREFS->getAreaOpacity() << M_PREFS->getNodeSize() << M_PREFS->getRegionalZoom();
+    out << M_PREFS->getUseShapefileForBackground() << M_PREFS->getBackgroundOverwriteStyle() << M_PREFS->getBgColor();
+    out << M_PREFS->getSimpleGpxTrack() << M_PREFS->getGpxTrackWidth() << M_PREFS->getGpxTrackColor();
+    for (int i=0; i<theDocument->layerSize(); ++i) {
+        Layer* L = theDocument->getLayer(i);
+        out << (quintptr)L << L->isVisible() << L->isEnabled() << L->isReadonly() << L->getAlpha();
+    }
+    return context;
+}
+
+void OsmRenderLayer::syncTileCache()
 {
-    if (renderGathering.isRunning()) {
-        renderGathering.cancel();
-        renderGathering.waitForFinished();
+    QByteArray context = renderContext();
+    quint32 revision = g_backend.changeRevision();
+    if (context != tileContext) {
+        clearTiles();
+        tileContext = context;
+    } else if (revision != tileRevision) {
+        QList<QRectF> boxes;
+        if (!g_backend.changesSince(tileRevision, boxes))
+            clearTiles();
+        else {
+            theTileCache->invalidate(boxes);
+
+            /* The labels of the blocks around the changes are placed again before their tiles are
+             * drawn; the tiles whose labels then change are rendered again, see DecideLabels */
+            theLabelBlocks->setStale(boxes, theProjection, theTransform.m22() < 0);
+        }
     }
+    tileRevision = revision;
+}
+
+void OsmRenderLayer::clearTiles()
+{
+    theTileCache->clear();
+    theLabelBlocks->clear();
+}
+
+/* The blocks of the viewport whose labels are to be placed before the tiles are rendered */
+QList<QPoint> OsmRenderLayer::labelBlocksToDecide()
+{
+    QList<QPoint> blocks;
+    if (!theDocument || !ROptions.options.testFlag(RendererOptions::NamesVisible))
+        return blocks;
+
+    QSet<TileKey> inView;
+    for (int y=blockOf(tileViewport.top()); y<=blockOf(tileViewport.bottom()); ++y)
+        for (int x=blockOf(tileViewport.left()); x<=blockOf(tileViewport.right()); ++x) {
+            TileKey key = { tileLevel, tilePpm, x, y };
+            inView.insert(key);
+            if (theLabelBlocks->getOrCreate(key)->isStale())
+                blocks << QPoint(x, y);
+        }
+
+    // The tiles of a dropped block go with it, as its labels will be placed anew
+    QList<TileKey> dropped = theLabelBlocks->trim(inView);
+    for (int i=0; i<dropped.size(); ++i) {
+        const TileKey& k = dropped[i];
+        theTileCache->invalidate(k.level, k.ppm, QRect(k.x*LABEL_BLOCK_TILES, k.y*LABEL_BLOCK_TILES, LABEL_BLOCK_TILES, LABEL_BLOCK_TILES));
+    }
+    return blocks;
+}
+
+/* Starts placing the labels of the blocks that need it, then rendering the tiles, on the thread pool */
+void OsmRenderLayer::dispatchRendering()
+{
+    QList<QPoint> blocks = labelBlocksToDecide();
+    if (tiles.isEmpty() && blocks.isEmpty())
+        return;
+    renderGathering = QtConcurrent::run(this, &OsmRenderLayer::renderTiles, tiles, blocks);
+    renderGatheringWatcher.setFuture(renderGathering);
+}
+
+/* The labels of the blocks, in parallel, then the tiles, with the cached ones in view whose labels
+ * changed */
+void OsmRenderLayer::renderTiles(QList<QPoint> theTiles, QList<QPoint> theBlocks)
+{
+    if (theBlocks.size()) {
+        QSet<QPoint> changed;
+        QMutex changedLock;
+        QtConcurrent::blockingMap(theBlocks, DecideLabels(this, &changed, &changedLock));
+
+        if (changed.size()) {
+            theTileCache->invalidate(tileLevel, tilePpm, changed);
+            QSet<QPoint> pending = theTiles.toSet();
+            foreach (const QPoint& t, changed)
+                if (tileViewport.contains(t) && !pending.contains(t))
+                    theTiles << t;
+        }
+    }
+    if (!renderCanceled.load())
+        QtConcurrent::blockingMap(theTiles, RenderTile(this));
+}
+
+void OsmRenderLayer::cancelRendering()
+{
+    if (!renderGathering.isRunning())
+        return;
+    renderCanceled.store(1);
+    renderGathering.waitForFinished();
+    renderCanceled.store(0);
+}
+
+void OsmRenderLayer::updateTileViewport()
+{
+    QPointF tl = projRect.topLeft();
+    QPointF br = projRect.bottomRight();
+    int x1 = floor(tl.x() / tileSizeCoordW), x2 = floor(br.x() / tileSizeCoordW);
+    int y1 = floor(tl.y() / tileSizeCoordH), y2 = floor(br.y() / tileSizeCoordH);
+    tileViewport.setLeft(qMin(x1, x2) - 1);
+    tileViewport.setRight(qMax(x1, x2) + 1);
+    tileViewport.setTop(qMin(y1, y2) - 1);
+    tileViewport.setBottom(qMax(y1, y2) + 1);
+
+    tiles.clear();
+    for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
+        for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
+            TileKey key = { tileLevel, tilePpm, j, i };
+            if (!theTileCache->contains(key))
+                tiles << TILE_CONSTRUCTOR(j, i);
+        }
+}
+
+QRect OsmRenderLayer::tileScreenRect(int x, int y) const
+{
+    // Rounding both edges keeps neighbouring tiles seamless
+    QPointF a = theTransform.map(QPointF(x*tileSizeCoordW, y*tileSizeCoordH));
+    QPointF b = theTransform.map(QPointF((x+1)*tileSizeCoordW, (y+1)*tileSizeCoordH));
+    return QRect(QPoint(qRound(qMin(a.x(), b.x())), qRound(qMin(a.y(), b.y()))),
+                 QPoint(qRound(qMax(a.x(), b.x()))-1, qRound(qMax(a.y(), b.y()))-1));
+}
+
+void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions)
+{
+    cancelRendering();
 
     if (!theDocument)
         return;
 
+    // Icons may only be evicted while no tile is being rendered, by any view
+    if (renderLock.tryLockForWrite()) {
+        IconCache::instance()->maintain();
+        renderLock.unlock();
+    }
+
     if (!renderLock.tryLockForRead()) return;
 
     setProjection(aProjection);
@@ -166,85 +688,52 @@ void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform
     PixelPerM = ppm;
     ROptions = roptions;
 
-    tileLock.lockForWrite();
-    tileCache->deleteLater();
-    tileCache = new TileCache(this);
-    tileOriginCoord = theInvertedTransform.map(QPointF(rect.topLeft()));
+    syncTileCache();
+
+    // Snap the scale to its level, so that the tiles of a level share one grid
+    tileLevel = qRound64(log(fabs(theTransform.m11())) / log(2.) * TILE_LEVEL_STEPS);
+    tilePpm = ppm > 0 ? qRound(log(ppm) * TILE_PPM_STEPS) : 0;
+    tileSizeCoordW = TILE_SIZE / pow(2., tileLevel / TILE_LEVEL_STEPS);
+    tileSizeCoordH = theTransform.m22() < 0 ? -tileSizeCoordW : tileSizeCoordW;
 
     QPointF tl = theInvertedTransform.map(QPointF(rect.topLeft()));
     QPointF br = theInvertedTransform.map(QPointF(rect.bottomRight())+QPointF(1,1));
     projRect = QRectF(tl, br);
 
-    tileSizeCoordW = (projRect.width()) / rect.width() * TILE_SIZE;
-    //            tileSizeCoordH = (projRect.height()) / rect.height() * TILE_SIZE;
-    tileSizeCoordH = tileSizeCoordW * projRect.height() / fabs(projRect.height());
-
-    tileViewport.setLeft(((projRect.left()-tileOriginCoord.x()) / tileSizeCoordW) - 1);
-    tileViewport.setTop(((projRect.top()-tileOriginCoord.y()) / tileSizeCoordH) - 1);
-    tileViewport.setRight(((projRect.right()-tileOriginCoord.x()) / tileSizeCoordW) + 1);
-    tileViewport.setBottom(((projRect.bottom()-tileOriginCoord.y()) / tileSizeCoordH) + 1);
-
-    tiles.clear();
-    for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
-        for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
-            TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
-            tiles << tile;
-        }
+    tileLock.lockForWrite();
+    updateTileViewport();
+    dispatchRendering();
     tileLock.unlock();
 
-    if (tiles.size()) {
-        renderGathering = QtConcurrent::map(tiles, RenderTile(this));
-        renderGatheringWatcher.setFuture(renderGathering);
-    }
-
     renderLock.unlock();
 }
 
 void OsmRenderLayer::pan(QPoint delta)
 {
-    if (renderGathering.isRunning()) {
-        renderGathering.cancel();
-        renderGathering.waitForFinished();
-    }
+    cancelRendering();
 
     theTransform.translate((qreal)(delta.x())/theTransform.m11(), (qreal)(delta.y())/theTransform.m22());
     theInvertedTransform = theTransform.inverted();
 
     projRect.translate(-(qreal)(delta.x())/theTransform.m11(), -(qreal)(delta.y())/theTransform.m22());
 
-    tileViewport.setLeft(((projRect.left()-tileOriginCoord.x()) / tileSizeCoordW) - 1);
-    tileViewport.setTop(((projRect.top()-tileOriginCoord.y()) / tileSizeCoordH) - 1);
-    tileViewport.setRight(((projRect.right()-tileOriginCoord.x()) / tileSizeCoordW) + 1);
-    tileViewport.setBottom(((projRect.bottom()-tileOriginCoord.y()) / tileSizeCoordH) + 1);
+    if (theDocument)
+        syncTileCache();
 
-    tileLock.lockForRead();
-    tiles.clear();
-    for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
-        for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
-            TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
-            if (!tileCache->contains(tile))
-                tiles << tile;
-        }
+    tileLock.lockForWrite();
+    updateTileViewport();
+    dispatchRendering();
     tileLock.unlock();
-
-    if (tiles.size()) {
-        renderGathering = QtConcurrent::map(tiles, RenderTile(this));
-        renderGatheringWatcher.setFuture(renderGathering);
-    }
 }
 
 void OsmRenderLayer::drawImage(QPainter *P)
 {
-    QPointF origin = theTransform.map(tileOriginCoord);
+    QImage img;
     for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
         for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
-            tileLock.lockForRead();
-            if (tileCache->contains(TILE_CONSTRUCTOR(j, i))) {
-                QPointF tl = QPointF((j*TILE_SIZE)+origin.x(), (i*TILE_SIZE)+origin.y());
-                P->drawImage(tl, *(tileCache->get(TILE_CONSTRUCTOR(j, i))));
-            }
-            tileLock.unlock();
-            //            qDebug() << QPoint(j, i) << tl;
+            TileKey key = { tileLevel, tilePpm, j, i };
+            if (theTileCache->get(key, img))
+                P->drawImage(tileScreenRect(j, i), img);
         }
 }
 
@@ -253,6 +742,32 @@ bool OsmRenderLayer::isRenderingDone()
     return renderGathering.isFinished();
 }
 
+void OsmRenderLayer::waitForRendering()
+{
+    renderGathering.waitForFinished();
+}
+
+void OsmRenderLayer::clearCache()
+{
+    cancelRendering();
+    clearTiles();
+}
+
+void OsmRenderLayer::logRenderProfile()
+{
+    QMutexLocker lock(&profileLock);
+    if (!profileTiles && !profileLabelBlocks)
+        return;
+    qDebug() << "Tile rendering:" << profileTiles << "tiles," << profileFeatures << "features;"
+             << "gather" << profileGatherNs / 1000000. << "ms, sort" << profileSortNs / 1000000.
+             << "ms, paint" << profilePaintNs / 1000000. << "ms;"
+             << "labels of" << profileLabelBlocks << "blocks" << profileLabelNs / 1000000. << "ms";
+    profileTiles = profileFeatures = 0;
+    profileGatherNs = profileSortNs = profilePaintNs = 0;
+    profileLabelBlocks = 0;
+    profileLabelNs = 0;
+}
+
 void OsmRenderLayer::stopRendering() {
     renderLock.lockForWrite();
 }
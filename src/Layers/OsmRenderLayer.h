@@ -2,26 +2,36 @@
 #define OSMRENDERLAYER_H
 
 #include <QObject>
+#include <QAtomicInt>
+#include <QList>
+#include <QPoint>
 #include <QRect>
 #include <QPointF>
 #include <QFuture>
 #include <QFutureWatcher>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
 #include <QTransform>
 
 #include "IRenderer.h"
 #include "Projection.h"
 
 class Document;
+class LabelBlocks;
 class Projection;
+class TileCache;
 
 class OsmRenderLayer : public QObject
 {
     Q_OBJECT
 
     friend class RenderTile;
+    friend class DecideLabels;
 
 public:
     OsmRenderLayer(QObject*parent=0);
+    ~OsmRenderLayer();
     void setDocument(Document *aDocument);
     void setTransform(const QTransform& aTransform);
     void setProjection(const Projection& aProjection);
@@ -31,6 +41,8 @@ public:
     void drawImage(QPainter* P);
 
     bool isRenderingDone();
+    void waitForRendering();
+    void clearCache();
 
     void stopRendering();
     void resumeRendering();
@@ -38,16 +50,51 @@ public:
 signals:
     void renderingDone();
 
+private slots:
+    void logRenderProfile();
+
 protected:
+    QByteArray renderContext() const;
+    void syncTileCache();
+    void clearTiles();
+    QList<QPoint> labelBlocksToDecide();
+    void dispatchRendering();
+    void renderTiles(QList<QPoint> theTiles, QList<QPoint> theBlocks);
+    void cancelRendering();
+    void updateTileViewport();
+    QRect tileScreenRect(int x, int y) const;
+
     Document* theDocument;
 
     QRectF projRect;
+    /* Tiles are laid on a grid anchored at the projection origin, one grid per zoom level so that they
+     * survive pans and zooms; tileLevel is the log2 of the scale in 1/65536 steps */
+    qint64 tileLevel;
+    int tilePpm;
     qreal tileSizeCoordW;
     qreal tileSizeCoordH;
-    QPointF tileOriginCoord;
     QRect tileViewport;
 
+    TileCache* theTileCache;
+    /* Labels placed on the tiles, by block of tiles of each level */
+    LabelBlocks* theLabelBlocks;
+    /* What, besides the features in their area, the cached tiles depend on */
+    QByteArray tileContext;
+    quint32 tileRevision;
+
+    /* Totals of the tiles rendered since the last batch finished, logged with --benchmark */
+    QMutex profileLock;
+    int profileTiles;
+    qint64 profileFeatures;
+    qint64 profileGatherNs;
+    qint64 profileSortNs;
+    qint64 profilePaintNs;
+    int profileLabelBlocks;
+    qint64 profileLabelNs;
+
     QFuture<void> renderGathering;
+    // Set to stop the labels and tiles not started yet
+    QAtomicInt renderCanceled;
     QFutureWatcher<void> renderGatheringWatcher;
 
     QTransform theTransform;
@@ -44,6 +44,8 @@ void showHelp()
     fprintf(stdout, "  --ignore-preferences\t\tIgnore saved preferences\n");
     fprintf(stdout, "  --reset-preferences\t\tReset saved preferences to default\n");
     fprintf(stdout, "  --ignore-startup-template\t\tIgnore the saved startup template document and start with a new document\n");
+    fprintf(stdout, "  --benchmark\t\tLog timings of data loading, indexing and redrawing\n");
+    fprintf(stdout, "  --import-threads n\t\tNumber of threads (de)compressing PBF files (default: one less than the number of cores, at least one)\n");
     fprintf(stdout, "  [filenames]\t\tOpen designated files \n");
 }
 
@@ -98,6 +100,10 @@ int main(int argc, char** argv)
             g_Merk_IgnoreStartupTemplate = true;
         } else if (argsIn[i] == "--selfclip") {
             g_Merk_SelfClip = true;
+        } else if (argsIn[i] == "--benchmark") {
+            g_Merk_Benchmark = true;
+        } else if (argsIn[i] == "--import-threads" && i+1 < argsIn.size()) {
+            g_Merk_ImportThreads = argsIn[++i].toInt();
         } else
             argsOut << argsIn[i];
     }
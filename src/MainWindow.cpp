@@ -408,6 +408,10 @@ MainWindow::MainWindow(QWidget *parent)
     ui->renderSVGAction->setVisible(false);
 #endif
 
+#ifndef USE_PROTOBUF
+    ui->exportPBFAction->setVisible(false);
+#endif
+
 #ifndef GEOIMAGE
     ui->windowGeoimageAction->setVisible(false);
     ui->viewPhotosAction->setVisible(false);
@@ -509,6 +513,14 @@ void MainWindow::handleMessage(const QString &msg)
 
     if (fileNames.size() > 0) {
         importFiles(theDocument, fileNames, NULL);
+        if (g_Merk_Benchmark) {
+            Relation::benchmarkPaths(theDocument, theView->projection());
+            theView->benchmarkEdits();
+        }
+    }
+    if (g_Merk_Benchmark) {
+        Layer::benchmarkMembership();
+        DirtyListExecutorOSC::benchmark();
     }
 }
 
@@ -3346,6 +3358,28 @@ void MainWindow::on_exportOSMAction_triggered()
     deleteProgressDialog();
 }
 
+void MainWindow::on_exportPBFAction_triggered()
+{
+#ifdef USE_PROTOBUF
+    QList<Feature*> theFeatures;
+
+    createProgressDialog();
+    if (!selectExportedFeatures(theFeatures))
+        return;
+
+    QString path;
+    if (getPathToSave(tr("Export PBF"), "pbf", tr("Protobuf Binary Format (*.pbf)") + "\n" + tr("All Files (*)"), &path)) {
+        startBusyCursor();
+        ImportExportPBF pbf(document());
+        bool OK = pbf.saveFile(path) && pbf.export_(theFeatures);
+        endBusyCursor();
+        if (!OK)
+            QMessageBox::warning(this, tr("Export PBF"), tr("%1 could not be written.").arg(path));
+    }
+    deleteProgressDialog();
+#endif
+}
+
 void MainWindow::on_exportOSCAction_triggered()
 {
 #ifndef FRISIUS_BUILD
@@ -155,6 +155,7 @@ public slots:
     virtual void on_mapStyleSaveAsAction_triggered();
     virtual void on_mapStyleLoadAction_triggered();
     virtual void on_exportOSMAction_triggered();
+    virtual void on_exportPBFAction_triggered();
     virtual void on_exportOSCAction_triggered();
     virtual void on_exportGPXAction_triggered();
     virtual void on_exportKMLAction_triggered();
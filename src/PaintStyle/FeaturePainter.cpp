@@ -5,6 +5,8 @@
 #include "Features.h"
 #include "LineF.h"
 #include "SvgCache.h"
+#include "GlyphCache.h"
+#include "LabelPlacement.h"
 
 #include <QtCore/QString>
 #include <QtGui/QPainter>
@@ -18,11 +20,11 @@
 #define JOINSTYLE Qt::RoundJoin
 
 FeaturePainter::FeaturePainter()
-: Painter(), theTagSelector(0){
+: Painter(), theTagSelector(0), IconId(0){
 }
 
 FeaturePainter::FeaturePainter(const FeaturePainter& f)
-: Painter(f), theTagSelector(0)
+: Painter(f), theTagSelector(0), IconId(f.IconId)
 {
     if (f.theTagSelector)
         theTagSelector = f.theTagSelector->copy();
@@ -76,14 +78,16 @@ FeaturePainter& FeaturePainter::operator=(const FeaturePainter& f)
     LabelBackgroundTag = f.LabelBackgroundTag;
     LabelHalo = f.LabelHalo;
     LabelArea = f.LabelArea;
+    IconId = f.IconId;
     return *this;
 }
 
 FeaturePainter::FeaturePainter(const Painter& f)
-: Painter(f), theTagSelector(0)
+: Painter(f), theTagSelector(0), IconId(0)
 {
     if (!f.theSelector.isEmpty())
         theTagSelector = TagSelector::parse(f.theSelector);
+    loadIcon();
 }
 
 FeaturePainter& FeaturePainter::operator=(const Painter& f)
@@ -133,9 +137,21 @@ FeaturePainter& FeaturePainter::operator=(const Painter& f)
     LabelBackgroundTag = f.LabelBackgroundTag;
     LabelHalo = f.LabelHalo;
     LabelArea = f.LabelArea;
+    loadIcon();
     return *this;
 }
 
+/* Registers the icon, and rasterizes it now if its size does not depend on the zoom */
+void FeaturePainter::loadIcon()
+{
+    IconId = 0;
+    if (IconName.isEmpty() || !(DrawIcon || ForegroundFillUseIcon))
+        return;
+    IconId = IconCache::instance()->iconId(IconName);
+    if (IconScale == 0 && IconOffset >= 0)
+        IconCache::instance()->preload(IconId, int(IconOffset));
+}
+
 FeaturePainter::~FeaturePainter()
 {
     delete theTagSelector;
@@ -287,9 +303,9 @@ void FeaturePainter::drawBackground(Way* R, QPainter* thePainter, MapRenderer* t
                 qreal PixelPerM = theRenderer->thePixelPerM;
                 qreal WW = PixelPerM*IconScale+IconOffset;
 
-                QImage* pm = getSVGImageFromFile(IconName,int(WW));
-                if (pm && !pm->isNull()) {
-                    thePainter->setBrush(*pm);
+                QImage pm = IconCache::instance()->image(IconId, int(WW));
+                if (!pm.isNull()) {
+                    thePainter->setBrush(pm);
                 }
             }
         } else if (ForegroundFill) {
@@ -370,9 +386,9 @@ void FeaturePainter::drawBackground(Relation* R, QPainter* thePainter, MapRender
             qreal PixelPerM = theRenderer->thePixelPerM;
             qreal WW = PixelPerM*IconScale+IconOffset;
 
-            QImage* pm = getSVGImageFromFile(IconName,int(WW));
-            if (pm && !pm->isNull()) {
-                thePainter->setBrush(*pm);
+            QImage pm = IconCache::instance()->image(IconId, int(WW));
+            if (!pm.isNull()) {
+                thePainter->setBrush(pm);
             }
         }
     } else if (ForegroundFill) {
@@ -471,13 +487,13 @@ void FeaturePainter::drawTouchup(Node* Pt, QPainter* thePainter, MapRenderer* th
             qreal PixelPerM = theRenderer->thePixelPerM;
             qreal WW = PixelPerM*IconScale+IconOffset;
 
-            QImage* pm = getSVGImageFromFile(IconName,int(WW));
-            if (pm && !pm->isNull()) {
+            QImage pm = IconCache::instance()->image(IconId, int(WW));
+            if (!pm.isNull()) {
                 IconOK = true;
                 QPointF C(theRenderer->theTransform.map(Pt->projected()));
                 // cbro-20090109: Don't draw the dot if there is an icon
                 // thePainter->fillRect(QRect(C-QPoint(2,2),QSize(4,4)),QColor(0,0,0,128));
-                thePainter->drawImage( int(C.x()-pm->width()/2), int(C.y()-pm->height()/2) , *pm);
+                thePainter->drawImage( int(C.x()-pm.width()/2), int(C.y()-pm.height()/2) , pm);
             }
         }
         if (!IconOK)
@@ -535,12 +551,12 @@ void FeaturePainter::drawTouchup(Way* R, QPainter* thePainter, MapRenderer* theR
             qreal PixelPerM = theRenderer->thePixelPerM;
             qreal WW = PixelPerM*IconScale+IconOffset;
 
-            QImage* pm = getSVGImageFromFile(IconName,int(WW));
-            if (pm && !pm->isNull()) {
+            QImage pm = IconCache::instance()->image(IconId, int(WW));
+            if (!pm.isNull()) {
                 R->getLock();
                 QPointF C(theRenderer->theTransform.map(R->getPath().boundingRect().center()));
                 R->releaseLock();
-                thePainter->drawImage( int(C.x()-pm->width()/2), int(C.y()-pm->height()/2) , *pm);
+                thePainter->drawImage( int(C.x()-pm.width()/2), int(C.y()-pm.height()/2) , pm);
             }
         }
     }
@@ -605,7 +621,7 @@ void FeaturePainter::drawTouchup(Way* R, QPainter* thePainter, MapRenderer* theR
 #define BG_SPACING 6
 #define BG_PEN_SZ 2
 
-void FeaturePainter::drawPointLabel(QPointF C, QString str, QString strBg, QPainter* thePainter, MapRenderer* theRenderer) const
+void FeaturePainter::drawPointLabel(const Feature* F, QPointF C, QString str, QString strBg, QPainter* thePainter, MapRenderer* theRenderer) const
 {
     LineParameters lp = labelBoundary();
     qreal PixelPerM = theRenderer->thePixelPerM;
@@ -614,56 +630,40 @@ void FeaturePainter::drawPointLabel(QPointF C, QString str, QString strBg, QPain
 
     QFont font = getLabelFont();
     font.setPixelSize(int(WW));
-    QFontMetrics metrics(font);
 
-    int modX = 0;
-    int modY = 0;
-    QPainterPath textPath;
-    QPainterPath bgPath;
-
-    if (!str.isEmpty()) {
-        modX = - (metrics.width(str)/2);
-        if (DrawIcon && !IconName.isEmpty() )
-        {
-            QImage pm(IconName);
-            modY = - pm.height();
-            if (DrawLabelBackground)
-                modY -= BG_SPACING;
-        }
-        textPath.addText(modX, modY, font, str);
-        thePainter->translate(C);
+    qreal modY = 0;
+    if (DrawIcon && !IconName.isEmpty() )
+    {
+        modY = - IconCache::instance()->image(IconId, 0).height();
+        if (DrawLabelBackground)
+            modY -= BG_SPACING;
     }
-    if (DrawLabelBackground && !strBg.isEmpty()) {
-        modX = - (metrics.width(strBg)/2);
-        if (DrawIcon && !IconName.isEmpty() )
-        {
-            QImage pm(IconName);
-            modY = - pm.height();
-            if (DrawLabelBackground)
-                modY -= BG_SPACING;
-        }
 
-        textPath.addText(modX, modY, font, strBg);
-        thePainter->translate(C);
+    LabelCandidate label;
+    label.feature = F;
+    label.importance = WW;
+    label.color = LabelColor;
+    label.opacity = thePainter->opacity();
+    if (getLabelHalo())
+        label.haloWidth = font.pixelSize()/5;
 
-        bgPath.addRect(textPath.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING));
-        thePainter->setPen(QPen(LabelColor, BG_PEN_SZ));
-        thePainter->setBrush(LabelBackgroundColor);
-        thePainter->drawPath(bgPath);
-    }
-    if (getLabelHalo()) {
-        thePainter->setPen(QPen(Qt::white, font.pixelSize()/5));
-        thePainter->drawPath(textPath);
+    if (!str.isEmpty()) {
+        GlyphCache::Glyph g = GlyphCache::instance()->text(font, str);
+        label.text.addPath(g.outline.translated(C.x() - int(g.advance/2), C.y() + modY));
     }
-    thePainter->setPen(Qt::NoPen);
-    thePainter->setBrush(LabelColor);
-    thePainter->drawPath(textPath);
-
     if (DrawLabelBackground && !strBg.isEmpty()) {
-        QRegion rg = thePainter->clipRegion();
-        rg -= textPath.boundingRect().toRect().translated(C.toPoint());
-        thePainter->setClipRegion(theRenderer->theTransform.map(rg));
+        GlyphCache::Glyph g = GlyphCache::instance()->text(font, strBg);
+        label.text.addPath(g.outline.translated(C.x() - int(g.advance/2), C.y() + modY));
+        label.background.addRect(label.text.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING));
+        label.backgroundColor = LabelBackgroundColor;
     }
+    if (label.text.isEmpty())
+        return;
+
+    QRectF box = label.background.isEmpty() ? label.text.boundingRect() : label.background.boundingRect();
+    label.boxes.append(box.adjusted(-label.haloWidth/2, -label.haloWidth/2, label.haloWidth/2, label.haloWidth/2));
+    if (theRenderer->theLabels.isNear(label.boxes[0]))
+        theRenderer->theLabels.add(label);
 }
 
 
@@ -679,7 +679,7 @@ void FeaturePainter::drawLabel(Node* Pt, QPainter* thePainter, MapRenderer* theR
         return;
 
     QPointF C(theRenderer->theTransform.map(Pt->projected()));
-    drawPointLabel(C, str, strBg, thePainter, theRenderer);
+    drawPointLabel(Pt, C, str, strBg, thePainter, theRenderer);
 }
 
 void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRenderer) const
@@ -696,9 +696,7 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
         R->getLock();
         QPointF C(theRenderer->theTransform.map(R->getPath().boundingRect().center()));
         R->releaseLock();
-//        if (rg.contains(C.toPoint())) {
-            drawPointLabel(C, str, strBg, thePainter, theRenderer);
-//        }
+        drawPointLabel(R, C, str, strBg, thePainter, theRenderer);
         return;
     }
 
@@ -706,128 +704,99 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
     qreal PixelPerM = theRenderer->thePixelPerM;
     qreal WW = PixelPerM*R->widthOf()*lp.Proportional+lp.Fixed;
     if (WW < 10 && !TEST_RFLAGS(RendererOptions::PrintAllLabels)) return;
-    //qreal WWR = qMax(PixelPerM*R->widthOf()*BackgroundScale+BackgroundOffset, PixelPerM*R->widthOf()*ForegroundScale+ForegroundOffset);
 
     R->getLock();
-    QPainterPath tranformedRoadPath = theRenderer->theTransform.map(R->getPath());
+    LabelPath roadPath(R->getPath().toSubpathPolygons(theRenderer->theTransform));
     R->releaseLock();
     QFont font = getLabelFont();
-//#if QT_VERSION >= 0x040700 || defined(FORCE_46)
-//    qreal pathSurface = tranformedRoadPath.controlPointRect().width() * tranformedRoadPath.controlPointRect().height();
-//    if (pathSurface > theRenderer->theScreen.width() * theRenderer->theScreen.height() * 3) {
-//        QPainterPath clipPath;
-//        clipPath.addRect(theRenderer->theScreen.adjusted(-500, -500, 500, 500));
-
-//        tranformedRoadPath = clipPath.intersected(tranformedRoadPath);
-//    }
-//#endif
+    font.setPixelSize(int(WW));
+    QFontMetricsF metrics(font);
+
+    LabelCandidate label;
+    label.feature = R;
+    label.importance = WW;
+    label.color = LabelColor;
+    label.opacity = thePainter->opacity();
+
+    if (!str.isEmpty() && (font.pixelSize() >= 5 || TEST_RFLAGS(RendererOptions::PrintAllLabels))) {
+        QVector<GlyphCache::Glyph> glyphs;
+        GlyphCache::instance()->glyphs(font, str, glyphs);
+        qreal strWidth = 0;
+        for (int i = 0; i < glyphs.size(); ++i)
+            strWidth += glyphs[i].advance;
+
+        if (roadPath.length() > strWidth) {
+            if (getLabelHalo())
+                label.haloWidth = font.pixelSize()/6;
+            qreal modY = (metrics.height()/2)-metrics.descent();
+            QRectF glyphBox(0, modY - metrics.ascent(), 0, metrics.height());
+            glyphBox.adjust(-label.haloWidth/2, -label.haloWidth/2, label.haloWidth/2, label.haloWidth/2);
+
+            int numSegment = int((roadPath.length() / ((strWidth * LABEL_PATH_DISTANCE))) - 0.5) + 1;
+            qreal lenSegment = roadPath.length() / numSegment;
+            for (int k = 0; k < numSegment; ++k) {
+                qreal startSegment = k * lenSegment;
+                qreal midAngle;
+                QPointF mid = roadPath.pointAt(startSegment + lenSegment/2, &midAngle);
+                if (!theRenderer->theLabels.isNear(QRectF(mid, mid).adjusted(-strWidth, -strWidth, strWidth, strWidth)))
+                    continue;
 
-    if (!str.isEmpty()) {
-        font.setPixelSize(int(WW));
-        QFontMetricsF metrics(font);
-        qreal strWidth = metrics.width(str);
-
-        if ((font.pixelSize() >= 5 || TEST_RFLAGS(RendererOptions::PrintAllLabels)) && tranformedRoadPath.length() > strWidth) {
-            thePainter->setFont(font);
-
-            int repeat = int((tranformedRoadPath.length() / ((strWidth * LABEL_PATH_DISTANCE))) - 0.5);
-            int numSegment = repeat+1;
-            qreal lenSegment = tranformedRoadPath.length() / numSegment;
-            qreal startSegment = 0;
-            QPainterPath textPath;
-            do {
                 qreal curLen = startSegment + ((lenSegment - strWidth) / 2);
                 int modIncrement = 1;
                 qreal modAngle = 0;
-                qreal modY = 0;
-                if (cos(angToRad(tranformedRoadPath.angleAtPercent((startSegment+(lenSegment/2))/tranformedRoadPath.length()))) < 0) {
+                if (cos(angToRad(midAngle)) < 0) {
                     modIncrement = -1;
                     modAngle = 180.0;
                     curLen += strWidth;
                 }
-                for (int i = 0; i < str.length(); ++i) {
-                    qreal t = tranformedRoadPath.percentAtLength(curLen);
-                    QPointF pt = tranformedRoadPath.pointAtPercent(t);
-
-//                    if (!theRenderer->theScreen.contains(pt.toPoint()))
-//                        continue;
 
-                    qreal angle = tranformedRoadPath.angleAtPercent(t);
-//                    modY = (metrics.ascent()/2)-3;
-                    modY = (metrics.height()/2)-metrics.descent();
+                label.order = k;
+                label.text = QPainterPath();
+                label.boxes.clear();
+                for (int i = 0; i < glyphs.size(); ++i) {
+                    qreal angle;
+                    QPointF pt = roadPath.pointAt(curLen, &angle);
 
-                    QMatrix m;
+                    QTransform m;
                     m.translate(pt.x(), pt.y());
-                    m.rotate(-angle+modAngle);
-
-                    QPainterPath charPath;
-                    charPath.addText(0, modY, font, str.mid(i, 1));
-                    charPath = charPath * m;
-
-                    textPath.addPath(charPath);
+                    m.rotate(angle+modAngle);
+                    m.translate(0, modY);
+                    label.text.addPath(m.map(glyphs[i].outline));
+                    label.boxes.append(m.mapRect(glyphBox.adjusted(0, 0, glyphs[i].advance, 0)));
 
-                    qreal incremenet = metrics.width(str[i]);
-                    curLen += (incremenet * modIncrement);
+                    curLen += (glyphs[i].advance * modIncrement);
                 }
-                startSegment += lenSegment;
-            } while (--repeat >= 0);
-
-            if (getLabelHalo()) {
-                thePainter->setPen(QPen(Qt::white, font.pixelSize()/6));
-                thePainter->drawPath(textPath);
+                theRenderer->theLabels.add(label);
             }
-            thePainter->setPen(Qt::NoPen);
-            thePainter->setBrush(LabelColor);
-            thePainter->drawPath(textPath);
         }
     }
     if (DrawLabelBackground && !strBg.isEmpty()) {
-        QRegion rg = thePainter->clipRegion();
-        font.setPixelSize(int(WW));
-        QFontMetrics metrics(font);
-        qreal strWidth = metrics.width(strBg);
-
-        int repeat = int((tranformedRoadPath.length() / (strWidth * LABEL_STRAIGHT_DISTANCE)) - 0.5);
-        int numSegment = repeat+1;
-        qreal lenSegment = tranformedRoadPath.length() / numSegment;
-        qreal startSegment = 0;
-        do {
-            int modX = 0;
-            int modY = 0;
-
-            qreal curLen = startSegment + (lenSegment / 2);
-            qreal t = tranformedRoadPath.percentAtLength(curLen);
-            QPointF pt = tranformedRoadPath.pointAtPercent(t);
-
-            modX = - (strWidth/2);
-            //modX = WW;
-            modY = (metrics.ascent()/2);
-
-            QPainterPath textPath, bgPath;
-            textPath.addText(modX, modY, font, strBg);
-            bgPath.addRect(textPath.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING));
-
-            if (rg.contains(bgPath.boundingRect().toRect().translated(pt.toPoint()))) {
-                thePainter->translate(pt);
-
-                thePainter->setPen(QPen(LabelColor, BG_PEN_SZ));
-                thePainter->setBrush(LabelBackgroundColor);
-                thePainter->drawPath(bgPath);
-
-                if (getLabelHalo()) {
-                    thePainter->setPen(QPen(Qt::white, font.pixelSize()/5));
-                    thePainter->drawPath(textPath);
-                }
-                thePainter->setPen(Qt::NoPen);
-                thePainter->setBrush(LabelColor);
-                thePainter->drawPath(textPath);
-
-                rg -= bgPath.boundingRect().toRect().translated(pt.toPoint());
-            }
-
-            startSegment += lenSegment;
-        } while (--repeat >= 0);
-
-        thePainter->setClipRegion(rg);
+        GlyphCache::Glyph g = GlyphCache::instance()->text(font, strBg);
+        qreal strWidth = g.advance;
+        QPainterPath textPath = g.outline.translated(- int(strWidth/2), int(metrics.ascent()/2));
+        QRectF bgRect = textPath.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING);
+
+        label.text = QPainterPath();
+        label.background = QPainterPath();
+        label.backgroundColor = LabelBackgroundColor;
+        label.haloWidth = getLabelHalo() ? font.pixelSize()/5 : 0;
+
+        int numSegment = int((roadPath.length() / (strWidth * LABEL_STRAIGHT_DISTANCE)) - 0.5) + 1;
+        qreal lenSegment = roadPath.length() / numSegment;
+        for (int k = 0; k < numSegment; ++k) {
+            qreal angle;
+            QPointF pt = roadPath.pointAt(k * lenSegment + (lenSegment / 2), &angle);
+            QRectF box = bgRect.translated(pt);
+            if (!theRenderer->theLabels.isNear(box))
+                continue;
+
+            label.order = numSegment + k;
+            label.text = textPath.translated(pt);
+            label.background = QPainterPath();
+            label.background.addRect(box);
+            label.boxes.clear();
+            label.boxes.append(box);
+            theRenderer->theLabels.add(label);
+        }
     }
 }
@@ -50,11 +50,17 @@ public:
     virtual void drawTouchup(Way* R, QPainter* thePainter, MapRenderer* theRender) const;
     virtual void drawTouchup(Node* R, QPainter* thePainter, MapRenderer* theRender) const;
     virtual void drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRender) const;
-    virtual void drawPointLabel(QPointF C, QString str, QString strBG, QPainter* thePainter, MapRenderer* theRender) const;
+    virtual void drawPointLabel(const Feature* F, QPointF C, QString str, QString strBG, QPainter* thePainter, MapRenderer* theRender) const;
     virtual void drawLabel(Node* Pt, QPainter* thePainter, MapRenderer* theRender) const;
 
 public:
     TagSelector* theTagSelector;
+
+private:
+    void loadIcon();
+
+    // In the IconCache
+    int IconId;
 };
 
 #endif
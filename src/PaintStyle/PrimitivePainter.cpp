@@ -220,10 +220,10 @@ void PrimitivePainter::drawTouchup(QPointF* Pt, QPainter* thePainter, qreal Pixe
         if (!IconName.isEmpty()) {
             qreal WW = PixelPerM*IconScale+IconOffset;
 
-            QImage* pm = getSVGImageFromFile(IconName,int(WW));
-            if (pm && !pm->isNull()) {
+            QImage pm = getSVGImageFromFile(IconName,int(WW));
+            if (!pm.isNull()) {
                 IconOK = true;
-                thePainter->drawImage( int(Pt->x()-pm->width()/2), int(Pt->y()-pm->height()/2) , *pm);
+                thePainter->drawImage( int(Pt->x()-pm.width()/2), int(Pt->y()-pm.height()/2) , pm);
             }
         }
     }
@@ -4,6 +4,7 @@ DEPENDPATH += $$MERKAARTOR_SRC_DIR/QMapControl
 # Input
 HEADERS += \
            imagemanager.h \
+           tilestore.h \
            mapadapter.h \
            mapnetwork.h \
            wmsmapadapter.h \
@@ -13,6 +14,7 @@ HEADERS += \
 SOURCES += \
            IImageManager.cpp \
            imagemanager.cpp \
+           tilestore.cpp \
            mapadapter.cpp \
            mapnetwork.cpp \
            wmsmapadapter.cpp \
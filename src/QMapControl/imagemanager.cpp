@@ -20,33 +20,145 @@
 #include "imagemanager.h"
 #include "MerkaartorPreferences.h"
 #include "IMapAdapter.h"
+#include "Global.h"
+#include "tilestore.h"
 
 #include <QDateTime>
 #include <QCryptographicHash>
+#include <QElapsedTimer>
+
+/* ImageDiskCache */
+
+ImageDiskCache::ImageDiskCache()
+    : store(0), maxBytes(0), permanent(false)
+{
+}
+
+ImageDiskCache::~ImageDiskCache()
+{
+    if (store && permanent)
+        store->setPermanent(false);
+    TileStore::release(store);
+}
+
+void ImageDiskCache::open(const QString& dirPath)
+{
+    // The store is shared with the other managers caching in the same directory
+    TileStore* old = store;
+    store = TileStore::acquire(dirPath);
+    if (store == old) {
+        TileStore::release(old);
+        return;
+    }
+
+    if (maxBytes)
+        store->setMaxSize(maxBytes);
+    if (permanent)
+        store->setPermanent(true);
+    if (old && permanent)
+        old->setPermanent(false);
+    TileStore::release(old);
+}
+
+void ImageDiskCache::setMaxSize(qint64 bytes)
+{
+    maxBytes = bytes;
+    if (store)
+        store->setMaxSize(bytes);
+}
+
+void ImageDiskCache::setPermanent(bool val)
+{
+    if (val == permanent)
+        return;
+    permanent = val;
+    if (store)
+        store->setPermanent(val);
+}
+
+void ImageDiskCache::read(const QString& hash, bool checkAge)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QByteArray key = hash.toLatin1();
+    QByteArray data;
+    uint time;
+    if (!store) {
+        emit readFailed(hash, timer.elapsed());
+        return;
+    }
+    if (!store->read(key, data, time)) {
+        emit readFailed(hash, timer.elapsed());
+        return;
+    }
+
+    if (checkAge) {
+        int random = qrand() % 100;
+        int days = QDateTime::fromTime_t(time).daysTo(QDateTime::currentDateTime());
+        if (random < (10 * days)) {
+            emit readFailed(hash, timer.elapsed());
+            return;
+        }
+    }
+
+    QImage img;
+    img.loadFromData(data);
+    if (img.isNull())
+        emit readFailed(hash, timer.elapsed());
+    else
+        emit readDone(hash, img, timer.elapsed());
+}
+
+void ImageDiskCache::write(const QString& hash, const QByteArray& data)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    if (store && store->write(hash.toLatin1(), data, QDateTime::currentDateTime().toTime_t()))
+        emit writeDone(timer.elapsed());
+}
+
+/* ImageManager */
 
 ImageManager* ImageManager::m_ImageManagerInstance = 0;
 
 ImageManager::ImageManager(QObject* parent)
-    :QObject(parent), emptyPixmap(QPixmap(1,1)), net(new MapNetwork(this))
+    :QObject(parent), emptyPixmap(QPixmap(1,1)), net(new MapNetwork(this)), m_disk(new ImageDiskCache)
 {
     emptyPixmap.fill(Qt::transparent);
 
 #ifndef _MOBILE
+    m_imageCache.setMaxCost(64*1024*1024); // 256 tiles of 256x256 ARGB32
     m_dataCache.setMaxCost(20000000); // 20mb
 #else
+    m_imageCache.setMaxCost(16*1024*1024);
     m_dataCache.setMaxCost(5000000); // 5mb
 #endif
+
+    m_disk->moveToThread(&m_diskThread);
+    connect(&m_diskThread, SIGNAL(finished()), m_disk, SLOT(deleteLater()));
+    connect(m_disk, SIGNAL(readDone(QString,QImage,int)), this, SLOT(diskReadDone(QString,QImage,int)));
+    connect(m_disk, SIGNAL(readFailed(QString,int)), this, SLOT(diskReadFailed(QString,int)));
+    connect(m_disk, SIGNAL(writeDone(int)), this, SLOT(diskWriteDone(int)));
+    m_diskThread.start(QThread::LowPriority);
 }
 
 ImageManager::~ImageManager()
 {
     net->abortLoading();
     delete net;
+
+    // Pending writes are lost, which is fine for a cache; the tile store saves its index when deleted
+    m_diskThread.quit();
+    m_diskThread.wait();
+
+    if (g_Merk_Benchmark)
+        logStatistics();
 }
 
-QByteArray ImageManager::getData(IMapAdapter* anAdapter, const QString &url)
+QString ImageManager::tileHash(IMapAdapter* anAdapter, const QString& url)
 {
-    QString host = anAdapter->getHost();
     QString strHash = anAdapter->getName() + url;
     QString hash = QString(strHash.toLatin1().toBase64());
     if (hash.size() > 255) {
@@ -54,113 +166,151 @@ QByteArray ImageManager::getData(IMapAdapter* anAdapter, const QString &url)
         crypt.addData(hash.toLatin1());
         hash = QString(crypt.result().toHex());
     }
+    return hash;
+}
 
-    QByteArray ba;
-    if (m_dataCache.contains(hash)) {
-        QBuffer* buf = m_dataCache.object(hash);
-        return buf->data();
-    }
-
+void ImageManager::loadFromNetwork(const QString& hash, const QString& host, const QString& url)
+{
     // currently loading?
-    if (!net->isLoading(hash))
-    {
-        // load from net, add empty image
-        net->load(hash, host, url);
-        emit(dataRequested());
-        return ba;
+    if (net->isLoading(hash))
+        return;
+
+    // load from net, add empty image
+    ++m_stats.networkLoads;
+    net->load(hash, host, url);
+    emit(dataRequested());
+}
+
+QByteArray ImageManager::getData(IMapAdapter* anAdapter, const QString &url)
+{
+    QString hash = tileHash(anAdapter, url);
+
+    if (QByteArray* ba = m_dataCache.object(hash))
+        return *ba;
+    if (QImage* img = m_imageCache.object(hash)) {
+        QBuffer buf;
+        buf.open(QIODevice::WriteOnly);
+        img->save(&buf, "PNG");
+        return buf.data();
     }
-    return ba;
+
+    loadFromNetwork(hash, anAdapter->getHost(), url);
+    return QByteArray();
 }
 
 QImage ImageManager::getImage(IMapAdapter* anAdapter, const QString &url)
 {
 // 	qDebug() << "ImageManager::getImage";
 
-    QString host = anAdapter->getHost();
-    QString strHash = anAdapter->getName() + url;
-    QString hash = QString(strHash.toLatin1().toBase64());
-    if (hash.size() > 255) {
-        QCryptographicHash crypt(QCryptographicHash::Md5);
-        crypt.addData(hash.toLatin1());
-        hash = QString(crypt.result().toHex());
-    }
-
-    /*	QPixmap pm(anAdapter->getTileSize(), anAdapter->getTileSize());
-        pm.fill(Qt::black);*/
-    //	QPixmap pm(emptyPixmap);
-    QImage pm;
+    QString hash = tileHash(anAdapter, url);
 
     // is image in picture cache
-    if (m_dataCache.contains(hash)) {
-        pm.loadFromData(m_dataCache.object(hash)->data());
-        return pm;
+    if (QImage* img = m_imageCache.object(hash)) {
+        ++m_stats.memoryHits;
+        return *img;
     }
+    ++m_stats.memoryMisses;
 
-    // disk cache?
-    if (anAdapter->isTiled() && useDiskCache(hash + ".png")) {
-        if (pm.load(cacheDir.absolutePath() + "/" + hash + ".png")) {
-            return pm;
-        }
+    // already on its way from the disk?
+    if (m_diskPending.contains(hash))
+        return QImage();
+
+    // disk cache? The answer comes back in diskReadDone() or diskReadFailed()
+    if (anAdapter->isTiled() && (cacheMaxSize || cachePermanent)) {
+        m_diskPending.insert(hash, qMakePair(anAdapter->getHost(), url));
+        bool checkAge = !M_PREFS->getOfflineMode() && !cachePermanent;
+        QMetaObject::invokeMethod(m_disk, "read", Qt::QueuedConnection,
+                                  Q_ARG(QString, hash), Q_ARG(bool, checkAge));
+        return QImage();
     }
 
     if (M_PREFS->getOfflineMode())
-        return pm;
+        return QImage();
 
-    // currently loading?
-    if (!net->isLoading(hash))
-    {
-        // load from net, add empty image
-        net->load(hash, host, url);
-        emit(dataRequested());
-        return pm;
-    }
-    return pm;
+    loadFromNetwork(hash, anAdapter->getHost(), url);
+    return QImage();
 }
 
 //QPixmap ImageManager::prefetchImage(const QString& host, const QString& url)
 QImage ImageManager::prefetchImage(IMapAdapter* anAdapter, int x, int y, int z)
 {
-    QString host = anAdapter->getHost();
     QString url = anAdapter->getQuery(x, y, z);
-    QString strHash = QString("%1%2").arg(anAdapter->getName()).arg(url);
-    QString hash = QString(strHash.toLatin1().toBase64());
 
-    prefetch.append(hash);
-    return getImage(anAdapter, anAdapter->getQuery(x, y, z));
+    prefetch.append(tileHash(anAdapter, url));
+    return getImage(anAdapter, url);
+}
+
+void ImageManager::diskReadDone(const QString& hash, const QImage& img, int elapsedMs)
+{
+    ++m_stats.diskHits;
+    m_stats.diskReadMs += elapsedMs;
+    m_stats.diskReadMaxMs = qMax(m_stats.diskReadMaxMs, elapsedMs);
+
+    m_diskPending.remove(hash);
+    m_imageCache.insert(hash, new QImage(img), img.byteCount());
+    emit(dataReceived());
+
+    if (m_diskPending.isEmpty() && g_Merk_Benchmark)
+        logStatistics();
+}
+
+void ImageManager::diskReadFailed(const QString& hash, int elapsedMs)
+{
+    ++m_stats.diskMisses;
+    m_stats.diskReadMs += elapsedMs;
+    m_stats.diskReadMaxMs = qMax(m_stats.diskReadMaxMs, elapsedMs);
+
+    QPair<QString, QString> request = m_diskPending.take(hash);
+    if (!M_PREFS->getOfflineMode())
+        loadFromNetwork(hash, request.first, request.second);
 }
 
-void ImageManager::receivedData(const QByteArray& ba, const QHash<QString, QString>& headers, const QString& hash)
+void ImageManager::receivedData(const QByteArray& ba, const QHash<QString, QString>& /* headers */, const QString& hash)
 {
 // 	qDebug() << "ImageManager::receivedImage";
 
-    QImage img = QImage::fromData(ba);
-    foreach (QString k, headers.keys()) {
-        img.setText(k, headers[k]);
-    }
-    QBuffer* buf = new QBuffer();
-    buf->open(QIODevice::WriteOnly);
-    img.save(buf, "PNG");
-    buf->close();
-    m_dataCache.insert(hash, buf, buf->data().size());
-    if (cacheMaxSize || cachePermanent) {
-
-        if (!img.isNull()) {
-            img.save(cacheDir.absolutePath() + "/" + hash + ".png");
-            QFileInfo info(cacheDir.absolutePath() + "/" + hash + ".png");
-            cacheInfo.append(info);
-            cacheSize += info.size();
-
-            adaptCache();
-        }
+    QElapsedTimer timer;
+    timer.start();
+    QImage* img = new QImage(QImage::fromData(ba));
+    m_stats.decodeMs += timer.elapsed();
+
+    if (img->isNull()) {
+        delete img;
+        m_dataCache.insert(hash, new QByteArray(ba), ba.size());
+    } else {
+        m_imageCache.insert(hash, img, img->byteCount());
+
+        // Keep the payload as received, there is no point in re-encoding it
+        if (cacheMaxSize || cachePermanent)
+            QMetaObject::invokeMethod(m_disk, "write", Qt::QueuedConnection,
+                                      Q_ARG(QString, hash), Q_ARG(QByteArray, ba));
     }
 
     prefetch.removeOne(hash);
     emit(dataReceived());
 }
 
+void ImageManager::diskWriteDone(int elapsedMs)
+{
+    ++m_stats.diskWrites;
+    m_stats.diskWriteMs += elapsedMs;
+}
+
+void ImageManager::logStatistics()
+{
+    int diskReads = m_stats.diskHits + m_stats.diskMisses;
+    qDebug() << "ImageManager: memory" << m_stats.memoryHits << "hits" << m_stats.memoryMisses << "misses;"
+             << "disk" << m_stats.diskHits << "hits" << m_stats.diskMisses << "misses,"
+             << (diskReads ? m_stats.diskReadMs / diskReads : 0) << "ms avg" << m_stats.diskReadMaxMs << "ms max;"
+             << m_stats.diskWrites << "writes in" << m_stats.diskWriteMs << "ms;"
+             << m_stats.networkLoads << "network loads decoded in" << m_stats.decodeMs << "ms";
+}
+
 void ImageManager::loadingQueueEmpty()
 {
     emit(loadingFinished());
+    if (g_Merk_Benchmark)
+        logStatistics();
 // 	((Layer*)this->parent())->removeZoomImage();
 // 	qDebug() << "size of image-map: " << images.size();
 // 	qDebug() << "size: " << QPixmapCache::cacheLimit();
@@ -175,15 +325,7 @@ void ImageManager::abortLoading()
 void ImageManager::setCacheDir(const QDir& path)
 {
     cacheDir = path;
-    cacheSize = 0;
-    if (!cacheDir.exists()) {
-        cacheDir.mkpath(cacheDir.absolutePath());
-    } else {
-        cacheInfo = cacheDir.entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
-        for (int i=0; i<cacheInfo.size(); i++) {
-            cacheSize += cacheInfo[i].size();
-        }
-    }
+    QMetaObject::invokeMethod(m_disk, "open", Qt::QueuedConnection, Q_ARG(QString, cacheDir.absolutePath()));
 }
 
 QDir ImageManager::getCacheDir()
@@ -194,4 +336,11 @@ QDir ImageManager::getCacheDir()
 void ImageManager::setCacheMaxSize(int max)
 {
     cacheMaxSize = max*1024*1024;
+    QMetaObject::invokeMethod(m_disk, "setMaxSize", Qt::QueuedConnection, Q_ARG(qint64, qint64(max)*1024*1024));
+}
+
+void ImageManager::setCachePermanent(bool val)
+{
+    IImageManager::setCachePermanent(val);
+    QMetaObject::invokeMethod(m_disk, "setPermanent", Qt::QueuedConnection, Q_ARG(bool, val));
 }
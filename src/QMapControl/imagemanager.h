@@ -26,6 +26,8 @@
 #include <QMutex>
 #include <QFileInfo>
 #include <QCache>
+#include <QImage>
+#include <QThread>
 #include "mapnetwork.h"
 
 #include "IImageManager.h"
@@ -33,6 +35,44 @@
 class MapNetwork;
 class IMapAdapter;
 
+class TileStore;
+
+/**
+    Disk tier of the ImageManager cache, living in its own thread.
+
+    Tiles are read and decoded, written and evicted here so that slow storage never blocks painting.
+*/
+class ImageDiskCache : public QObject
+{
+    Q_OBJECT
+    public:
+        ImageDiskCache();
+        ~ImageDiskCache();
+
+    public slots:
+        void open(const QString& dirPath);
+        void setMaxSize(qint64 bytes);
+        void setPermanent(bool val);
+
+        /*!
+         * Reads and decodes a cached tile. When checkAge is set, the older the tile the more likely it
+         * is to be considered stale and reported as missing, so that it gets refreshed from the network.
+         */
+        void read(const QString& hash, bool checkAge);
+        void write(const QString& hash, const QByteArray& data);
+
+    signals:
+        void readDone(const QString& hash, const QImage& img, int elapsedMs);
+        void readFailed(const QString& hash, int elapsedMs);
+        void writeDone(int elapsedMs);
+
+    private:
+        TileStore* store;
+        // Asked by this manager, applied to each store it opens
+        qint64 maxBytes;
+        bool permanent;
+};
+
 /**
     @author Kai Winter <kaiwinter@gmx.de>
 */
@@ -47,7 +87,7 @@ class ImageManager : public QObject, public IImageManager
 
         //! returns a QPixmap of the asked image
         /*!
-         * If this component doesn´t have the image a network query gets started to load it.
+         * If this component doesn´t have the image a disk or network query gets started to load it.
          * @param host the host of the image
          * @param path the path to the image
          * @return the pixmap of the asked image
@@ -77,6 +117,29 @@ class ImageManager : public QObject, public IImageManager
         void setCacheDir(const QDir& path);
         QDir getCacheDir();
         void setCacheMaxSize(int max);
+        void setCachePermanent(bool val);
+
+        struct Statistics {
+            Statistics() : memoryHits(0), memoryMisses(0), diskHits(0), diskMisses(0), networkLoads(0)
+                , diskReadMs(0), diskReadMaxMs(0), diskWrites(0), diskWriteMs(0), decodeMs(0) {}
+
+            int memoryHits;
+            int memoryMisses;
+            int diskHits;
+            int diskMisses;     // absent or stale
+            int networkLoads;
+            qint64 diskReadMs;  // read and decode, summed over hits and misses
+            int diskReadMaxMs;
+            int diskWrites;
+            qint64 diskWriteMs;
+            qint64 decodeMs;    // of the network payloads
+        };
+        const Statistics& statistics() const { return m_stats; }
+
+    private slots:
+        void diskReadDone(const QString& hash, const QImage& img, int elapsedMs);
+        void diskReadFailed(const QString& hash, int elapsedMs);
+        void diskWriteDone(int elapsedMs);
 
     private:
         QPixmap emptyPixmap;
@@ -85,7 +148,21 @@ class ImageManager : public QObject, public IImageManager
 
         static ImageManager* m_ImageManagerInstance;
 
-        QCache<QString, QBuffer> m_dataCache;
+        static QString tileHash(IMapAdapter* anAdapter, const QString& url);
+        void loadFromNetwork(const QString& hash, const QString& host, const QString& url);
+        void logStatistics();
+
+        // Decoded tiles, the cost being their size in bytes
+        QCache<QString, QImage> m_imageCache;
+        // Payloads that are not images, for getData()
+        QCache<QString, QByteArray> m_dataCache;
+
+        QThread m_diskThread;
+        ImageDiskCache* m_disk;
+        // Tiles being read from disk, with the host and url to fetch them from if they are not there
+        QHash<QString, QPair<QString, QString> > m_diskPending;
+
+        Statistics m_stats;
 
     signals:
         void dataRequested();
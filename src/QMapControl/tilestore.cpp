@@ -0,0 +1,458 @@
+#include "tilestore.h"
+#include "Global.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStringList>
+#include <QVector>
+
+#include <algorithm>
+#include <string.h>
+
+#define PACK_FILE "tiles.pack"
+#define INDEX_FILE "tiles.idx"
+
+#define RECORD_MAGIC 0x4d54494cu // "MTIL"
+#define INDEX_MAGIC 0x4d544958u  // "MTIX"
+#define INDEX_VERSION 1
+
+// magic, key length, key, time, data size, data
+#define RECORD_HEADER (4 + 1 + 4 + 4)
+
+static inline void putUInt32(char* p, quint32 v)
+{
+    p[0] = char(v >> 24); p[1] = char(v >> 16); p[2] = char(v >> 8); p[3] = char(v);
+}
+
+static inline quint32 getUInt32(const char* p)
+{
+    const uchar* u = reinterpret_cast<const uchar*>(p);
+    return (quint32(u[0]) << 24) | (quint32(u[1]) << 16) | (quint32(u[2]) << 8) | quint32(u[3]);
+}
+
+// Open stores by directory
+static QHash<QString, TileStore*> theStores;
+static QMutex theStoresLock;
+
+TileStore* TileStore::acquire(const QString& dirPath)
+{
+    QString key = QDir::cleanPath(QDir(dirPath).absolutePath());
+
+    QMutexLocker registry(&theStoresLock);
+    TileStore* store = theStores.value(key);
+    if (!store) {
+        store = new TileStore;
+        theStores.insert(key, store);
+    }
+    ++store->theUsers;
+
+    QMutexLocker lock(&store->theLock);
+    // Also retries a store that could not be opened before
+    if (!store->isOpen())
+        store->open(key);
+    return store;
+}
+
+void TileStore::release(TileStore* store)
+{
+    if (!store)
+        return;
+
+    // Closing under the registry lock keeps the directory from being reopened before the index is saved
+    QMutexLocker registry(&theStoresLock);
+    if (--store->theUsers > 0)
+        return;
+    theStores.remove(theStores.key(store));
+    delete store;
+}
+
+TileStore::TileStore()
+    : thePack(0), liveBytes(0), packBytes(0), maxBytes(0), permanentUsers(0), theUsers(0), useClock(0)
+{
+}
+
+TileStore::~TileStore()
+{
+    close();
+}
+
+qint64 TileStore::recordSize(int keyLength, quint32 dataSize)
+{
+    return RECORD_HEADER + keyLength + dataSize;
+}
+
+bool TileStore::open(const QString& dirPath)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    theDir = dirPath;
+    QDir().mkpath(theDir);
+    thePack = new QFile(theDir + "/" PACK_FILE);
+    if (!thePack->open(QIODevice::ReadWrite)) {
+        qDebug() << "TileStore: cannot open" << thePack->fileName() << thePack->errorString();
+        delete thePack;
+        thePack = 0;
+        return false;
+    }
+    packBytes = thePack->size();
+
+    if (!loadIndex()) {
+        theIndex.clear();
+        liveBytes = 0;
+        useClock = 0;
+        scan(0);
+    }
+    migrate();
+    if (g_Merk_Benchmark)
+        qDebug() << "TileStore: opened" << theIndex.size() << "tiles," << liveBytes << "bytes in" << timer.elapsed() << "ms";
+
+    maintain();
+    return true;
+}
+
+void TileStore::close()
+{
+    if (!isOpen())
+        return;
+    writeIndex();
+    thePack->close();
+    delete thePack;
+    thePack = 0;
+    theIndex.clear();
+    liveBytes = packBytes = 0;
+}
+
+void TileStore::setMaxSize(qint64 bytes)
+{
+    QMutexLocker lock(&theLock);
+    maxBytes = bytes;
+    maintain();
+}
+
+void TileStore::setPermanent(bool val)
+{
+    QMutexLocker lock(&theLock);
+    if (val)
+        ++permanentUsers;
+    else if (permanentUsers > 0)
+        --permanentUsers;
+    maintain();
+}
+
+bool TileStore::contains(const QByteArray& key) const
+{
+    QMutexLocker lock(&theLock);
+    return theIndex.contains(key);
+}
+
+int TileStore::count() const
+{
+    QMutexLocker lock(&theLock);
+    return theIndex.size();
+}
+
+qint64 TileStore::size() const
+{
+    QMutexLocker lock(&theLock);
+    return liveBytes;
+}
+
+qint64 TileStore::packSize() const
+{
+    QMutexLocker lock(&theLock);
+    return packBytes;
+}
+
+bool TileStore::loadIndex()
+{
+    QFile f(theDir + "/" INDEX_FILE);
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream in(&f);
+
+    quint32 magic, version, count;
+    qint64 covered;
+    in >> magic >> version >> covered >> useClock >> count;
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION || covered > packBytes)
+        return false;
+
+    theIndex.reserve(count);
+    liveBytes = 0;
+    for (quint32 i=0; i<count && in.status() == QDataStream::Ok; ++i) {
+        QByteArray key;
+        Entry e;
+        in >> key >> e.offset >> e.size >> e.time >> e.lastUsed;
+        theIndex.insert(key, e);
+        liveBytes += recordSize(key.size(), e.size);
+    }
+    if (in.status() != QDataStream::Ok)
+        return false;
+
+    // Tiles written after the index was saved
+    if (covered < packBytes)
+        scan(covered);
+    return true;
+}
+
+bool TileStore::saveIndex()
+{
+    QMutexLocker lock(&theLock);
+    return writeIndex();
+}
+
+bool TileStore::writeIndex()
+{
+    if (!isOpen())
+        return false;
+    thePack->flush();
+
+    QSaveFile f(theDir + "/" INDEX_FILE);
+    if (!f.open(QIODevice::WriteOnly))
+        return false;
+    QDataStream out(&f);
+
+    out << quint32(INDEX_MAGIC) << quint32(INDEX_VERSION) << packBytes << useClock << quint32(theIndex.size());
+    QHash<QByteArray, Entry>::const_iterator it = theIndex.constBegin();
+    for (; it != theIndex.constEnd(); ++it) {
+        const Entry& e = it.value();
+        out << it.key() << e.offset << e.size << e.time << e.lastUsed;
+    }
+    return f.commit();
+}
+
+void TileStore::scan(qint64 from)
+{
+    qint64 pos = from;
+    char header[RECORD_HEADER];
+    thePack->seek(pos);
+    while (pos < packBytes) {
+        if (thePack->read(header, 5) != 5 || getUInt32(header) != RECORD_MAGIC)
+            break;
+        int keyLength = uchar(header[4]);
+        QByteArray key = thePack->read(keyLength);
+        if (key.size() != keyLength || thePack->read(header + 5, 8) != 8)
+            break;
+        Entry e;
+        e.offset = pos;
+        e.time = getUInt32(header + 5);
+        e.size = getUInt32(header + 9);
+        e.lastUsed = ++useClock;
+        qint64 next = pos + recordSize(keyLength, e.size);
+        if (next > packBytes)
+            break;
+
+        QHash<QByteArray, Entry>::iterator old = theIndex.find(key);
+        if (old != theIndex.end())
+            liveBytes -= recordSize(keyLength, old.value().size);
+        theIndex.insert(key, e);
+        liveBytes += recordSize(keyLength, e.size);
+
+        pos = next;
+        thePack->seek(pos);
+    }
+    if (pos < packBytes) {
+        // A torn write at the end of the pack
+        qDebug() << "TileStore: dropping" << packBytes - pos << "bytes of garbage at the end of" << thePack->fileName();
+        thePack->resize(pos);
+        packBytes = pos;
+    }
+}
+
+bool TileStore::read(const QByteArray& key, QByteArray& data, uint& time)
+{
+    QMutexLocker lock(&theLock);
+    if (!isOpen())
+        return false;
+    QHash<QByteArray, Entry>::iterator it = theIndex.find(key);
+    if (it == theIndex.end())
+        return false;
+
+    Entry& e = it.value();
+    if (!thePack->seek(e.offset + RECORD_HEADER + key.size()))
+        return false;
+    data = thePack->read(e.size);
+    if (data.size() != int(e.size))
+        return false;
+    time = e.time;
+    e.lastUsed = ++useClock;
+    return true;
+}
+
+/* Moves the tiles of the time the cache was one PNG file per tile into the store, the least
+ * recently used first */
+void TileStore::migrate()
+{
+    QDir dir(theDir);
+    QFileInfoList legacy = dir.entryInfoList(QStringList() << "*.png", QDir::Files, QDir::Time | QDir::Reversed);
+    if (legacy.isEmpty())
+        return;
+
+    int migrated = 0;
+    for (int i=0; i<legacy.size(); ++i) {
+        const QFileInfo& fi = legacy[i];
+        QByteArray key = fi.fileName().left(fi.fileName().length() - 4).toLatin1();
+        QFile f(fi.absoluteFilePath());
+        QByteArray data;
+        if (f.open(QIODevice::ReadOnly))
+            data = f.readAll();
+        f.close();
+        // Unreadable ones would stay forever, and tiles are downloaded again anyway
+        if (!data.isEmpty() && !theIndex.contains(key) && !append(key, data, fi.lastModified().toTime_t()))
+            break;
+        QFile::remove(fi.absoluteFilePath());
+        ++migrated;
+    }
+    if (g_Merk_Benchmark)
+        qDebug() << "TileStore: migrated" << migrated << "of" << legacy.size() << "legacy tiles";
+    writeIndex();
+}
+
+bool TileStore::write(const QByteArray& key, const QByteArray& data, uint time)
+{
+    QMutexLocker lock(&theLock);
+    if (!isOpen() || !append(key, data, time))
+        return false;
+
+    maintain();
+    return true;
+}
+
+bool TileStore::append(const QByteArray& key, const QByteArray& data, uint time)
+{
+    if (key.isEmpty() || key.size() > 255)
+        return false;
+
+    QByteArray record;
+    record.resize(RECORD_HEADER + key.size());
+    char* p = record.data();
+    putUInt32(p, RECORD_MAGIC);
+    p[4] = char(key.size());
+    memcpy(p + 5, key.constData(), key.size());
+    putUInt32(p + 5 + key.size(), time);
+    putUInt32(p + 9 + key.size(), data.size());
+    record.append(data);
+
+    thePack->seek(packBytes);
+    if (thePack->write(record) != record.size()) {
+        qDebug() << "TileStore: cannot write to" << thePack->fileName() << thePack->errorString();
+        thePack->resize(packBytes);
+        return false;
+    }
+
+    Entry e;
+    e.offset = packBytes;
+    e.size = data.size();
+    e.time = time;
+    e.lastUsed = ++useClock;
+    QHash<QByteArray, Entry>::iterator old = theIndex.find(key);
+    if (old != theIndex.end())
+        liveBytes -= recordSize(key.size(), old.value().size);
+    theIndex.insert(key, e);
+    liveBytes += record.size();
+    packBytes += record.size();
+    return true;
+}
+
+void TileStore::maintain()
+{
+    if (!isOpen())
+        return;
+
+    if (!permanentUsers && maxBytes > 0 && packBytes > maxBytes) {
+        if (liveBytes > maxBytes * 3 / 4) {
+            // Drop the least recently used tiles down to 3/4 of the maximum
+            QVector<QPair<quint32, QByteArray> > byUse;
+            byUse.reserve(theIndex.size());
+            QHash<QByteArray, Entry>::const_iterator it = theIndex.constBegin();
+            for (; it != theIndex.constEnd(); ++it)
+                byUse.append(qMakePair(it.value().lastUsed, it.key()));
+            std::sort(byUse.begin(), byUse.end());
+
+            int evicted = 0;
+            for (int i=0; i<byUse.size() && liveBytes > maxBytes * 3 / 4; ++i, ++evicted) {
+                const QByteArray& key = byUse[i].second;
+                liveBytes -= recordSize(key.size(), theIndex.value(key).size);
+                theIndex.remove(key);
+            }
+            if (g_Merk_Benchmark)
+                qDebug() << "TileStore: evicted" << evicted << "tiles";
+        }
+        compact();
+    } else if (packBytes > 1024*1024 && packBytes - liveBytes > packBytes / 2) {
+        // Mostly overwritten tiles
+        compact();
+    }
+}
+
+static bool offsetLessThan(const QPair<qint64, QByteArray>& a, const QPair<qint64, QByteArray>& b)
+{
+    return a.first < b.first;
+}
+
+bool TileStore::compact()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QString newName = thePack->fileName() + ".new";
+    QFile out(newName);
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qDebug() << "TileStore: cannot compact to" << newName << out.errorString();
+        return false;
+    }
+
+    // Copy the live records in pack order, so that the old pack is read sequentially
+    QVector<QPair<qint64, QByteArray> > byOffset;
+    byOffset.reserve(theIndex.size());
+    QHash<QByteArray, Entry>::const_iterator it = theIndex.constBegin();
+    for (; it != theIndex.constEnd(); ++it)
+        byOffset.append(qMakePair(it.value().offset, it.key()));
+    std::sort(byOffset.begin(), byOffset.end(), offsetLessThan);
+
+    QVector<qint64> newOffsets(byOffset.size());
+    qint64 pos = 0;
+    for (int i=0; i<byOffset.size(); ++i) {
+        const Entry& e = theIndex[byOffset[i].second];
+        qint64 length = recordSize(byOffset[i].second.size(), e.size);
+        thePack->seek(e.offset);
+        QByteArray record = thePack->read(length);
+        if (record.size() != length || out.write(record) != length) {
+            qDebug() << "TileStore: compaction failed" << out.errorString();
+            out.close();
+            QFile::remove(newName);
+            return false;
+        }
+        newOffsets[i] = pos;
+        pos += length;
+    }
+    out.close();
+
+    QString packName = thePack->fileName();
+    thePack->close();
+    if (!QFile::remove(packName) || !QFile::rename(newName, packName)) {
+        // Start over rather than trust offsets into the wrong file
+        qDebug() << "TileStore: cannot replace" << packName << "by" << newName;
+        QFile::remove(newName);
+        QFile::remove(packName);
+        theIndex.clear();
+        pos = 0;
+    } else {
+        for (int i=0; i<byOffset.size(); ++i)
+            theIndex[byOffset[i].second].offset = newOffsets[i];
+    }
+    thePack->open(QIODevice::ReadWrite);
+    packBytes = thePack->size();
+    liveBytes = pos;
+
+    writeIndex();
+    if (g_Merk_Benchmark)
+        qDebug() << "TileStore: compacted to" << theIndex.size() << "tiles," << pos << "bytes in" << timer.elapsed() << "ms";
+    return true;
+}
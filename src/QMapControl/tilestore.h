@@ -0,0 +1,93 @@
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+class QFile;
+
+/**
+    Tile cache packed in a single file, replacing one file per tile in the cache directory.
+
+    Tiles are appended to tiles.pack, each record carrying its key so that the pack can always be
+    rescanned. The in-memory index (key, offset, size, write time and last use) is saved to tiles.idx
+    on close and after each compaction, which makes opening a store instant; records appended after
+    the last save, e.g. before a crash, are recovered by scanning the tail of the pack. The PNG files
+    of the former one file per tile cache are moved into the store when it is opened.
+
+    Going over the maximum size evicts the least recently used tiles in bulk, down to 3/4 of it, and
+    compacts the pack. A permanent store never evicts and only compacts away overwritten tiles.
+
+    There is one store per directory, shared by all the ImageManagers caching there, each from its
+    own disk thread: it is obtained with acquire() and given back with release(), and every access
+    is serialized by a lock. Two stores on the same files would overwrite each other's records.
+*/
+class TileStore
+{
+public:
+    // Opens the store of the directory, or shares the one already open
+    static TileStore* acquire(const QString& dirPath);
+    // Closes the store when its last user gives it back
+    static void release(TileStore* store);
+
+    bool isOpen() const { return thePack != 0; }
+    QString path() const { return theDir; }
+
+    // Shared by all the users of the store: the last one set applies
+    void setMaxSize(qint64 bytes);
+    // Counted: the store is permanent while any user asked for it and did not take it back
+    void setPermanent(bool val);
+
+    bool contains(const QByteArray& key) const;
+    // Returns false if the tile is not there; time is when it was stored
+    bool read(const QByteArray& key, QByteArray& data, uint& time);
+    bool write(const QByteArray& key, const QByteArray& data, uint time);
+
+    int count() const;
+    // Bytes used by the live tiles, and by the pack file
+    qint64 size() const;
+    qint64 packSize() const;
+
+    bool saveIndex();
+
+private:
+    TileStore();
+    ~TileStore();
+
+    bool open(const QString& dirPath);
+    void close();
+
+    struct Entry {
+        qint64 offset;  // of the record
+        quint32 size;   // of the tile data
+        quint32 time;
+        quint32 lastUsed;
+    };
+
+    static qint64 recordSize(int keyLength, quint32 dataSize);
+    bool loadIndex();
+    bool writeIndex();
+    void scan(qint64 from);
+    void migrate();
+    // Adds the record and indexes it, without maintenance
+    bool append(const QByteArray& key, const QByteArray& data, uint time);
+    void maintain();
+    bool compact();
+
+    QString theDir;
+    QFile* thePack;
+    QHash<QByteArray, Entry> theIndex;
+    qint64 liveBytes;
+    qint64 packBytes;
+    qint64 maxBytes;
+    int permanentUsers;
+    // Users sharing the store, counted under the lock of the registry
+    int theUsers;
+    mutable QMutex theLock;
+    // Logical clock for the LRU order
+    quint32 useClock;
+};
+
+#endif // TILESTORE_H
@@ -0,0 +1,74 @@
+#include "GlyphCache.h"
+
+#include <QFontMetricsF>
+#include <QStringList>
+
+#define MAX_GLYPHS 16384
+
+GlyphCache* GlyphCache::instance()
+{
+    static GlyphCache theCache;
+    return &theCache;
+}
+
+GlyphCache::GlyphCache()
+    : theGlyphs(MAX_GLYPHS)
+{
+}
+
+GlyphCache::Glyph GlyphCache::lookup(const QString& fontKey, const QFont& font, const QString& str)
+{
+    QString key = fontKey + QChar(0) + str;
+    {
+        QMutexLocker ml(&lock);
+        if (Glyph* cached = theGlyphs.object(key))
+            return *cached;
+    }
+
+    // Laid out unlocked, another worker may insert the same entry meanwhile
+    Glyph* g = new Glyph;
+    g->outline.addText(0, 0, font, str);
+    g->advance = QFontMetricsF(font).width(str);
+    Glyph result = *g;
+
+    QMutexLocker ml(&lock);
+    theGlyphs.insert(key, g);
+    return result;
+}
+
+GlyphCache::Glyph GlyphCache::text(const QFont& font, const QString& str)
+{
+    QString fontKey = font.key();
+    if (!str.contains(QLatin1Char(' ')))
+        return lookup(fontKey, font, str);
+
+    // Word by word, each put after the previous one and a space
+    QStringList words = str.split(QLatin1Char(' '));
+    qreal space = lookup(fontKey, font, QString(QLatin1Char(' '))).advance;
+    Glyph result;
+    result.advance = 0;
+    for (int i=0; i<words.size(); ++i) {
+        if (i)
+            result.advance += space;
+        if (words[i].isEmpty())
+            continue;
+        Glyph word = lookup(fontKey, font, words[i]);
+        result.outline.addPath(word.outline.translated(result.advance, 0));
+        result.advance += word.advance;
+    }
+    return result;
+}
+
+void GlyphCache::glyphs(const QFont& font, const QString& str, QVector<Glyph>& result)
+{
+    QString fontKey = font.key();
+    result.resize(str.length());
+    for (int i=0; i<str.length(); ++i)
+        result[i] = lookup(fontKey, font, str.mid(i, 1));
+}
+
+void GlyphCache::clear()
+{
+    QMutexLocker ml(&lock);
+    theGlyphs.clear();
+}
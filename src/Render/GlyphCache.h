@@ -0,0 +1,47 @@
+#ifndef GLYPHCACHE_H
+#define GLYPHCACHE_H
+
+#include <QCache>
+#include <QFont>
+#include <QMutex>
+#include <QPainterPath>
+#include <QString>
+#include <QVector>
+
+/**
+    Outlines of label texts, so that QPainterPath::addText is not called again for each label of
+    each tile.
+
+    Entries are keyed by the font (family, style and pixel size) and a word or a single character:
+    labels along ways ask for their characters one by one, and other labels are put together from
+    their words, which many labels share (street types, "River", ...). The least recently used
+    entries are evicted once the cache reaches its maximum size.
+
+    Thread-safe: it is shared by the render workers.
+*/
+class GlyphCache
+{
+public:
+    struct Glyph {
+        // On the baseline, starting at the origin
+        QPainterPath outline;
+        qreal advance;
+    };
+
+    static GlyphCache* instance();
+
+    Glyph text(const QFont& font, const QString& str);
+    // The glyphs of each character of str
+    void glyphs(const QFont& font, const QString& str, QVector<Glyph>& result);
+
+    void clear();
+
+private:
+    GlyphCache();
+    Glyph lookup(const QString& fontKey, const QFont& font, const QString& str);
+
+    QMutex lock;
+    QCache<QString, Glyph> theGlyphs;
+};
+
+#endif // GLYPHCACHE_H
@@ -0,0 +1,286 @@
+#include "LabelPlacement.h"
+
+#include <QPainter>
+#include <QPen>
+
+#include <algorithm>
+#include <math.h>
+
+// Size, in pixels, of the cells of the collision grid
+#define LABEL_CELL_SIZE 32
+
+LabelPlacement::LabelPlacement()
+    : cols(0), rows(0), cellW(LABEL_CELL_SIZE), cellH(LABEL_CELL_SIZE)
+{
+}
+
+void LabelPlacement::begin(const QRectF& area)
+{
+    theArea = area.normalized();
+    theCandidates.clear();
+
+    cols = qMax(1, int(ceil(theArea.width() / LABEL_CELL_SIZE)));
+    rows = qMax(1, int(ceil(theArea.height() / LABEL_CELL_SIZE)));
+    cellW = theArea.width() / cols;
+    cellH = theArea.height() / rows;
+    theGrid.clear();
+    theGrid.resize(cols*rows);
+}
+
+void LabelPlacement::add(const LabelCandidate& label)
+{
+    if (label.boxes.isEmpty())
+        return;
+    theCandidates.append(label);
+}
+
+// Boxes outside the area go to the border cells
+void LabelPlacement::cellRange(const QRectF& r, int& x1, int& y1, int& x2, int& y2) const
+{
+    x1 = qBound(0, int(floor((r.left() - theArea.left()) / cellW)), cols-1);
+    x2 = qBound(0, int(floor((r.right() - theArea.left()) / cellW)), cols-1);
+    y1 = qBound(0, int(floor((r.top() - theArea.top()) / cellH)), rows-1);
+    y2 = qBound(0, int(floor((r.bottom() - theArea.top()) / cellH)), rows-1);
+}
+
+bool LabelPlacement::collides(const LabelCandidate& label) const
+{
+    int x1, y1, x2, y2;
+    for (int b=0; b<label.boxes.size(); ++b) {
+        const QRectF& r = label.boxes[b];
+        cellRange(r, x1, y1, x2, y2);
+        for (int y=y1; y<=y2; ++y)
+            for (int x=x1; x<=x2; ++x) {
+                const QVector<QRectF>& cell = theGrid[y*cols+x];
+                for (int i=0; i<cell.size(); ++i)
+                    if (cell[i].intersects(r))
+                        return true;
+            }
+    }
+    return false;
+}
+
+void LabelPlacement::insert(const LabelCandidate& label)
+{
+    int x1, y1, x2, y2;
+    for (int b=0; b<label.boxes.size(); ++b) {
+        const QRectF& r = label.boxes[b];
+        cellRange(r, x1, y1, x2, y2);
+        for (int y=y1; y<=y2; ++y)
+            for (int x=x1; x<=x2; ++x)
+                theGrid[y*cols+x].append(r);
+    }
+}
+
+static bool moreImportant(const LabelCandidate* a, const LabelCandidate* b)
+{
+    if (a->importance != b->importance)
+        return a->importance > b->importance;
+    if (a->feature != b->feature)
+        return a->feature < b->feature;
+    return a->order < b->order;
+}
+
+static void drawLabel(QPainter* P, const LabelCandidate& label)
+{
+    P->setOpacity(label.opacity);
+    if (!label.background.isEmpty()) {
+        P->setPen(QPen(label.color, 2));
+        P->setBrush(label.backgroundColor);
+        P->drawPath(label.background);
+    }
+    if (label.haloWidth > 0) {
+        P->setPen(QPen(Qt::white, label.haloWidth));
+        P->setBrush(Qt::NoBrush);
+        P->drawPath(label.text);
+    }
+    P->setPen(Qt::NoPen);
+    P->setBrush(label.color);
+    P->drawPath(label.text);
+}
+
+int LabelPlacement::draw(QPainter* P)
+{
+    QVector<const LabelCandidate*> order;
+    order.reserve(theCandidates.size());
+    for (int i=0; i<theCandidates.size(); ++i)
+        order.append(&theCandidates.at(i));
+    std::sort(order.begin(), order.end(), moreImportant);
+
+    int placed = 0;
+    P->save();
+    for (int i=0; i<order.size(); ++i) {
+        const LabelCandidate& label = *order[i];
+        if (collides(label))
+            continue;
+        insert(label);
+        ++placed;
+        drawLabel(P, label);
+    }
+    P->restore();
+
+    theCandidates.clear();
+    return placed;
+}
+
+int LabelPlacement::draw(QPainter* P, const LabelDecisions& decisions)
+{
+    // In the same order as when placed, for overlapping halos
+    QVector<const LabelCandidate*> order;
+    for (int i=0; i<theCandidates.size(); ++i)
+        if (decisions.isPlaced(theCandidates.at(i)))
+            order.append(&theCandidates.at(i));
+    std::sort(order.begin(), order.end(), moreImportant);
+
+    P->save();
+    for (int i=0; i<order.size(); ++i)
+        drawLabel(P, *order[i]);
+    P->restore();
+
+    theCandidates.clear();
+    return order.size();
+}
+
+/*** LabelDecisions ***/
+
+static inline quint64 cellKey(int x, int y)
+{
+    return (quint64(quint32(x)) << 32) | quint32(y);
+}
+
+LabelDecisions::LabelDecisions(const QRectF& area)
+    : theArea(area), stale(true), decided(false)
+{
+}
+
+void LabelDecisions::cellRange(const QRectF& r, int& x1, int& y1, int& x2, int& y2) const
+{
+    x1 = int(floor(r.left() / LABEL_CELL_SIZE));
+    x2 = int(floor(r.right() / LABEL_CELL_SIZE));
+    y1 = int(floor(r.top() / LABEL_CELL_SIZE));
+    y2 = int(floor(r.bottom() / LABEL_CELL_SIZE));
+}
+
+bool LabelDecisions::collides(const QVector<QRectF>& boxes) const
+{
+    int x1, y1, x2, y2;
+    for (int b=0; b<boxes.size(); ++b) {
+        const QRectF& r = boxes[b];
+        cellRange(r, x1, y1, x2, y2);
+        for (int y=y1; y<=y2; ++y)
+            for (int x=x1; x<=x2; ++x) {
+                QHash<quint64, QVector<Key> >::const_iterator cell = theGrid.constFind(cellKey(x, y));
+                if (cell == theGrid.constEnd())
+                    continue;
+                for (int i=0; i<cell.value().size(); ++i) {
+                    const QVector<QRectF>& other = theLabels.constFind(cell.value()[i]).value();
+                    for (int j=0; j<other.size(); ++j)
+                        if (other[j].intersects(r))
+                            return true;
+                }
+            }
+    }
+    return false;
+}
+
+QVector<QRectF> LabelDecisions::decide(const QList<LabelCandidate>& labels, const QPointF& origin)
+{
+    QHash<Key, QVector<QRectF> > before;
+    before.swap(theLabels);
+    theGrid.clear();
+    stale = false;
+    decided = true;
+
+    QVector<const LabelCandidate*> order;
+    order.reserve(labels.size());
+    for (int i=0; i<labels.size(); ++i)
+        order.append(&labels.at(i));
+    std::sort(order.begin(), order.end(), moreImportant);
+
+    for (int i=0; i<order.size(); ++i) {
+        const LabelCandidate& label = *order[i];
+        Key key(label.feature, label.order);
+        // A feature may be gathered twice, e.g. by two layers
+        if (theLabels.contains(key))
+            continue;
+
+        QVector<QRectF> boxes;
+        bool inside = true;
+        for (int b=0; b<label.boxes.size() && inside; ++b) {
+            boxes.append(label.boxes[b].translated(origin));
+            inside = theArea.contains(boxes.last());
+        }
+        if (!inside || collides(boxes))
+            continue;
+        theLabels.insert(key, boxes);
+
+        int x1, y1, x2, y2;
+        for (int b=0; b<boxes.size(); ++b) {
+            cellRange(boxes[b], x1, y1, x2, y2);
+            for (int y=y1; y<=y2; ++y)
+                for (int x=x1; x<=x2; ++x) {
+                    QVector<Key>& cell = theGrid[cellKey(x, y)];
+                    if (cell.isEmpty() || cell.last() != key)
+                        cell.append(key);
+                }
+        }
+    }
+
+    QVector<QRectF> changed;
+    QHash<Key, QVector<QRectF> >::const_iterator it = before.constBegin();
+    for (; it != before.constEnd(); ++it)
+        if (theLabels.value(it.key()) != it.value())
+            changed += it.value();
+    for (it = theLabels.constBegin(); it != theLabels.constEnd(); ++it)
+        if (before.value(it.key()) != it.value())
+            changed += it.value();
+    return changed;
+}
+
+bool LabelDecisions::isPlaced(const LabelCandidate& label) const
+{
+    return theLabels.contains(Key(label.feature, label.order));
+}
+
+/*** LabelPath ***/
+
+LabelPath::LabelPath(const QList<QPolygonF>& polygons)
+    : theLength(0)
+{
+    for (int i=0; i<polygons.size(); ++i) {
+        const QPolygonF& poly = polygons[i];
+        for (int j=0; j<poly.size(); ++j) {
+            if (j > 0) {
+                QPointF d = poly[j] - poly[j-1];
+                theLength += sqrt(d.x()*d.x() + d.y()*d.y());
+            }
+            thePoints.append(poly[j]);
+            theDistances.append(theLength);
+        }
+    }
+}
+
+QPointF LabelPath::pointAt(qreal distance, qreal* angle) const
+{
+    if (thePoints.size() < 2) {
+        *angle = 0;
+        return thePoints.isEmpty() ? QPointF() : thePoints[0];
+    }
+
+    // First segment ending past the distance; gaps between subpaths have no length and are skipped
+    int i = int(std::upper_bound(theDistances.constBegin(), theDistances.constEnd(), distance) - theDistances.constBegin());
+    if (i >= thePoints.size()) {
+        i = thePoints.size() - 1;
+        while (i > 1 && theDistances[i] == theDistances[i-1])
+            --i;
+    }
+    if (i < 1)
+        i = 1;
+
+    const QPointF& a = thePoints[i-1];
+    const QPointF& b = thePoints[i];
+    qreal len = theDistances[i] - theDistances[i-1];
+    qreal t = len > 0 ? (distance - theDistances[i-1]) / len : 0;
+    *angle = atan2(b.y() - a.y(), b.x() - a.x()) * 180. / M_PI;
+    return a + (b - a) * t;
+}
@@ -0,0 +1,147 @@
+#ifndef LABELPLACEMENT_H
+#define LABELPLACEMENT_H
+
+#include <QColor>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QPainterPath>
+#include <QPolygonF>
+#include <QRectF>
+#include <QVector>
+
+class Feature;
+class LabelDecisions;
+class QPainter;
+
+/* A label ready to be drawn, in painter coordinates */
+struct LabelCandidate
+{
+    LabelCandidate()
+        : haloWidth(0), opacity(1.), importance(0), feature(0), order(0) {}
+
+    QPainterPath text;
+    // Drawn under the text, outlined with the text color, if not empty
+    QPainterPath background;
+    QColor color;
+    QColor backgroundColor;
+    // White outline around the text, none if 0
+    qreal haloWidth;
+    qreal opacity;
+
+    // What the label covers: one box per glyph along a way, one for a point label
+    QVector<QRectF> boxes;
+    // Larger is placed first; ties are broken by feature then order, so that neighbouring tiles
+    // take the same decisions
+    qreal importance;
+    const Feature* feature;
+    int order;
+};
+
+/**
+    Label placement stage of a render.
+
+    The label pass of MapRenderer adds the label candidates of all its features; they are then
+    placed most important first, each label being dropped if one of its boxes overlaps a label
+    already placed. Placed boxes are kept in a uniform grid over the render area.
+*/
+class LabelPlacement
+{
+public:
+    LabelPlacement();
+
+    // Starts over for a render of the given area
+    void begin(const QRectF& area);
+    // Whether a label covering r may show; labels far from the render area are not worth laying out
+    bool isNear(const QRectF& r) const { return theArea.intersects(r); }
+    void add(const LabelCandidate& label);
+    // Places and draws the candidates; returns the number of labels drawn
+    int draw(QPainter* P);
+    // Draws the candidates placed beforehand by the decisions
+    int draw(QPainter* P, const LabelDecisions& decisions);
+
+    const QList<LabelCandidate>& candidates() const { return theCandidates; }
+    int size() const { return theCandidates.size(); }
+
+private:
+    void cellRange(const QRectF& r, int& x1, int& y1, int& x2, int& y2) const;
+    bool collides(const LabelCandidate& label) const;
+    void insert(const LabelCandidate& label);
+
+    QRectF theArea;
+    QList<LabelCandidate> theCandidates;
+
+    int cols, rows;
+    qreal cellW, cellH;
+    QVector<QVector<QRectF> > theGrid;
+};
+
+/**
+    Label placement shared by the tiles of a block of a zoom level.
+
+    Tiles are rendered separately, each from the features around it, so that placing labels tile by
+    tile would not take the same decisions on both sides of a seam. Tiles are instead grouped in
+    fixed blocks: the labels of a block are placed in one pass over the candidates of the whole
+    block, and its tiles then draw the labels placed, whole or in part. Only labels that fit in the
+    block are placed, so that the decisions of a block only depend on what it holds, and not on
+    which blocks were decided before.
+
+    Boxes are in pixels of the level, from the projection origin. Decisions must not change while a
+    tile of the block is being rendered.
+*/
+class LabelDecisions
+{
+public:
+    typedef QPair<const Feature*, int> Key;
+
+    // area is the block, in pixels of the level
+    LabelDecisions(const QRectF& area);
+
+    const QRectF& area() const { return theArea; }
+    // Whether the labels have to be decided again, as are those of a new block
+    bool isStale() const { return stale; }
+    void setStale() { stale = true; }
+    // Not decided yet: no tile can show its labels
+    bool isNew() const { return !decided; }
+
+    // Places the labels anew, most important first; origin is the pixel position of the
+    // candidates' coordinates origin. Returns the boxes of the labels placed before and not now, or
+    // the other way round.
+    QVector<QRectF> decide(const QList<LabelCandidate>& labels, const QPointF& origin);
+    bool isPlaced(const LabelCandidate& label) const;
+
+    int size() const { return theLabels.size(); }
+
+private:
+    void cellRange(const QRectF& r, int& x1, int& y1, int& x2, int& y2) const;
+    bool collides(const QVector<QRectF>& boxes) const;
+
+    QRectF theArea;
+    bool stale;
+    bool decided;
+    // The boxes of the labels placed
+    QHash<Key, QVector<QRectF> > theLabels;
+    // The labels placed touching each cell
+    QHash<quint64, QVector<Key> > theGrid;
+};
+
+/**
+    Walks a polyline by distance, for laying glyphs along a way. Subpaths are joined without
+    counting the gaps between them, like QPainterPath::length().
+*/
+class LabelPath
+{
+public:
+    LabelPath(const QList<QPolygonF>& polygons);
+
+    qreal length() const { return theLength; }
+    // Point at the distance from the start, and direction there in degrees, with y down
+    QPointF pointAt(qreal distance, qreal* angle) const;
+
+private:
+    QVector<QPointF> thePoints;
+    QVector<qreal> theDistances;
+    qreal theLength;
+};
+
+#endif // LABELPLACEMENT_H
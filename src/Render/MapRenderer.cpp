@@ -206,6 +206,7 @@ void LabelStyleLayer::draw(Node* Pt)
 /*** MapRenderer ***/
 
 MapRenderer::MapRenderer()
+    : theDecisions(0)
 {
     bglayer = BackgroundStyleLayer(this);
     fglayer = ForegroundStyleLayer(this);
@@ -219,14 +220,8 @@ QPoint MapRenderer::toView(Node* aPt) const
 }
 
 
-void MapRenderer::render(
-        QPainter* P,
-        const QMap<RenderPriority, QSet <Feature*> >& theFeatures,
-        const QRectF& pViewport,
-        const QRect& screen,
-        const qreal pixelPerM,
-        const RendererOptions& options
-)
+void MapRenderer::setup(QPainter* P, const QRectF& pViewport, const QRect& screen, const qreal pixelPerM,
+                        const RendererOptions& options)
 {
     theViewport = pViewport;
     theScreen = screen;
@@ -260,138 +255,118 @@ void MapRenderer::render(
             NodeWidth = M_PREFS->getNodeSize();
     }
 
+    thePainter = P;
+}
+
+/* Opacity of each feature, looked up once for all the passes */
+static void featureAlphas(const RenderList& theFeatures, const RendererOptions& theOptions, QVector<qreal>& alphas)
+{
+    alphas.resize(theFeatures.size());
+    bool halveReadonly = !TEST_RFLAGS(RendererOptions::ForPrinting);
+    for (int i=0; i<theFeatures.size(); ++i) {
+        Feature* F = theFeatures.feature(i);
+        alphas[i] = F->getAlpha();
+        if (halveReadonly && F->isReadonly())
+            alphas[i] /= 2.0;
+    }
+}
+
+void MapRenderer::render(
+        QPainter* P,
+        RenderList& theFeatures,
+        const QRectF& pViewport,
+        const QRect& screen,
+        const qreal pixelPerM,
+        const RendererOptions& options
+)
+{
+    setup(P, pViewport, screen, pixelPerM, options);
+
     bool bgLayerVisible = TEST_RFLAGS(RendererOptions::BackgroundVisible);
     bool fgLayerVisible = TEST_RFLAGS(RendererOptions::ForegroundVisible);
     bool tchpLayerVisible = TEST_RFLAGS(RendererOptions::TouchupVisible);
     bool lblLayerVisible = TEST_RFLAGS(RendererOptions::NamesVisible);
 
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itmCur;
-    QSet<Feature*>::const_iterator it;
+    theFeatures.sort();
+    QVector<qreal> alphas;
+    featureAlphas(theFeatures, theOptions, alphas);
 
-    thePainter = P;
     thePainter->save();
     thePainter->translate(screen.left(), screen.top());
 
-    itm = theFeatures.constBegin();
-    while (itm != theFeatures.constEnd())
-    {
-        int curLayer = (itm.key()).layer();
-        itmCur = itm;
-        while (itm != theFeatures.constEnd() && (itm.key()).layer() == curLayer)
-        {
-            if (bgLayerVisible)
-            {
-                for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                    qreal alpha = (*it)->getAlpha();
-                    if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                        alpha /= 2.0;
-                    if (alpha != 1.) {
-                        P->save();
-                        P->setOpacity(alpha);
-                    }
-
-                    if (CHECK_WAY(*it)) {
-                        Way * R = STATIC_CAST_WAY(*it);
-                        for (int i=0; i<R->sizeParents(); ++i)
-                            if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                                continue;
-                        bglayer.draw(R);
-                    } else if (CHECK_NODE(*it))
-                        bglayer.draw(STATIC_CAST_NODE(*it));
-                    else if (CHECK_RELATION(*it))
-                        bglayer.draw(STATIC_CAST_RELATION(*it));
-                    if (alpha != 1.) {
-                        P->restore();
-                    }
-                }
-            }
-            ++itm;
-        }
-        itm = itmCur;
-        while (itm != theFeatures.constEnd() && (itm.key()).layer() == curLayer)
-        {
-            if (fgLayerVisible)
-            {
-                for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                    qreal alpha = (*it)->getAlpha();
-                    if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                        alpha /= 2.0;
-                    if (alpha != 1.) {
-                        P->save();
-                        P->setOpacity(alpha);
-                    }
-
-                    if (CHECK_WAY(*it)) {
-                        Way * R = STATIC_CAST_WAY(*it);
-                        for (int i=0; i<R->sizeParents(); ++i)
-                            if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                                continue;
-                        fglayer.draw(R);
-                    } else if (CHECK_NODE(*it))
-                        fglayer.draw(STATIC_CAST_NODE(*it));
-                    else if (CHECK_RELATION(*it))
-                        fglayer.draw(STATIC_CAST_RELATION(*it));
-                    if (alpha != 1.) {
-                        P->restore();
-                    }
-                }
-            }
-            ++itm;
-        }
+    // Background then foreground, one priority layer after the other
+    int n = theFeatures.size();
+    for (int from=0; from < n; ) {
+        int curLayer = theFeatures.at(from).priorityLayer();
+        int to = from + 1;
+        while (to < n && theFeatures.at(to).priorityLayer() == curLayer)
+            ++to;
+        if (bgLayerVisible)
+            renderPass(bglayer, theFeatures, alphas, from, to);
+        if (fgLayerVisible)
+            renderPass(fglayer, theFeatures, alphas, from, to);
+        from = to;
     }
     if (tchpLayerVisible)
-    {
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm) {
-            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                qreal alpha = (*it)->getAlpha();
-                if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                    alpha /= 2.0;
-                if (alpha != 1.) {
-                    P->save();
-                    P->setOpacity(alpha);
-                }
+        renderPass(tchuplayer, theFeatures, alphas, 0, n);
+    if (lblLayerVisible) {
+        theLabels.begin(QRectF(screen).translated(-screen.topLeft()));
+        renderPass(lbllayer, theFeatures, alphas, 0, n);
+        if (theDecisions)
+            theLabels.draw(thePainter, *theDecisions);
+        else
+            theLabels.draw(thePainter);
+    }
+    thePainter->restore();
+}
 
-                if (CHECK_WAY(*it)) {
-                    Way * R = STATIC_CAST_WAY(*it);
-                    for (int i=0; i<R->sizeParents(); ++i)
-                        if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                            continue;
-                    tchuplayer.draw(R);
-                } else if (CHECK_NODE(*it))
-                    tchuplayer.draw(STATIC_CAST_NODE(*it));
-                else if (CHECK_RELATION(*it))
-                    tchuplayer.draw(STATIC_CAST_RELATION(*it));
-                if (alpha != 1.) {
-                    P->restore();
-                }
-            }
+void MapRenderer::gatherLabels(
+        QPainter* P,
+        RenderList& theFeatures,
+        const QRectF& pViewport,
+        const QRect& screen,
+        const qreal pixelPerM,
+        const RendererOptions& options
+)
+{
+    setup(P, pViewport, screen, pixelPerM, options);
+
+    theFeatures.sort();
+    QVector<qreal> alphas;
+    featureAlphas(theFeatures, theOptions, alphas);
+
+    thePainter->save();
+    theLabels.begin(QRectF(screen).translated(-screen.topLeft()));
+    renderPass(lbllayer, theFeatures, alphas, 0, theFeatures.size());
+    thePainter->restore();
+}
+
+void MapRenderer::renderPass(PaintStyleLayer& layer, const RenderList& theFeatures, const QVector<qreal>& alphas,
+                             int from, int to)
+{
+    for (int i=from; i<to; ++i) {
+        const RenderList::Item& it = theFeatures.at(i);
+        bool save = alphas[i] != 1.;
+        if (save) {
+            thePainter->save();
+            thePainter->setOpacity(alphas[i]);
         }
-    }
 
-    if (lblLayerVisible)
-    {
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm) {
-            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                P->save();
-                qreal alpha = (*it)->getAlpha();
-                if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                    alpha /= 2.0;
-                P->setOpacity(alpha);
-
-                if (CHECK_WAY(*it)) {
-                    Way * R = STATIC_CAST_WAY(*it);
-                    for (int i=0; i<R->sizeParents(); ++i)
-                        if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                            continue;
-                    lbllayer.draw(R);
-                } else if (CHECK_NODE(*it))
-                    lbllayer.draw(STATIC_CAST_NODE(*it));
-                else if (CHECK_RELATION(*it))
-                    lbllayer.draw(STATIC_CAST_RELATION(*it));
-                P->restore();
-            }
+        switch (it.itemKind()) {
+        case RenderList::WayItem:
+            layer.draw(STATIC_CAST_WAY(it.feature));
+            break;
+        case RenderList::NodeItem:
+            layer.draw(STATIC_CAST_NODE(it.feature));
+            break;
+        case RenderList::RelationItem:
+            layer.draw(STATIC_CAST_RELATION(it.feature));
+            break;
+        default:
+            break;
         }
+
+        if (save)
+            thePainter->restore();
     }
-    thePainter->restore();
 }
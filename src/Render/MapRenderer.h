@@ -20,6 +20,8 @@
 
 #include "Feature.h"
 #include "IRenderer.h"
+#include "RenderList.h"
+#include "LabelPlacement.h"
 
 class Document;
 class PaintStylePrivate;
@@ -89,12 +91,23 @@ public:
 
     void render(
             QPainter* P,
-            const QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+            RenderList& theFeatures,
             const QRectF& pViewport,
             const QRect& screen,
             const qreal pixelPerM,
             const RendererOptions& options
     );
+    // Only fills theLabels with the label candidates of the features, painting nothing
+    void gatherLabels(
+            QPainter* P,
+            RenderList& theFeatures,
+            const QRectF& pViewport,
+            const QRect& screen,
+            const qreal pixelPerM,
+            const RendererOptions& options
+    );
+    // Draws the labels placed by the decisions instead of placing them in the render
+    void setLabelDecisions(const LabelDecisions* decisions) { theDecisions = decisions; }
 //    void print(
 //            QPainter* P,
 //            QMap<RenderPriority, QSet <Feature*> > theFeatures,
@@ -111,10 +124,19 @@ public:
     QPainter* thePainter;
     RendererOptions theOptions;
     GlobalPainter theGlobalPainter;
+    // Filled by the label pass, then placed and drawn at once
+    LabelPlacement theLabels;
+    const LabelDecisions* theDecisions;
 
     QPoint toView(Node *aPt) const;
 
 protected:
+    void setup(QPainter* P, const QRectF& pViewport, const QRect& screen, const qreal pixelPerM,
+               const RendererOptions& options);
+    // Draws the features [from, to[ of the list with one of the style layers
+    void renderPass(PaintStyleLayer& layer, const RenderList& theFeatures, const QVector<qreal>& alphas,
+                    int from, int to);
+
     BackgroundStyleLayer bglayer;
     ForegroundStyleLayer fglayer;
     TouchupStyleLayer tchuplayer;
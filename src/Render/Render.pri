@@ -4,12 +4,18 @@ DEPENDPATH += $$MERKAARTOR_SRC_DIR/Render
 # Header files
 HEADERS += \
     FeaturePainter.h \
-    MapRenderer.h
+    GlyphCache.h \
+    LabelPlacement.h \
+    MapRenderer.h \
+    RenderList.h
 
 # Source files
 SOURCES += \
     FeaturePainter.cpp \
-    MapRenderer.cpp
+    GlyphCache.cpp \
+    LabelPlacement.cpp \
+    MapRenderer.cpp \
+    RenderList.cpp
 
 isEmpty(MOBILE) {
   QT += svg
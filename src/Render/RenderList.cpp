@@ -0,0 +1,116 @@
+#include "RenderList.h"
+
+#include <algorithm>
+#include <string.h>
+
+// Address bytes, layer, priority and class, from the least significant
+#define ADDRESS_DIGITS int(sizeof(quintptr))
+#define DIGITS (ADDRESS_DIGITS + 2 + 8 + 1)
+// Below that, the histograms cost more than a comparison sort
+#define RADIX_MIN_SIZE 64
+
+/* Maps a double to an unsigned integer with the same order: positive numbers get their sign bit
+   set, negative ones are flipped entirely */
+static inline quint64 orderedBits(qreal v)
+{
+    double d = (v == 0.) ? 0. : double(v); // -0 == 0
+    quint64 bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return (bits & Q_UINT64_C(0x8000000000000000)) ? ~bits : (bits | Q_UINT64_C(0x8000000000000000));
+}
+
+static inline uint digit(const RenderList::Item& it, int d)
+{
+    if (d < ADDRESS_DIGITS)
+        return uint(quintptr(it.feature) >> (8*d)) & 0xff;
+    d -= ADDRESS_DIGITS;
+    if (d < 2)
+        return (it.layer >> (8*d)) & 0xff;
+    d -= 2;
+    if (d < 8)
+        return uint(it.priority >> (8*d)) & 0xff;
+    return it.renderClass;
+}
+
+static bool itemLessThan(const RenderList::Item& a, const RenderList::Item& b)
+{
+    if (a.renderClass != b.renderClass)
+        return a.renderClass < b.renderClass;
+    if (a.priority != b.priority)
+        return a.priority < b.priority;
+    if (a.layer != b.layer)
+        return a.layer < b.layer;
+    return quintptr(a.feature) < quintptr(b.feature);
+}
+
+RenderList::RenderList()
+    : sorted(true)
+{
+}
+
+void RenderList::add(Feature* F, const RenderPriority& pri, Kind kind)
+{
+    Item it;
+    it.priority = orderedBits(pri.priority());
+    it.layer = quint16(qBound(-0x8000, pri.layer(), 0x7fff) + 0x8000);
+    it.renderClass = quint8(pri.renderClass());
+    it.kind = quint8(kind);
+    it.feature = F;
+    theItems.append(it);
+    sorted = false;
+}
+
+void RenderList::clear()
+{
+    theItems.clear();
+    sorted = true;
+}
+
+void RenderList::sort()
+{
+    if (sorted)
+        return;
+    sorted = true;
+
+    int n = theItems.size();
+    if (n < RADIX_MIN_SIZE) {
+        std::sort(theItems.begin(), theItems.end(), itemLessThan);
+    } else {
+        // All the histograms in a single read of the keys
+        int counts[DIGITS][256];
+        memset(counts, 0, sizeof(counts));
+        const Item* items = theItems.constData();
+        for (int i=0; i<n; ++i)
+            for (int d=0; d<DIGITS; ++d)
+                ++counts[d][digit(items[i], d)];
+
+        theBuffer.resize(n);
+        Item* from = theItems.data();
+        Item* to = theBuffer.data();
+        for (int d=0; d<DIGITS; ++d) {
+            int* count = counts[d];
+            if (count[digit(from[0], d)] == n)
+                continue;
+
+            int offset = 0;
+            for (int b=0; b<256; ++b) {
+                int c = count[b];
+                count[b] = offset;
+                offset += c;
+            }
+            for (int i=0; i<n; ++i)
+                to[count[digit(from[i], d)]++] = from[i];
+            std::swap(from, to);
+        }
+        if (from != theItems.constData())
+            theItems.swap(theBuffer);
+    }
+
+    // The same feature, found from several rects, sorts next to itself
+    Item* items = theItems.data();
+    int kept = n ? 1 : 0;
+    for (int i=1; i<n; ++i)
+        if (items[i].feature != items[kept-1].feature)
+            items[kept++] = items[i];
+    theItems.resize(kept);
+}
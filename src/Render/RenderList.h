@@ -0,0 +1,55 @@
+#ifndef RENDERLIST_H
+#define RENDERLIST_H
+
+#include "Feature.h"
+
+#include <QVector>
+
+/**
+    Features to render, in render priority order.
+
+    Features are appended with their priority while gathering, in any order and possibly several
+    times (e.g. once per invalid rect), and the list is then sorted once: by class and priority, as
+    RenderPriority::operator<, then by priority layer and by address so that the order is stable
+    from one render to the next. The sort is a LSD radix sort on 8 bits digits, which skips the
+    digits all the keys share; duplicates end up next to each other and are dropped in the same go.
+
+    Not thread-safe: each renderer gathers in a list of its own.
+*/
+class RenderList
+{
+public:
+    // What a feature is, as told by its type, so that the passes do not ask again
+    typedef enum { WayItem, NodeItem, RelationItem, OtherItem } Kind;
+
+    struct Item {
+        quint64 priority;   // order preserving image of RenderPriority::priority()
+        quint16 layer;      // RenderPriority::layer(), biased
+        quint8 renderClass;
+        quint8 kind;
+        Feature* feature;
+
+        Kind itemKind() const { return Kind(kind); }
+        int priorityLayer() const { return int(layer) - 0x8000; }
+    };
+
+    RenderList();
+
+    void add(Feature* F, const RenderPriority& pri, Kind kind);
+    // Sorts and removes the duplicates; does nothing if already done
+    void sort();
+    void clear();
+    void reserve(int size) { theItems.reserve(size); }
+
+    int size() const { return theItems.size(); }
+    bool isEmpty() const { return theItems.isEmpty(); }
+    const Item& at(int i) const { return theItems.at(i); }
+    Feature* feature(int i) const { return theItems.at(i).feature; }
+
+private:
+    QVector<Item> theItems;
+    QVector<Item> theBuffer;
+    bool sorted;
+};
+
+#endif // RENDERLIST_H
@@ -49,7 +49,7 @@ bool DirtyListBuild::add(Feature* F)
     if (!F->isDirty()) return false;
     //if (F->hasOSMId()) return false;
 
-    Added.push_back(F);
+    Added.insert(F);
     return false;
 }
 
@@ -57,14 +57,7 @@ bool DirtyListBuild::update(Feature* F)
 {
     if (!F->isDirty()) return false;
 
-    for (int i=0; i<Updated.size(); ++i)
-        if (Updated[i] == F)
-        {
-            UpdateCounter[i].first++;
-            return false;
-        }
-    Updated.push_back(F);
-    UpdateCounter.push_back(qMakePair((int) 1, (int)0));
+    Updated[F].first++;
     return false;
 }
 
@@ -72,35 +65,34 @@ bool DirtyListBuild::erase(Feature* F)
 {
     if (!F->isDirty()) return false;
 
-    Deleted.push_back(F);
+    Deleted.insert(F);
     return false;
 }
 
 bool DirtyListBuild::willBeAdded(Feature* F) const
 {
-    return std::find(Added.begin(),Added.end(),F) != Added.end();
+    return Added.contains(F);
 }
 
 bool DirtyListBuild::willBeErased(Feature* F) const
 {
-    return std::find(Deleted.begin(),Deleted.end(),F) != Deleted.end();
+    return Deleted.contains(F);
 }
 
 bool DirtyListBuild::updateNow(Feature* F) const
 {
-    for (int i=0; i<Updated.size(); ++i)
-        if (Updated[i] == F)
-        {
-            UpdateCounter[i].second++;
-            return UpdateCounter[i].first == UpdateCounter[i].second;
-        }
-    return false;
+    QHash<Feature*, QPair<int, int> >::iterator it = Updated.find(F);
+    if (it == Updated.end())
+        return false;
+    it.value().second++;
+    return it.value().first == it.value().second;
 }
 
 void DirtyListBuild::resetUpdates()
 {
-    for (int i=0; i<UpdateCounter.size(); ++i)
-        UpdateCounter[i].second = 0;
+    QHash<Feature*, QPair<int, int> >::iterator it;
+    for (it = Updated.begin(); it != Updated.end(); ++it)
+        it.value().second = 0;
 }
 
 /* DIRTYLISTVISIT */
@@ -115,20 +107,20 @@ bool DirtyListVisit::runVisit()
     DeletePass = false;
     document()->history().buildDirtyList(*this);
     DeletePass = true;
-    for (int i=0; i<RelationsToDelete.uniqueKeys().size(); i++) {
-        if (!RelationsToDelete.uniqueKeys()[i]->hasOSMId())
+    for (QMap<Relation*, bool>::iterator it = RelationsToDelete.begin(); it != RelationsToDelete.end(); ++it) {
+        if (!it.key()->hasOSMId())
             continue;
-        RelationsToDelete[RelationsToDelete.uniqueKeys()[i]] = eraseRelation(RelationsToDelete.uniqueKeys()[i]);
+        it.value() = eraseRelation(it.key());
     }
-    for (int i=0; i<RoadsToDelete.uniqueKeys().size(); i++) {
-        if (!RoadsToDelete.uniqueKeys()[i]->hasOSMId())
+    for (QMap<Way*, bool>::iterator it = RoadsToDelete.begin(); it != RoadsToDelete.end(); ++it) {
+        if (!it.key()->hasOSMId())
             continue;
-        RoadsToDelete[RoadsToDelete.uniqueKeys()[i]] = eraseRoad(RoadsToDelete.uniqueKeys()[i]);
+        it.value() = eraseRoad(it.key());
     }
-    for (int i=0; i<TrackPointsToDelete.uniqueKeys().size(); i++) {
-        if (!TrackPointsToDelete.uniqueKeys()[i]->hasOSMId())
+    for (QMap<Node*, bool>::iterator it = TrackPointsToDelete.begin(); it != TrackPointsToDelete.end(); ++it) {
+        if (!it.key()->hasOSMId())
             continue;
-        TrackPointsToDelete[TrackPointsToDelete.uniqueKeys()[i]] = erasePoint(TrackPointsToDelete.uniqueKeys()[i]);
+        it.value() = erasePoint(it.key());
     }
     return document()->history().buildDirtyList(*this);
 }
@@ -140,7 +132,7 @@ Document* DirtyListVisit::document()
 
 bool DirtyListVisit::notYetAdded(Feature* F)
 {
-    return std::find(AlreadyAdded.begin(),AlreadyAdded.end(),F) == AlreadyAdded.end();
+    return !AlreadyAdded.contains(F);
 }
 
 bool DirtyListVisit::add(Feature* F)
@@ -149,15 +141,18 @@ bool DirtyListVisit::add(Feature* F)
     if (F->isDeleted()) return false;
     // TODO Needed to add children of updated imported features. Sure there is no advert cases?
     //if (!F->isDirty()) return false;
+    // Accepted by an upload that stopped short, and not changed since
+    if (F->isUploaded() && !F->isDirty())
+        return EraseFromHistory;
 
     // Allow "Force Upload" of OSM objects
     //if (F->hasOSMId()) return false;
 
     if (Future.willBeErased(F))
         return EraseFromHistory;
-    for (int i=0; i<AlreadyAdded.size(); ++i)
-        if (AlreadyAdded[i] == F)
-            return EraseResponse[i];
+    QHash<Feature*, bool>::const_iterator done = AlreadyAdded.constFind(F);
+    if (done != AlreadyAdded.constEnd())
+        return done.value();
 
     bool x;
     if (Node* Pt = CAST_NODE(F))
@@ -168,8 +163,7 @@ bool DirtyListVisit::add(Feature* F)
                 x = updatePoint(Pt);
             else
                 x = addPoint(Pt);
-            AlreadyAdded.push_back(F);
-            EraseResponse.push_back(x);
+            AlreadyAdded.insert(F, x);
             return x;
         }
         else
@@ -185,8 +179,7 @@ bool DirtyListVisit::add(Feature* F)
             x = updateRoad(R);
         else
             x = addRoad(R);
-        AlreadyAdded.push_back(F);
-        EraseResponse.push_back(x);
+        AlreadyAdded.insert(F, x);
         return x;
     }
     else if (Relation* Rel = dynamic_cast<Relation*>(F))
@@ -198,8 +191,7 @@ bool DirtyListVisit::add(Feature* F)
             x = updateRelation(Rel);
         else
             x = addRelation(Rel);
-        AlreadyAdded.push_back(F);
-        EraseResponse.push_back(x);
+        AlreadyAdded.insert(F, x);
         return x;
     }
     return EraseFromHistory;
@@ -18,7 +18,9 @@ class QWidget;
 #include <QtCore/QString>
 
 #include <utility>
+#include <QHash>
 #include <QList>
+#include <QSet>
 
 class DirtyList
 {
@@ -50,9 +52,9 @@ class DirtyListBuild : public DirtyList
         virtual void resetUpdates();
 
     protected:
-        QList<Feature*> Added, Deleted;
-        QList<Feature*> Updated;
-        mutable QList<QPair<int, int> > UpdateCounter;
+        QSet<Feature*> Added, Deleted;
+        // Number of updates of each feature in the history, and of those visited so far
+        mutable QHash<Feature*, QPair<int, int> > Updated;
 };
 
 class DirtyListVisit : public DirtyList
@@ -83,9 +85,8 @@ class DirtyListVisit : public DirtyList
         Document* theDocument;
         const DirtyListBuild& Future;
         bool EraseFromHistory;
-        QList<Feature*> Updated;
-        QList<Feature*> AlreadyAdded;
-        QList<bool> EraseResponse;
+        // What the visit of the features already added answered
+        QHash<Feature*, bool> AlreadyAdded;
         bool DeletePass;
         QMap<Node*, bool> TrackPointsToDelete;
         QMap<Way*, bool> RoadsToDelete;
@@ -18,25 +18,34 @@
 #include "DownloadOSM.h"
 #include "MerkaartorPreferences.h"
 #include "Command.h"
+#include "DocumentCommands.h"
+#include "NodeCommands.h"
 #include "Utils.h"
 
 #include <QMessageBox>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QProgressDialog>
 #include <QRegExp>
 
+#define BENCHMARK_CHANGES 100000
+// Changes per diff upload, well under the limit of the API on the size of a changeset
+#define UPLOAD_CHUNK_SIZE 1000
+
 extern int glbAdded, glbUpdated, glbDeleted;
 extern QString glbChangeSetComment;
 
 DirtyListExecutorOSC::DirtyListExecutorOSC(Document* aDoc, const DirtyListBuild& aFuture)
     : DirtyListVisit(aDoc, aFuture, false)
+    , Tasks(0)
     , Done(0)
+    , ChunkSize(0)
     , theDownloader(0)
 {
 }
 
 DirtyListExecutorOSC::DirtyListExecutorOSC(Document* aDoc, const DirtyListBuild& aFuture, const QString& aWeb, const QString& aUser, const QString& aPwd, int aTasks)
-: DirtyListVisit(aDoc, aFuture, false), Tasks(aTasks), Done(0), Web(aWeb), User(aUser), Pwd(aPwd), theDownloader(0)
+: DirtyListVisit(aDoc, aFuture, false), Tasks(aTasks), Done(0), ChunkSize(0), Web(aWeb), User(aUser), Pwd(aPwd), theDownloader(0)
 {
     theDownloader = new Downloader(User, Pwd);
 }
@@ -107,16 +116,7 @@ QByteArray DirtyListExecutorOSC::getChanges()
     Progress->setMaximum(Tasks+2);
     Progress->show();
 
-    OscBuffer.buffer().clear();
-    OscBuffer.open(QIODevice::WriteOnly);
-
-    OscStream.setDevice(&OscBuffer);
-    OscStream.writeStartDocument();
-
-    OscStream.writeStartElement("osmChange ");
-    OscStream.writeAttribute("version", "0.3");
-    OscStream.writeAttribute("generator", QString("Merkaartor %1").arg(STRINGIFY(VERSION)));
-
+    beginChunk();
     runVisit();
 
     SAFE_DELETE(Progress)
@@ -127,6 +127,42 @@ QByteArray DirtyListExecutorOSC::getChanges()
     return OscBuffer.buffer();
 }
 
+void DirtyListExecutorOSC::benchmark()
+{
+    Document theDocument;
+    Layer* theDirtyLayer = theDocument.getDirtyLayer();
+    DrawingLayer* theLayer = theDocument.addDrawingLayer();
+
+    // Half new nodes, half moves of nodes as if downloaded
+    for (int i=0; i<BENCHMARK_CHANGES/2; ++i) {
+        Node* N = g_backend.allocNode(theDirtyLayer, Coord(0.001 * (i % 1000), 0.001 * (i / 1000)));
+        N->setTag("note", "benchmark");
+        theDocument.history().add(new AddFeatureCommand(theDirtyLayer, N, true));
+    }
+    for (int i=0; i<BENCHMARK_CHANGES/2; ++i) {
+        Node* N = g_backend.allocNode(theLayer, Coord(0.001 * (i % 1000), -0.001 * (i / 1000)));
+        N->setId(IFeature::FId(IFeature::Point, i+1));
+        N->setLastUpdated(Feature::OSMServer);
+        theLayer->add(N);
+        theDocument.history().add(new MoveNodeCommand(N, N->position() + Coord(0.0001, 0.0001), theDirtyLayer));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    DirtyListBuild Future;
+    theDocument.history().buildDirtyList(Future);
+    qint64 buildMs = timer.elapsed();
+
+    timer.start();
+    Future.resetUpdates();
+    DirtyListExecutorOSC Exec(&theDocument, Future);
+    QByteArray osc = Exec.getChanges();
+    qint64 changesMs = timer.elapsed();
+
+    qDebug() << "osmChange benchmark:" << BENCHMARK_CHANGES << "edits," << osc.size() << "bytes";
+    qDebug() << "  dirty list:" << buildMs << "ms, osmChange:" << changesMs << "ms";
+}
+
 bool DirtyListExecutorOSC::executeChanges(QWidget* aParent)
 {
     bool ok = true;
@@ -154,20 +190,13 @@ bool DirtyListExecutorOSC::executeChanges(QWidget* aParent)
 
     if ((ok = start()))
     {
-        OscBuffer.buffer().clear();
-        OscBuffer.open(QIODevice::WriteOnly);
-        OscStream.setDevice(&OscBuffer);
-        OscStream.writeStartDocument();
-
-        OscStream.writeStartElement("osmChange ");
-        OscStream.writeAttribute("version", "0.3");
-        OscStream.writeAttribute("generator", QString("Merkaartor %1").arg(STRINGIFY(VERSION)));
+        beginChunk();
 
         Lbl->setText(QApplication::translate("Downloader","Preparing changes"));
-        if ((ok = runVisit())) {
-            Lbl->setText(QApplication::translate("Downloader","Waiting for server response"));
-            ok = stop();
-        }
+        runVisit();
+        // Also after an error, to keep what the server accepted and close the changeset
+        Lbl->setText(QApplication::translate("Downloader","Waiting for server response"));
+        ok = stop() && !inError();
     }
     main->deleteProgressDialog();
 #endif
@@ -202,109 +231,119 @@ bool DirtyListExecutorOSC::start()
     return true;
 }
 
-bool DirtyListExecutorOSC::stop()
+void DirtyListExecutorOSC::beginChunk()
 {
-    QString DataIn, DataOut;
-    QString errFeat;
+    OscBuffer.close();
+    OscBuffer.buffer().clear();
+    OscBuffer.open(QIODevice::WriteOnly);
+    OscStream.setDevice(&OscBuffer);
+    OscStream.writeStartDocument();
+
+    OscStream.writeStartElement("osmChange");
+    OscStream.writeAttribute("version", "0.3");
+    OscStream.writeAttribute("generator", QString("Merkaartor %1").arg(STRINGIFY(VERSION)));
+
+    LastAction.clear();
+    ChunkSize = 0;
+}
+
+/*
+    Uploads the changes written since the last chunk and applies the ids the server gave. The
+    features are written in dependency order, so the ones of the next chunks refer to the new ids.
+*/
+bool DirtyListExecutorOSC::flushChunk()
+{
+    if (inError())
+        return false;
+    if (!ChunkSize)
+        return true;
 
     OscStream.writeEndDocument();
     OscBuffer.close();
-    qDebug() << OscBuffer.buffer();
+
+    QString DataOut;
     QString URL = theDownloader->getURLToUploadDiff(ChangeSetId);
-    switch (sendRequest("POST", URL, QString::fromUtf8(OscBuffer.buffer().data()), DataOut)) {
-    case 200: {
-        QDomDocument resDoc;
-        if (resDoc.setContent(DataOut)) {
-
-            QDomNodeList nl = resDoc.elementsByTagName("diffResult");
-            if (nl.size()) {
-                QDomElement resRoot = nl.at(0).toElement();
-                QDomElement c = resRoot.firstChildElement();
-                while (!c.isNull()) {
-                    IFeature::FeatureType aType = IFeature::FeatureType::Uninitialized;
-                    if (c.tagName() == "node")
-                        aType = IFeature::Point;
-                    else if (c.tagName() == "way")
-                        aType = IFeature::LineString;
-                    else if (c.tagName() == "relation")
-                        aType = IFeature::OsmRelation;
-                    else {
-                        qDebug() << "Unknown element found in response.";
-                    }
-
-                    Feature* F = theDocument->getFeature(IFeature::FId(aType, c.attribute("old_id").toLongLong()));
-                    if (F) {
-                        F->setId(IFeature::FId(aType, c.attribute("new_id").toLongLong()));
-                        F->setVersionNumber(c.attribute("new_version").toInt());
-                        F->setLastUpdated(Feature::OSMServer);
-                        F->setUser("me");
-                        F->setTime(QDateTime::currentDateTime());
-
-                        if (!g_Merk_Frisius) {
-                            F->layer()->remove(F);
-                            document()->getUploadedLayer()->add(F);
-                        }
-                        F->setUploaded(true);
-                        F->setDirtyLevel(0);
-
-                    } else
-                        qDebug() << "Feature not found in diff upload result: " << c.attribute("old_id");
-
-                    c = c.nextSiblingElement();
-                }
-                theDocument->history().cleanup();
-            }
-        }
-        break;
+    if (sendRequest("POST", URL, QString::fromUtf8(OscBuffer.buffer().data()), DataOut) != 200) {
+        // Conflicts and gone features are for the user to sort out from what is left
+        errorAbort = true;
+        return false;
     }
+    applyDiffResult(DataOut);
+    if (g_Merk_Benchmark)
+        qDebug() << QString("Upload: chunk of %1 changes done, %2 in all").arg(ChunkSize).arg(Uploaded.size());
 
-    case 409: {    // Confilct
-//            QRegExp rx(".*node.*(\\d+)", Qt::CaseInsensitive);
-//            if (rx.indexIn(DataOut) > -1) {
-//                errFeat = "node_" + rx.cap(1);
-//            } else {
-//                QRegExp rx(".*way.*(\\d+)", Qt::CaseInsensitive);
-//                if (rx.indexIn(DataOut) > -1) {
-//                    errFeat = "way_" + rx.cap(1);
-//                } else {
-//                    QRegExp rx(".*relation.*(\\d+)", Qt::CaseInsensitive);
-//                    if (rx.indexIn(DataOut) > -1) {
-//                        errFeat = "rel_" + rx.cap(1);
-//                    }
-//                }
-//            }
-//            qDebug() << errFeat;
-            break;
-        }
-    case 410: {    // Gone
-//            QRegExp rx(".*node.*(\\d+)", Qt::CaseInsensitive);
-//            if (rx.indexIn(DataOut) > -1) {
-//                errFeat = "node_" + rx.cap(1);
-//            } else {
-//                QRegExp rx(".*way.*(\\d+)", Qt::CaseInsensitive);
-//                if (rx.indexIn(DataOut) > -1) {
-//                    errFeat = "way_" + rx.cap(1);
-//                } else {
-//                    QRegExp rx(".*relation.*(\\d+)", Qt::CaseInsensitive);
-//                    if (rx.indexIn(DataOut) > -1) {
-//                        errFeat = "rel_" + rx.cap(1);
-//                    }
-//                }
-//            }
-//            qDebug() << errFeat;
-            break;
+    beginChunk();
+    return true;
+}
+
+void DirtyListExecutorOSC::applyDiffResult(const QString& DataOut)
+{
+    QDomDocument resDoc;
+    if (!resDoc.setContent(DataOut))
+        return;
+
+    QDomNodeList nl = resDoc.elementsByTagName("diffResult");
+    if (!nl.size())
+        return;
+
+    QDomElement resRoot = nl.at(0).toElement();
+    QDomElement c = resRoot.firstChildElement();
+    while (!c.isNull()) {
+        IFeature::FeatureType aType = IFeature::FeatureType::Uninitialized;
+        if (c.tagName() == "node")
+            aType = IFeature::Point;
+        else if (c.tagName() == "way")
+            aType = IFeature::LineString;
+        else if (c.tagName() == "relation")
+            aType = IFeature::OsmRelation;
+        else {
+            qDebug() << "Unknown element found in response.";
         }
 
-    default:
-        break;
+        Feature* F = theDocument->getFeature(IFeature::FId(aType, c.attribute("old_id").toLongLong()));
+        if (F) {
+            // Deleted features get no new id
+            if (c.hasAttribute("new_id")) {
+                F->setId(IFeature::FId(aType, c.attribute("new_id").toLongLong()));
+                F->setVersionNumber(c.attribute("new_version").toInt());
+            }
+            F->setLastUpdated(Feature::OSMServer);
+            F->setUser("me");
+            F->setTime(QDateTime::currentDateTime());
+            F->setDirtyLevel(0);
+            Uploaded << F;
+        } else
+            qDebug() << "Feature not found in diff upload result: " << c.attribute("old_id");
+
+        c = c.nextSiblingElement();
     }
+}
+
+bool DirtyListExecutorOSC::stop()
+{
+    QString DataIn;
+
+    flushChunk();
+
+    /* The features accepted by the server leave the dirty layer only now, as the history is being
+     * visited until the last chunk. After an error, the next upload resumes with the others. */
+    for (int i=0; i<Uploaded.size(); ++i) {
+        Feature* F = Uploaded[i];
+        if (!g_Merk_Frisius) {
+            F->layer()->remove(F);
+            document()->getUploadedLayer()->add(F);
+        }
+        F->setUploaded(true);
+    }
+    if (!inError() && Uploaded.size())
+        theDocument->history().cleanup();
 
     qDebug() << QString("CLOSE changeset");
 
     Progress->setLabelText(tr("CLOSE changeset"));
     QEventLoop L; L.processEvents(QEventLoop::ExcludeUserInputEvents);
 
-    URL = theDownloader->getURLToCloseChangeSet(ChangeSetId);
+    QString URL = theDownloader->getURLToCloseChangeSet(ChangeSetId);
     QUrl theUrl(Web+URL);
     theDownloader->setAnimator(NULL, NULL, NULL, false);
     if (!theDownloader->request("PUT",theUrl,DataIn)) {
@@ -314,8 +353,18 @@ bool DirtyListExecutorOSC::stop()
     return true;
 }
 
+// Uploads the chunk once full; exporting to a file makes a single one
+void DirtyListExecutorOSC::endChange()
+{
+    if (theDownloader && ++ChunkSize >= UPLOAD_CHUNK_SIZE)
+        flushChunk();
+}
+
 void DirtyListExecutorOSC::OscCreate(Feature* F)
 {
+    if (inError())
+        return;
+
     if (LastAction != "create") {
         if (!LastAction.isEmpty())
             OscStream.writeEndElement();
@@ -324,10 +373,14 @@ void DirtyListExecutorOSC::OscCreate(Feature* F)
     }
 
     F->toXML(OscStream, Progress, true, ChangeSetId);
+    endChange();
 }
 
 void DirtyListExecutorOSC::OscModify(Feature* F)
 {
+    if (inError())
+        return;
+
     if (LastAction != "modify") {
         if (!LastAction.isEmpty())
             OscStream.writeEndElement();
@@ -336,18 +389,23 @@ void DirtyListExecutorOSC::OscModify(Feature* F)
     }
 
     F->toXML(OscStream, Progress, true, ChangeSetId);
+    endChange();
 }
 
 void DirtyListExecutorOSC::OscDelete(Feature* F)
 {
+    if (inError())
+        return;
+
     if (LastAction != "delete") {
         if (!LastAction.isEmpty())
             OscStream.writeEndElement();
         OscStream.writeStartElement("delete");
-        LastAction = "modify";
+        LastAction = "delete";
     }
 
     F->toXML(OscStream, Progress, true, ChangeSetId);
+    endChange();
 }
 
 
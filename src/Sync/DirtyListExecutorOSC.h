@@ -48,14 +48,25 @@ public:
     bool executeChanges(QWidget* Parent);
     QByteArray getChanges();
 
+    // Logs the time taken to build the osmChange of many synthetic edits
+    static void benchmark();
+
 private:
     int sendRequest(const QString& Method, const QString& URL, const QString& Out, QString& Rcv);
+    void beginChunk();
+    void endChange();
+    bool flushChunk();
+    void applyDiffResult(const QString& DataOut);
 
     QXmlStreamWriter OscStream;
     QBuffer OscBuffer;
 
     Ui::SyncListDialog Ui;
     int Tasks, Done;
+    // Changes written to the chunk being built
+    int ChunkSize;
+    // Accepted by the server, moved to the uploaded layer at the end
+    QList<Feature*> Uploaded;
     QProgressDialog* Progress;
     QString Web,User,Pwd;
     Downloader* theDownloader;
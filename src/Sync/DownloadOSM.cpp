@@ -32,7 +32,8 @@
 
 Downloader::Downloader(const QString& aUser, const QString& aPwd)
 : User(aUser), Password(aPwd),
-  currentReply(0),Error(false), AnimatorLabel(0), AnimatorBar(0), AnimationTimer(0)
+  currentReply(0),Error(false), AnimatorLabel(0), AnimatorBar(0), AnimationTimer(0),
+  Sink(0), Feeding(false)
 {
     //IdAuth = Request.setUser(User.toUtf8(), Password.toUtf8());
     connect(&netManager,SIGNAL(finished(QNetworkReply*)),this,SLOT(on_requestFinished(QNetworkReply*)));
@@ -66,6 +67,11 @@ void Downloader::setAnimator(QProgressDialog *anAnimator, QLabel* anAnimatorLabe
     }
 }
 
+void Downloader::setSink(DownloadSink* aSink)
+{
+    Sink = aSink;
+}
+
 void Downloader::on_Cancel_clicked()
 {
     Error = true;
@@ -89,6 +95,7 @@ bool Downloader::request(const QString& theMethod, const QUrl& url, const QStrin
 
     req.setRawHeader(QByteArray("Content-Type"), QByteArray("text/xml"));
     req.setRawHeader(QByteArray("User-Agent"), USER_AGENT.toLatin1());
+    // No Accept-Encoding: the network manager then asks for gzip itself and inflates the body
 
     QByteArray dataArray(theData.toUtf8());
     QBuffer dataBuffer(&dataArray);
@@ -98,8 +105,13 @@ bool Downloader::request(const QString& theMethod, const QUrl& url, const QStrin
         AnimationTimer->start(200);
         connect(currentReply,SIGNAL(downloadProgress(qint64, qint64)), this,SLOT(progress(qint64, qint64)));
     }
+    if (Sink)
+        connect(currentReply,SIGNAL(readyRead()), this,SLOT(on_readyRead()));
 
-    if (Loop.exec() == QDialog::Rejected)
+    int Exit = Loop.exec();
+    if (Sink)
+        disconnect(currentReply,SIGNAL(readyRead()), this,SLOT(on_readyRead()));
+    if (Exit == QDialog::Rejected)
         return false;
 
     if (AnimationTimer)
@@ -121,8 +133,12 @@ bool Downloader::request(const QString& theMethod, const QUrl& url, const QStrin
 
 
     /* Read the data */
-    Content = currentReply->readAll();
     Result = currentReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (Sink && Result == 200) {
+        Content.clear();
+        on_readyRead();
+    } else
+        Content = currentReply->readAll();
     ResultText = currentReply->errorString();
     ErrorText = currentReply->rawHeader("Error");
     return !Error;
@@ -154,6 +170,26 @@ void Downloader::on_requestFinished( QNetworkReply *reply)
         Loop.exit(QDialog::Accepted);
 }
 
+void Downloader::on_readyRead()
+{
+    // The bodies of errors and redirections are kept for content()
+    if (!Sink || Feeding || currentReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200)
+        return;
+
+    // The sink may process events, in which more data can come in: it is read by this loop
+    Feeding = true;
+    while (!Error && currentReply->bytesAvailable()) {
+        QByteArray Chunk = currentReply->readAll();
+        if (!Sink->write(Chunk.constData(), Chunk.size())) {
+            Error = true;
+            currentReply->abort();
+            if (Loop.isRunning())
+                Loop.exit(QDialog::Rejected);
+        }
+    }
+    Feeding = false;
+}
+
 void Downloader::progress(qint64 done, qint64 total)
 {
     if (AnimatorLabel && AnimatorBar)
@@ -275,6 +311,9 @@ QString Downloader::getURLToTrackPoints()
 bool downloadOSM(QWidget* aParent, const QUrl& theUrl, const QString& aUser, const QString& aPassword, Document* theDocument, Layer* theLayer)
 {
     Downloader Rcv(aUser, aPassword);
+    // Parsed while it downloads
+    OSMStreamImport Import(aParent, theDocument, theLayer);
+    Rcv.setSink(&Import);
 
     IProgressWindow* aProgressWindow = dynamic_cast<IProgressWindow*>(aParent);
     if (aProgressWindow) {
@@ -338,7 +377,7 @@ bool downloadOSM(QWidget* aParent, const QUrl& theUrl, const QString& aUser, con
         return false;
     }
     Downloader Down(aUser, aPassword);
-    bool OK = importOSM(aParent, Rcv.content(), theDocument, theLayer, &Down);
+    bool OK = Import.finish(&Down);
     return OK;
 }
 
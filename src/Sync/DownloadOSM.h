@@ -23,6 +23,16 @@ class SpecialLayer;
 
 #include "IFeature.h"
 
+/* Takes the body of a successful download as it arrives, instead of Downloader::content() */
+class DownloadSink
+{
+    public:
+        virtual ~DownloadSink() {}
+
+        // Returns false to cancel the download
+        virtual bool write(const char* data, qint64 size) = 0;
+};
+
 class Downloader : public QObject
 {
     Q_OBJECT
@@ -50,10 +60,12 @@ class Downloader : public QObject
         QString getURLToCloseChangeSet(const QString& Id);
         QString getURLToUploadDiff(QString changesetId);
         void setAnimator(QProgressDialog *anAnimator, QLabel* AnimatorLabel, QProgressBar* AnimatorBar, bool anAnimate);
+        void setSink(DownloadSink* aSink);
 
     public slots:
         void progress( qint64 done, qint64 total );
         void on_requestFinished( QNetworkReply *reply);
+        void on_readyRead();
         void on_authenticationRequired( QNetworkReply *reply, QAuthenticator *auth);
         void animate();
         void on_Cancel_clicked();
@@ -73,6 +85,8 @@ class Downloader : public QObject
         QLabel* AnimatorLabel;
         QProgressBar* AnimatorBar;
         QTimer *AnimationTimer;
+        DownloadSink* Sink;
+        bool Feeding;
 };
 
 bool downloadOSM(MainWindow* Main, const CoordBox& aBox , Document* theDocument);
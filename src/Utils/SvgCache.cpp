@@ -1,35 +1,174 @@
 #include "SvgCache.h"
+#include "Global.h"
 
-#include <QtCore/QMap>
 #include <QtCore/QPair>
+#include <QtCore/QVector>
 #include <QtGui/QPainter>
 #include <QtSvg/QSvgRenderer>
 #include <QFileInfo>
 #include <QDebug>
 
-QImage* getSVGImageFromFile(const QString& aName, int Size)
-{
-    static QMap<QPair<QString, int>, QImage> Cache;
-    QPair<QString, int> Key(aName,Size);
-    if (!Cache.contains(Key))
-    {
-        QFileInfo fi(aName);
-        if (fi.suffix().toUpper() == "SVG") {
-            if (!Size)
-                Size = 16;
-            QImage result(Size, Size, QImage::Format_ARGB32_Premultiplied);
-            result.fill(Qt::transparent);
-            QPainter p(&result);
-            QSvgRenderer Monet(aName);
-            Monet.render(&p,QRectF(0,0,Size,Size));
-            Cache[Key] = result;
+#include <algorithm>
+
+#define MAX_ICONS 4096
+// Sizes 0 to 256 pixels are cached, bigger icons are rasterized each time
+#define ICON_SIZES 257
+
+struct IconCache::Icon
+{
+    QString name;
+    QAtomicPointer<Entry> sizes[ICON_SIZES];
+};
+
+IconCache* IconCache::instance()
+{
+    static IconCache theCache;
+    return &theCache;
+}
+
+IconCache::IconCache()
+    : theIcons(new Icon*[MAX_ICONS]), theIconCount(1), bytes(0)
+{
+    // Id 0 is no icon
+    theIcons[0] = 0;
+#ifndef _MOBILE
+    maxBytes = 32*1024*1024;
+#else
+    maxBytes = 8*1024*1024;
+#endif
+}
+
+IconCache::~IconCache()
+{
+    for (int i=1; i<theIconCount.load(); ++i) {
+        for (int s=0; s<ICON_SIZES; ++s)
+            delete theIcons[i]->sizes[s].load();
+        delete theIcons[i];
+    }
+    delete [] theIcons;
+}
+
+QImage IconCache::rasterize(const QString& name, int size)
+{
+    QFileInfo fi(name);
+    if (fi.suffix().toUpper() == "SVG") {
+        if (!size)
+            size = 16;
+        QImage result(size, size, QImage::Format_ARGB32_Premultiplied);
+        result.fill(Qt::transparent);
+        QPainter p(&result);
+        QSvgRenderer Monet(name);
+        Monet.render(&p,QRectF(0,0,size,size));
+        return result;
+    } else {
+        QImage result(name);
+        if (size && !result.isNull())
+            result = result.scaledToWidth(size);
+        return result;
+    }
+}
+
+int IconCache::iconId(const QString& name)
+{
+    if (name.isEmpty())
+        return 0;
+
+    QMutexLocker locker(&lock);
+    QHash<QString, int>::const_iterator it = theIds.constFind(name);
+    if (it != theIds.constEnd())
+        return it.value();
+
+    int id = theIconCount.load();
+    if (id >= MAX_ICONS) {
+        qDebug() << "IconCache: too many icons, not caching" << name;
+        return 0;
+    }
+    Icon* icon = new Icon;
+    icon->name = name;
+    theIcons[id] = icon;
+    theIds.insert(name, id);
+    // Publishes theIcons[id] to the threads that check the count
+    theIconCount.storeRelease(id + 1);
+    return id;
+}
+
+QImage IconCache::image(int id, int size)
+{
+    if (id <= 0 || id >= theIconCount.loadAcquire() || size < 0)
+        return QImage();
+    Icon* icon = theIcons[id];
+    if (size >= ICON_SIZES)
+        return rasterize(icon->name, size);
+
+    Entry* e = icon->sizes[size].loadAcquire();
+    if (!e) {
+        e = new Entry;
+        e->image = rasterize(icon->name, size);
+        e->lastUse.store(theEpoch.load());
+        if (icon->sizes[size].testAndSetOrdered(0, e)) {
+            QMutexLocker locker(&lock);
+            bytes += e->image.byteCount();
         } else {
-            QImage result(aName);
-            if (Size)
-                result = result.scaledToWidth(Size);
-            Cache[Key] = result;
+            // Another thread was faster
+            delete e;
+            e = icon->sizes[size].loadAcquire();
+        }
+    }
+
+    int epoch = theEpoch.load();
+    if (e->lastUse.load() != epoch)
+        e->lastUse.store(epoch);
+    return e->image;
+}
+
+void IconCache::preload(int id, int size)
+{
+    image(id, size);
+}
+
+static bool lessUse(const QPair<int, QPair<int, int> >& a, const QPair<int, QPair<int, int> >& b)
+{
+    return a.first < b.first;
+}
+
+void IconCache::maintain()
+{
+    QMutexLocker locker(&lock);
+    theEpoch.ref();
+    if (bytes <= maxBytes)
+        return;
+
+    // Least recently used first, down to 3/4 of the budget
+    QVector<QPair<int, QPair<int, int> > > byUse;
+    int count = theIconCount.load();
+    for (int i=1; i<count; ++i)
+        for (int s=0; s<ICON_SIZES; ++s) {
+            Entry* e = theIcons[i]->sizes[s].load();
+            if (e)
+                byUse.append(qMakePair(e->lastUse.load(), qMakePair(i, s)));
         }
+    std::sort(byUse.begin(), byUse.end(), lessUse);
+
+    int evicted = 0;
+    for (int i=0; i<byUse.size() && bytes > maxBytes * 3 / 4; ++i, ++evicted) {
+        QAtomicPointer<Entry>& slot = theIcons[byUse[i].second.first]->sizes[byUse[i].second.second];
+        Entry* e = slot.load();
+        slot.store(0);
+        bytes -= e->image.byteCount();
+        delete e;
     }
-    return &(Cache[Key]);
+    if (g_Merk_Benchmark)
+        qDebug() << "IconCache: evicted" << evicted << "icons," << bytes << "bytes left";
 }
 
+qint64 IconCache::size() const
+{
+    QMutexLocker locker(&lock);
+    return bytes;
+}
+
+QImage getSVGImageFromFile(const QString& aName, int Size)
+{
+    IconCache* cache = IconCache::instance();
+    return cache->image(cache->iconId(aName), Size);
+}
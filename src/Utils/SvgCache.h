@@ -1,8 +1,61 @@
 #ifndef MERKAARTOR_SVGCACHE_H_
 #define MERKAARTOR_SVGCACHE_H_
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QHash>
 #include <QImage>
+#include <QMutex>
+#include <QString>
 
-QImage* getSVGImageFromFile(const QString& aName, int Size);
+/**
+    Rasterized icons, shared by the render workers.
+
+    Icons are registered once by file name, e.g. when a style is loaded, and then looked up by id
+    and size without locking: each icon has a slot per size, filled on first use (or beforehand with
+    preload) and never replaced. Sizes are in pixels; size 0 is the natural size of a bitmap, 16
+    pixels for an SVG.
+
+    The cache has a memory budget. Going over it is allowed until maintain() evicts the icons least
+    recently used; as images may be in use by a lookup, maintain() must only be called while no
+    render is running.
+*/
+class IconCache
+{
+public:
+    static IconCache* instance();
+
+    // Id of the icon file, 0 for none
+    int iconId(const QString& name);
+    // Null image if the file cannot be read
+    QImage image(int id, int size);
+    void preload(int id, int size);
+
+    void maintain();
+    qint64 size() const;
+
+private:
+    IconCache();
+    ~IconCache();
+
+    struct Entry {
+        QImage image;
+        QAtomicInt lastUse;
+    };
+    struct Icon;
+
+    static QImage rasterize(const QString& name, int size);
+
+    mutable QMutex lock;
+    QHash<QString, int> theIds;
+    Icon** theIcons;
+    QAtomicInt theIconCount;
+    qint64 bytes;
+    qint64 maxBytes;
+    // Bumped at each maintain(), to tell recently used icons
+    QAtomicInt theEpoch;
+};
+
+QImage getSVGImageFromFile(const QString& aName, int Size);
 
 #endif
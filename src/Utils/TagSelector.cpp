@@ -343,6 +343,11 @@ TagSelector::~TagSelector()
 {
 }
 
+bool TagSelector::requiredKeys(QStringList& /*keys*/) const
+{
+    return false;
+}
+
 
 /* TAGSELECTOROPERATOR */
 
@@ -776,6 +781,15 @@ QString TagSelectorOperator::asExpression(bool) const
     return "[" + Key + "]" + Oper + Value;
 }
 
+bool TagSelectorOperator::requiredKeys(QStringList& keys) const
+{
+    // A missing tag never matches, unless testing for _NULL_
+    if (specialKey != TagSelectKey_None || Key == "*" || specialValue == TagSelectValue_Empty)
+        return false;
+    keys << Key;
+    return true;
+}
+
 /* TAGSELECTORISONEOF */
 
 TagSelectorIsOneOf::TagSelectorIsOneOf(const QString& key, const QStringList& values)
@@ -872,6 +886,21 @@ QString TagSelectorIsOneOf::asExpression(bool) const
     return "[" + Key + "] isoneof (" + Values.join(" , ") + ")";
 }
 
+bool TagSelectorIsOneOf::requiredKeys(QStringList& keys) const
+{
+    if (specialKey != TagSelectKey_None || specialValue == TagSelectValue_Empty)
+        return false;
+    // A missing tag is seen as emptyString: make sure none of the values accepts it
+    if (exactMatchv.contains(emptyString))
+        return false;
+    foreach (QRegExp pattern, rxv) {
+        if (pattern.exactMatch(emptyString))
+            return false;
+    }
+    keys << Key;
+    return true;
+}
+
 /* TAGSELECTORTYPEIS */
 
 TagSelectorTypeIs::TagSelectorTypeIs(const QString& type)
@@ -961,6 +990,17 @@ TagSelectorMatchResult TagSelectorOr::matches(const IFeature* F, qreal PixelPerM
     return TagSelect_NoMatch;
 }
 
+bool TagSelectorOr::requiredKeys(QStringList& keys) const
+{
+    // Every term must need a key
+    QStringList termKeys;
+    for (int i=0; i<Terms.size(); ++i)
+        if (!Terms[i]->requiredKeys(termKeys))
+            return false;
+    keys << termKeys;
+    return true;
+}
+
 QString TagSelectorOr::asExpression(bool Precedence) const
 {
     QString R;
@@ -1006,6 +1046,24 @@ TagSelectorMatchResult TagSelectorAnd::matches(const IFeature* F, qreal PixelPer
     return TagSelect_Match;
 }
 
+bool TagSelectorAnd::requiredKeys(QStringList& keys) const
+{
+    // Any term needing keys will do: take the most selective one
+    bool found = false;
+    QStringList bestKeys;
+    for (int i=0; i<Terms.size(); ++i) {
+        QStringList termKeys;
+        if (!Terms[i]->requiredKeys(termKeys))
+            continue;
+        if (!found || termKeys.size() < bestKeys.size())
+            bestKeys = termKeys;
+        found = true;
+    }
+    if (found)
+        keys << bestKeys;
+    return found;
+}
+
 QString TagSelectorAnd::asExpression(bool /* Precedence */) const
 {
     QString R;
@@ -1108,6 +1166,12 @@ TagSelectorMatchResult TagSelectorFalse::matches(const IFeature* /* F */, qreal
     return TagSelect_NoMatch;
 }
 
+bool TagSelectorFalse::requiredKeys(QStringList& /*keys*/) const
+{
+    // Never matches
+    return true;
+}
+
 QString TagSelectorFalse::asExpression(bool /* Precedence */) const
 {
     return " false ";
@@ -1160,6 +1224,11 @@ TagSelectorMatchResult TagSelectorDefault::matches(const IFeature* F, qreal Pixe
         return TagSelect_NoMatch;
 }
 
+bool TagSelectorDefault::requiredKeys(QStringList& keys) const
+{
+    return Term->requiredKeys(keys);
+}
+
 QString TagSelectorDefault::asExpression(bool /* Precedence */) const
 {
     return " [Default] " + Term->asExpression(true);
@@ -42,6 +42,10 @@ class TagSelector
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const = 0;
         virtual QString asExpression(bool Precedence) const = 0;
 
+        /* Fills keys with tag keys of which at least one must be set on a feature for it to match.
+         * Returns false if there is no such set, i.e. the selector has to be tested on every feature. */
+        virtual bool requiredKeys(QStringList& keys) const;
+
         static TagSelector* parse(const QString& Expression);
         static TagSelector* parse(const QString& Expression, int& idx);
 };
@@ -62,6 +66,7 @@ class TagSelectorOperator : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredKeys(QStringList& keys) const;
 
     private:
         TagSelectorMatchResult evaluateVal(const QString& val) const;
@@ -88,6 +93,7 @@ class TagSelectorIsOneOf : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredKeys(QStringList& keys) const;
 
     private:
         QList<QRegExp> rxv;
@@ -133,6 +139,7 @@ class TagSelectorOr : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredKeys(QStringList& keys) const;
 
     private:
         QList<TagSelector*> Terms;
@@ -147,6 +154,7 @@ class TagSelectorAnd : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredKeys(QStringList& keys) const;
 
     private:
         QList<TagSelector*> Terms;
@@ -188,6 +196,7 @@ class TagSelectorFalse : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredKeys(QStringList& keys) const;
 };
 
 class TagSelectorTrue : public TagSelector
@@ -209,6 +218,7 @@ class TagSelectorDefault : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredKeys(QStringList& keys) const;
 
     private:
         TagSelector* Term;
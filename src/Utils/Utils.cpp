@@ -17,6 +17,11 @@
 #include <QNetworkReply>
 #include <QEventLoop>
 #include <QTimer>
+#include <QFile>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
 
 const QString Utils::encodeAttributes(const QString & text)
 {
@@ -113,3 +118,18 @@ bool Utils::sendBlockingNetRequest(const QUrl& theUrl, QString& reply)
     return true;
 }
 
+/* Resident set size of the process in bytes, -1 if unknown */
+qint64 Utils::residentMemory()
+{
+#if defined(Q_OS_LINUX)
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly))
+        return -1;
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2)
+        return -1;
+    return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
@@ -28,6 +28,7 @@ public:
     static const QString encodeAttributes(const QString & text);
     static bool QRectInterstects(const QRectF& r, const QLineF& l, QPointF& a, QPointF& b);
     static bool sendBlockingNetRequest(const QUrl& theUrl, QString& reply);
+    static qint64 residentMemory();
 };
 
 #endif // UTILS_H
@@ -25,6 +25,8 @@
 
 #include "LayerIterator.h"
 #include "IMapAdapter.h"
+#include "FeatureIdIndex.h"
+#include "TagIndex.h"
 
 
 #include <QString>
@@ -37,6 +39,9 @@
 #include <QMenu>
 #include <QSet>
 #include <QReadWriteLock>
+#include <QElapsedTimer>
+
+#include <algorithm>
 
 /* MAPDOCUMENT */
 
@@ -50,7 +55,7 @@ public:
         /*, trashLayer(0)*/
         , theDock(0)
         , lastDownloadLayer(0)
-        , tagFilter(0), FilterRevision(0)
+        , tagFilter(0), FilterRevision(0), PaintersRevision(0)
         , layerNum(0)
         , theFeaturePaintersLock( QReadWriteLock::Recursive )
     {
@@ -59,6 +64,8 @@ public:
     {
         History->cleanup();
         delete History;
+        // The layers are going away with us, no use keeping the id index up to date
+        indexedLayers.clear();
         for (int i=0; i<Layers.size(); ++i) {
             if (theDock)
                 theDock->deleteLayer(Layers[i]);
@@ -76,14 +83,77 @@ public:
 
     TagSelector* tagFilter;
     int FilterRevision;
+    int PaintersRevision;
     QString title;
     int layerNum;
     mutable QString Id;
 
     QList<FeaturePainter> theFeaturePainters;
     QReadWriteLock theFeaturePaintersLock;
+
+    /* Painters by tag key id, for the painters whose selector needs one of a set of keys; the others
+     * have to be tested on every feature */
+    QHash<quint32, QVector<int> > painterIndexByKey;
+    QVector<int> unindexedPainters;
+
+    /* Ids of the features of all the layers of the document */
+    FeatureIdIndex featureIndex;
+    QSet<Layer*> indexedLayers;
+    /* Tag keys of the features of the same layers */
+    TagIndex tagIndex;
+
+    void buildPainterIndex();
+    void indexLayer(Layer* aLayer);
+    void unindexLayer(Layer* aLayer);
 };
 
+void MapDocumentPrivate::buildPainterIndex()
+{
+    painterIndexByKey.clear();
+    unindexedPainters.clear();
+    for (int i=0; i<theFeaturePainters.size(); ++i) {
+        QStringList keys;
+        const TagSelector* selector = theFeaturePainters[i].theTagSelector;
+        if (!selector) // never matches
+            continue;
+        if (!selector->requiredKeys(keys)) {
+            unindexedPainters << i;
+            continue;
+        }
+        keys.removeDuplicates();
+        foreach (QString k, keys)
+            painterIndexByKey[g_setTagKey(k)] << i;
+    }
+}
+
+void MapDocumentPrivate::indexLayer(Layer* aLayer)
+{
+    if (indexedLayers.contains(aLayer))
+        return;
+    indexedLayers.insert(aLayer);
+    for (int i=0; i<aLayer->size(); ++i) {
+        Feature* F = aLayer->get(i);
+        if (!F)
+            continue;
+        if (!F->isVirtual())
+            featureIndex.insert(F->id(), F);
+        tagIndex.insertTags(F);
+    }
+}
+
+void MapDocumentPrivate::unindexLayer(Layer* aLayer)
+{
+    if (!indexedLayers.remove(aLayer))
+        return;
+    for (int i=0; i<aLayer->size(); ++i) {
+        Feature* F = aLayer->get(i);
+        if (F) {
+            featureIndex.remove(F->id().numId, F);
+            tagIndex.removeTags(F);
+        }
+    }
+}
+
 Document::Document()
     : p(new MapDocumentPrivate)
 {
@@ -93,6 +163,7 @@ Document::Document()
     for (int i=0; i<M_STYLE->painterSize(); ++i) {
         p->theFeaturePainters.append(FeaturePainter(*M_STYLE->getPainter(i)));
     }
+    p->buildPainterIndex();
 }
 
 Document::Document(LayerDock* aDock)
@@ -105,6 +176,7 @@ Document::Document(LayerDock* aDock)
     for (int i=0; i<M_STYLE->painterSize(); ++i) {
         p->theFeaturePainters.append(FeaturePainter(*M_STYLE->getPainter(i)));
     }
+    p->buildPainterIndex();
 }
 
 Document::Document(const Document&, LayerDock*)
@@ -133,11 +205,75 @@ void Document::setPainters(QList<Painter> aPainters)
         FeaturePainter fp(aPainters[i]);
         p->theFeaturePainters.append(fp);
     }
+    p->buildPainterIndex();
+    ++p->PaintersRevision;
     for (FeatureIterator it(this); !it.isEnd(); ++it)
     {
         it.get()->invalidatePainter();
     }
     unlockPainters();
+
+    if (g_Merk_Benchmark)
+        benchmarkPainters();
+}
+
+void Document::benchmarkPainters()
+{
+    lockPainters();
+
+    QElapsedTimer timer;
+    timer.start();
+    int features = 0;
+    int painted = 0;
+    for (FeatureIterator it(this); !it.isEnd(); ++it) {
+        it.get()->invalidatePainter();
+        if (it.get()->hasPainter())
+            ++painted;
+        ++features;
+    }
+    qint64 indexedTime = timer.elapsed();
+
+    timer.restart();
+    int matched = 0;
+    for (FeatureIterator it(this); !it.isEnd(); ++it) {
+        for (int i=0; i<p->theFeaturePainters.size(); ++i)
+            if (p->theFeaturePainters[i].matchesTag(it.get(), NULL) != TagSelect_NoMatch) {
+                ++matched;
+                break;
+            }
+    }
+    qint64 bruteTime = timer.elapsed();
+
+    qDebug() << "Style assignment:" << features << "features," << p->theFeaturePainters.size() << "painters ("
+             << p->unindexedPainters.size() << "unindexed," << p->painterIndexByKey.size() << "keys)";
+    qDebug() << "  indexed:" << indexedTime << "ms," << painted << "painted";
+    qDebug() << "  brute force:" << bruteTime << "ms," << matched << "matched";
+
+    unlockPainters();
+}
+
+void Document::getPossiblePainters(const QList<QPair<quint32, quint32> >& Tags, QVector<int>& indices) const
+{
+    indices = p->unindexedPainters;
+    int indexed = 0;
+    for (int i=0; i<Tags.size(); ++i) {
+        QHash<quint32, QVector<int> >::const_iterator it = p->painterIndexByKey.constFind(Tags[i].first);
+        if (it == p->painterIndexByKey.constEnd())
+            continue;
+        indices += it.value();
+        ++indexed;
+    }
+    if (!indexed || (indexed == 1 && p->unindexedPainters.isEmpty()))
+        return;
+
+    // Back to style order, without painters found through several keys
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+}
+
+int Document::paintersRevision() const
+{
+    return p->PaintersRevision;
 }
 
 int Document::getPaintersSize()
@@ -357,6 +493,7 @@ void Document::add(Layer* aLayer)
 {
     p->Layers.push_back(aLayer);
     aLayer->setDocument(this);
+    p->indexLayer(aLayer);
     if (p->theDock)
         p->theDock->addLayer(aLayer);
 }
@@ -399,9 +536,15 @@ FilterLayer* Document::addFilterLayer(FilterLayer *aLayer)
         theLayer = new FilterLayer(QUuid::createUuid().toString(), tr("Filter layer #%1").arg(++p->layerNum), "false");
     add(theLayer);
 
-    FeatureIterator it(this);
-    for(;!it.isEnd(); ++it) {
-        it.get()->updateFilters();
+    QList<Feature*> candidates;
+    if (getTagCandidates(theLayer->selector(), candidates)) {
+        foreach (Feature* F, candidates)
+            F->updateFilters();
+    } else {
+        FeatureIterator it(this);
+        for(;!it.isEnd(); ++it) {
+            it.get()->updateFilters();
+        }
     }
 
     return theLayer;
@@ -412,6 +555,7 @@ void Document::remove(Layer* aLayer)
     QList<Layer*>::iterator i = qFind(p->Layers.begin(),p->Layers.end(), aLayer);
     if (i != p->Layers.end()) {
         p->Layers.erase(i);
+        p->unindexLayer(aLayer);
     }
     if (aLayer == p->lastDownloadLayer)
         p->lastDownloadLayer = NULL;
@@ -481,13 +625,113 @@ QList<Feature*> Document::getFeatures(Layer::LayerType layerType)
 
 Feature* Document::getFeature(const IFeature::FId& id)
 {
+    QVarLengthArray<Feature*, 4> found;
+    if (p->featureIndex.findAll(id, found) <= 1)
+        return (found.size() && p->indexedLayers.contains(found[0]->layer())) ? found[0] : NULL;
+
+    // The same id in several layers: the first layer wins, as with a scan of the layers
+    Feature* F = NULL;
+    int best = p->Layers.size();
+    for (int i=0; i<found.size(); ++i) {
+        int idx = p->Layers.indexOf(found[i]->layer());
+        if (idx != -1 && idx < best) {
+            best = idx;
+            F = found[i];
+        }
+    }
+    return F;
+}
+
+void Document::notifyIdUpdate(Layer* aLayer, const IFeature::FId& id, Feature* aFeature, bool added)
+{
+    if (!p->indexedLayers.contains(aLayer))
+        return;
+    if (added)
+        p->featureIndex.insert(id, aFeature);
+    else
+        p->featureIndex.remove(id.numId, aFeature);
+}
+
+void Document::notifyTagUpdate(Layer* aLayer, Feature* aFeature, quint32 key, bool added)
+{
+    if (!p->indexedLayers.contains(aLayer))
+        return;
+    if (added)
+        p->tagIndex.insert(key, aFeature);
+    else
+        p->tagIndex.remove(key, aFeature);
+}
+
+void Document::notifyTagsUpdate(Layer* aLayer, Feature* aFeature, bool added)
+{
+    if (!p->indexedLayers.contains(aLayer))
+        return;
+    if (added)
+        p->tagIndex.insertTags(aFeature);
+    else
+        p->tagIndex.removeTags(aFeature);
+}
+
+bool Document::getTagCandidates(const TagSelector* aSelector, QList<Feature*>& result)
+{
+    if (!aSelector) // never matches
+        return true;
+    QStringList keys;
+    if (!aSelector->requiredKeys(keys))
+        return false;
+
+    QList<Feature*> found;
+    p->tagIndex.find(keys, found);
+
+    // Same order as a FeatureIterator, by layer then by position in the layer
+    QHash<Layer*, int> layerIdx;
     for (int i=0; i<p->Layers.size(); ++i)
-    {
-        Feature* F = p->Layers[i]->get(id);
-        if (F)
-            return F;
+        layerIdx.insert(p->Layers[i], i);
+    QVector<QPair<QPair<int, int>, Feature*> > sorted;
+    sorted.reserve(found.size());
+    foreach (Feature* F, found) {
+        if (F->lastUpdated() == Feature::NotYetDownloaded || F->isDeleted() || F->isVirtual())
+            continue;
+        QHash<Layer*, int>::const_iterator it = layerIdx.constFind(F->layer());
+        if (it == layerIdx.constEnd())
+            continue;
+        sorted << qMakePair(qMakePair(it.value(), F->layerSlot()), F);
     }
-    return NULL;
+    std::sort(sorted.begin(), sorted.end());
+
+    result.reserve(result.size() + sorted.size());
+    for (int i=0; i<sorted.size(); ++i)
+        result << sorted[i].second;
+    return true;
+}
+
+QList<Feature*> Document::findFeatures(const TagSelector* aSelector, qreal PixelPerM, int maxResults)
+{
+    QList<Feature*> found;
+    if (!aSelector)
+        return found;
+
+    QElapsedTimer timer;
+    timer.start();
+    QList<Feature*> candidates;
+    bool indexed = getTagCandidates(aSelector, candidates);
+    if (indexed) {
+        foreach (Feature* F, candidates) {
+            if (maxResults && found.size() >= maxResults)
+                break;
+            if (!F->isHidden() && aSelector->matches(F, PixelPerM))
+                found << F;
+        }
+    } else {
+        for (VisibleFeatureIterator i(this); !i.isEnd() && (!maxResults || found.size() < maxResults); ++i) {
+            if (aSelector->matches(i.get(), PixelPerM))
+                found << i.get();
+        }
+    }
+    if (g_Merk_Benchmark)
+        qDebug() << "Document::findFeatures:" << found.size() << "found in" << timer.elapsed() << "ms"
+                 << (indexed ? QString("(%1 candidates)").arg(candidates.size()) : QString("(full scan)"));
+    return found;
 }
 
 void Document::setDirtyLayer(DirtyLayer* aLayer)
@@ -767,7 +1011,9 @@ bool Document::importPBF(const QString& filename, DrawingLayer* NewLayer)
     ImportExportPBF imp(this);
     if (!imp.loadFile(filename))
         return false;
-    imp.import(NewLayer);
+    // A damaged file must not pass for a complete one
+    if (!imp.import(NewLayer))
+        return false;
 
     if (NewLayer->size())
         return true;
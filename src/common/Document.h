@@ -64,6 +64,16 @@ public:
     int size() const;
 
     Feature* getFeature(const IFeature::FId& id);
+    /* Keeps the document-wide id index in sync, see Layer::notifyIdUpdate */
+    void notifyIdUpdate(Layer* aLayer, const IFeature::FId& id, Feature* aFeature, bool added);
+    /* Keeps the document-wide tag index in sync, for one key or all the keys of a feature */
+    void notifyTagUpdate(Layer* aLayer, Feature* aFeature, quint32 key, bool added);
+    void notifyTagsUpdate(Layer* aLayer, Feature* aFeature, bool added);
+    /* Appends the features that may match the selector, in document order; false if the selector
+     * cannot be narrowed by tag keys and every feature has to be tested */
+    bool getTagCandidates(const TagSelector* aSelector, QList<Feature*>& result);
+    /* Visible features matching the selector, at most maxResults unless 0 */
+    QList<Feature*> findFeatures(const TagSelector* aSelector, qreal PixelPerM, int maxResults = 0);
     QList<Feature*> getFeatures(Layer::LayerType layerType = Layer::UndefinedType);
     void setHistory(CommandHistory* h);
     CommandHistory& history();
@@ -122,10 +132,13 @@ public:
 
     virtual void setPainters(QList<Painter> aPainters);
     virtual int getPaintersSize();
+    int paintersRevision() const;
     void lockPainters();
     void lockPaintersForWrite();
     void unlockPainters();
     virtual const Painter* getPainter(int i);
+    /* Indices, in style order, of the painters that may match a feature with these (key, value) tag ids */
+    void getPossiblePainters(const QList<QPair<quint32, quint32> >& Tags, QVector<int>& indices) const;
 
     QStringList getCurrentSourceTags();
 
@@ -136,6 +149,8 @@ public:
 private:
     MapDocumentPrivate* p;
 
+    void benchmarkPainters();
+
 protected slots:
     void on_imageRequested(ImageMapLayer* anImageLayer);
     void on_imageReceived(ImageMapLayer* anImageLayer);
@@ -0,0 +1,115 @@
+#include "FeatureIdIndex.h"
+
+#define MIN_CAPACITY 64
+
+FeatureIdIndex::FeatureIdIndex()
+    : theCount(0), theMask(-1)
+{
+}
+
+void FeatureIdIndex::rehash(int capacity)
+{
+    QVector<Slot> old = theTable;
+
+    Slot empty;
+    empty.numId = 0;
+    empty.feature = NULL;
+    empty.type = 0;
+    theTable.fill(empty, capacity);
+    theMask = capacity - 1;
+
+    Slot* table = theTable.data();
+    for (int i=0; i<old.size(); ++i) {
+        if (!old[i].feature)
+            continue;
+        int j = home(old[i].numId);
+        while (table[j].feature)
+            j = (j + 1) & theMask;
+        table[j] = old[i];
+    }
+}
+
+void FeatureIdIndex::insert(const IFeature::FId& id, Feature* aFeature)
+{
+    if (!aFeature)
+        return;
+    // Keep the load factor under 1/2
+    if ((theCount + 1) * 2 > theTable.size())
+        rehash(qMax(MIN_CAPACITY, theTable.size() * 2));
+
+    Slot* table = theTable.data();
+    int i = home(id.numId);
+    while (table[i].feature) {
+        if (table[i].feature == aFeature && table[i].numId == id.numId) {
+            table[i].type = id.type;
+            return;
+        }
+        i = (i + 1) & theMask;
+    }
+    table[i].numId = id.numId;
+    table[i].feature = aFeature;
+    table[i].type = id.type;
+    ++theCount;
+}
+
+bool FeatureIdIndex::remove(qint64 numId, Feature* aFeature)
+{
+    if (!theCount)
+        return false;
+
+    Slot* table = theTable.data();
+    int i = home(numId);
+    while (table[i].feature && !(table[i].feature == aFeature && table[i].numId == numId))
+        i = (i + 1) & theMask;
+    if (!table[i].feature)
+        return false;
+
+    // Shift back the following entries of the cluster that may no longer be reached past the hole
+    int j = i;
+    while (true) {
+        j = (j + 1) & theMask;
+        if (!table[j].feature)
+            break;
+        int k = home(table[j].numId);
+        bool movable = (i <= j) ? (k <= i || k > j) : (k <= i && k > j);
+        if (movable) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].feature = NULL;
+    --theCount;
+    return true;
+}
+
+void FeatureIdIndex::clear()
+{
+    theTable.clear();
+    theCount = 0;
+    theMask = -1;
+}
+
+Feature* FeatureIdIndex::find(const IFeature::FId& id) const
+{
+    if (!theCount)
+        return NULL;
+
+    const Slot* table = theTable.constData();
+    for (int i = home(id.numId); table[i].feature; i = (i + 1) & theMask)
+        if (table[i].numId == id.numId && (table[i].type & id.type))
+            return table[i].feature;
+    return NULL;
+}
+
+int FeatureIdIndex::findAll(const IFeature::FId& id, QVarLengthArray<Feature*, 4>& result) const
+{
+    result.clear();
+    if (!theCount)
+        return 0;
+
+    const Slot* table = theTable.constData();
+    for (int i = home(id.numId); table[i].feature; i = (i + 1) & theMask)
+        if (table[i].numId == id.numId && (table[i].type & id.type))
+            result.append(table[i].feature);
+    return result.size();
+}
@@ -0,0 +1,54 @@
+#ifndef FEATUREIDINDEX_H
+#define FEATUREIDINDEX_H
+
+#include "IFeature.h"
+
+#include <QVector>
+#include <QVarLengthArray>
+
+class Feature;
+
+/**
+    Open addressing hash (linear probing, no tombstones) from feature ids to features.
+
+    Slots are hashed on the numeric id only so that lookups with a type mask (e.g. IFeature::All)
+    stay a single probe sequence; the type is compared while probing. The same id may be present
+    several times, for different types or for copies of a feature living in different layers.
+*/
+class FeatureIdIndex
+{
+public:
+    FeatureIdIndex();
+
+    void insert(const IFeature::FId& id, Feature* aFeature);
+    // Removes the entry of this feature under this numeric id, if any
+    bool remove(qint64 numId, Feature* aFeature);
+    void clear();
+
+    // First feature matching id.numId whose id type has a bit in common with id.type
+    Feature* find(const IFeature::FId& id) const;
+    // All of them, in no particular order
+    int findAll(const IFeature::FId& id, QVarLengthArray<Feature*, 4>& result) const;
+
+    int size() const { return theCount; }
+
+private:
+    struct Slot {
+        qint64 numId;
+        Feature* feature; // NULL for an empty slot
+        unsigned char type;
+    };
+
+    inline int home(qint64 numId) const
+    {
+        quint64 h = quint64(numId) * Q_UINT64_C(0x9E3779B97F4A7C15);
+        return int((h ^ (h >> 32)) & theMask);
+    }
+    void rehash(int capacity);
+
+    QVector<Slot> theTable;
+    int theCount;
+    int theMask;
+};
+
+#endif // FEATUREIDINDEX_H
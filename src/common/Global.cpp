@@ -14,6 +14,10 @@
 #include "MainWindow.h"
 #include "SlippyMapWidget.h"
 
+#include <QReadWriteLock>
+#include <QMutex>
+#include <QVector>
+
 #ifdef PORTABLE_BUILD
 bool g_Merk_Portable = true;
 #else
@@ -30,68 +34,133 @@ bool g_Merk_SelfClip = true;
 #else
 bool g_Merk_SelfClip = false;
 #endif
+bool g_Merk_Benchmark = false;
+int g_Merk_ImportThreads = 0;
 
 MainWindow* g_Merk_MainWindow = NULL;
 MemoryBackend g_backend;
 SlippyMapCache* SlippyMapWidget::theSlippyCache = 0;
 
-QStringList tagKeys;
-QHash<QString, quint32> tagKeysHash;
-QStringList tagValues;
-QHash<QString, quint32> tagValuesHash;
-QHash< quint32, QList<quint32> > tagList;
-QStringList userList;
+/* Interned strings.
+ * Ids are indices into the table and never change; the strings themselves are never moved
+ * nor freed, so references returned by at() stay valid while other threads intern new ones.
+ */
+class StringTable
+{
+public:
+    quint32 intern(const QString& s)
+    {
+        {
+            QReadLocker locker(&lock);
+            QHash<QString, quint32>::const_iterator i = index.constFind(s);
+            if (i != index.constEnd())
+                return i.value();
+        }
+        QWriteLocker locker(&lock);
+        QHash<QString, quint32>::const_iterator i = index.constFind(s);
+        if (i != index.constEnd())
+            return i.value();
+        quint32 idx = strings.size();
+        strings.append(new QString(s));
+        index.insert(s, idx);
+        return idx;
+    }
+
+    quint32 find(const QString& s) const
+    {
+        QReadLocker locker(&lock);
+        return index.value(s, 0xffffffff);
+    }
+
+    const QString& at(quint32 idx) const
+    {
+        QReadLocker locker(&lock);
+        return *strings.at(idx);
+    }
+
+    QStringList toList() const
+    {
+        QReadLocker locker(&lock);
+        QStringList res;
+        res.reserve(strings.size());
+        foreach (const QString* s, strings)
+            res << *s;
+        return res;
+    }
+
+private:
+    mutable QReadWriteLock lock;
+    QHash<QString, quint32> index;
+    QVector<const QString*> strings;
+};
+
+StringTable tagKeys;
+StringTable tagValues;
+StringTable userList;
 QString noUser;
 
+/* For each key, the values in use and how many features use them */
+QMutex tagListLock;
+QHash< quint32, QHash<quint32, int> > tagList;
+
 QPair<quint32, quint32> g_addToTagList(QString k, QString v)
 {
-    qint32 ik, iv;
-
-    if (!tagKeysHash.contains(k)) {
-        tagKeys.append(k);
-        ik = tagKeys.size()-1;
-        tagKeysHash[k] = ik;
-    } else
-        ik = tagKeysHash.value(k);
+    quint32 ik = tagKeys.intern(k);
+    quint32 iv = tagValues.intern(v);
 
-    if (!tagValuesHash.contains(v)) {
-        tagValues.append(v);
-        iv = tagValues.size()-1;
-        tagValuesHash[v] = iv;
-    } else
-        iv = tagValuesHash.value(v);
+    if (!k.isEmpty() && !v.isEmpty()) {
+        QMutexLocker locker(&tagListLock);
+        ++tagList[ik][iv];
+    }
 
-    if (!k.isEmpty() && !v.isEmpty())
-        tagList[ik].append(iv);
+    return qMakePair(ik, iv);
+}
 
-    return qMakePair((quint32)ik, (quint32)iv);
+/* Same with already interned, non empty key and value */
+void g_addToTagList(quint32 k, quint32 v)
+{
+    QMutexLocker locker(&tagListLock);
+    ++tagList[k][v];
 }
 
 void g_removeFromTagList(quint32 k, quint32 v)
 {
-    tagList[k].removeOne(v);
-    if (tagList[k].isEmpty())
-        tagList.remove(k);
+    QMutexLocker locker(&tagListLock);
+    QHash< quint32, QHash<quint32, int> >::iterator values = tagList.find(k);
+    if (values == tagList.end())
+        return;
+    QHash<quint32, int>::iterator count = values.value().find(v);
+    if (count == values.value().end())
+        return;
+    if (--count.value() <= 0) {
+        values.value().erase(count);
+        if (values.value().isEmpty())
+            tagList.erase(values);
+    }
 }
 
 QStringList g_getTagKeys()
 {
-    return tagKeys;
+    return tagKeys.toList();
 }
 
 QStringList g_getTagValues()
 {
-    return tagValues;
+    return tagValues.toList();
 }
 
 QStringList g_getTagValueList(QString k)
 {
     QSet<quint32> retList;
-    if (k == "*") {
-        foreach (QList<quint32> list, tagList)
-            retList.unite(list.toSet());
-    } else
-        retList = tagList[tagKeys.indexOf(k)].toSet();
+    {
+        QMutexLocker locker(&tagListLock);
+        if (k == "*") {
+            QHash< quint32, QHash<quint32, int> >::const_iterator i = tagList.constBegin();
+            for (; i != tagList.constEnd(); ++i)
+                retList.unite(i.value().keys().toSet());
+        } else
+            retList = tagList.value(tagKeys.find(k)).keys().toSet();
+    }
 
     QStringList res;
     foreach (quint32 i, retList)
@@ -107,12 +176,17 @@ const QString& g_getTagKey(int idx)
 
 quint32 g_getTagKeyIndex(const QString& s)
 {
-    return tagKeys.indexOf(s);
+    return tagKeys.find(s);
+}
+
+quint32 g_setTagKey(const QString& k)
+{
+    return tagKeys.intern(k);
 }
 
 QStringList g_getTagKeyList()
 {
-    return tagKeys.toSet().toList();
+    return tagKeys.toList();
 }
 
 QString g_getTagValue(int idx)
@@ -122,7 +196,12 @@ QString g_getTagValue(int idx)
 
 quint32 g_getTagValueIndex(const QString& s)
 {
-    return tagValues.indexOf(s);
+    return tagValues.find(s);
+}
+
+quint32 g_setTagValue(const QString& v)
+{
+    return tagValues.intern(v);
 }
 
 quint32 g_setUser(const QString& u)
@@ -130,18 +209,13 @@ quint32 g_setUser(const QString& u)
     if (u.isEmpty())
         return 0xffffffff;
 
-    qint32 ret = userList.indexOf(u);
-    if (ret == -1) {
-        userList.append(u);
-        return userList.size()-1;
-    }
-    return ret;
+    return userList.intern(u);
 }
 
 const QString& g_getUser(quint32 idx)
 {
     if (idx != 0xffffffff)
-        return userList[idx];
+        return userList.at(idx);
     else
         return noUser;
 }
@@ -35,18 +35,23 @@ extern bool g_Merk_Ignore_Preferences;
 extern bool g_Merk_Reset_Preferences;
 extern bool g_Merk_IgnoreStartupTemplate;
 extern bool g_Merk_SelfClip;
+extern bool g_Merk_Benchmark;
+extern int g_Merk_ImportThreads;
 
 extern MainWindow* g_Merk_MainWindow;
 
 extern QPair<quint32, quint32> g_addToTagList(QString k, QString v);
+extern void g_addToTagList(quint32 k, quint32 v);
 extern void g_removeFromTagList(quint32 k, quint32 v);
 extern QStringList g_getTagKeys();
 extern QStringList g_getTagValues();
 extern const QString& g_getTagKey(int idx);
 extern quint32 g_getTagKeyIndex(const QString& s);
+extern quint32 g_setTagKey(const QString& k);
 extern QStringList g_getTagKeyList();
 extern QString g_getTagValue(int idx);
 extern quint32 g_getTagValueIndex(const QString& s);
+extern quint32 g_setTagValue(const QString& v);
 extern QStringList g_getTagValueList(QString k) ;
 
 extern quint32 g_setUser(const QString& u);
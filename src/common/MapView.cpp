@@ -12,6 +12,9 @@
 #include "IMapAdapter.h"
 #include "IMapWatermark.h"
 #include "Feature.h"
+#include "Node.h"
+#include "Way.h"
+#include "RenderList.h"
 #include "Interaction.h"
 #include "IPaintStyle.h"
 #include "Projection.h"
@@ -27,6 +30,8 @@
 #include "SvgCache.h"
 
 #include <QTime>
+#include <QElapsedTimer>
+#include <QDataStream>
 #include <QMainWindow>
 #include <QMouseEvent>
 #include <QPainter>
@@ -41,6 +46,12 @@
 #define LAT_ANG_PER_M 1.0 / EQUATORIALRADIUS
 #define TEST_RFLAGS(x) p->ROptions.options.testFlag(x)
 
+/* Pixels around the edited boxes redrawn in the wireframe, for node handles and pen widths */
+#define WIREFRAME_MARGIN 16
+/* Above that many edited boxes, their union is redrawn */
+#define WIREFRAME_MAX_RECTS 64
+#define BENCHMARK_EDITS 50
+
 class MapViewPrivate
 {
 public:
@@ -67,11 +78,16 @@ public:
 
     OsmRenderLayer* osmLayer;
 
+    /* What the wireframe was last drawn for, and the backend change revision it is up to date with */
+    QByteArray WireframeContext;
+    quint32 WireframeRevision;
+
     MapViewPrivate()
       : PixelPerM(0.0), Viewport(WORLD_COORDBOX), theVectorRotation(0.0)
       , BackgroundOnlyPanZoom(false)
       , theDocument(0)
       , theInteraction(0)
+      , WireframeRevision(0)
     {}
 };
 
@@ -175,7 +191,7 @@ void MapView::invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgM
                 p->osmLayer->forceRedraw(p->theProjection, p->theTransform, rect(), p->PixelPerM, p->ROptions);
         }
     }
-    if (updateWireframe) {
+    if (updateWireframe && !invalidateChanges()) {
         p->invalidRects.clear();
         p->invalidRects.push_back(p->Viewport);
 
@@ -215,8 +231,58 @@ void MapView::invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgM
     update();
 }
 
+QByteArray MapView::wireframeContext() const
+{
+    QByteArray context;
+    if (!p->theDocument)
+        return context;
+    QDataStream out(&context, QIODevice::WriteOnly);
+
+    out << (quintptr)p->theDocument << size();
+    out << p->theTransform.m11() << p->theTransform.m12() << p->theTransform.m21() << p->theTransform.m22()
+        << p->theTransform.dx() << p->theTransform.dy();
+    out << p->theProjection.getProjectionType() << p->theProjection.projectionRevision();
+    out << (int)(p->ROptions.options & ~RendererOptions::Interacting) << (int)p->ROptions.arrowOptions;
+    out << p->theDocument->paintersRevision() << p->theDocument->filterRevision();
+    out << M_PREFS->getWireframeView() << M_PREFS->getUseStyledWireframe() << M_PREFS->getEditRendering();
+    for (int i=0; i<p->theDocument->layerSize(); ++i) {
+        Layer* L = p->theDocument->getLayer(i);
+        out << (quintptr)L << L->isVisible() << L->isEnabled() << L->isReadonly() << L->getAlpha();
+    }
+    return context;
+}
+
+/* When the only change since the wireframe was drawn is edits to the document, queues the boxes of
+ * the edited features for redraw and returns true; the caller redraws everything otherwise */
+bool MapView::invalidateChanges()
+{
+    QByteArray context = wireframeContext();
+    quint32 revision = g_backend.changeRevision();
+    QList<QRectF> boxes;
+    bool incremental = !context.isEmpty() && context == p->WireframeContext
+            && revision != p->WireframeRevision && g_backend.changesSince(p->WireframeRevision, boxes);
+    p->WireframeContext = context;
+    p->WireframeRevision = revision;
+    if (!incremental)
+        return false;
+
+    if (boxes.size() > WIREFRAME_MAX_RECTS) {
+        QRectF all = boxes[0].normalized();
+        for (int i=1; i<boxes.size(); ++i)
+            all |= boxes[i].normalized();
+        boxes.clear();
+        boxes << all;
+    }
+    foreach (const QRectF& r, boxes)
+        p->invalidRects.push_back(CoordBox(r.normalized()));
+    return true;
+}
+
 void MapView::panScreen(QPoint delta)
 {
+    // Scrolling keeps the wireframe current
+    bool wireframeCurrent = !p->WireframeContext.isEmpty() && p->WireframeContext == wireframeContext();
+
     Coord cDelta = fromView(delta) - fromView(QPoint(0, 0));
     if (p->BackgroundOnlyPanZoom) {
         p->BackgroundOnlyVpTransform.translate(-cDelta.x(), -cDelta.y());
@@ -245,6 +311,8 @@ void MapView::panScreen(QPoint delta)
         if (!M_PREFS->getWireframeView() && p->theDocument) {
             p->osmLayer->pan(delta);
         }
+        if (wireframeCurrent)
+            p->WireframeContext = wireframeContext();
     }
 
     for (LayerIterator<ImageMapLayer*> ImgIt(p->theDocument); !ImgIt.isEnd(); ++ImgIt)
@@ -394,8 +462,7 @@ void MapView::drawGPS(QPainter & P)
         if (Main->gps()->getGpsDevice()->fixStatus() == QGPSDevice::StatusActive) {
             Coord vp(Main->gps()->getGpsDevice()->longitude(), Main->gps()->getGpsDevice()->latitude());
             QPoint g = toView(vp);
-            QImage* pm = getSVGImageFromFile(":/Gps/Gps_Marker.svg", 32);
-            P.drawImage(g - QPoint(16, 16), *pm);
+            P.drawImage(g - QPoint(16, 16), getSVGImageFromFile(":/Gps/Gps_Marker.svg", 32));
         }
     }
 }
@@ -603,74 +670,70 @@ void MapView::updateStaticBackground()
 
 void MapView::updateWireframe()
 {
-    QMap<RenderPriority, QSet <Feature*> > theFeatures;
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
-    QSet<Feature*>::const_iterator it;
-
+    RenderList theFeatures;
     QPainter P;
 
+    // Screen area to redraw, and the features that may draw in it
+    Coord margin = fromView(QPoint(WIREFRAME_MARGIN, WIREFRAME_MARGIN)) - fromView(QPoint(0, 0));
+    qreal mx = fabs(margin.x());
+    qreal my = fabs(margin.y());
+    QRegion dirty;
+    QList<CoordBox> queryRects;
+    foreach (const CoordBox& cb, p->invalidRects) {
+        CoordBox r(cb.normalized());
+        if (cb == p->Viewport)
+            dirty += rect();
+        QPolygon corners;
+        corners << toView(Coord(r.left(), r.top())) << toView(Coord(r.right(), r.top()))
+                << toView(Coord(r.right(), r.bottom())) << toView(Coord(r.left(), r.bottom()));
+        dirty += corners.boundingRect().adjusted(-WIREFRAME_MARGIN, -WIREFRAME_MARGIN, WIREFRAME_MARGIN, WIREFRAME_MARGIN) & rect();
+        queryRects << CoordBox(r.adjusted(-2*mx, -2*my, 2*mx, 2*my));
+    }
+
     for (int i=0; i<p->theDocument->layerSize(); ++i)
-        g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, p->invalidRects, p->theProjection);
+        g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, queryRects, p->theProjection);
+    theFeatures.sort();
 
     if (!p->theVectorPanDelta.isNull()) {
         QRegion exposed;
         StaticWireframe->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticWireframe->rect(), &exposed);
-        P.begin(StaticWireframe);
-        P.setClipping(true);
-        P.setClipRegion(exposed);
-        P.setCompositionMode(QPainter::CompositionMode_Source);
-        P.fillRect(StaticWireframe->rect(), Qt::transparent);
-    } else {
-        StaticWireframe->fill(Qt::transparent);
-        P.begin(StaticWireframe);
-        P.setClipping(true);
-        P.setClipRegion(rect());
+        dirty += exposed;
     }
+    P.begin(StaticWireframe);
+    P.setClipping(true);
+    P.setClipRegion(dirty);
+    P.setCompositionMode(QPainter::CompositionMode_Source);
+    P.fillRect(StaticWireframe->rect(), Qt::transparent);
+    P.setCompositionMode(QPainter::CompositionMode_SourceOver);
 
     if (M_PREFS->getWireframeView() || !p->osmLayer->isRenderingDone() || M_PREFS->getEditRendering() == 1) {
         if (M_PREFS->getWireframeView() && M_PREFS->getUseAntiAlias())
             P.setRenderHint(QPainter::Antialiasing);
         else if (M_PREFS->getEditRendering() == 1)
             P.setRenderHint(QPainter::Antialiasing);
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm)
-        {
-            for (it = itm.value().constBegin() ;it != itm.value().constEnd(); ++it)
-            {
-                qreal alpha = (*it)->getAlpha();
-                P.setOpacity(alpha);
-
-                (*it)->drawSimple(P, this);
-            }
+        for (int i=0; i<theFeatures.size(); ++i) {
+            Feature* F = theFeatures.feature(i);
+            P.setOpacity(F->getAlpha());
+            F->drawSimple(P, this);
         }
     }
     P.end();
 
-    if (!p->theVectorPanDelta.isNull()) {
-        QRegion exposed;
-        StaticTouchup->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticTouchup->rect(), &exposed);
-        P.begin(StaticTouchup);
-        P.setClipping(true);
-        P.setClipRegion(exposed);
-        P.setCompositionMode(QPainter::CompositionMode_Source);
-        P.fillRect(StaticTouchup->rect(), Qt::transparent);
-    } else {
-        StaticTouchup->fill(Qt::transparent);
-        P.begin(StaticTouchup);
-        P.setClipping(true);
-        P.setClipRegion(rect());
-    }
+    if (!p->theVectorPanDelta.isNull())
+        StaticTouchup->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticTouchup->rect());
+    P.begin(StaticTouchup);
+    P.setClipping(true);
+    P.setClipRegion(dirty);
+    P.setCompositionMode(QPainter::CompositionMode_Source);
+    P.fillRect(StaticTouchup->rect(), Qt::transparent);
+    P.setCompositionMode(QPainter::CompositionMode_SourceOver);
 
     P.setRenderHint(QPainter::Antialiasing);
 
-    for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm)
-    {
-        for (it = itm.value().constBegin() ;it != itm.value().constEnd(); ++it)
-        {
-            qreal alpha = (*it)->getAlpha();
-            P.setOpacity(alpha);
-
-            (*it)->drawTouchup(P, this);
-        }
+    for (int i=0; i<theFeatures.size(); ++i) {
+        Feature* F = theFeatures.feature(i);
+        P.setOpacity(F->getAlpha());
+        F->drawTouchup(P, this);
     }
     P.end();
 
@@ -1176,3 +1239,95 @@ QString MapView::toPropertiesHtml()
 
     return h;
 }
+
+/* Moves nodes in view back and forth, redrawing after each move the way an edit does: from the
+ * edited boxes, then from scratch (--benchmark). The edits are made on a scratch document holding a
+ * copy of the ways and nodes in view, so that the user's data is left alone */
+void MapView::benchmarkEdits()
+{
+    if (!p->theDocument || !StaticWireframe)
+        return;
+
+    Document* theDocument = p->theDocument;
+    Document scratch;
+    DrawingLayer* theLayer = scratch.addDrawingLayer();
+    QHash<Node*, Node*> copies;
+    for (VisibleFeatureIterator it(theDocument); !it.isEnd(); ++it) {
+        if (Way* W = CAST_WAY(it.get())) {
+            if (!W->boundingBox().intersects(p->Viewport))
+                continue;
+            Way* C = g_backend.allocWay(theLayer);
+            theLayer->add(C);
+            copyTags(C, W);
+            for (int i=0; i<W->size(); ++i) {
+                Node* N = W->getNode(i);
+                Node*& copy = copies[N];
+                if (!copy) {
+                    copy = g_backend.allocNode(theLayer, N->position());
+                    theLayer->add(copy);
+                    copyTags(copy, N);
+                }
+                C->add(copy);
+            }
+        } else if (Node* N = CAST_NODE(it.get())) {
+            if (N->isVirtual() || !p->Viewport.contains(N->position()) || copies.contains(N))
+                continue;
+            Node* copy = g_backend.allocNode(theLayer, N->position());
+            theLayer->add(copy);
+            copyTags(copy, N);
+            copies.insert(N, copy);
+        }
+    }
+
+    QList<Node*> candidates;
+    foreach (Node* N, copies)
+        if (p->Viewport.contains(N->position()))
+            candidates << N;
+    if (candidates.isEmpty())
+        return;
+    QList<Node*> nodes;
+    int step = qMax(1, candidates.size() / BENCHMARK_EDITS);
+    for (int i=0; i<candidates.size() && nodes.size() < BENCHMARK_EDITS; i += step)
+        nodes << candidates[i];
+
+    setDocument(&scratch);
+
+    Coord delta = fromView(QPoint(8, 8)) - fromView(QPoint(0, 0));
+    qint64 elapsed[2] = { 0, 0 };
+    QElapsedTimer timer;
+    for (int pass=0; pass<2; ++pass) {
+        invalidate(true, true, false);
+        p->osmLayer->waitForRendering();
+        if (!p->invalidRects.isEmpty())
+            updateWireframe();
+
+        for (int i=0; i<nodes.size(); ++i) {
+            Coord pos = nodes[i]->position();
+            for (int k=0; k<2; ++k) {
+                nodes[i]->setPosition(k ? pos : pos + delta);
+
+                timer.start();
+                if (pass) {
+                    p->osmLayer->clearCache();
+                    p->WireframeContext.clear();
+                }
+                invalidate(true, true, false);
+                p->osmLayer->waitForRendering();
+                if (!p->invalidRects.isEmpty())
+                    updateWireframe();
+                elapsed[pass] += timer.nsecsElapsed();
+            }
+        }
+    }
+
+    p->osmLayer->waitForRendering();
+    setDocument(theDocument);
+    p->osmLayer->clearCache();
+    p->WireframeContext.clear();
+    invalidate(true, true, false);
+
+    int edits = nodes.size() * 2;
+    qDebug() << "Edit redraw benchmark:" << edits << "node moves";
+    qDebug() << "  incremental:" << elapsed[0] / 1000000 << "ms," << elapsed[0] / 1000 / edits << "us per edit";
+    qDebug() << "  full:" << elapsed[1] / 1000000 << "ms," << elapsed[1] / 1000 / edits << "us per edit";
+}
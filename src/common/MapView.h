@@ -98,10 +98,14 @@ public:
 
     void on_imageReceived(ImageMapLayer *aLayer);
 
+    void benchmarkEdits();
+
 private:
     void drawGPS(QPainter & painter);
     void updateStaticBackground();
     void updateWireframe();
+    QByteArray wireframeContext() const;
+    bool invalidateChanges();
 
     MainWindow* Main;
     QPixmap* StaticBackground;
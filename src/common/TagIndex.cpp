@@ -0,0 +1,65 @@
+#include "TagIndex.h"
+
+#include "Feature.h"
+#include "Global.h"
+
+void TagIndex::insert(quint32 key, Feature* aFeature)
+{
+    theFeatures[key].insert(aFeature);
+}
+
+void TagIndex::remove(quint32 key, Feature* aFeature)
+{
+    QHash<quint32, QSet<Feature*> >::iterator it = theFeatures.find(key);
+    if (it == theFeatures.end())
+        return;
+    it.value().remove(aFeature);
+    if (it.value().isEmpty())
+        theFeatures.erase(it);
+}
+
+void TagIndex::insertTags(Feature* aFeature)
+{
+    for (int i=0; i<aFeature->tagSize(); ++i)
+        insert(aFeature->tagKeyId(i), aFeature);
+}
+
+void TagIndex::removeTags(Feature* aFeature)
+{
+    for (int i=0; i<aFeature->tagSize(); ++i)
+        remove(aFeature->tagKeyId(i), aFeature);
+}
+
+void TagIndex::clear()
+{
+    theFeatures.clear();
+}
+
+void TagIndex::find(const QStringList& keys, QList<Feature*>& result) const
+{
+    QList<const QSet<Feature*>*> sets;
+    int total = 0;
+    foreach (const QString& k, keys) {
+        // A key never interned is on no feature
+        quint32 ik = g_getTagKeyIndex(k);
+        QHash<quint32, QSet<Feature*> >::const_iterator it = theFeatures.constFind(ik);
+        if (it == theFeatures.constEnd() || sets.contains(&it.value()))
+            continue;
+        sets << &it.value();
+        total += it.value().size();
+    }
+
+    result.reserve(result.size() + total);
+    if (sets.size() == 1) {
+        foreach (Feature* F, *sets[0])
+            result << F;
+        return;
+    }
+    QSet<Feature*> seen;
+    for (int i=0; i<sets.size(); ++i)
+        foreach (Feature* F, *sets[i])
+            if (!seen.contains(F)) {
+                seen.insert(F);
+                result << F;
+            }
+}
@@ -0,0 +1,34 @@
+#ifndef TAGINDEX_H
+#define TAGINDEX_H
+
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+
+class Feature;
+
+/**
+    Inverted index from interned tag keys to the features having them.
+
+    It indexes keys only: a value change does not touch it, and a key such as "name" with a value
+    per feature costs one entry per feature rather than one set per value. The values are then
+    checked by testing the selector on the candidates, which are few compared to a document.
+*/
+class TagIndex
+{
+public:
+    void insert(quint32 key, Feature* aFeature);
+    void remove(quint32 key, Feature* aFeature);
+    // All the keys of the feature
+    void insertTags(Feature* aFeature);
+    void removeTags(Feature* aFeature);
+    void clear();
+
+    // Features having at least one of the keys, each once, in no particular order
+    void find(const QStringList& keys, QList<Feature*>& result) const;
+
+private:
+    QHash<quint32, QSet<Feature*> > theFeatures;
+};
+
+#endif // TAGINDEX_H
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+"""Local stand-in for the OSM API 0.6, to try downloads against without a server.
+
+Point the OSM API URL preference at http://localhost:8000/api/0.6, then:
+
+    tools/osm-api-standin.py --map some.osm
+
+serves some.osm for every map, node, way or relation request (the query is
+ignored), gzipped if the client asks for it.
+
+    tools/osm-api-standin.py --map some.osm --rate 512 --fail-after 2000000
+
+sends it at 512 kB/s and drops the connection after 2 MB, to watch the data
+being parsed while it arrives and an interrupted download being rolled back.
+
+Uploads go through changeset create, upload and close. Each diff upload gets
+new ids and versions back, and a modify or delete of a stale version is
+refused with 409, as the API does.
+
+    tools/osm-api-standin.py --fail-upload 2
+
+refuses the second diff upload of the run, so that the next upload has to
+resume with what the server did not accept.
+"""
+
+import argparse
+import gzip
+import itertools
+import re
+import sys
+import threading
+import time
+import xml.etree.ElementTree as ET
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+OPTIONS = None
+
+DOWNLOAD = re.compile(r"^/api/0\.6/(map|node|way|relation)\b")
+CREATE = re.compile(r"^/api/0\.6/changeset/create$")
+UPLOAD = re.compile(r"^/api/0\.6/changeset/(\d+)/upload$")
+CLOSE = re.compile(r"^/api/0\.6/changeset/(\d+)/close$")
+
+
+def content(element):
+    """What an element holds, leaving out its id and version."""
+    attributes = sorted((k, v) for k, v in element.attrib.items()
+                        if k not in ("id", "version", "changeset", "timestamp", "user", "uid"))
+    return attributes, [(child.tag, sorted(child.attrib.items())) for child in element]
+
+
+class Changesets:
+    """What was uploaded during the run: the current version and content of each element."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.changesets = itertools.count(1)
+        self.ids = itertools.count(1000000)
+        self.uploads = 0
+        self.versions = {}
+        self.contents = {}
+
+    def create(self):
+        with self.lock:
+            return next(self.changesets)
+
+    def upload(self, changeset, data):
+        """Returns the HTTP code and body of the answer to a diff upload."""
+        with self.lock:
+            self.uploads += 1
+            if self.uploads == OPTIONS.fail_upload:
+                return 409, "Refusing upload %d, as asked" % self.uploads
+
+            try:
+                root = ET.fromstring(data)
+            except ET.ParseError as e:
+                return 400, "Cannot parse the osmChange: %s" % e
+
+            # Checked first, as the API applies all of a diff or nothing
+            counts = {"create": 0, "modify": 0, "delete": 0, "unchanged": 0}
+            for action in root:
+                for element in action:
+                    key = (element.tag, element.get("id"))
+                    version = element.get("version")
+                    counts[action.tag] = counts.get(action.tag, 0) + 1
+                    if action.tag in ("modify", "delete") and key in self.versions \
+                            and version != str(self.versions[key]):
+                        return 409, "Version mismatch: Provided %s, server had: %d of %s %s" % (
+                            version, self.versions[key], element.tag, element.get("id"))
+                    # Allowed, but a sign of changes being sent twice
+                    if action.tag == "modify" and self.contents.get(key) == content(element):
+                        counts["unchanged"] += 1
+
+            result = ET.Element("diffResult", version="0.6", generator="osm-api-standin")
+            for action in root:
+                for element in action:
+                    old_id = element.get("id")
+                    if action.tag == "create":
+                        new_id, new_version = str(next(self.ids)), 1
+                    elif action.tag == "modify":
+                        new_id = old_id
+                        new_version = self.versions.get((element.tag, old_id), int(element.get("version", "0"))) + 1
+                    else:
+                        self.versions.pop((element.tag, old_id), None)
+                        self.contents.pop((element.tag, old_id), None)
+                        ET.SubElement(result, element.tag, old_id=old_id)
+                        continue
+                    self.versions[(element.tag, new_id)] = new_version
+                    self.contents[(element.tag, new_id)] = content(element)
+                    ET.SubElement(result, element.tag, old_id=old_id, new_id=new_id,
+                                  new_version=str(new_version))
+
+            sys.stderr.write("changeset %d, upload %d: %d created, %d modified (%d of them unchanged), %d deleted\n" % (
+                changeset, self.uploads, counts["create"], counts["modify"], counts["unchanged"], counts["delete"]))
+            return 200, ET.tostring(result, encoding="unicode")
+
+
+CHANGESETS = Changesets()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def reply(self, code, body=b"", content_type="text/plain; charset=utf-8"):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_slowly(self, body):
+        """Writes the body at the given rate, stopping short if asked to fail."""
+        limit = len(body)
+        if OPTIONS.fail_after is not None:
+            limit = min(limit, OPTIONS.fail_after)
+        chunk = 16 * 1024
+        delay = chunk / (OPTIONS.rate * 1024.0) if OPTIONS.rate else 0
+        sent = 0
+        while sent < limit:
+            n = min(chunk, limit - sent)
+            self.wfile.write(body[sent:sent + n])
+            self.wfile.flush()
+            sent += n
+            if delay:
+                time.sleep(delay)
+        if sent < len(body):
+            sys.stderr.write("dropping the connection after %d of %d bytes\n" % (sent, len(body)))
+            self.close_connection = True
+
+    def body(self):
+        return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+    def do_PUT(self):
+        self.body()
+        if CREATE.match(self.path):
+            self.reply(200, str(CHANGESETS.create()).encode())
+        elif CLOSE.match(self.path):
+            self.reply(200)
+        else:
+            self.reply(404, b"Not found in the stand-in\n")
+
+    def do_POST(self):
+        data = self.body()
+        m = UPLOAD.match(self.path)
+        if not m:
+            self.reply(404, b"Not found in the stand-in\n")
+            return
+        code, answer = CHANGESETS.upload(int(m.group(1)), data)
+        if code != 200:
+            sys.stderr.write("upload refused: %s\n" % answer)
+        self.reply(code, answer.encode("utf-8"),
+                   "text/xml; charset=utf-8" if code == 200 else "text/plain; charset=utf-8")
+
+    def do_GET(self):
+        if not DOWNLOAD.match(self.path):
+            self.reply(404, b"Not found in the stand-in\n")
+            return
+        if not OPTIONS.map:
+            self.reply(404, b"No --map file given\n")
+            return
+
+        with open(OPTIONS.map, "rb") as f:
+            body = f.read()
+        gzipped = "gzip" in self.headers.get("Accept-Encoding", "")
+        if gzipped:
+            body = gzip.compress(body)
+
+        self.send_response(200)
+        self.send_header("Content-Type", "text/xml; charset=utf-8")
+        if gzipped:
+            self.send_header("Content-Encoding", "gzip")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.send_slowly(body)
+
+
+def main():
+    global OPTIONS
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--map", help="OSM file served for downloads")
+    parser.add_argument("--rate", type=int, default=0,
+                        help="transfer rate of downloads, in kB/s (default: as fast as possible)")
+    parser.add_argument("--fail-after", type=int, metavar="BYTES",
+                        help="drop the connection after sending that many bytes of a download")
+    parser.add_argument("--fail-upload", type=int, metavar="N",
+                        help="refuse the Nth diff upload of the run with 409")
+    OPTIONS = parser.parse_args()
+
+    server = ThreadingHTTPServer(("localhost", OPTIONS.port), Handler)
+    sys.stderr.write("OSM API stand-in on http://localhost:%d/api/0.6\n" % OPTIONS.port)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()